@@ -56,9 +56,37 @@ typedef char *VA;  /* VA = virtual address */
 
 typedef enum ProcMapsAreaProperties {
   DMTCP_ZERO_PAGE = 0x0001,
-  DMTCP_SKIP_WRITING_TEXT_SEGMENTS = 0x0002
+  DMTCP_SKIP_WRITING_TEXT_SEGMENTS = 0x0002,
+  DMTCP_INCREMENTAL_AREA = 0x0004,  // Unchanged area; data is in parent image
+  DMTCP_INCREMENTAL_PAGES = 0x0008, // Changed pages inside such an area
+  DMTCP_SPARSE_PAGES = 0x0010,      // Zero pages left out of the data
+  DMTCP_COMPRESSED_DATA = 0x0020    // Data in compressed blocks
 } ProcMapsAreaProperties;
 
+/* The data of a DMTCP_SPARSE_PAGES area comes in chunks of
+ * DMTCP_SPARSE_CHUNK_PAGES pages (the last chunk may be shorter).  Each chunk
+ * starts with a bitmap of DMTCP_SPARSE_BITMAP_SIZE bytes, in which bit i
+ * (least significant bit first) is set if page i of the chunk has data.  The
+ * data of those pages follows, in order.  All other pages are zero.
+ */
+#define DMTCP_SPARSE_BITMAP_SIZE 4096
+#define DMTCP_SPARSE_CHUNK_PAGES (8 * DMTCP_SPARSE_BITMAP_SIZE)
+
+/* The data of a DMTCP_COMPRESSED_DATA area is a series of blocks, each of at
+ * most DMTCP_COMPRESS_BLOCK_SIZE bytes of data.  A block is a
+ * CompressedBlockHeader followed by compSize bytes: the data compressed in
+ * the LZ4 block format, or the data itself if compSize == rawSize.  Blocks
+ * are independent of each other.  Each piece of data that mtcp_restart reads
+ * at once (the data of an area, the bitmap of a sparse chunk, a run of
+ * sparse pages) starts a new block.
+ */
+#define DMTCP_COMPRESS_BLOCK_SIZE (256 * 1024)
+
+typedef struct CompressedBlockHeader {
+  uint32_t rawSize;
+  uint32_t compSize;
+} CompressedBlockHeader;
+
 typedef union ProcMapsArea {
   struct {
     union {
@@ -33,16 +33,23 @@
 #include "dmtcpalloc.h"
 
 #define PTS_PATH_MAX             32
-#define MAX_PID_MAPS             32768
-#define MAX_IPC_ID_MAPS          256
-#define MAX_PTY_NAME_MAPS        256
-#define MAX_PTRACE_ID_MAPS       256
+#define MAX_PID_MAPS             131072
+#define MAX_IPC_ID_MAPS          4096
+#define MAX_PTY_NAME_MAPS        1024
+#define MAX_PTRACE_ID_MAPS       4096
 #define MAX_INCOMING_CONNECTIONS 10240
 #define MAX_INODE_PID_MAPS       10240
 #define CON_ID_LEN \
   (sizeof(DmtcpUniqueProcessId) + sizeof(int64_t))
 
-#define SHM_VERSION_STR          "DMTCP_GLOBAL_AREA_V0.99"
+// Sizes of the open-addressed hash indexes over the maps above: powers of two,
+// at least twice the number of entries.
+#define PID_MAP_HASH_SIZE        (2 * MAX_PID_MAPS)
+#define IPC_ID_MAP_HASH_SIZE     (2 * MAX_IPC_ID_MAPS)
+#define PTY_NAME_MAP_HASH_SIZE   (2 * MAX_PTY_NAME_MAPS)
+#define PTRACE_ID_MAP_HASH_SIZE  (2 * MAX_PTRACE_ID_MAPS)
+
+#define SHM_VERSION_STR          "DMTCP_GLOBAL_AREA_V1.00"
 #define VIRT_PTS_PREFIX_STR      "/dev/pts/v"
 
 #define SYSV_SHM_ID              1
@@ -135,6 +142,13 @@ struct Header {
   uint32_t numIncomingConMaps;
   uint32_t numInodeConnIdMaps;
 
+  // Sequence counts of the pid, IPC-id and pty-name maps; odd while a
+  // writer is updating the map.
+  uint32_t pidMapSeq;
+  uint32_t ipcIdMapSeq;
+  uint32_t ptyNameMapSeq;
+  uint32_t _seqPad;
+
   union {
     struct BarrierInfo barrierInfo;
     char pad[128];
@@ -146,6 +160,16 @@ struct Header {
   struct IPCIdMap sysvMsqIdMap[MAX_IPC_ID_MAPS];
   struct PtraceIdMaps ptraceIdMap[MAX_PTRACE_ID_MAPS];
   struct PtyNameMap ptyNameMap[MAX_PTY_NAME_MAPS];
+
+  // Hash indexes: each slot holds the index of a map entry plus one, or zero.
+  uint32_t pidMapIndex[PID_MAP_HASH_SIZE];
+  uint32_t sysvShmIdMapIndex[IPC_ID_MAP_HASH_SIZE];
+  uint32_t sysvSemIdMapIndex[IPC_ID_MAP_HASH_SIZE];
+  uint32_t sysvMsqIdMapIndex[IPC_ID_MAP_HASH_SIZE];
+  uint32_t ptraceIdMapIndex[PTRACE_ID_MAP_HASH_SIZE];
+  uint32_t ptyVirtNameIndex[PTY_NAME_MAP_HASH_SIZE];
+  uint32_t ptyRealNameIndex[PTY_NAME_MAP_HASH_SIZE];
+
   struct IncomingConMap incomingConMap[MAX_INCOMING_CONNECTIONS];
   InodeConnIdMap inodeConnIdMap[MAX_INODE_PID_MAPS];
 
@@ -181,6 +181,8 @@ bool isPseudoTty(const string &path);
 size_t pageSize();
 size_t pageMask();
 bool areZeroPages(void *addr, size_t numPages);
+size_t scanZeroPages(void *addr, size_t numPages, char *isZero);
+const char *zeroPageScanner();
 
 char *findExecutable(char *executable, const char *path_env, char *exec_path);
 string getPath(string cmd, bool is32bit = false);
@@ -182,6 +182,16 @@ class JFixedAllocStack
       } while (!__sync_bool_compare_and_swap(&_root, item->next, item));
     }
 
+    // deallocate a list of chunks, linked through their first word
+    void deallocateList(void *first, void *last)
+    {
+      FreeItem *head = static_cast<FreeItem *>(first);
+      FreeItem *tail = static_cast<FreeItem *>(last);
+      do {
+        tail->next = _root;
+      } while (!__sync_bool_compare_and_swap(&_root, tail->next, head));
+    }
+
     int numExpands()
     {
       return _numExpands;
@@ -250,29 +260,219 @@ class JFixedAllocStack
 };
 } // namespace jalib
 
-jalib::JFixedAllocStack<64>lvl1;
-jalib::JFixedAllocStack<256>lvl2;
-jalib::JFixedAllocStack<1024>lvl3;
+// Size classes are powers of two.  Those up to MAX_CHUNKSIZE are the small
+// classes, used during /proc/self/maps parsing (see preExpand()); the large
+// classes take the place of a mmap()/munmap() pair for every allocation of
+// up to MAX_LARGE_CHUNKSIZE bytes.
+# define MIN_CHUNKSIZE       32
+# define MAX_LARGE_CHUNKSIZE (256 * 1024)
 # if MAX_CHUNKSIZE <= 1024
 #  error MAX_CHUNKSIZE must be larger
 # endif // if MAX_CHUNKSIZE <= 1024
-jalib::JFixedAllocStack<MAX_CHUNKSIZE>lvl4;
+
+jalib::JFixedAllocStack<32>lvl32;
+jalib::JFixedAllocStack<64>lvl64;
+jalib::JFixedAllocStack<128>lvl128;
+jalib::JFixedAllocStack<256>lvl256;
+jalib::JFixedAllocStack<512>lvl512;
+jalib::JFixedAllocStack<1024>lvl1k;
+jalib::JFixedAllocStack<2048>lvl2k;
+jalib::JFixedAllocStack<MAX_CHUNKSIZE>lvl4k;
+jalib::JFixedAllocStack<8 * 1024>lvl8k;
+jalib::JFixedAllocStack<16 * 1024>lvl16k;
+jalib::JFixedAllocStack<32 * 1024>lvl32k;
+jalib::JFixedAllocStack<64 * 1024>lvl64k;
+jalib::JFixedAllocStack<128 * 1024>lvl128k;
+jalib::JFixedAllocStack<MAX_LARGE_CHUNKSIZE>lvl256k;
+
+namespace
+{
+// The stacks are used before the static constructors have run, so the table
+// must not need one either: it holds the addresses of template functions.
+struct SizeClass {
+  size_t chunkSize;
+  void (*initialize)(int blockSize);
+  void *(*allocate)();
+  void (*deallocateList)(void *first, void *last);
+  int (*numExpands)();
+  void (*preExpand)();
+};
+
+template<typename Stack, Stack *stack>
+void initializeStack(int blockSize) { stack->initialize(blockSize); }
+
+template<typename Stack, Stack *stack>
+void *allocateFromStack() { return stack->allocate(); }
+
+template<typename Stack, Stack *stack>
+void deallocateListToStack(void *first, void *last)
+{
+  stack->deallocateList(first, last);
+}
+
+template<typename Stack, Stack *stack>
+int numExpandsOfStack() { return stack->numExpands(); }
+
+template<typename Stack, Stack *stack>
+void preExpandStack() { stack->preExpand(); }
+}
+
+# define SIZE_CLASS(n, stack)                                             \
+  { n,                                                                    \
+    &initializeStack<jalib::JFixedAllocStack<n>, &stack>,                 \
+    &allocateFromStack<jalib::JFixedAllocStack<n>, &stack>,               \
+    &deallocateListToStack<jalib::JFixedAllocStack<n>, &stack>,           \
+    &numExpandsOfStack<jalib::JFixedAllocStack<n>, &stack>,               \
+    &preExpandStack<jalib::JFixedAllocStack<n>, &stack> }
+
+static const SizeClass sizeClasses[] = {
+  SIZE_CLASS(32, lvl32),
+  SIZE_CLASS(64, lvl64),
+  SIZE_CLASS(128, lvl128),
+  SIZE_CLASS(256, lvl256),
+  SIZE_CLASS(512, lvl512),
+  SIZE_CLASS(1024, lvl1k),
+  SIZE_CLASS(2048, lvl2k),
+  SIZE_CLASS(MAX_CHUNKSIZE, lvl4k),
+  SIZE_CLASS(8 * 1024, lvl8k),
+  SIZE_CLASS(16 * 1024, lvl16k),
+  SIZE_CLASS(32 * 1024, lvl32k),
+  SIZE_CLASS(64 * 1024, lvl64k),
+  SIZE_CLASS(128 * 1024, lvl128k),
+  SIZE_CLASS(MAX_LARGE_CHUNKSIZE, lvl256k)
+};
+
+# define NUM_SIZE_CLASSES \
+  ((int)(sizeof(sizeClasses) / sizeof(sizeClasses[0])))
+
+// Each thread keeps up to THREAD_CACHE_SIZE free chunks of every small size
+// class, so that most allocations do not touch the shared stacks at all.
+// Chunks move between the thread cache and the shared stack
+// THREAD_CACHE_BATCH at a time.  The large classes are not cached: that
+// would pin megabytes per thread, all of which goes into every ckpt image.
+# define THREAD_CACHE_SIZE  32
+# define THREAD_CACHE_BATCH 16
+
+namespace
+{
+struct ThreadCache {
+  struct Bin {
+    void *head;
+    int count;
+    size_t hits;
+  };
+
+  Bin bins[NUM_SIZE_CLASSES];
+
+  // Set while the cache is being modified.  An allocation from a signal
+  // handler that interrupted it goes straight to the shared stack.
+  volatile int busy;
+};
+
+struct SizeClassCounters {
+  size_t volatile cacheHits;
+  size_t volatile cacheRefills;
+};
+}
+
+// Only the thread itself and its signal handlers touch its cache, so a
+// compiler barrier is enough around the updates of busy.
+# define CACHE_BARRIER() __asm__ __volatile__ ("" : : : "memory")
+
+static __thread ThreadCache threadCache;
+static SizeClassCounters counters[NUM_SIZE_CLASSES];
+
+static inline void *&
+nextChunk(void *chunk)
+{
+  return *static_cast<void **>(chunk);
+}
+
+static void
+atomicAdd(size_t volatile *counter, size_t n)
+{
+  size_t old;
+
+  do {
+    old = *counter;
+  } while (!__sync_bool_compare_and_swap(counter, old, old + n));
+}
+
+static inline bool
+isCachedSizeClass(int idx)
+{
+  return sizeClasses[idx].chunkSize <= MAX_CHUNKSIZE;
+}
+
+static inline int
+sizeClassOf(size_t n)
+{
+  int idx = 0;
+
+  while (idx < NUM_SIZE_CLASSES && n > sizeClasses[idx].chunkSize) {
+    idx++;
+  }
+  return idx;
+}
+
+static void
+refillBin(int idx, ThreadCache::Bin *bin)
+{
+  atomicAdd(&counters[idx].cacheRefills, 1);
+  if (bin->hits > 0) {
+    atomicAdd(&counters[idx].cacheHits, bin->hits);
+    bin->hits = 0;
+  }
+  for (int i = 0; i < THREAD_CACHE_BATCH; i++) {
+    void *chunk = sizeClasses[idx].allocate();
+    nextChunk(chunk) = bin->head;
+    bin->head = chunk;
+    bin->count++;
+  }
+}
+
+// Returns the oldest chunks of the bin to the shared stack, leaving keep.
+static void
+drainBin(int idx, ThreadCache::Bin *bin, int keep)
+{
+  if (bin->count <= keep) {
+    return;
+  }
+  void *last = bin->head;
+  for (int i = 1; i < keep; i++) {
+    last = nextChunk(last);
+  }
+  void *first = keep == 0 ? bin->head : nextChunk(last);
+  if (keep == 0) {
+    bin->head = NULL;
+  } else {
+    nextChunk(last) = NULL;
+  }
+  bin->count = keep;
+
+  last = first;
+  while (nextChunk(last) != NULL) {
+    last = nextChunk(last);
+  }
+  sizeClasses[idx].deallocateList(first, last);
+}
 
 void
 jalib::JAllocDispatcher::initialize(void)
 {
-  if (fred_record_replay_enabled != 0 && fred_record_replay_enabled()) {
-    /* We need a greater arena size to eliminate mmap() calls that could happen
-       at different times for record vs. replay. */
-    lvl1.initialize(1024 * 1024 * 16);
-    lvl2.initialize(1024 * 1024 * 16);
-    lvl3.initialize(1024 * 32 * 16);
-    lvl4.initialize(1024 * 32 * 16);
-  } else {
-    lvl1.initialize(1024 * 16);
-    lvl2.initialize(1024 * 16);
-    lvl3.initialize(1024 * 32);
-    lvl4.initialize(1024 * 32);
+  for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+    size_t n = sizeClasses[i].chunkSize;
+    if (fred_record_replay_enabled != 0 && fred_record_replay_enabled()) {
+      /* We need a greater arena size to eliminate mmap() calls that could
+         happen at different times for record vs. replay. */
+      sizeClasses[i].initialize(n <= 256 ? 1024 * 1024 * 16
+                                : n <= MAX_CHUNKSIZE ? 1024 * 32 * 16
+                                : 16 * n);
+    } else {
+      sizeClasses[i].initialize(n <= 256 ? 1024 * 16
+                                : n <= MAX_CHUNKSIZE ? 1024 * 32
+                                : 4 * n);
+    }
   }
   _initialized = true;
 }
@@ -283,18 +483,30 @@ jalib::JAllocDispatcher::allocate(size_t n)
   if (!_initialized) {
     initialize();
   }
-  void *retVal;
-  if (n <= lvl1.chunkSize()) {
-    retVal = lvl1.allocate();
-  } else if (n <= lvl2.chunkSize()) {
-    retVal = lvl2.allocate();
-  } else if (n <= lvl3.chunkSize()) {
-    retVal = lvl3.allocate();
-  } else if (n <= lvl4.chunkSize()) {
-    retVal = lvl4.allocate();
-  } else {
-    retVal = _alloc_raw(n);
+  int idx = sizeClassOf(n);
+  if (idx == NUM_SIZE_CLASSES) {
+    return _alloc_raw(n);
   }
+
+  ThreadCache &cache = threadCache;
+  if (cache.busy || !isCachedSizeClass(idx)) {
+    return sizeClasses[idx].allocate();
+  }
+  cache.busy = 1;
+  CACHE_BARRIER();
+
+  ThreadCache::Bin *bin = &cache.bins[idx];
+  if (bin->head == NULL) {
+    refillBin(idx, bin);
+  }
+  void *retVal = bin->head;
+  bin->head = nextChunk(retVal);
+  bin->count--;
+  bin->hits++;
+  nextChunk(retVal) = NULL;
+
+  CACHE_BARRIER();
+  cache.busy = 0;
   return retVal;
 }
 
@@ -306,33 +518,108 @@ jalib::JAllocDispatcher::deallocate(void *ptr, size_t n)
     jalib::write(2, msg, sizeof(msg));
     abort();
   }
-  if (n <= lvl1.N) {
-    lvl1.deallocate(ptr);
-  } else if (n <= lvl2.N) {
-    lvl2.deallocate(ptr);
-  } else if (n <= lvl3.N) {
-    lvl3.deallocate(ptr);
-  } else if (n <= lvl4.N) {
-    lvl4.deallocate(ptr);
-  } else {
+  int idx = sizeClassOf(n);
+  if (idx == NUM_SIZE_CLASSES) {
     _dealloc_raw(ptr, n);
+    return;
+  }
+  if (ptr == NULL) {
+    return;
+  }
+
+  ThreadCache &cache = threadCache;
+  if (cache.busy || !isCachedSizeClass(idx)) {
+    nextChunk(ptr) = NULL;
+    sizeClasses[idx].deallocateList(ptr, ptr);
+    return;
+  }
+  cache.busy = 1;
+  CACHE_BARRIER();
+
+  ThreadCache::Bin *bin = &cache.bins[idx];
+  nextChunk(ptr) = bin->head;
+  bin->head = ptr;
+  bin->count++;
+  if (bin->count > THREAD_CACHE_SIZE) {
+    drainBin(idx, bin, THREAD_CACHE_SIZE - THREAD_CACHE_BATCH);
+  }
+
+  CACHE_BARRIER();
+  cache.busy = 0;
+}
+
+void
+jalib::JAllocDispatcher::flushThreadCache()
+{
+  ThreadCache &cache = threadCache;
+
+  if (!_initialized || cache.busy) {
+    return;
+  }
+  cache.busy = 1;
+  CACHE_BARRIER();
+  for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+    ThreadCache::Bin *bin = &cache.bins[i];
+    drainBin(i, bin, 0);
+    if (bin->hits > 0) {
+      atomicAdd(&counters[i].cacheHits, bin->hits);
+      bin->hits = 0;
+    }
   }
+  CACHE_BARRIER();
+  cache.busy = 0;
 }
 
 int
 jalib::JAllocDispatcher::numExpands()
 {
-  return lvl1.numExpands() + lvl2.numExpands() +
-         lvl3.numExpands() + lvl4.numExpands();
+  int n = 0;
+
+  for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+    n += sizeClasses[i].numExpands();
+  }
+  return n;
 }
 
+// Also fills the cache of the calling thread, since that is where its next
+// allocations come from.
 void
 jalib::JAllocDispatcher::preExpand()
 {
-  lvl1.preExpand();
-  lvl2.preExpand();
-  lvl3.preExpand();
-  lvl4.preExpand();
+  if (!_initialized) {
+    initialize();
+  }
+  ThreadCache &cache = threadCache;
+  for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+    if (!isCachedSizeClass(i)) {
+      continue;
+    }
+    sizeClasses[i].preExpand();
+    if (!cache.busy && cache.bins[i].count < THREAD_CACHE_BATCH) {
+      cache.busy = 1;
+      CACHE_BARRIER();
+      refillBin(i, &cache.bins[i]);
+      CACHE_BARRIER();
+      cache.busy = 0;
+    }
+  }
+}
+
+int
+jalib::JAllocDispatcher::numSizeClasses()
+{
+  return NUM_SIZE_CLASSES;
+}
+
+// The hits of the other threads are counted once they next refill or flush
+// their caches.
+void
+jalib::JAllocDispatcher::sizeClassStats(int idx, SizeClassStats *stats)
+{
+  stats->chunkSize = sizeClasses[idx].chunkSize;
+  stats->cacheHits = counters[idx].cacheHits + threadCache.bins[idx].hits;
+  stats->cacheRefills = counters[idx].cacheRefills;
+  stats->numExpands = sizeClasses[idx].numExpands();
 }
 
 #else // ifdef JALIB_ALLOCATOR
@@ -352,6 +639,10 @@ jalib::JAllocDispatcher::deallocate(void *ptr, size_t)
 {
   ::free(ptr);
 }
+
+void
+jalib::JAllocDispatcher::flushThreadCache()
+{}
 #endif // ifdef JALIB_ALLOCATOR
 
 #ifdef OVERRIDE_GLOBAL_ALLOCATOR
@@ -55,6 +55,19 @@ class JAllocDispatcher
 
     static int numExpands();
     static void preExpand();
+
+    // Returns the free chunks cached by the calling thread to the shared
+    // stacks; called when a thread exits.
+    static void flushThreadCache();
+
+    struct SizeClassStats {
+      size_t chunkSize;
+      size_t cacheHits;     // allocations served from a thread cache
+      size_t cacheRefills;  // batches taken from the shared stack
+      int numExpands;       // blocks obtained with mmap()
+    };
+    static int numSizeClasses();
+    static void sizeClassStats(int idx, SizeClassStats *stats);
 };
 
 class JAlloc
@@ -0,0 +1,498 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP.  If not, see <http://www.gnu.org/licenses/>.  *
+ ****************************************************************************/
+
+/* The checkpoint thread hands the data of the memory areas to
+ * writeCompressed(), which cuts it into blocks of DMTCP_COMPRESS_BLOCK_SIZE.
+ * The blocks go into a ring of slots; a pool of compressor threads
+ * compresses them, and the checkpoint thread writes the finished slots to
+ * the image in order.  The Area headers (writeRaw()) go through the same
+ * ring, uncompressed, so that they stay in order with the data.
+ *
+ * The compressor threads read the data in place until the slot is written,
+ * so the caller must flush() before it changes or unmaps the memory.  Small
+ * buffers, such as the bitmaps of a sparse area, are copied instead.
+ *
+ * The compressor threads are helper threads (ThreadList::startHelperThread())
+ * and leave no trace in the image.  They cannot use sem_wait() and the like,
+ * so the ring is synchronized with futexes.
+ */
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "dmtcpalloc.h"
+#include "jalloc.h"
+#include "jassert.h"
+#include "ckptcompress.h"
+#include "constants.h"
+#include "procmapsarea.h"
+#include "syscallwrappers.h"
+#include "threadlist.h"
+#include "util.h"
+
+using namespace dmtcp;
+
+#define COMPRESS_MAX_THREADS 64
+#define COMPRESS_SLOTS_PER_THREAD 4
+#define COMPRESS_STACK_SIZE (1024 * 1024)
+#define COMPRESS_SLOT_SIZE \
+  (sizeof(CompressedBlockHeader) + DMTCP_COMPRESS_BLOCK_SIZE)
+#define COMPRESS_COPY_SIZE DMTCP_SPARSE_BITMAP_SIZE
+
+typedef struct CompressSlot {
+  const char *src;      /* NULL for a raw slot */
+  size_t len;
+  char *out;            /* COMPRESS_SLOT_SIZE bytes, then a copy of src if
+                           len <= COMPRESS_COPY_SIZE */
+  size_t outLen;
+  size_t align;         /* Nonzero: pad the image to this alignment */
+  ssize_t rawWrite;     /* First slot of the n-th writeRaw(), or -1 */
+  volatile int done;
+} CompressSlot;
+
+static int compressFd = -1;
+static int numCompressThreads = 0;
+static size_t numSlots = 0;
+static CompressSlot *slots = NULL;
+static size_t *jobs = NULL;     /* Slots waiting for a compressor thread */
+static size_t nextSlot = 0;     /* Next slot to fill */
+static size_t nextWrite = 0;    /* Next slot to write to the image */
+static size_t nextJob = 0;      /* Next entry of jobs[] to queue */
+static volatile size_t nextTakenJob = 0;
+static volatile int numQueuedJobs = 0;  /* Futex; -1 stops the threads */
+static ThreadList::HelperThread compressThreads[COMPRESS_MAX_THREADS];
+static off_t outOffset = -1;    /* Image offset of the next slot; see align */
+static vector<off_t> *rawOffsets = NULL;
+static size_t numRawWrites = 0;
+
+int
+CkptCompress::numThreads()
+{
+  const char *str = getenv(ENV_VAR_CKPT_COMPRESS);
+
+  if (str == NULL) {
+    return 0;
+  }
+
+  int n = atoi(str);
+  if (n <= 0) {
+    return 0;
+  }
+  return MIN(n, COMPRESS_MAX_THREADS);
+}
+
+bool
+CkptCompress::isActive()
+{
+  return compressFd != -1;
+}
+
+static void
+compress_slot(CompressSlot *slot)
+{
+  CompressedBlockHeader *hdr = (CompressedBlockHeader *)slot->out;
+  char *data = slot->out + sizeof(*hdr);
+  size_t len = CkptCompress::compressBlock(slot->src, slot->len, data,
+                                           slot->len - 1);
+
+  if (len == 0) {
+    /* Incompressible; store the data as is. */
+    memcpy(data, slot->src, slot->len);
+    len = slot->len;
+  }
+  hdr->rawSize = slot->len;
+  hdr->compSize = len;
+  slot->outLen = sizeof(*hdr) + len;
+}
+
+static long
+futex(volatile int *addr, int op, int val)
+{
+  return _real_syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* Take the next queued job.  Returns false once end() stops the threads. */
+static bool
+take_job(size_t *n)
+{
+  while (1) {
+    int queued = numQueuedJobs;
+    if (queued < 0) {
+      return false;
+    } else if (queued == 0) {
+      futex(&numQueuedJobs, FUTEX_WAIT_PRIVATE, 0);
+    } else if (__sync_bool_compare_and_swap(&numQueuedJobs, queued,
+                                            queued - 1)) {
+      *n = __sync_fetch_and_add(&nextTakenJob, 1);
+      return true;
+    }
+  }
+}
+
+static int
+compress_thread(void *arg)
+{
+  size_t n;
+
+  while (take_job(&n)) {
+    CompressSlot *slot = &slots[jobs[n % numSlots]];
+    compress_slot(slot);
+    __sync_synchronize();
+    slot->done = 1;
+    futex(&slot->done, FUTEX_WAKE_PRIVATE, 1);
+  }
+  return 0;
+}
+
+/* Write the oldest slot to the image, once it is done. */
+static void
+write_next_slot()
+{
+  CompressSlot *slot = &slots[nextWrite % numSlots];
+
+  while (!slot->done) {
+    futex(&slot->done, FUTEX_WAIT_PRIVATE, 0);
+  }
+  __sync_synchronize();
+  if (slot->align != 0 && outOffset != -1) {
+    slot->outLen = (slot->align - outOffset % slot->align) % slot->align;
+    memset(slot->out, 0, slot->outLen);
+  }
+  if (slot->rawWrite != -1) {
+    (*rawOffsets)[slot->rawWrite] = outOffset;
+  }
+  JASSERT(Util::writeAll(compressFd, slot->out, slot->outLen) ==
+          (ssize_t)slot->outLen) (slot->outLen) (JASSERT_ERRNO)
+  .Text("error writing checkpoint image");
+  if (outOffset != -1) {
+    outOffset += slot->outLen;
+  }
+  nextWrite++;
+}
+
+static CompressSlot *
+get_free_slot()
+{
+  if (nextSlot - nextWrite == numSlots) {
+    write_next_slot();
+  }
+
+  CompressSlot *slot = &slots[nextSlot % numSlots];
+  slot->done = 0;
+  slot->align = 0;
+  slot->rawWrite = -1;
+  nextSlot++;
+  return slot;
+}
+
+/* The offsets of the first maxRawWrites writeRaw() calls are kept; room
+ * for them is made here, since nothing may be allocated while the memory
+ * areas are written.
+ */
+void
+CkptCompress::begin(int fd, int numThreads, size_t maxRawWrites)
+{
+  JASSERT(compressFd == -1);
+  compressFd = fd;
+  outOffset = lseek(fd, 0, SEEK_CUR);
+  // Left over from the previous checkpoint, or from before a restart.
+  delete rawOffsets;
+  rawOffsets = new vector<off_t>();
+  rawOffsets->reserve(maxRawWrites);
+  numRawWrites = 0;
+  numCompressThreads = 0;
+  numSlots = numThreads * COMPRESS_SLOTS_PER_THREAD;
+  slots = (CompressSlot *)JALLOC_HELPER_MALLOC(numSlots * sizeof(*slots));
+  jobs = (size_t *)JALLOC_HELPER_MALLOC(numSlots * sizeof(*jobs));
+  for (size_t i = 0; i < numSlots; i++) {
+    slots[i].out = (char *)JALLOC_HELPER_MALLOC(COMPRESS_SLOT_SIZE +
+                                                COMPRESS_COPY_SIZE);
+  }
+  nextSlot = nextWrite = nextJob = nextTakenJob = 0;
+  numQueuedJobs = 0;
+
+  for (int i = 0; i < numThreads; i++) {
+    if (!ThreadList::startHelperThread(&compressThreads[i], compress_thread,
+                                       NULL, COMPRESS_STACK_SIZE)) {
+      JTRACE("Failed to create compressor thread; "
+             "continuing with fewer threads") (i) (JASSERT_ERRNO);
+      break;
+    }
+    numCompressThreads++;
+  }
+  JASSERT(numCompressThreads > 0) (JASSERT_ERRNO)
+  .Text("Failed to create any compressor thread");
+
+  JTRACE("Compressing checkpoint image") (numCompressThreads) (numSlots);
+}
+
+size_t
+CkptCompress::writeRaw(const void *buf, size_t len)
+{
+  const char *ptr = (const char *)buf;
+  size_t n = numRawWrites++;
+
+  if (n < rawOffsets->capacity()) {
+    rawOffsets->push_back(-1);
+  }
+  for (size_t done = 0; done < len; done += COMPRESS_SLOT_SIZE) {
+    CompressSlot *slot = get_free_slot();
+    slot->src = NULL;
+    if (done == 0 && n < rawOffsets->size()) {
+      slot->rawWrite = n;
+    }
+    slot->len = MIN(len - done, (size_t)COMPRESS_SLOT_SIZE);
+    slot->outLen = slot->len;
+    memcpy(slot->out, ptr + done, slot->len);
+    slot->done = 1;
+  }
+  return n;
+}
+
+/* Pad the image with zeros up to a multiple of alignment (at most
+ * COMPRESS_SLOT_SIZE).  Does nothing if the image is not seekable.
+ */
+void
+CkptCompress::alignOutput(size_t alignment)
+{
+  CompressSlot *slot = get_free_slot();
+
+  JASSERT(alignment <= COMPRESS_SLOT_SIZE) (alignment);
+  slot->src = NULL;
+  slot->len = 0;
+  slot->outLen = 0;
+  slot->align = alignment;
+  slot->done = 1;
+}
+
+off_t
+CkptCompress::rawOffset(size_t n)
+{
+  JASSERT(rawOffsets != NULL && n < rawOffsets->size()) (n);
+  return (*rawOffsets)[n];
+}
+
+/* buf is read by the compressor threads until the next flush(), unless it
+ * is at most COMPRESS_COPY_SIZE bytes long; then it is copied right away.
+ */
+void
+CkptCompress::writeCompressed(const void *buf, size_t len)
+{
+  const char *ptr = (const char *)buf;
+
+  for (size_t done = 0; done < len; done += DMTCP_COMPRESS_BLOCK_SIZE) {
+    CompressSlot *slot = get_free_slot();
+    slot->src = ptr + done;
+    slot->len = MIN(len - done, (size_t)DMTCP_COMPRESS_BLOCK_SIZE);
+    if (len <= COMPRESS_COPY_SIZE) {
+      memcpy(slot->out + COMPRESS_SLOT_SIZE, slot->src, slot->len);
+      slot->src = slot->out + COMPRESS_SLOT_SIZE;
+    }
+    jobs[nextJob++ % numSlots] = slot - slots;
+    __sync_fetch_and_add(&numQueuedJobs, 1);
+    futex(&numQueuedJobs, FUTEX_WAKE_PRIVATE, 1);
+  }
+}
+
+/* Write out everything queued so far. */
+void
+CkptCompress::flush()
+{
+  while (nextWrite < nextSlot) {
+    write_next_slot();
+  }
+}
+
+void
+CkptCompress::end()
+{
+  flush();
+
+  numQueuedJobs = -1;
+  futex(&numQueuedJobs, FUTEX_WAKE_PRIVATE, INT_MAX);
+  for (int i = 0; i < numCompressThreads; i++) {
+    ThreadList::joinHelperThread(&compressThreads[i]);
+  }
+
+  // We never return here on restart, so free now.
+  for (size_t i = 0; i < numSlots; i++) {
+    JALLOC_HELPER_FREE(slots[i].out);
+  }
+  JALLOC_HELPER_FREE(slots);
+  JALLOC_HELPER_FREE(jobs);
+  slots = NULL;
+  jobs = NULL;
+  compressFd = -1;
+}
+
+/*****************************************************************************
+ *
+ *  Block compressor, LZ4 block format: a series of sequences, each one a
+ *  token (literal length << 4 | match length - 4), more literal length bytes
+ *  if the literal length is 15 or more, the literals, a 16-bit little-endian
+ *  match offset, and more match length bytes if the match length field is
+ *  15.  The last sequence has literals only.  The decompressor is
+ *  mtcp_lz_decompress() in mtcp/mtcp_util.ic.
+ *
+ *****************************************************************************/
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5   /* The last bytes are always literals ... */
+#define LZ_MFLIMIT 12        /* ... and no match starts in the last bytes. */
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_LOG 14
+#define LZ_SKIP_TRIGGER 6    /* Go faster over incompressible data. */
+
+static inline uint32_t
+lz_read32(const char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static inline size_t
+lz_match_length(const char *p, const char *ref, const char *limit)
+{
+  const char *start = p;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (p + sizeof(uint64_t) <= limit) {
+    uint64_t a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, ref, sizeof(b));
+    if (a != b) {
+      return p - start + (__builtin_ctzll(a ^ b) >> 3);
+    }
+    p += sizeof(uint64_t);
+    ref += sizeof(uint64_t);
+  }
+#endif // if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (p < limit && *p == *ref) {
+    p++;
+    ref++;
+  }
+  return p - start;
+}
+
+static inline char *
+lz_write_length(char *op, size_t len)
+{
+  while (len >= 255) {
+    *op++ = (char)255;
+    len -= 255;
+  }
+  *op++ = (char)len;
+  return op;
+}
+
+/* Compress len bytes (at most DMTCP_COMPRESS_BLOCK_SIZE) at src into dst.
+ * Returns the compressed size, or 0 if it would exceed dstLen.
+ */
+size_t
+CkptCompress::compressBlock(const char *src, size_t len, char *dst,
+                            size_t dstLen)
+{
+  uint32_t table[1 << LZ_HASH_LOG];
+  const char *ip = src;
+  const char *anchor = src;
+  const char *end = src + len;
+  const char *mflimit = end - LZ_MFLIMIT;
+  const char *matchlimit = end - LZ_LAST_LITERALS;
+  char *op = dst;
+  char *oend = dst + dstLen;
+
+  if (len > LZ_MFLIMIT) {
+    memset(table, 0, sizeof(table));
+    ip++;
+    size_t misses = 0;
+    while (ip < mflimit) {
+      uint32_t seq = lz_read32(ip);
+      uint32_t h = lz_hash(seq);
+      const char *ref = src + table[h];
+      table[h] = ip - src;
+
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+        ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+
+      size_t litLen = ip - anchor;
+      size_t matchLen = lz_match_length(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH,
+                                        matchlimit);
+      if (op + 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1 >
+          oend) {
+        return 0;
+      }
+
+      char *token = op++;
+      *token = (char)((litLen >= 15 ? 15 : litLen) << 4);
+      if (litLen >= 15) {
+        op = lz_write_length(op, litLen - 15);
+      }
+      memcpy(op, anchor, litLen);
+      op += litLen;
+
+      size_t offset = ip - ref;
+      *op++ = (char)(offset & 0xff);
+      *op++ = (char)(offset >> 8);
+
+      *token |= (char)(matchLen >= 15 ? 15 : matchLen);
+      if (matchLen >= 15) {
+        op = lz_write_length(op, matchLen - 15);
+      }
+
+      ip += LZ_MIN_MATCH + matchLen;
+      anchor = ip;
+      if (ip - 2 > src && ip < mflimit) {
+        table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+      }
+    }
+  }
+
+  size_t litLen = end - anchor;
+  if (op + 1 + litLen / 255 + 1 + litLen > oend) {
+    return 0;
+  }
+  *op++ = (char)((litLen >= 15 ? 15 : litLen) << 4);
+  if (litLen >= 15) {
+    op = lz_write_length(op, litLen - 15);
+  }
+  memcpy(op, anchor, litLen);
+  op += litLen;
+  return op - dst;
+}
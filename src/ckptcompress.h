@@ -0,0 +1,51 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP.  If not, see <http://www.gnu.org/licenses/>.  *
+ ****************************************************************************/
+
+#ifndef CKPT_COMPRESS_H
+#define CKPT_COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Built-in compression of the checkpoint image (DMTCP_CKPT_COMPRESS=N).
+ * The memory areas are compressed in blocks by N threads and written in
+ * order; see DMTCP_COMPRESSED_DATA in procmapsarea.h for the format.
+ */
+namespace dmtcp
+{
+namespace CkptCompress
+{
+int numThreads();
+void begin(int fd, int numThreads, size_t maxRawWrites);
+bool isActive();
+size_t writeRaw(const void *buf, size_t len);
+void writeCompressed(const void *buf, size_t len);
+void alignOutput(size_t alignment);
+void flush();
+void end();
+
+// File offset of the n-th writeRaw() since begin(), for n < maxRawWrites;
+// valid after end().
+off_t rawOffset(size_t n);
+
+size_t compressBlock(const char *src, size_t len, char *dst, size_t dstLen);
+}
+}
+#endif // ifndef CKPT_COMPRESS_H
@@ -41,6 +41,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
+#include "ckptcompress.h"
 #include "ckptserializer.h"
 #include "constants.h"
 #include "dmtcp.h"
@@ -63,10 +64,16 @@ using namespace dmtcp;
 #define FORKED_CKPT_CHILD  2
 
 static int forked_ckpt_status = -1;
+
+// Parent: read end, grandchild: write end of a pipe on which the grandchild
+// reports that the image of a forked checkpoint has been written.
+static int forked_ckpt_fd = -1;
 static pid_t ckpt_extcomp_child_pid = -1;
 static struct sigaction saved_sigchld_action;
 static int open_ckpt_to_write(int fd, int pipe_fds[2], char **extcomp_args);
 void mtcp_writememoryareas(int fd) __attribute__((weak));
+void mtcp_prepare_incremental_ckpt(int fd, void *mtcpHdr)
+__attribute__((weak));
 
 /* We handle SIGCHLD while checkpointing. */
 static void
@@ -234,6 +241,12 @@ perform_open_ckpt_image_fd(const char *tempCkptFilename,
   return fd;
 #endif // ifdef FAST_RST_VIA_MMAP
 
+  /* 1b. The built-in compressor replaces gzip/hbict; see ckptcompress.cpp */
+  if (CkptCompress::numThreads() > 0) {
+    JTRACE("NOTICE: built-in compression is enabled\n");
+    return fd;
+  }
+
   /* 2. Test if using GZIP/HBICT compression */
   /* 2a. Test if using GZIP compression */
   int use_gzip_compression = 0;
@@ -307,6 +320,13 @@ test_and_prepare_for_forked_ckpt()
     return 0;
   }
 
+  int status_fds[2];
+  if (_real_pipe(status_fds) == -1) {
+    JWARNING(false) (JASSERT_ERRNO)
+    .Text("Failed to do forked checkpointing, trying normal checkpoint");
+    return FORKED_CKPT_FAILED;
+  }
+
   /* Set SIGCHLD to our own handler;
    *     User handling is restored after forking child process.
    */
@@ -316,10 +336,18 @@ test_and_prepare_for_forked_ckpt()
   if (forked_cpid == -1) {
     JWARNING(false)
     .Text("Failed to do forked checkpointing, trying normal checkpoint");
+    sigaction(SIGCHLD, &saved_sigchld_action, NULL);
+    _real_close(status_fds[0]);
+    _real_close(status_fds[1]);
     return FORKED_CKPT_FAILED;
   } else if (forked_cpid > 0) {
     restore_sigchld_handler_and_wait_for_zombie(forked_cpid);
-    JTRACE("checkpoint complete\n");
+    _real_close(status_fds[1]);
+
+    // The user threads resume before the image is written; keep the status
+    // pipe out of their way.
+    forked_ckpt_fd = Util::changeFd(status_fds[0], PROTECTED_FORKED_CKPT_FD);
+    JTRACE("forked checkpoint started\n");
     return FORKED_CKPT_PARENT;
   } else {
     pid_t grandchild_pid = _real_sys_fork();
@@ -333,6 +361,12 @@ test_and_prepare_for_forked_ckpt()
 
     /* grandchild continues; no need now to waitpid() on grandchild */
     JTRACE("inside grandchild process");
+    _real_close(status_fds[0]);
+    forked_ckpt_fd = status_fds[1];
+
+    // Don't leak the write end into gzip; the parent must see EOF if this
+    // process dies before the image is complete.
+    fcntl(forked_ckpt_fd, F_SETFD, FD_CLOEXEC);
   }
   return FORKED_CKPT_CHILD;
 }
@@ -446,6 +480,10 @@ CkptSerializer::writeCkptImage(void *mtcpHdr, size_t mtcpHdrLen)
   // The rest of this function is for compatibility with original definition.
   writeDmtcpHeader(fd);
 
+  // Decide whether this is a full or an incremental image.  The latter
+  // records the parent image in the MTCP header.
+  mtcp_prepare_incremental_ckpt(fd, mtcpHdr);
+
   // Write MTCP header
   JASSERT(Util::writeAll(fd, mtcpHdr, mtcpHdrLen) == (ssize_t)mtcpHdrLen);
 
@@ -472,6 +510,10 @@ CkptSerializer::writeCkptImage(void *mtcpHdr, size_t mtcpHdrLen)
   JASSERT(rename(tempCkptFilename.c_str(), ckptFilename.c_str()) == 0);
 
   if (forked_ckpt_status == FORKED_CKPT_CHILD) {
+    char done = 1;
+    JWARNING(Util::writeAll(forked_ckpt_fd, &done, sizeof(done)) ==
+             sizeof(done)) (JASSERT_ERRNO);
+
     // Use _exit() instead of exit() to avoid popping atexit() handlers
     // registered by the parent process.
     _exit(0); /* grandchild exits */
@@ -480,6 +522,35 @@ CkptSerializer::writeCkptImage(void *mtcpHdr, size_t mtcpHdrLen)
   JTRACE("checkpoint complete");
 }
 
+bool
+CkptSerializer::forkedCkptPending()
+{
+  return forked_ckpt_status == FORKED_CKPT_PARENT && forked_ckpt_fd != -1;
+}
+
+// Called by the checkpoint thread of the parent of a forked checkpoint,
+// usually after the user threads have resumed.  Returns once the grandchild
+// has renamed the image into place, or has died trying.
+bool
+CkptSerializer::waitForForkedCkpt()
+{
+  if (!forkedCkptPending()) {
+    return true;
+  }
+
+  char done = 0;
+  ssize_t rc = Util::readAll(forked_ckpt_fd, &done, sizeof(done));
+  _real_close(forked_ckpt_fd);
+  forked_ckpt_fd = -1;
+  forked_ckpt_status = -1;
+
+  JWARNING(rc == sizeof(done) && done == 1)
+    (ProcessInfo::instance().getCkptFilename())
+  .Text("Forked checkpoint failed; the checkpoint image may be incomplete");
+  JTRACE("forked checkpoint complete");
+  return rc == sizeof(done) && done == 1;
+}
+
 void
 CkptSerializer::writeDmtcpHeader(int fd)
 {
@@ -33,6 +33,8 @@ namespace CkptSerializer
 int openCkptFileToWrite(const string &path);
 void createCkptDir();
 void writeCkptImage(void *mtcpHdr, size_t mtcpHdrLen);
+bool forkedCkptPending();
+bool waitForForkedCkpt();
 void writeDmtcpHeader(int fd);
 }
 }
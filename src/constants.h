@@ -98,6 +98,9 @@
                                     "DMTCP_SKIP_WRITING_TEXT_SEGMENTS"
 
 #define ENV_VAR_COORD_LOGFILE       "DMTCP_COORD_LOG_FILENAME"
+#define ENV_VAR_COORD_IO_THREADS    "DMTCP_COORD_IO_THREADS"
+#define ENV_VAR_COORD_PARENT        "DMTCP_COORD_PARENT"
+#define ENV_VAR_COORD_TRACE_DIR     "DMTCP_COORD_TRACE_DIR"
 
 // it is not yet safe to change these; these names are hard-wired in the code
 #define ENV_VAR_STDERR_PATH         "JALIB_STDERR_PATH"
@@ -112,6 +115,11 @@
 #endif // ifdef HBICT_DELTACOMP
 
 #define ENV_VAR_FORKED_CKPT             "DMTCP_FORKED_CHECKPOINT"
+#define ENV_VAR_CKPT_WRITER_THREADS     "DMTCP_CKPT_WRITER_THREADS"
+#define ENV_VAR_CKPT_COMPRESS           "DMTCP_CKPT_COMPRESS"
+#define ENV_VAR_CKPT_INCREMENTAL        "DMTCP_CKPT_INCREMENTAL"
+#define ENV_VAR_LAZY_RESTORE            "DMTCP_LAZY_RESTORE"
+#define ENV_VAR_RESTORE_DIRECT_IO       "DMTCP_RESTORE_DIRECT_IO"
 #define ENV_VAR_SIGCKPT                 "DMTCP_SIGCKPT"
 #define ENV_VAR_SCREENDIR               "SCREENDIR"
 #define ENV_VAR_DISABLE_STRICT_CHECKING "DMTCP_DISABLE_STRICT_CHECKING"
@@ -148,6 +156,10 @@
   ENV_VAR_DLSYM_OFFSET_M32,           \
   ENV_VAR_VIRTUAL_PID,                \
   ENV_VAR_SKIP_WRITING_TEXT_SEGMENTS, \
+  ENV_VAR_CKPT_WRITER_THREADS,        \
+  ENV_VAR_CKPT_COMPRESS,              \
+  ENV_VAR_CKPT_INCREMENTAL,           \
+  ENV_VAR_FORKED_CKPT,                \
   ENV_DELTACOMPRESSION
 
 #define DMTCP_RESTART_CMD       "dmtcp_restart"
@@ -155,6 +167,8 @@
 #define RESTART_SCRIPT_BASENAME "dmtcp_restart_script"
 #define RESTART_SCRIPT_EXT      "sh"
 
+#define TRACE_FILE_BASENAME     "dmtcp_trace"
+
 #define DMTCP_FILE_HEADER       "DMTCP_CHECKPOINT_IMAGE_v2.0\n"
 
 // #define MIN_SIGNAL 1
@@ -0,0 +1,365 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP.  If not, see <http://www.gnu.org/licenses/>.  *
+ ****************************************************************************/
+
+#include "coordinator_aggregator.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "../jalib/jassert.h"
+
+using namespace dmtcp;
+
+#define MAX_AGGREGATOR_EVENTS 1024
+
+// Reads a message along with its extra data; returns false on EOF or error.
+static bool
+readMessage(jalib::JSocket &sock, vector<char> *buf)
+{
+  buf->resize(sizeof(DmtcpMessage));
+  if (sock.readAll(&(*buf)[0], sizeof(DmtcpMessage)) !=
+      sizeof(DmtcpMessage)) {
+    return false;
+  }
+
+  DmtcpMessage *msg = (DmtcpMessage *)&(*buf)[0];
+  if (!msg->isValid()) {
+    return false;
+  }
+
+  size_t extraBytes = msg->extraBytes;
+  if (extraBytes > 0) {
+    buf->resize(sizeof(DmtcpMessage) + extraBytes);
+    if (sock.readAll(&(*buf)[sizeof(DmtcpMessage)], extraBytes) !=
+        (ssize_t)extraBytes) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+writeMessage(jalib::JSocket &sock, const vector<char> &buf)
+{
+  return sock.writeAll(&buf[0], buf.size()) == (ssize_t)buf.size();
+}
+
+CoordinatorAggregator::CoordinatorAggregator(jalib::JSocket &listenSock,
+                                             const string &parentHost,
+                                             int parentPort)
+  : _listenSock(listenSock)
+  , _parent(-1)
+  , _parentHost(parentHost)
+  , _parentPort(parentPort)
+  , _aggregatorId(0)
+  , _numRelayed(0)
+  , _epollFd(-1)
+{}
+
+void
+CoordinatorAggregator::addToEpoll(int fd, void *ptr)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = ptr;
+  JASSERT(epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev) != -1) (JASSERT_ERRNO);
+}
+
+void
+CoordinatorAggregator::eventLoop()
+{
+  struct epoll_event events[MAX_AGGREGATOR_EVENTS];
+
+  // A worker may go away while we relay a broadcast to it.
+  signal(SIGPIPE, SIG_IGN);
+
+  _parent = jalib::JClientSocket(_parentHost.c_str(), _parentPort);
+  JASSERT(_parent.isValid()) (_parentHost) (_parentPort) (JASSERT_ERRNO)
+  .Text("Failed to connect to the parent coordinator");
+
+  DmtcpMessage hello(DMT_NEW_AGGREGATOR);
+  _parent << hello;
+
+  DmtcpMessage reply;
+  reply.poison();
+  _parent >> reply;
+  reply.assertValid();
+  JASSERT(reply.type == DMT_ACCEPT) (reply.type)
+  .Text("Parent coordinator refused the aggregator");
+  _aggregatorId = reply.aggregatorId;
+  JNOTE("Connected to parent coordinator")
+    (_parentHost) (_parentPort) (_aggregatorId);
+
+  _epollFd = epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(_epollFd != -1) (JASSERT_ERRNO);
+  addToEpoll(_listenSock.sockfd(), &_listenSock);
+  addToEpoll(_parent.sockfd(), &_parent);
+
+  while (true) {
+    int nfds = epoll_wait(_epollFd, events, MAX_AGGREGATOR_EVENTS, -1);
+    if (nfds == -1 && errno == EINTR) {
+      continue;
+    }
+    JASSERT(nfds != -1) (JASSERT_ERRNO);
+
+    for (int n = 0; n < nfds; n++) {
+      void *ptr = events[n].data.ptr;
+      if (ptr == &_listenSock) {
+        onConnect();
+      } else if (ptr == &_parent) {
+        onParentData();
+      } else {
+        Endpoint *end = (Endpoint *)ptr;
+
+        // Closed while handling an earlier event of this batch.
+        if (!end->conn->local.isValid()) {
+          continue;
+        }
+        if (end->upstream) {
+          onUpstreamData(end->conn);
+        } else {
+          onLocalData(end->conn);
+        }
+      }
+    }
+
+    for (size_t i = 0; i < _closed.size(); i++) {
+      delete _closed[i];
+    }
+    _closed.clear();
+  }
+}
+
+void
+CoordinatorAggregator::onConnect()
+{
+  jalib::JSocket remote = _listenSock.accept();
+
+  if (!remote.isValid()) {
+    return;
+  }
+
+  jalib::JSocket upstream =
+    jalib::JClientSocket(_parentHost.c_str(), _parentPort);
+  if (!upstream.isValid()) {
+    JWARNING(false) (_parentHost) (_parentPort) (JASSERT_ERRNO)
+    .Text("Failed to connect to the parent coordinator");
+    remote.close();
+    return;
+  }
+
+  Connection *conn = new Connection(remote, upstream);
+  conn->localEnd.conn = conn;
+  conn->localEnd.upstream = false;
+  conn->upstreamEnd.conn = conn;
+  conn->upstreamEnd.upstream = true;
+  conn->helloSent = false;
+  conn->isWorker = false;
+  conn->joined = false;
+  conn->firstBroadcast = 0;
+  conn->atBarrier = false;
+  conn->reported = false;
+
+  addToEpoll(conn->local.sockfd(), &conn->localEnd);
+  addToEpoll(conn->upstream.sockfd(), &conn->upstreamEnd);
+  _connections.push_back(conn);
+}
+
+void
+CoordinatorAggregator::closeConnection(Connection *conn)
+{
+  // Closing the sockets also removes them from the epoll set.
+  conn->local.close();
+  conn->upstream.close();
+  _connections.remove(conn);
+  _closed.push_back(conn);
+
+  // The remaining workers may all be at the barrier now.
+  if (conn->isWorker) {
+    reportBarrier();
+  }
+}
+
+// Messages from a worker (or dmtcp_command, etc.) are relayed to the parent
+// coordinator, except for the DMT_OK of a worker at a barrier.
+void
+CoordinatorAggregator::onLocalData(Connection *conn)
+{
+  vector<char> buf;
+
+  if (!readMessage(conn->local, &buf)) {
+    closeConnection(conn);
+    return;
+  }
+
+  DmtcpMessage *msg = (DmtcpMessage *)&buf[0];
+  if (!conn->helloSent) {
+    conn->helloSent = true;
+    conn->isWorker = msg->type == DMT_NEW_WORKER ||
+                     msg->type == DMT_RESTART_WORKER;
+    msg->aggregatorId = _aggregatorId;
+  } else if (conn->isWorker && conn->joined && msg->type == DMT_OK) {
+    conn->okMsg = buf;
+    conn->atBarrier = true;
+    conn->reported = false;
+    reportBarrier();
+    return;
+  } else if (conn->isWorker) {
+    _numRelayed++;
+  }
+
+  if (!writeMessage(conn->upstream, buf)) {
+    closeConnection(conn);
+  }
+}
+
+void
+CoordinatorAggregator::onUpstreamData(Connection *conn)
+{
+  vector<char> buf;
+
+  if (!readMessage(conn->upstream, &buf)) {
+    closeConnection(conn);
+    return;
+  }
+
+  DmtcpMessage *msg = (DmtcpMessage *)&buf[0];
+  bool accepted = false;
+  if (conn->isWorker && !conn->joined && msg->type == DMT_ACCEPT) {
+    conn->joined = true;
+    conn->firstBroadcast = msg->aggregatorSeq;
+    accepted = true;
+  }
+
+  if (!writeMessage(conn->local, buf)) {
+    closeConnection(conn);
+    return;
+  }
+
+  // Broadcasts that overtook the DMT_ACCEPT of this worker.
+  if (accepted) {
+    list<vector<char> >::iterator it;
+    for (it = conn->pendingBroadcasts.begin();
+         it != conn->pendingBroadcasts.end();
+         it++) {
+      DmtcpMessage *bcast = (DmtcpMessage *)&(*it)[0];
+      if (bcast->aggregatorSeq >= conn->firstBroadcast) {
+        writeMessage(conn->local, *it);
+      }
+    }
+  }
+  conn->pendingBroadcasts.clear();
+}
+
+// A broadcast of the parent coordinator; fan it out to the local workers.
+void
+CoordinatorAggregator::onParentData()
+{
+  vector<char> buf;
+
+  if (!readMessage(_parent, &buf)) {
+    JNOTE("Parent coordinator disconnected, exiting");
+    exit(0);
+  }
+
+  DmtcpMessage *msg = (DmtcpMessage *)&buf[0];
+  JTRACE("relaying broadcast") (msg->type) (msg->aggregatorSeq);
+
+  list<Connection *>::iterator it;
+  for (it = _connections.begin(); it != _connections.end(); it++) {
+    Connection *conn = *it;
+    if (!conn->isWorker) {
+      continue;
+    }
+    if (!conn->joined) {
+      conn->pendingBroadcasts.push_back(buf);
+    } else if (msg->aggregatorSeq >= conn->firstBroadcast) {
+      writeMessage(conn->local, buf);
+      conn->atBarrier = false;
+      conn->reported = false;
+    }
+  }
+
+  // The parent coordinator counts the relayed messages per barrier, too.
+  _numRelayed = 0;
+}
+
+// Once all of the local workers have reached the barrier, report them to the
+// parent coordinator with a single DMT_OK.  If the workers are not in the same
+// state, or some of them were already reported, relay the DMT_OK messages
+// individually instead.
+void
+CoordinatorAggregator::reportBarrier()
+{
+  WorkerState::eWorkerState state = WorkerState::UNKNOWN;
+  uint32_t count = 0;
+  bool unanimous = true;
+  bool someReported = false;
+
+  list<Connection *>::iterator it;
+  for (it = _connections.begin(); it != _connections.end(); it++) {
+    Connection *conn = *it;
+    if (!conn->isWorker || !conn->joined) {
+      continue;
+    }
+    if (!conn->atBarrier) {
+      return;
+    }
+    if (conn->reported) {
+      someReported = true;
+      continue;
+    }
+
+    DmtcpMessage *ok = (DmtcpMessage *)&conn->okMsg[0];
+    if (count > 0 && ok->state != state) {
+      unanimous = false;
+    }
+    state = ok->state;
+    count++;
+  }
+
+  if (count == 0) {
+    return;
+  }
+
+  for (it = _connections.begin(); it != _connections.end(); it++) {
+    Connection *conn = *it;
+    if (!conn->isWorker || !conn->joined || conn->reported) {
+      continue;
+    }
+    if (someReported || !unanimous) {
+      writeMessage(conn->upstream, conn->okMsg);
+      _numRelayed++;
+    }
+    conn->reported = true;
+  }
+
+  if (someReported || !unanimous) {
+    return;
+  }
+
+  DmtcpMessage msg(DMT_OK);
+  msg.state = state;
+  msg.numPeers = count;
+  msg.aggregatorSeq = _numRelayed;
+  JTRACE("workers reached barrier") (count) (state) (_numRelayed);
+  _parent << msg;
+}
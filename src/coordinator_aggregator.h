@@ -0,0 +1,110 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP.  If not, see <http://www.gnu.org/licenses/>.  *
+ ****************************************************************************/
+
+#ifndef COORDINATOR_AGGREGATOR_H
+#define COORDINATOR_AGGREGATOR_H
+
+#include "../jalib/jsocket.h"
+#include "dmtcpalloc.h"
+#include "dmtcpmessagetypes.h"
+
+/* Per-node barrier aggregator (dmtcp_coordinator --parent HOST:PORT).
+ *
+ * The workers of a node connect to the aggregator instead of the main
+ * coordinator.  For every worker, the aggregator opens a connection to the
+ * main coordinator and relays the worker's messages over it, so that the
+ * coordinator still sees one client per process.  In addition, the
+ * aggregator keeps a control connection (DMT_NEW_AGGREGATOR) to the
+ * coordinator:
+ *   - A worker's DMT_OK is held back until all local workers reached the
+ *     barrier; a single DMT_OK with numPeers set to the number of workers is
+ *     then sent over the control connection.
+ *   - The coordinator sends its broadcasts (DMT_DO_SUSPEND,
+ *     DMT_BARRIER_RELEASED, ...) once over the control connection, and the
+ *     aggregator fans them out to the local workers.
+ * Thus, the coordinator handles one message per node and barrier instead of
+ * one per process.
+ *
+ * Ordering across the connections is kept with two sequence numbers in
+ * DmtcpMessage::aggregatorSeq: the aggregated DMT_OK carries the number of
+ * messages relayed so far, and the coordinator doesn't count it until it has
+ * processed that many messages from the node's workers.  Broadcasts carry
+ * their index, and the DMT_ACCEPT of a worker the number of broadcasts sent
+ * before it; a worker only gets the broadcasts that were meant for it.
+ */
+namespace dmtcp
+{
+class CoordinatorAggregator
+{
+  public:
+    CoordinatorAggregator(jalib::JSocket &listenSock,
+                          const string &parentHost,
+                          int parentPort);
+
+    void eventLoop();
+
+  private:
+    struct Connection;
+
+    // One side of a relayed connection, as registered with epoll.
+    struct Endpoint {
+      Connection *conn;
+      bool upstream;
+    };
+
+    struct Connection {
+      Connection(const jalib::JSocket &localSock,
+                 const jalib::JSocket &upstreamSock)
+        : local(localSock), upstream(upstreamSock) {}
+
+      jalib::JSocket local;
+      jalib::JSocket upstream;
+      Endpoint localEnd;
+      Endpoint upstreamEnd;
+      bool helloSent;
+      bool isWorker;
+      bool joined;
+      uint32_t firstBroadcast;
+      bool atBarrier;
+      bool reported;
+      vector<char> okMsg;
+      list<vector<char> > pendingBroadcasts;
+    };
+
+    void onConnect();
+    void onLocalData(Connection *conn);
+    void onUpstreamData(Connection *conn);
+    void onParentData();
+    void closeConnection(Connection *conn);
+    void reportBarrier();
+    void addToEpoll(int fd, void *ptr);
+
+    jalib::JSocket &_listenSock;
+    jalib::JSocket _parent;
+    string _parentHost;
+    int _parentPort;
+    uint32_t _aggregatorId;
+    uint32_t _numRelayed;
+    int _epollFd;
+    list<Connection *> _connections;
+    vector<Connection *> _closed;
+};
+}
+#endif // ifndef COORDINATOR_AGGREGATOR_H
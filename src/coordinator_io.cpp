@@ -0,0 +1,271 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP.  If not, see <http://www.gnu.org/licenses/>.  *
+ ****************************************************************************/
+
+#include "coordinator_io.h"
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "../jalib/jassert.h"
+#include "dmtcp_coordinator.h"
+#include "util.h"
+
+using namespace dmtcp;
+
+#define MAX_IO_EVENTS 1024
+
+CoordinatorIO::CoordinatorIO()
+  : _eventFd(-1)
+  , _broadcastClients(NULL)
+  , _broadcastBuf(NULL)
+  , _broadcastLen(0)
+  , _broadcastPending(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_broadcastDone, NULL);
+}
+
+void
+CoordinatorIO::initialize(size_t numThreads)
+{
+  JASSERT(_threads.empty());
+  if (numThreads == 0) {
+    return;
+  }
+
+  _eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  JASSERT(_eventFd != -1) (JASSERT_ERRNO);
+
+  // The checkpoint timer (SIGALRM) and SIGINT must interrupt the main
+  // thread's epoll_wait(); the I/O threads inherit a blocked mask.
+  sigset_t set, oldSet;
+  sigfillset(&set);
+  JASSERT(pthread_sigmask(SIG_SETMASK, &set, &oldSet) == 0);
+
+  for (size_t i = 0; i < numThreads; i++) {
+    IOThread *thread = new IOThread;
+    thread->io = this;
+    thread->id = i;
+    thread->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    JASSERT(thread->epollFd != -1) (JASSERT_ERRNO);
+    thread->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    JASSERT(thread->wakeFd != -1) (JASSERT_ERRNO);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    JASSERT(epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, thread->wakeFd, &ev)
+            != -1) (JASSERT_ERRNO);
+
+    JASSERT(pthread_create(&thread->tid, NULL, threadMain, thread) == 0);
+    _threads.push_back(thread);
+  }
+
+  JASSERT(pthread_sigmask(SIG_SETMASK, &oldSet, NULL) == 0);
+  JNOTE("Started coordinator I/O threads") (numThreads);
+}
+
+CoordinatorIO::IOThread *
+CoordinatorIO::threadFor(CoordClient *client)
+{
+  return _threads[client->clientNumber() % _threads.size()];
+}
+
+void
+CoordinatorIO::addClient(CoordClient *client)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+#ifdef EPOLLRDHUP
+  ev.events |= EPOLLRDHUP;
+#endif // ifdef EPOLLRDHUP
+  ev.data.ptr = client;
+  JASSERT(epoll_ctl(threadFor(client)->epollFd, EPOLL_CTL_ADD,
+                    client->sock().sockfd(), &ev) != -1)
+    (JASSERT_ERRNO);
+}
+
+void
+CoordinatorIO::rearmClient(CoordClient *client)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+#ifdef EPOLLRDHUP
+  ev.events |= EPOLLRDHUP;
+#endif // ifdef EPOLLRDHUP
+  ev.data.ptr = client;
+  JASSERT(epoll_ctl(threadFor(client)->epollFd, EPOLL_CTL_MOD,
+                    client->sock().sockfd(), &ev) != -1)
+    (JASSERT_ERRNO);
+}
+
+// The socket is not armed while the main thread handles one of its events,
+// so no I/O thread can be using it.  It is already gone from the epoll set
+// if the I/O thread reported the disconnect.
+void
+CoordinatorIO::removeClient(CoordClient *client)
+{
+  struct epoll_event ev;
+
+  JASSERT(epoll_ctl(threadFor(client)->epollFd, EPOLL_CTL_DEL,
+                    client->sock().sockfd(), &ev) != -1 || errno == ENOENT)
+    (JASSERT_ERRNO);
+}
+
+void
+CoordinatorIO::postEvent(const Event &event)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&_lock);
+  _events.push_back(event);
+  pthread_mutex_unlock(&_lock);
+  JASSERT(write(_eventFd, &one, sizeof(one)) == sizeof(one) || errno == EAGAIN)
+    (JASSERT_ERRNO);
+}
+
+bool
+CoordinatorIO::nextEvent(Event *event)
+{
+  uint64_t count;
+  bool found = false;
+
+  // Clear the eventfd before looking at the queue, so that an event posted
+  // after we found the queue empty wakes up the main thread again.
+  if (read(_eventFd, &count, sizeof(count)) == -1) {
+    JASSERT(errno == EAGAIN) (JASSERT_ERRNO);
+  }
+
+  pthread_mutex_lock(&_lock);
+  if (!_events.empty()) {
+    *event = _events.front();
+    _events.pop_front();
+    found = true;
+  }
+  pthread_mutex_unlock(&_lock);
+  return found;
+}
+
+void
+CoordinatorIO::broadcast(const vector<CoordClient *> &clients,
+                         const void *buf,
+                         size_t len)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&_lock);
+  _broadcastClients = &clients;
+  _broadcastBuf = buf;
+  _broadcastLen = len;
+  _broadcastPending = _threads.size();
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t i = 0; i < _threads.size(); i++) {
+    JASSERT(write(_threads[i]->wakeFd, &one, sizeof(one)) == sizeof(one))
+      (JASSERT_ERRNO);
+  }
+
+  pthread_mutex_lock(&_lock);
+  while (_broadcastPending > 0) {
+    pthread_cond_wait(&_broadcastDone, &_lock);
+  }
+  _broadcastClients = NULL;
+  pthread_mutex_unlock(&_lock);
+}
+
+// Thread i writes to clients i, i + n, i + 2n, ...  The main thread waits
+// in broadcast() meanwhile, so the client list doesn't change.
+void
+CoordinatorIO::writeShard(IOThread *thread)
+{
+  const vector<CoordClient *> &clients = *_broadcastClients;
+
+  for (size_t i = thread->id; i < clients.size(); i += _threads.size()) {
+    clients[i]->sock().writeAll((const char *)_broadcastBuf, _broadcastLen);
+  }
+
+  pthread_mutex_lock(&_lock);
+  if (--_broadcastPending == 0) {
+    pthread_cond_signal(&_broadcastDone);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void
+CoordinatorIO::readFromClient(IOThread *thread, CoordClient *client)
+{
+  Event event;
+
+  event.client = client;
+  event.extraData = NULL;
+  event.disconnected = false;
+  client->sock() >> event.msg;
+  event.msg.assertValid();
+  if (event.msg.extraBytes > 0) {
+    event.extraData = new char[event.msg.extraBytes];
+    client->sock().readAll(event.extraData, event.msg.extraBytes);
+  }
+  postEvent(event);
+}
+
+void *
+CoordinatorIO::threadMain(void *arg)
+{
+  IOThread *thread = (IOThread *)arg;
+
+  thread->io->run(thread);
+  return NULL;
+}
+
+void
+CoordinatorIO::run(IOThread *thread)
+{
+  struct epoll_event events[MAX_IO_EVENTS];
+
+  while (true) {
+    int nfds = epoll_wait(thread->epollFd, events, MAX_IO_EVENTS, -1);
+    JASSERT(nfds != -1 || errno == EINTR) (JASSERT_ERRNO);
+
+    for (int n = 0; n < nfds; n++) {
+      CoordClient *client = (CoordClient *)events[n].data.ptr;
+      if (client == NULL) {
+        uint64_t count;
+        if (read(thread->wakeFd, &count, sizeof(count)) == sizeof(count)) {
+          writeShard(thread);
+        }
+      } else if ((events[n].events & EPOLLHUP) ||
+#ifdef EPOLLRDHUP
+                 (events[n].events & EPOLLRDHUP) ||
+#endif // ifdef EPOLLRDHUP
+                 (events[n].events & EPOLLERR)) {
+        removeClient(client);
+        Event event;
+        event.client = client;
+        event.extraData = NULL;
+        event.disconnected = true;
+        postEvent(event);
+      } else if (events[n].events & EPOLLIN) {
+        readFromClient(thread, client);
+      }
+    }
+  }
+}
@@ -0,0 +1,96 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP.  If not, see <http://www.gnu.org/licenses/>.  *
+ ****************************************************************************/
+
+#ifndef COORDINATOR_IO_H
+#define COORDINATOR_IO_H
+
+#include <pthread.h>
+#include "dmtcpalloc.h"
+#include "dmtcpmessagetypes.h"
+
+/* Optional I/O threads of the coordinator (--io-threads N).  The client
+ * sockets are sharded across the threads, which read the incoming messages
+ * and queue them for the main thread; all of the coordinator state is still
+ * updated by the main thread only.  A client is re-armed only once the main
+ * thread has processed its message, so the messages of a client are handled
+ * in order and its socket is never read while the main thread uses it.
+ * Broadcasts are written by all of the threads in parallel.
+ */
+namespace dmtcp
+{
+class CoordClient;
+
+class CoordinatorIO
+{
+  public:
+    struct Event {
+      CoordClient *client;
+      DmtcpMessage msg;
+      char *extraData;
+      bool disconnected;
+    };
+
+    CoordinatorIO();
+
+    void initialize(size_t numThreads);
+    bool enabled() const { return !_threads.empty(); }
+
+    // Readable in the main thread's epoll set when events are queued.
+    int eventFd() const { return _eventFd; }
+
+    void addClient(CoordClient *client);
+    void removeClient(CoordClient *client);
+    void rearmClient(CoordClient *client);
+    bool nextEvent(Event *event);
+
+    // Writes 'buf' to all 'clients', and returns once all writes are done.
+    void broadcast(const vector<CoordClient *> &clients,
+                   const void *buf,
+                   size_t len);
+
+  private:
+    struct IOThread {
+      CoordinatorIO *io;
+      size_t id;
+      pthread_t tid;
+      int epollFd;
+      int wakeFd;
+    };
+
+    static void *threadMain(void *arg);
+    void run(IOThread *thread);
+    void readFromClient(IOThread *thread, CoordClient *client);
+    void writeShard(IOThread *thread);
+    void postEvent(const Event &event);
+    IOThread *threadFor(CoordClient *client);
+
+    vector<IOThread *> _threads;
+    int _eventFd;
+    pthread_mutex_t _lock;
+    pthread_cond_t _broadcastDone;
+    list<Event> _events;
+
+    const vector<CoordClient *> *_broadcastClients;
+    const void *_broadcastBuf;
+    size_t _broadcastLen;
+    size_t _broadcastPending;
+};
+}
+#endif // ifndef COORDINATOR_IO_H
@@ -38,6 +38,7 @@
 #include "processinfo.h"
 #include "shareddata.h"
 #include "syscallwrappers.h"
+#include "tracing.h"
 #include "util.h"
 #include "util.h"
 
@@ -425,6 +426,7 @@ void waitForBarrier(const string& barrierId)
   JASSERT(msg.type == DMT_BARRIER_RELEASED) (msg.type);
   JASSERT(extraData != NULL);
   JASSERT(barrierId == extraData) (barrierId) (extraData);
+  Tracing::enable(msg.traceEnabled);
 
   JALLOC_FREE(extraData);
 }
@@ -683,12 +685,13 @@ connectToCoordOnRestart(CoordinatorMode  mode,
   if (localIP != NULL) {
     memcpy(localIP, &hello_remote.ipAddr, sizeof hello_remote.ipAddr);
   }
+  Tracing::enable(hello_remote.traceEnabled);
 
   JTRACE("Coordinator handshake RECEIVED!!!!!");
 }
 
 void
-sendCkptFilename()
+sendCkptFilename(bool imagePending)
 {
   if (noCoordinator()) {
     return;
@@ -703,6 +706,7 @@ sendCkptFilename()
   } else {
     msg.type = DMT_CKPT_FILENAME;
   }
+  msg.ckptImagePending = imagePending;
   // Tell coordinator type of remote shell command used ssh/rsh
   string shellType = "";
   const char *remoteShellType = getenv(ENV_VAR_REMOTE_SHELL_CMD);
@@ -722,6 +726,16 @@ sendCkptFilename()
   sendMsgToCoordinator(msg, buf, buflen);
 }
 
+void
+sendCkptImageWritten()
+{
+  if (noCoordinator()) {
+    return;
+  }
+
+  sendMsgToCoordinator(DmtcpMessage(DMT_CKPT_IMAGE_WRITTEN));
+}
+
 int
 sendKeyValPairToCoordinator(const char *id,
                             const void *key,
@@ -756,6 +770,57 @@ sendKeyValPairToCoordinator(const char *id,
   return 1;
 }
 
+// Registers num_pairs pairs with a single message: key i is at
+// keys + i * key_len, and its value at vals + i * val_len.
+int
+sendKeyValPairsToCoordinator(const char *id,
+                             uint32_t num_pairs,
+                             const void *keys,
+                             uint32_t key_len,
+                             const void *vals,
+                             uint32_t val_len)
+{
+  DmtcpMessage msg(DMT_REGISTER_NAME_SERVICE_DATA_BATCH);
+
+  JWARNING(strlen(id) < sizeof(msg.nsid));
+  strncpy(msg.nsid, id, sizeof msg.nsid);
+  msg.keyLen = key_len;
+  msg.valLen = val_len;
+  msg.extraBytes = num_pairs * (key_len + val_len);
+  int sock = coordinatorSocket;
+
+  if (num_pairs == 0 || keys == NULL || key_len == 0 || vals == NULL ||
+      val_len == 0) {
+    return 0;
+  }
+
+  if (dmtcp_is_running_state()) {
+    if (nsSock == -1) {
+      nsSock = createNewSocketToCoordinator(COORD_ANY);
+      JASSERT(nsSock != -1);
+      nsSock = Util::changeFd(nsSock, PROTECTED_NS_FD);
+      JASSERT(nsSock == PROTECTED_NS_FD);
+      DmtcpMessage m(DMT_NAME_SERVICE_WORKER);
+      JASSERT(Util::writeAll(nsSock, &m, sizeof(m)) == sizeof(m));
+    }
+    sock = nsSock;
+  }
+
+  // The pairs are interleaved into one buffer and sent with one write.
+  vector<char> buf(msg.extraBytes);
+  for (uint32_t i = 0; i < num_pairs; i++) {
+    char *pair = buf.data() + i * (key_len + val_len);
+    memcpy(pair, (const char *)keys + i * key_len, key_len);
+    memcpy(pair + key_len, (const char *)vals + i * val_len, val_len);
+  }
+
+  JASSERT(Util::writeAll(sock, &msg, sizeof(msg)) == sizeof(msg));
+  JASSERT(Util::writeAll(sock, buf.data(), buf.size()) ==
+          (ssize_t)buf.size());
+
+  return 1;
+}
+
 // On input, val points to a buffer in user memory and *val_len is the maximum
 // size of that buffer (the memory allocated by user).
 // On output, we copy data to val, and set *val_len to the actual buffer size
@@ -809,6 +874,71 @@ sendQueryToCoordinator(const char *id,
   return *val_len;
 }
 
+// Looks up num_keys keys of key_len bytes in one round trip.  The value of
+// key i is copied to vals + i * val_len, and its length to val_lens[i] (zero
+// if the key is not found).  Returns the number of keys found.
+int
+sendQueriesToCoordinator(const char *id,
+                         uint32_t num_keys,
+                         const void *keys,
+                         uint32_t key_len,
+                         void *vals,
+                         uint32_t val_len,
+                         uint32_t *val_lens)
+{
+  DmtcpMessage msg(DMT_NAME_SERVICE_QUERY_BATCH);
+
+  JWARNING(strlen(id) < sizeof(msg.nsid));
+  strncpy(msg.nsid, id, sizeof msg.nsid);
+  msg.keyLen = key_len;
+  msg.valLen = val_len;
+  msg.extraBytes = num_keys * key_len;
+  int sock = coordinatorSocket;
+
+  if (num_keys == 0 || keys == NULL || key_len == 0 || vals == NULL ||
+      val_lens == NULL) {
+    return 0;
+  }
+
+  if (dmtcp_is_running_state()) {
+    if (nsSock == -1) {
+      nsSock = createNewSocketToCoordinator(COORD_ANY);
+      JASSERT(nsSock != -1);
+      nsSock = Util::changeFd(nsSock, PROTECTED_NS_FD);
+      JASSERT(nsSock == PROTECTED_NS_FD);
+      DmtcpMessage m(DMT_NAME_SERVICE_WORKER);
+      JASSERT(Util::writeAll(nsSock, &m, sizeof(m)) == sizeof(m));
+    }
+    sock = nsSock;
+  }
+
+  JASSERT(Util::writeAll(sock, &msg, sizeof(msg)) == sizeof(msg));
+  JASSERT(Util::writeAll(sock, keys, msg.extraBytes) == msg.extraBytes);
+
+  msg.poison();
+
+  JASSERT(Util::readAll(sock, &msg, sizeof(msg)) == sizeof(msg));
+  msg.assertValid();
+  JASSERT(msg.type == DMT_NAME_SERVICE_QUERY_BATCH_RESPONSE &&
+          msg.valLen == val_len &&
+          msg.extraBytes == num_keys * (sizeof(uint32_t) + val_len))
+    (msg.type) (msg.valLen) (msg.extraBytes);
+
+  size_t lensSize = num_keys * sizeof(uint32_t);
+  size_t valsSize = num_keys * val_len;
+  JASSERT(Util::readAll(sock, val_lens, lensSize) == (ssize_t)lensSize);
+  JASSERT(Util::readAll(sock, vals, valsSize) == (ssize_t)valsSize);
+
+  int numFound = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    JASSERT(val_lens[i] <= val_len) (i) (val_lens[i]) (val_len);
+    if (val_lens[i] > 0) {
+      numFound++;
+    }
+  }
+  return numFound;
+}
+
 int getUniqueIdFromCoordinator(const char *id,
                                const void *key,
                                uint32_t key_len,
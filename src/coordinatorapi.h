@@ -80,13 +80,20 @@ char *connectAndSendUserCommand(char c,
 void updateCoordCkptDir(const char *dir);
 string getCoordCkptDir(void);
 
-void sendCkptFilename();
+void sendCkptFilename(bool imagePending = false);
+void sendCkptImageWritten();
 
 int sendKeyValPairToCoordinator(const char *id,
                                 const void *key,
                                 uint32_t key_len,
                                 const void *val,
                                 uint32_t val_len);
+int sendKeyValPairsToCoordinator(const char *id,
+                                 uint32_t num_pairs,
+                                 const void *keys,
+                                 uint32_t key_len,
+                                 const void *vals,
+                                 uint32_t val_len);
 int sendQueryToCoordinator(const char *id,
                            const void *key,
                            uint32_t key_len,
@@ -99,6 +106,14 @@ int getUniqueIdFromCoordinator(const char *id,
                                uint32_t *val_len,
                                uint32_t offset = 1);
 
+int sendQueriesToCoordinator(const char *id,
+                             uint32_t num_keys,
+                             const void *keys,
+                             uint32_t key_len,
+                             void *vals,
+                             uint32_t val_len,
+                             uint32_t *val_lens);
+
 int sendQueryAllToCoordinator(const char *id, void **buf, int *len);
 
 } // namespace CoordinatorAPI
@@ -74,11 +74,14 @@
 #include "../jalib/jfilesystem.h"
 #include "../jalib/jtimer.h"
 #include "constants.h"
+#include "coordinator_aggregator.h"
+#include "coordinator_io.h"
 #include "dmtcpmessagetypes.h"
 #include "lookup_service.h"
 #include "protectedfds.h"
 #include "restartscript.h"
 #include "syscallwrappers.h"
+#include "tracing.h"
 #include "util.h"
 #undef min
 #undef max
@@ -124,6 +127,18 @@ static const char *theUsage =
   "      (default: 0, disabled)\n"
   "  --coord-logfile PATH (environment variable DMTCP_COORD_LOG_FILENAME\n"
   "              Coordinator will dump its logs to the given file\n"
+  "  --io-threads N (environment variable DMTCP_COORD_IO_THREADS)\n"
+  "      Read from and broadcast to the workers with N threads, each serving\n"
+  "      a share of the worker sockets.  For computations with many\n"
+  "      processes.  (default: 0, everything done by the main thread)\n"
+  "  --parent HOST:PORT (environment variable DMTCP_COORD_PARENT)\n"
+  "      Run as a per-node aggregator for the coordinator at HOST:PORT.  The\n"
+  "      workers of this node connect here; their barriers are reported to\n"
+  "      the coordinator once per node instead of once per process.\n"
+  "  --trace-dir DIR (environment variable DMTCP_COORD_TRACE_DIR)\n"
+  "      Write a timeline of each checkpoint and restart to DIR, in the\n"
+  "      Chrome trace format: the barriers, the plugin callbacks and the\n"
+  "      writing of the image, for each process.\n"
   "  -q, --quiet \n"
   "      Skip startup msg; Skip NOTE msgs; if given twice, also skip WARNINGs\n"
   "  --help:\n"
@@ -204,6 +219,30 @@ static string ckptDir;
 struct epoll_event events[MAX_EVENTS];
 int epollFd;
 static jalib::JSocket *listenSock = NULL;
+static CoordinatorIO coordIO;
+
+/* Time from releasing a barrier (or broadcasting DMT_DO_SUSPEND) until all
+ * the workers have reached it; shown by the 's' command.
+ */
+struct BarrierLatency {
+  uint64_t count;
+  double total;
+  double max;
+};
+static map<string, BarrierLatency> barrierLatency;
+static string barrierInProgress;
+static struct timespec barrierStartTime;
+
+/* The timeline of the current checkpoint or restart, with --trace-dir: the
+ * spans sent by the workers (DMT_TRACE_EVENTS) and the barriers as seen by the
+ * coordinator (pid 0).  It is written out, in the Chrome trace format, once
+ * all the workers are running again; or, if they exit after the checkpoint,
+ * once all of them have sent their ckpt filenames.
+ */
+static string traceDir;
+static string traceKind;
+static vector<string> traceEntries;
+static uint64_t barrierStartUsec;
 
 static void removeStaleSharedAreaFile();
 static void preExitCleanup();
@@ -221,6 +260,9 @@ CoordClient::CoordClient(const jalib::JSocket &sock,
   : _sock(sock)
 {
   _isNSWorker = isNSWorker;
+  _ckptImagePending = false;
+  _isAggregator = hello_remote.type == DMT_NEW_AGGREGATOR;
+  _aggregatorId = 0;
   _realPid = hello_remote.realPid;
   _clientNumber = theNextClientNumber++;
   _identity = hello_remote.from;
@@ -412,6 +454,21 @@ DmtcpCoordinator::printStatus(size_t numPeers, bool isRunning)
     << "Checkpoint Dir: " << ckptDir << std::endl
     << "NUM_PEERS=" << numPeers << std::endl
     << "RUNNING=" << (isRunning ? "yes" : "no") << std::endl;
+
+  if (!_aggregators.empty()) {
+    o << "Aggregators: " << _aggregators.size() << std::endl;
+  }
+
+  if (!barrierLatency.empty()) {
+    o << "Barrier latency (count, avg ms, max ms):" << std::endl;
+    map<string, BarrierLatency>::iterator it;
+    for (it = barrierLatency.begin(); it != barrierLatency.end(); it++) {
+      o << "  " << it->first << ": " << it->second.count << ", "
+        << std::fixed << std::setprecision(3)
+        << it->second.total * 1000 / it->second.count << ", "
+        << it->second.max * 1000 << std::endl;
+    }
+  }
   printf("%s", o.str().c_str());
   fflush(stdout);
 }
@@ -438,15 +495,141 @@ DmtcpCoordinator::printList()
   return o.str();
 }
 
+static string
+jsonString(const string &s)
+{
+  ostringstream o;
+
+  o << '"';
+  for (size_t i = 0; i < s.length(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      o << '\\' << c;
+    } else if (c < 0x20) {
+      o << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c
+        << std::dec;
+    } else {
+      o << c;
+    }
+  }
+  o << '"';
+  return o.str();
+}
+
+static void
+addTraceProcess(pid_t pid, const string &name)
+{
+  ostringstream o;
+
+  o << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+    << ",\"args\":{\"name\":" << jsonString(name) << "}}";
+  traceEntries.push_back(o.str());
+}
+
+static void
+addTraceEvent(pid_t pid,
+              const string &category,
+              const string &name,
+              uint64_t start,
+              uint64_t duration)
+{
+  ostringstream o;
+
+  if (traceEntries.empty()) {
+    addTraceProcess(0, BINARY_NAME);
+  }
+  o << "{\"name\":" << jsonString(name) << ",\"cat\":" << jsonString(category)
+    << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << pid
+    << ",\"ts\":" << start << ",\"dur\":" << duration << "}";
+  traceEntries.push_back(o.str());
+}
+
+static void
+writeTraceFile()
+{
+  if (traceEntries.empty()) {
+    return;
+  }
+
+  ostringstream o;
+  o << traceDir << "/" << TRACE_FILE_BASENAME << "_" << compId << "_"
+    << std::setw(5) << std::setfill('0') << compId.computationGeneration()
+    << "_" << traceKind << ".json";
+  string path = o.str();
+
+  // Written under another name and renamed, so that whoever waits for the
+  // file never reads half of it.
+  string tmpPath = path + ".tmp";
+  FILE *fp = fopen(tmpPath.c_str(), "w");
+  if (fp == NULL) {
+    JWARNING(false) (tmpPath) (JASSERT_ERRNO).Text("Could not write trace");
+    traceEntries.clear();
+    return;
+  }
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < traceEntries.size(); i++) {
+    fprintf(fp, "%s%s\n", traceEntries[i].c_str(),
+            i + 1 < traceEntries.size() ? "," : "");
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+  if (fclose(fp) != 0 || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    JWARNING(false) (path) (JASSERT_ERRNO).Text("Could not write trace");
+    unlink(tmpPath.c_str());
+    traceEntries.clear();
+    return;
+  }
+
+  JNOTE("Wrote trace") (path) (traceEntries.size());
+  traceEntries.clear();
+}
+
+static void
+startBarrierTimer(const string &barrier)
+{
+  barrierInProgress = barrier;
+  clock_gettime(CLOCK_MONOTONIC, &barrierStartTime);
+  barrierStartUsec = Tracing::now();
+}
+
+static void
+stopBarrierTimer()
+{
+  if (barrierInProgress.empty()) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - barrierStartTime.tv_sec) +
+    (now.tv_nsec - barrierStartTime.tv_nsec) / 1e9;
+
+  BarrierLatency &latency = barrierLatency[barrierInProgress];
+  latency.count++;
+  latency.total += elapsed;
+  latency.max = std::max(latency.max, elapsed);
+  JTRACE("barrier reached by all workers") (barrierInProgress) (elapsed);
+  if (!traceDir.empty()) {
+    addTraceEvent(0, "barrier", barrierInProgress, barrierStartUsec,
+                  Tracing::now() - barrierStartUsec);
+  }
+  barrierInProgress.clear();
+}
+
 void
 DmtcpCoordinator::releaseBarrier(const string &barrier)
 {
+  startBarrierTimer(barrier);
   broadcastMessage(DMT_BARRIER_RELEASED, barrier.length() + 1, barrier.c_str());
 }
 
 void
 DmtcpCoordinator::updateMinimumState()
 {
+  // Avoid scanning all of the clients on every DMT_OK of a barrier.
+  if (workersAtCurrentBarrier < (int)clients.size()) {
+    return;
+  }
+
   ComputationStatus status = getStatus();
 
   if (!status.minimumStateUnanimous ||
@@ -454,6 +637,8 @@ DmtcpCoordinator::updateMinimumState()
     return;
   }
 
+  stopBarrierTimer();
+
   if (status.minimumState == WorkerState::SUSPENDED) {
     broadcastMessage(DMT_COMPUTATION_INFO);
     _numCkptWorkers = status.numPeers;
@@ -483,10 +668,43 @@ DmtcpCoordinator::updateMinimumState()
       JNOTE("Resuming all nodes after restart");
     }
   }
+
+  if (status.minimumState == WorkerState::RUNNING) {
+    writeTraceFile();
+  }
+}
+
+void
+DmtcpCoordinator::recordTraceEvents(CoordClient *client,
+                                    const DmtcpMessage &msg,
+                                    const char *extraData)
+{
+  if (traceDir.empty() || extraData == NULL) {
+    return;
+  }
+  JASSERT(msg.extraBytes % sizeof(TraceEvent) == 0) (msg.extraBytes);
+
+  pid_t pid = client->identity().pid();
+  ostringstream name;
+  name << client->progname() << "[" << pid << "]@" << client->hostname();
+  addTraceProcess(pid, name.str());
+
+  const TraceEvent *events = (const TraceEvent *)extraData;
+  for (size_t i = 0; i < msg.extraBytes / sizeof(TraceEvent); i++) {
+    const TraceEvent &event = events[i];
+    addTraceEvent(pid,
+                  string(event.category,
+                         strnlen(event.category, sizeof(event.category))),
+                  string(event.name, strnlen(event.name, sizeof(event.name))),
+                  event.start,
+                  event.duration);
+  }
 }
 
 void
-DmtcpCoordinator::recordCkptFilename(CoordClient *client, const char *extraData)
+DmtcpCoordinator::recordCkptFilename(CoordClient *client,
+                                     const char *extraData,
+                                     bool imagePending)
 {
   client->setState(WorkerState::CHECKPOINTED);
   JASSERT(extraData != NULL)
@@ -515,6 +733,14 @@ DmtcpCoordinator::recordCkptFilename(CoordClient *client, const char *extraData)
   }
   _numRestartFilenames++;
 
+  // With forked checkpointing, the worker resumes while a child process is
+  // still writing its image.  The worker reports the image separately
+  // (DMT_CKPT_IMAGE_WRITTEN) and the checkpoint completes only then.
+  if (imagePending) {
+    client->ckptImagePending(true);
+    _numPendingCkptImages++;
+  }
+
   if (_numRestartFilenames == _numCkptWorkers) {
     const string restartScriptPath =
       RestartScript::writeScript(ckptDir,
@@ -527,38 +753,72 @@ DmtcpCoordinator::recordCkptFilename(CoordClient *client, const char *extraData)
                                  _rshCmdFileNames,
                                  _sshCmdFileNames);
 
-    JNOTE("Checkpoint complete. Wrote restart script") (restartScriptPath);
-
-    JTIMER_STOP(checkpoint);
-    resetCkptTimer();
-
-    if (blockUntilDone) {
-      DmtcpMessage blockUntilDoneReply(DMT_USER_CMD_RESULT);
-      JNOTE("replying to dmtcp_command:  we're done");
-
-      // These were set in DmtcpCoordinator::onConnect in this file
-      jalib::JSocket remote(blockUntilDoneRemote);
-      remote << blockUntilDoneReply;
-      remote.close();
-      blockUntilDone = false;
-      blockUntilDoneRemote = -1;
-    }
+    JNOTE("Wrote restart script") (restartScriptPath);
 
-    if (exitAfterCkpt || exitAfterCkptOnce) {
-      JNOTE("Checkpoint Done. Killing all peers.");
-      broadcastMessage(DMT_KILL_PEER);
-      exitAfterCkptOnce = false;
-    } else {
+    if (!exitAfterCkpt && !exitAfterCkptOnce) {
       lookupService.reset();
     }
     _numRestartFilenames = 0;
     _numCkptWorkers = 0;
 
-    // All the workers have checkpointed so now it is safe to reset this flag.
-    workersRunningAndSuspendMsgSent = false;
+    if (_numPendingCkptImages == 0) {
+      checkpointComplete();
+    } else {
+      JNOTE("Waiting for forked checkpoint images") (_numPendingCkptImages);
+    }
   }
 }
 
+void
+DmtcpCoordinator::recordCkptImageWritten(CoordClient *client)
+{
+  if (!client->ckptImagePending()) {
+    return;
+  }
+  client->ckptImagePending(false);
+  JASSERT(_numPendingCkptImages > 0);
+  _numPendingCkptImages--;
+
+  // The restart script is written once all the filenames are in.
+  if (_numPendingCkptImages == 0 && _numRestartFilenames == 0 &&
+      _numCkptWorkers == 0) {
+    checkpointComplete();
+  }
+}
+
+void
+DmtcpCoordinator::checkpointComplete()
+{
+  JNOTE("Checkpoint complete.");
+
+  JTIMER_STOP(checkpoint);
+  resetCkptTimer();
+
+  if (blockUntilDone) {
+    DmtcpMessage blockUntilDoneReply(DMT_USER_CMD_RESULT);
+    JNOTE("replying to dmtcp_command:  we're done");
+
+    // These were set in DmtcpCoordinator::onConnect in this file
+    jalib::JSocket remote(blockUntilDoneRemote);
+    remote << blockUntilDoneReply;
+    remote.close();
+    blockUntilDone = false;
+    blockUntilDoneRemote = -1;
+  }
+
+  if (exitAfterCkpt || exitAfterCkptOnce) {
+    // Workers that exit after the checkpoint send their events before their
+    // ckpt filenames; see DmtcpWorker::postCheckpoint().
+    writeTraceFile();
+    JNOTE("Checkpoint Done. Killing all peers.");
+    broadcastMessage(DMT_KILL_PEER);
+    exitAfterCkptOnce = false;
+  }
+
+  // All the workers have checkpointed so now it is safe to reset this flag.
+  workersRunningAndSuspendMsgSent = false;
+}
+
 void
 DmtcpCoordinator::onData(CoordClient *client)
 {
@@ -574,6 +834,41 @@ DmtcpCoordinator::onData(CoordClient *client)
     client->sock().readAll(extraData, msg.extraBytes);
   }
 
+  processMessage(client, msg, extraData);
+}
+
+// Messages read by the I/O threads, see coordinator_io.h.
+void
+DmtcpCoordinator::processIOEvents()
+{
+  CoordinatorIO::Event event;
+
+  while (coordIO.nextEvent(&event)) {
+    if (event.disconnected) {
+      onDisconnect(event.client);
+    } else if (processMessage(event.client, event.msg, event.extraData)) {
+      coordIO.rearmClient(event.client);
+    }
+  }
+}
+
+// Returns false if the client was disconnected.  Frees extraData.
+bool
+DmtcpCoordinator::processMessage(CoordClient *client,
+                                 DmtcpMessage &msg,
+                                 char *extraData)
+{
+  bool connected = true;
+
+  if (client->isAggregator()) {
+    return processAggregatorMessage(client, msg, extraData);
+  }
+
+  Aggregator *aggregator = findAggregator(client);
+  if (aggregator != NULL) {
+    aggregator->numMsgsReceived++;
+  }
+
   switch (msg.type) {
   case DMT_OK:
   {
@@ -607,7 +902,17 @@ DmtcpCoordinator::onData(CoordClient *client)
 
   // Fall though
   case DMT_CKPT_FILENAME:
-    recordCkptFilename(client, extraData);
+    recordCkptFilename(client, extraData, msg.ckptImagePending != 0);
+    break;
+
+  case DMT_CKPT_IMAGE_WRITTEN:
+    JTRACE("got DMT_CKPT_IMAGE_WRITTEN message") (client->identity());
+    recordCkptImageWritten(client);
+    break;
+
+  case DMT_TRACE_EVENTS:
+    JTRACE("got DMT_TRACE_EVENTS message") (client->identity());
+    recordTraceEvents(client, msg, extraData);
     break;
 
   case DMT_GET_CKPT_DIR:
@@ -636,6 +941,14 @@ DmtcpCoordinator::onData(CoordClient *client)
     break;
   }
 
+  case DMT_REGISTER_NAME_SERVICE_DATA_BATCH:
+  {
+    JTRACE("received REGISTER_NAME_SERVICE_DATA_BATCH msg")
+      (client->identity());
+    lookupService.registerBatch(msg, (const void *)extraData);
+    break;
+  }
+
   case DMT_NAME_SERVICE_QUERY:
   {
     JTRACE("received NAME_SERVICE_QUERY msg") (client->identity());
@@ -652,6 +965,14 @@ DmtcpCoordinator::onData(CoordClient *client)
     break;
   }
 
+  case DMT_NAME_SERVICE_QUERY_BATCH:
+  {
+    JTRACE("received NAME_SERVICE_QUERY_BATCH msg") (client->identity());
+    lookupService.respondToBatchQuery(client->sock(), msg,
+                                      (const void *)extraData);
+    break;
+  }
+
   case DMT_NAME_SERVICE_QUERY_ALL:
   {
     JTRACE("received NAME_SERVICE_QUERY_ALL msg") (client->identity());
@@ -682,6 +1003,7 @@ DmtcpCoordinator::onData(CoordClient *client)
     JWARNING(false) (msg.type).Text(
       "unexpected message from worker. Closing connection");
     onDisconnect(client);
+    connected = false;
     break;
   default:
     JASSERT(false) (msg.from) (msg.type)
@@ -689,6 +1011,95 @@ DmtcpCoordinator::onData(CoordClient *client)
   }
 
   delete[] extraData;
+
+  // The aggregated DMT_OK of the node may have been waiting for this message.
+  if (aggregator != NULL) {
+    applyAggregatedOk(aggregator, false);
+  }
+  return connected;
+}
+
+bool
+DmtcpCoordinator::processAggregatorMessage(CoordClient *client,
+                                           DmtcpMessage &msg,
+                                           char *extraData)
+{
+  Aggregator *aggregator = &_aggregators[client->clientNumber()];
+  bool connected = true;
+
+  switch (msg.type) {
+  case DMT_OK:
+    JTRACE("got aggregated DMT_OK message")
+      (client->clientNumber()) (msg.numPeers) (msg.state);
+    JASSERT(!aggregator->okPending);
+    aggregator->ok = msg;
+    aggregator->okPending = true;
+    applyAggregatedOk(aggregator, false);
+    break;
+
+  case DMT_NULL:
+    onDisconnect(client);
+    connected = false;
+    break;
+
+  default:
+    JASSERT(false) (msg.from) (msg.type)
+    .Text("unexpected message from aggregator");
+  }
+
+  delete[] extraData;
+  return connected;
+}
+
+DmtcpCoordinator::Aggregator *
+DmtcpCoordinator::findAggregator(CoordClient *client)
+{
+  if (client->aggregatorId() == 0) {
+    return NULL;
+  }
+
+  map<uint32_t, Aggregator>::iterator it =
+    _aggregators.find(client->aggregatorId());
+  return it == _aggregators.end() ? NULL : &it->second;
+}
+
+// The aggregated DMT_OK counts once all of the messages that the aggregator
+// relayed before it have been processed (or one of its workers went away).
+void
+DmtcpCoordinator::applyAggregatedOk(Aggregator *aggregator, bool force)
+{
+  if (!aggregator->okPending ||
+      (!force && aggregator->numMsgsReceived < aggregator->ok.aggregatorSeq)) {
+    return;
+  }
+
+  aggregator->okPending = false;
+  for (size_t i = 0; i < aggregator->members.size(); i++) {
+    aggregator->members[i]->setState(aggregator->ok.state);
+  }
+  workersAtCurrentBarrier += aggregator->ok.numPeers;
+  updateMinimumState();
+}
+
+void
+DmtcpCoordinator::removeAggregatorMember(CoordClient *client)
+{
+  Aggregator *aggregator = findAggregator(client);
+
+  if (aggregator == NULL) {
+    return;
+  }
+
+  vector<CoordClient *> &members = aggregator->members;
+  for (size_t i = 0; i < members.size(); i++) {
+    if (members[i] == client) {
+      members.erase(members.begin() + i);
+      break;
+    }
+  }
+
+  // Messages of the worker that were still in flight are lost.
+  applyAggregatedOk(aggregator, true);
 }
 
 static void
@@ -713,6 +1124,20 @@ preExitCleanup()
 void
 DmtcpCoordinator::onDisconnect(CoordClient *client)
 {
+  if (coordIO.enabled()) {
+    coordIO.removeClient(client);
+  }
+  if (client->isAggregator()) {
+    JNOTE("aggregator disconnected") (client->clientNumber()) (client->ip());
+    Aggregator &aggregator = _aggregators[client->clientNumber()];
+    for (size_t i = 0; i < aggregator.members.size(); i++) {
+      aggregator.members[i]->aggregatorId(0);
+    }
+    _aggregators.erase(client->clientNumber());
+    client->sock().close();
+    delete client;
+    return;
+  }
   if (client->isNSWorker()) {
     client->sock().close();
     delete client;
@@ -727,6 +1152,11 @@ DmtcpCoordinator::onDisconnect(CoordClient *client)
   client->sock().close();
   JNOTE("client disconnected") (client->identity()) (client->progname());
   _virtualPidToClientMap.erase(client->virtualPid());
+  removeAggregatorMember(client);
+
+  // Don't wait for the image of a forked checkpoint that will never be
+  // reported; the child process writing it is not a client.
+  recordCkptImageWritten(client);
 
   ComputationStatus s = getStatus();
   if (s.numPeers < 1) {
@@ -770,6 +1200,7 @@ DmtcpCoordinator::initializeComputation()
   exitAfterCkptOnce = false;
   workersAtCurrentBarrier = 0;
   nextCkptBarrier = nextRestartBarrier = 0;
+  _numPendingCkptImages = 0;
 
   // exitAfterCkpt = false;
 
@@ -851,6 +1282,22 @@ DmtcpCoordinator::onConnect()
     return;
   }
 
+  if (hello_remote.type == DMT_NEW_AGGREGATOR) {
+    CoordClient *client = new CoordClient(remote, &remoteAddr, remoteLen,
+                                          hello_remote);
+    Aggregator &aggregator = _aggregators[client->clientNumber()];
+    aggregator.client = client;
+    aggregator.numMsgsReceived = 0;
+    aggregator.okPending = false;
+
+    DmtcpMessage reply(DMT_ACCEPT);
+    reply.aggregatorId = client->clientNumber();
+    remote << reply;
+    JNOTE("aggregator connected") (client->clientNumber()) (client->ip());
+    addDataSocket(client);
+    return;
+  }
+
   if (killInProgress) {
     JNOTE("Connection request received in the middle of killing computation. "
           "Sending it the kill message.");
@@ -899,6 +1346,12 @@ DmtcpCoordinator::onConnect()
   updateCheckpointInterval(hello_remote.theCheckpointInterval);
   JNOTE("worker connected") (hello_remote.from) (client->progname());
 
+  if (hello_remote.aggregatorId != 0 &&
+      _aggregators.find(hello_remote.aggregatorId) != _aggregators.end()) {
+    client->aggregatorId(hello_remote.aggregatorId);
+    _aggregators[hello_remote.aggregatorId].members.push_back(client);
+  }
+
   clients.push_back(client);
   addDataSocket(client);
 
@@ -961,6 +1414,8 @@ DmtcpCoordinator::validateRestartingWorkerProcess(
   string remoteIP = inet_ntoa(sin->sin_addr);
   DmtcpMessage hello_local(DMT_ACCEPT);
 
+  hello_local.aggregatorSeq = _numBroadcasts;
+  hello_local.traceEnabled = !traceDir.empty();
   JASSERT(hello_remote.state == WorkerState::RESTARTING) (hello_remote.state);
 
   if (compId == UniquePid(0, 0, 0)) {
@@ -975,6 +1430,8 @@ DmtcpCoordinator::validateRestartingWorkerProcess(
     JNOTE("FIRST dmtcp_restart connection.  Set numPeers. Generate timestamp")
       (numPeers) (curTimeStamp) (compId);
     JTIMER_START(restart);
+    traceKind = "restart";
+    traceEntries.clear();
   } else if (minimumState() != WorkerState::RESTARTING) {
     JNOTE("Computation not in RESTARTING state."
           "  Reject incoming computation process requesting restart.")
@@ -1040,6 +1497,7 @@ DmtcpCoordinator::validateNewWorkerProcess(
   DmtcpMessage hello_local(DMT_ACCEPT);
 
   hello_local.virtualPid = client->virtualPid();
+  hello_local.aggregatorSeq = _numBroadcasts;
   ComputationStatus s = getStatus();
 
   JASSERT(hello_remote.state == WorkerState::RUNNING ||
@@ -1131,8 +1589,11 @@ DmtcpCoordinator::startCheckpoint()
     compId.incrementGeneration();
     JNOTE("starting checkpoint; incrementing generation; suspending all nodes")
       (s.numPeers) (compId.computationGeneration());
+    traceKind = "ckpt";
+    traceEntries.clear();
 
     // Pass number of connected peers to all clients
+    startBarrierTimer("DMT_DO_SUSPEND");
     broadcastMessage(DMT_DO_SUSPEND);
 
     // Suspend Message has been sent but the workers are still in running
@@ -1160,17 +1621,45 @@ DmtcpCoordinator::broadcastMessage(DmtcpMessageType type,
   msg.compGroup = compId;
   msg.numPeers = clients.size();
   msg.exitAfterCkpt = exitAfterCkpt || exitAfterCkptOnce;
+  msg.traceEnabled = !traceDir.empty();
   msg.extraBytes = extraBytes;
+  msg.aggregatorSeq = _numBroadcasts++;
 
   if (msg.type == DMT_KILL_PEER && clients.size() > 0) {
     killInProgress = true;
   }
 
+  // The workers connected through an aggregator get the message from it.
+  const vector<CoordClient *> *targets = &clients;
+  vector<CoordClient *> nodeTargets;
+  if (!_aggregators.empty()) {
+    for (size_t i = 0; i < clients.size(); i++) {
+      if (clients[i]->aggregatorId() == 0) {
+        nodeTargets.push_back(clients[i]);
+      }
+    }
+    map<uint32_t, Aggregator>::iterator it;
+    for (it = _aggregators.begin(); it != _aggregators.end(); it++) {
+      nodeTargets.push_back(it->second.client);
+      it->second.numMsgsReceived = 0;
+    }
+    targets = &nodeTargets;
+  }
+
   JTRACE("sending message")(type);
-  for (size_t i = 0; i < clients.size(); i++) {
-    clients[i]->sock() << msg;
+  if (coordIO.enabled()) {
+    vector<char> buf(sizeof(msg) + extraBytes);
+    memcpy(&buf[0], &msg, sizeof(msg));
     if (extraBytes > 0) {
-      clients[i]->sock().writeAll((const char *)extraData, extraBytes);
+      memcpy(&buf[sizeof(msg)], extraData, extraBytes);
+    }
+    coordIO.broadcast(*targets, &buf[0], buf.size());
+  } else {
+    for (size_t i = 0; i < targets->size(); i++) {
+      (*targets)[i]->sock() << msg;
+      if (extraBytes > 0) {
+        (*targets)[i]->sock().writeAll((const char *)extraData, extraBytes);
+      }
     }
   }
   workersAtCurrentBarrier = 0;
@@ -1362,6 +1851,13 @@ DmtcpCoordinator::eventLoop(bool daemon)
       (JASSERT_ERRNO);
   }
 
+  if (coordIO.enabled()) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &coordIO;
+    JASSERT(epoll_ctl(epollFd, EPOLL_CTL_ADD, coordIO.eventFd(), &ev) != -1)
+      (JASSERT_ERRNO);
+  }
+
   while (true) {
     // Wait until either there is some activity on client sockets, or the timer
     // has expired.
@@ -1396,6 +1892,8 @@ DmtcpCoordinator::eventLoop(bool daemon)
       } else if (events[n].events & EPOLLIN) {
         if (ptr == (void *)listenSock) {
           onConnect();
+        } else if (ptr == (void *)&coordIO) {
+          processIOEvents();
         } else if (ptr == (void *)STDIN_FILENO) {
           char buf[1];
           int ret = Util::readAll(STDIN_FD, buf, sizeof(buf));
@@ -1421,6 +1919,11 @@ DmtcpCoordinator::addDataSocket(CoordClient *client)
 {
   struct epoll_event ev;
 
+  if (coordIO.enabled()) {
+    coordIO.addClient(client);
+    return;
+  }
+
 #ifdef EPOLLRDHUP
   ev.events = EPOLLIN | EPOLLRDHUP;
 #else // ifdef EPOLLRDHUP
@@ -1487,6 +1990,15 @@ main(int argc, char **argv)
     } else if (s == "--daemon") {
       daemon = true;
       shift;
+    } else if (argc > 1 && s == "--io-threads") {
+      setenv(ENV_VAR_COORD_IO_THREADS, argv[1], 1);
+      shift; shift;
+    } else if (argc > 1 && s == "--parent") {
+      setenv(ENV_VAR_COORD_PARENT, argv[1], 1);
+      shift; shift;
+    } else if (argc > 1 && s == "--trace-dir") {
+      setenv(ENV_VAR_COORD_TRACE_DIR, argv[1], 1);
+      shift; shift;
     } else if (s == "--coord-logfile") {
       useLogFile = true;
       logFilename = argv[1];
@@ -1551,6 +2063,13 @@ main(int argc, char **argv)
     ckptDir = get_current_dir_name();
   }
 
+  if (getenv(ENV_VAR_COORD_TRACE_DIR) != NULL) {
+    traceDir = getenv(ENV_VAR_COORD_TRACE_DIR);
+    if (!traceDir.empty() && traceDir[0] != '/') {
+      traceDir = string(get_current_dir_name()) + "/" + traceDir;
+    }
+  }
+
   /*Test if the listener socket is already open*/
   if (fcntl(PROTECTED_COORD_FD, F_GETFD) != -1) {
     listenSock = new jalib::JServerSocket(PROTECTED_COORD_FD);
@@ -1646,6 +2165,19 @@ main(int argc, char **argv)
     }
   }
 
+  // Per-node aggregator: relay the local workers to the parent coordinator.
+  if (getenv(ENV_VAR_COORD_PARENT) != NULL) {
+    string parent = getenv(ENV_VAR_COORD_PARENT);
+    size_t colon = parent.rfind(':');
+    JASSERT(colon != string::npos && colon > 0) (parent)
+    .Text("Expected HOST:PORT for the parent coordinator");
+    CoordinatorAggregator aggregator(*listenSock,
+                                     parent.substr(0, colon),
+                                     jalib::StringToInt(parent.substr(colon + 1)));
+    aggregator.eventLoop();
+    return 0;
+  }
+
   /* We set up the signal handler for SIGINT and SIGALRM.
    * SIGINT is used to send DMT_KILL_PEER message to all the connected peers
    * before exiting.
@@ -1669,10 +2201,15 @@ main(int argc, char **argv)
     // unblock SIGALRM because we are using alarm() for interval checkpointing
     sigdelset(&set, SIGALRM);
 
-    // sigprocmask is only per-thread; but the coordinator is single-threaded.
+    // sigprocmask is only per-thread; the I/O threads, if any, are started
+    // below with all signals blocked.
     sigprocmask(SIG_BLOCK, &set, NULL);
   }
 
+  if (getenv(ENV_VAR_COORD_IO_THREADS) != NULL) {
+    coordIO.initialize(jalib::StringToInt(getenv(ENV_VAR_COORD_IO_THREADS)));
+  }
+
   prog.eventLoop(daemon);
   return 0;
 }
@@ -69,6 +69,16 @@ class CoordClient
 
     int isNSWorker() { return _isNSWorker; }
 
+    bool ckptImagePending() const { return _ckptImagePending; }
+
+    void ckptImagePending(bool pending) { _ckptImagePending = pending; }
+
+    bool isAggregator() const { return _isAggregator; }
+
+    uint32_t aggregatorId() const { return _aggregatorId; }
+
+    void aggregatorId(uint32_t id) { _aggregatorId = id; }
+
     void readProcessInfo(DmtcpMessage &msg);
 
   private:
@@ -82,6 +92,9 @@ class CoordClient
     pid_t _realPid;
     pid_t _virtualPid;
     int _isNSWorker;
+    bool _ckptImagePending;
+    bool _isAggregator;
+    uint32_t _aggregatorId;
 };
 
 class DmtcpCoordinator
@@ -95,6 +108,13 @@ class DmtcpCoordinator
     } ComputationStatus;
 
     void onData(CoordClient *client);
+    bool processMessage(CoordClient *client,
+                        DmtcpMessage &msg,
+                        char *extraData);
+    void processIOEvents();
+    bool processAggregatorMessage(CoordClient *client,
+                                  DmtcpMessage &msg,
+                                  char *extraData);
     void onConnect();
     void onDisconnect(CoordClient *client);
     void eventLoop(bool daemon);
@@ -108,7 +128,14 @@ class DmtcpCoordinator
                           const void *extraData = NULL);
     void releaseBarrier(const string &barrier);
     bool startCheckpoint();
-    void recordCkptFilename(CoordClient *client, const char *barrierList);
+    void recordCkptFilename(CoordClient *client,
+                            const char *barrierList,
+                            bool imagePending);
+    void recordCkptImageWritten(CoordClient *client);
+    void recordTraceEvents(CoordClient *client,
+                           const DmtcpMessage &msg,
+                           const char *extraData);
+    void checkpointComplete();
 
     void handleUserCommand(char cmd, DmtcpMessage *reply = NULL);
     void printStatus(size_t numPeers, bool isRunning);
@@ -136,8 +163,23 @@ class DmtcpCoordinator
     void writeRestartScript();
 
   private:
+    // A per-node aggregator (see coordinator_aggregator.h) and the workers
+    // connected through it.
+    struct Aggregator {
+      CoordClient *client;
+      vector<CoordClient *>members;
+      uint32_t numMsgsReceived;
+      bool okPending;
+      DmtcpMessage ok;
+    };
+
+    Aggregator *findAggregator(CoordClient *client);
+    void applyAggregatedOk(Aggregator *aggregator, bool force);
+    void removeAggregatorMember(CoordClient *client);
+
     size_t _numCkptWorkers;
     size_t _numRestartFilenames;
+    size_t _numPendingCkptImages;
 
     // Store whether rsh/ssh was used
     map< string, vector<string> > _rshCmdFileNames;
@@ -152,6 +194,9 @@ class DmtcpCoordinator
 
     size_t nextCkptBarrier;
     size_t nextRestartBarrier;
+
+    map<uint32_t, Aggregator>_aggregators;
+    uint32_t _numBroadcasts;
 };
 }
 #endif // ifndef DMTCPDMTCPCOORDINATOR_H
@@ -101,6 +101,23 @@ static const char *theUsage =
   "  --ckptdir PATH (environment variable DMTCP_CHECKPOINT_DIR)\n"
   "              Directory to store checkpoint images\n"
   "              (default: curr dir at launch)\n"
+  "  --ckpt-writer-threads N (environment variable DMTCP_CKPT_WRITER_THREADS)\n"
+  "              Number of threads writing memory areas to the checkpoint\n"
+  "              image.  Used only for uncompressed images (--no-gzip).\n"
+  "              (default: 1)\n"
+  "  --ckpt-incremental N (environment variable DMTCP_CKPT_INCREMENTAL)\n"
+  "              Write only the pages changed since the previous checkpoint,\n"
+  "              with at most N incremental images after each full one.\n"
+  "              Needs uncompressed images (--no-gzip) or --ckpt-compress,\n"
+  "              and a new image name per generation (unique-ckpt plugin).\n"
+  "              (default: 0 (disabled))\n"
+  "  --ckpt-compress N (environment variable DMTCP_CKPT_COMPRESS)\n"
+  "              Compress checkpoint images in-process with N threads,\n"
+  "              instead of piping them to gzip.  (default: 0 (disabled))\n"
+  "  --forked-checkpointing (environment variable DMTCP_FORKED_CHECKPOINT)\n"
+  "              Write the checkpoint image from a forked child process and\n"
+  "              resume the application as soon as it has been forked.\n"
+  "              Disables --ckpt-incremental.  (default: disabled)\n"
   "  --ckpt-open-files\n"
   "  --checkpoint-open-files\n"
   "              Checkpoint open files and restore old working dir.\n"
@@ -315,6 +332,18 @@ processArgs(int *orig_argc,
     } else if (argc > 1 && s == "--ckpt-signal") {
       setenv(ENV_VAR_SIGCKPT, argv[1], 1);
       shift; shift;
+    } else if (argc > 1 && s == "--ckpt-writer-threads") {
+      setenv(ENV_VAR_CKPT_WRITER_THREADS, argv[1], 1);
+      shift; shift;
+    } else if (argc > 1 && s == "--ckpt-incremental") {
+      setenv(ENV_VAR_CKPT_INCREMENTAL, argv[1], 1);
+      shift; shift;
+    } else if (argc > 1 && s == "--ckpt-compress") {
+      setenv(ENV_VAR_CKPT_COMPRESS, argv[1], 1);
+      shift; shift;
+    } else if (s == "--forked-checkpointing") {
+      setenv(ENV_VAR_FORKED_CKPT, "1", 1);
+      shift;
     } else if (s == "--checkpoint-open-files" || s == "--ckpt-open-files") {
       checkpointOpenFiles = true;
       shift;
@@ -433,12 +462,9 @@ main(int argc, char **argv)
 
 #ifdef FORKED_CHECKPOINTING
 
-  /* When this is robust, add --forked-checkpointing option on command-line,
-   * with #ifdef FORKED_CHECKPOINTING around the option, change default of
-   * configure.ac, dmtcp/configure.ac, to enable, and change them
-   * from enable-forked... to disable-...
-   */
-  setenv(ENV_VAR_FORKED_CKPT, "1", 1);
+  // configure --enable-forked-checkpointing makes --forked-checkpointing
+  // the default.
+  setenv(ENV_VAR_FORKED_CKPT, "1", 0);
 #endif // ifdef FORKED_CHECKPOINTING
 
   // This code will go away when zero-mapped pages are implemented in MTCP.
@@ -97,6 +97,15 @@ static const char *theUsage =
   "              Not allowed if --join-coordinator is specified\n"
   "\n"
   "Other options:\n"
+  "  --lazy-restore (environment variable DMTCP_LAZY_RESTORE)\n"
+  "              Map the memory of uncompressed ckpt images directly from the\n"
+  "              image file, instead of reading it in before resuming.\n"
+  "              Pages are read in as they are touched.  The image file must\n"
+  "              not be modified while the restarted process runs.\n"
+  "  --direct-io (environment variable DMTCP_RESTORE_DIRECT_IO)\n"
+  "              Read the memory of ckpt images with O_DIRECT, bypassing the\n"
+  "              page cache, in large requests.  May be faster on parallel\n"
+  "              file systems.\n"
   "  --no-strict-checking\n"
   "              Disable uid checking for checkpoint image. Allow checkpoint\n"
   "              image to be restarted by a different user than the one\n"
@@ -127,6 +136,8 @@ typedef map<UniquePid, RestoreTarget *>RestoreTargetMap;
 RestoreTargetMap targets;
 RestoreTargetMap independentProcessTreeRoots;
 bool noStrictChecking = false;
+static bool lazyRestore = false;
+static bool directIO = false;
 static string thePortFile;
 CoordinatorMode allowedModes = COORD_ANY;
 
@@ -503,14 +514,25 @@ runMtcpRestart(int is32bitElf, int fd, ProcessInfo *pInfo)
     //     postRestartDebug() in the checkpoint image instead of postRestart().
   }
 
-  char *const newArgs[] = {
+  char *newArgs[] = {
     (char *)mtcprestart.c_str(),
     const_cast<char *>("--fd"), fdBuf,
     const_cast<char *>("--stderr-fd"), stderrFdBuf,
-    // This flag must be last, since it may become NULL
-    ( mtcp_restart_pause ? const_cast<char *>("--mtcp-restart-pause") : NULL ),
+    NULL, // Optional flags follow here
+    NULL,
+    NULL,
     NULL
   };
+  int numArgs = 5;
+  if (lazyRestore) {
+    newArgs[numArgs++] = const_cast<char *>("--lazy-restore");
+  }
+  if (directIO) {
+    newArgs[numArgs++] = const_cast<char *>("--direct-io");
+  }
+  if (mtcp_restart_pause) {
+    newArgs[numArgs++] = const_cast<char *>("--mtcp-restart-pause");
+  }
 
   execve(newArgs[0], newArgs, environ);
   JASSERT(false) (newArgs[0]) (newArgs[1]) (JASSERT_ERRNO)
@@ -756,6 +778,14 @@ main(int argc, char **argv)
     noStrictChecking = true;
   }
 
+  if (getenv(ENV_VAR_LAZY_RESTORE)) {
+    lazyRestore = true;
+  }
+
+  if (getenv(ENV_VAR_RESTORE_DIRECT_IO)) {
+    directIO = true;
+  }
+
   if (getenv(ENV_VAR_CHECKPOINT_DIR)) {
     ckptdir_arg = getenv(ENV_VAR_CHECKPOINT_DIR);
   }
@@ -788,6 +818,12 @@ main(int argc, char **argv)
     } else if (s == "--no-strict-checking") {
       noStrictChecking = true;
       shift;
+    } else if (s == "--lazy-restore") {
+      lazyRestore = true;
+      shift;
+    } else if (s == "--direct-io") {
+      directIO = true;
+      shift;
     } else if (s == "-i" || s == "--interval") {
       setenv(ENV_VAR_CKPT_INTR, argv[1], 1);
       shift; shift;
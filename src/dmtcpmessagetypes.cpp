@@ -41,6 +41,10 @@ DmtcpMessage::DmtcpMessage(DmtcpMessageType t /*= DMT_NULL*/)
   , coordTimeStamp(0)
   , theCheckpointInterval(DMTCPMESSAGE_SAME_CKPT_INTERVAL)
   , exitAfterCkpt(0)
+  , ckptImagePending(0)
+  , aggregatorId(0)
+  , aggregatorSeq(0)
+  , traceEnabled(0)
 {
   // struct sockaddr_storage _addr;
   // socklen_t _addrlen;
@@ -92,6 +96,7 @@ dmtcp::operator<<(dmtcp::ostream &o, const DmtcpMessageType &s)
     OSHIFTPRINTF(DMT_NEW_WORKER)
     OSHIFTPRINTF(DMT_NAME_SERVICE_WORKER)
     OSHIFTPRINTF(DMT_RESTART_WORKER)
+    OSHIFTPRINTF(DMT_NEW_AGGREGATOR)
     OSHIFTPRINTF(DMT_ACCEPT)
     OSHIFTPRINTF(DMT_REJECT_NOT_RESTARTING)
     OSHIFTPRINTF(DMT_REJECT_WRONG_COMP)
@@ -107,6 +112,7 @@ dmtcp::operator<<(dmtcp::ostream &o, const DmtcpMessageType &s)
     OSHIFTPRINTF(DMT_USER_CMD_RESULT)
     OSHIFTPRINTF(DMT_CKPT_FILENAME)
     OSHIFTPRINTF(DMT_UNIQUE_CKPT_FILENAME)
+    OSHIFTPRINTF(DMT_CKPT_IMAGE_WRITTEN)
 
     // OSHIFTPRINTF ( DMT_RESTART_PROCESS )
     // OSHIFTPRINTF ( DMT_RESTART_PROCESS_REPLY )
@@ -129,6 +135,12 @@ dmtcp::operator<<(dmtcp::ostream &o, const DmtcpMessageType &s)
     OSHIFTPRINTF(DMT_NAME_SERVICE_GET_UNIQUE_ID)
     OSHIFTPRINTF(DMT_NAME_SERVICE_GET_UNIQUE_ID_RESPONSE)
 
+    OSHIFTPRINTF(DMT_REGISTER_NAME_SERVICE_DATA_BATCH)
+    OSHIFTPRINTF(DMT_NAME_SERVICE_QUERY_BATCH)
+    OSHIFTPRINTF(DMT_NAME_SERVICE_QUERY_BATCH_RESPONSE)
+
+    OSHIFTPRINTF(DMT_TRACE_EVENTS)
+
     OSHIFTPRINTF(DMT_OK)
 
   default:
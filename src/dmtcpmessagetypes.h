@@ -36,6 +36,7 @@ enum DmtcpMessageType {
   DMT_NEW_WORKER,     // on connect established worker-coordinator
   DMT_NAME_SERVICE_WORKER,
   DMT_RESTART_WORKER,     // on connect established worker-coordinator
+  DMT_NEW_AGGREGATOR,     // on connect established aggregator-coordinator
   DMT_ACCEPT,          // on connect established coordinator-worker
   DMT_REJECT_NOT_RESTARTING,
   DMT_REJECT_WRONG_COMP,
@@ -51,6 +52,8 @@ enum DmtcpMessageType {
                              // coordinator
   DMT_UNIQUE_CKPT_FILENAME,  // same as DMT_CKPT_FILENAME, except when
                              // unique-ckpt plugin is being used.
+  DMT_CKPT_IMAGE_WRITTEN,    // a slave reporting that the image of a forked
+                             // checkpoint has been written
 
   DMT_USER_CMD,              // on connect established dmtcp_command ->
                              // coordinator
@@ -75,6 +78,13 @@ enum DmtcpMessageType {
   DMT_NAME_SERVICE_GET_UNIQUE_ID,
   DMT_NAME_SERVICE_GET_UNIQUE_ID_RESPONSE,
 
+  DMT_REGISTER_NAME_SERVICE_DATA_BATCH,
+  DMT_NAME_SERVICE_QUERY_BATCH,
+  DMT_NAME_SERVICE_QUERY_BATCH_RESPONSE,
+
+  DMT_TRACE_EVENTS,          // a slave sending the TraceEvents of the last
+                             // checkpoint or restart
+
   DMT_OK,                    // slave telling coordinator it is done (response
                              // to DMT_DO_*)  this means slave reached barrier
 };
@@ -127,12 +137,28 @@ struct DmtcpMessage {
   uint32_t uniqueIdOffset;
 
   uint32_t exitAfterCkpt;
-  uint32_t padding;
+  uint32_t ckptImagePending;  // with DMT_CKPT_FILENAME: forked checkpoint
+
+  // See coordinator_aggregator.h.
+  uint32_t aggregatorId;
+  uint32_t aggregatorSeq;
+
+  // Set by the coordinator if it wants the DMT_TRACE_EVENTS message.
+  uint32_t traceEnabled;
 
   DmtcpMessage(DmtcpMessageType t = DMT_NULL);
   void assertValid() const;
   bool isValid() const;
   void poison();
 };
+
+// A span of time in the checkpoint or restart of a worker.  An array of these
+// is the payload of DMT_TRACE_EVENTS.
+struct TraceEvent {
+  uint64_t start;      // microseconds since the epoch
+  uint64_t duration;   // microseconds
+  char category[16];
+  char name[80];
+};
 } // namespace dmtcp
 #endif // ifndef DMTCPMESSAGETYPES_H
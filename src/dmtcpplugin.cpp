@@ -512,6 +512,19 @@ dmtcp_send_key_val_pair_to_coordinator(const char *id,
                                                      val_len);
 }
 
+EXTERNC int
+dmtcp_send_key_val_pairs_to_coordinator(const char *id,
+                                        uint32_t num_pairs,
+                                        const void *keys,
+                                        uint32_t key_len,
+                                        const void *vals,
+                                        uint32_t val_len)
+{
+  return CoordinatorAPI::sendKeyValPairsToCoordinator(id, num_pairs,
+                                                      keys, key_len,
+                                                      vals, val_len);
+}
+
 // On input, val points to a buffer in user memory and *val_len is the maximum
 // size of that buffer (the memory allocated by user).
 // On output, we copy data to val, and set *val_len to the actual buffer size
@@ -538,6 +551,19 @@ dmtcp_get_unique_id_from_coordinator(const char *id,    // DB name
                                                     val, &val_len, offset);
 }
 
+EXTERNC int
+dmtcp_send_queries_to_coordinator(const char *id,
+                                  uint32_t num_keys,
+                                  const void *keys,
+                                  uint32_t key_len,
+                                  void *vals,
+                                  uint32_t val_len,
+                                  uint32_t *val_lens)
+{
+  return CoordinatorAPI::sendQueriesToCoordinator(id, num_keys, keys, key_len,
+                                                  vals, val_len, val_lens);
+}
+
 EXTERNC int
 dmtcp_send_query_all_to_coordinator(const char *id, void **buf, int *len)
 {
@@ -23,10 +23,12 @@
 #include <stdlib.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include "../jalib/jalloc.h"
 #include "../jalib/jbuffer.h"
 #include "../jalib/jconvert.h"
 #include "../jalib/jfilesystem.h"
 #include "../jalib/jsocket.h"
+#include "ckptserializer.h"
 #include "coordinatorapi.h"
 #include "pluginmanager.h"
 #include "processinfo.h"
@@ -35,6 +37,7 @@
 #include "syslogwrappers.h"
 #include "threadlist.h"
 #include "threadsync.h"
+#include "tracing.h"
 #include "util.h"
 
 using namespace dmtcp;
@@ -471,6 +474,9 @@ DmtcpWorker::waitForSuspendMessage()
     (SharedData::getCompId()) (msg.compGroup);
 
   _exitAfterCkpt = msg.exitAfterCkpt;
+
+  Tracing::reset();
+  Tracing::enable(msg.traceEnabled);
 }
 
 void
@@ -512,6 +518,20 @@ DmtcpWorker::waitForCheckpointRequest()
   JTRACE("Starting checkpoint, suspending...");
 }
 
+static void
+logAllocatorStats()
+{
+  for (int i = 0; i < jalib::JAllocDispatcher::numSizeClasses(); i++) {
+    jalib::JAllocDispatcher::SizeClassStats stats;
+    jalib::JAllocDispatcher::sizeClassStats(i, &stats);
+    if (stats.cacheRefills > 0) {
+      JTRACE("allocator size class")
+        (stats.chunkSize) (stats.cacheHits) (stats.cacheRefills)
+        (stats.numExpands);
+    }
+  }
+}
+
 // now user threads are stopped
 void
 DmtcpWorker::preCheckpoint()
@@ -519,6 +539,7 @@ DmtcpWorker::preCheckpoint()
   WorkerState::setCurrentState(WorkerState::SUSPENDED);
 
   JTRACE("suspended");
+  logAllocatorStats();
 
   if (exitInProgress()) {
     ThreadSync::destroyDmtcpWorkerLockUnlock();
@@ -545,7 +566,16 @@ void
 DmtcpWorker::postCheckpoint()
 {
   WorkerState::setCurrentState(WorkerState::CHECKPOINTED);
-  CoordinatorAPI::sendCkptFilename();
+
+  // With forked checkpointing, a child process is still writing the image.
+  // Report it once written (see postCheckpointResume()), unless we are about
+  // to exit.  In that case, the coordinator writes the trace as soon as it
+  // has the last ckpt filename, so the events must reach it first.
+  if (_exitAfterCkpt) {
+    CkptSerializer::waitForForkedCkpt();
+    Tracing::sendToCoordinator();
+  }
+  CoordinatorAPI::sendCkptFilename(CkptSerializer::forkedCkptPending());
 
   if (_exitAfterCkpt) {
     JTRACE("Asked to exit after checkpoint. Exiting!");
@@ -556,23 +586,43 @@ DmtcpWorker::postCheckpoint()
 #ifdef TIMING
   PluginManager::logCkptResumeBarrierOverhead();
 #endif
+  Tracing::sendToCoordinator();
 
   // Inform Coordinator of RUNNING state.
   WorkerState::setCurrentState(WorkerState::RUNNING);
   CoordinatorAPI::sendMsgToCoordinator(DmtcpMessage(DMT_OK));
 }
 
+// Called by the checkpoint thread after the user threads have resumed.
+void
+DmtcpWorker::postCheckpointResume()
+{
+  if (CkptSerializer::forkedCkptPending()) {
+    CkptSerializer::waitForForkedCkpt();
+    CoordinatorAPI::sendCkptImageWritten();
+  }
+}
+
 void
 DmtcpWorker::postRestart(double ckptReadTime)
 {
   JTRACE("begin postRestart()");
   WorkerState::setCurrentState(WorkerState::RESTARTING);
 
+  // The events in the image are those of the checkpoint.
+  Tracing::reset();
+  if (ckptReadTime > 0) {
+    uint64_t duration = ckptReadTime * 1000000;
+    Tracing::recordDuration("restart", "read image",
+                            Tracing::now() - duration, duration);
+  }
+
   PluginManager::processRestartBarriers();
 #ifdef TIMING
   PluginManager::logRestartBarrierOverhead(ckptReadTime);
 #endif
   JTRACE("got resume message after restart");
+  Tracing::sendToCoordinator();
 
   // Inform Coordinator of RUNNING state.
   WorkerState::setCurrentState(WorkerState::RUNNING);
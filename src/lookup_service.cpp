@@ -19,73 +19,288 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <limits.h>
+#include <sys/uio.h>
+#include <algorithm>
 #include "lookup_service.h"
 #include "../jalib/jassert.h"
 #include "../jalib/jsocket.h"
 
+// The initial number of hash slots of a database, and the size of the arena
+// blocks; a database grows by doubling the slots when half of them are used.
+#define KVDB_INITIAL_SLOTS 4096
+#define KVDB_BLOCK_SIZE    (1024 * 1024)
+
 using namespace dmtcp;
 
-void
-LookupService::reset()
+static uint64_t
+hashBytes(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 0xcbf29ce484222325ULL;   // FNV-1a
+
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Accessors of a serialized pair: <keyLen, key, valLen, val>.
+static size_t
+pairKeyLen(const char *pair)
+{
+  size_t len;
+
+  memcpy(&len, pair, sizeof(len));
+  return len;
+}
+
+static const char *
+pairKey(const char *pair)
+{
+  return pair + sizeof(size_t);
+}
+
+static size_t
+pairValLen(const char *pair)
+{
+  size_t len;
+
+  memcpy(&len, pairKey(pair) + pairKeyLen(pair), sizeof(len));
+  return len;
+}
+
+static const char *
+pairVal(const char *pair)
+{
+  return pairKey(pair) + pairKeyLen(pair) + sizeof(size_t);
+}
+
+static size_t
+pairSize(const char *pair)
+{
+  return pairVal(pair) + pairValLen(pair) - pair;
+}
+
+KeyValueDB::KeyValueDB()
+  : _slots(NULL),
+  _numSlots(0),
+  _numPairs(0),
+  _dataSize(0),
+  _numStale(0)
+{
+  resize(KVDB_INITIAL_SLOTS);
+}
+
+KeyValueDB::~KeyValueDB()
+{
+  for (size_t i = 0; i < _blocks.size(); i++) {
+    JALLOC_HELPER_FREE(_blocks[i].data);
+  }
+  JALLOC_HELPER_FREE(_slots);
+}
+
+// Returns the slot of key, or the free slot where it would be inserted.
+size_t
+KeyValueDB::findSlot(uint64_t hash, const void *key, size_t keyLen) const
 {
-  MapIterator i;
-
-  for (i = _maps.begin(); i != _maps.end(); i++) {
-    KeyValueMap &kvmap = i->second;
-    KeyValueMap::iterator it;
-    for (it = kvmap.begin(); it != kvmap.end(); it++) {
-      KeyValue *k = (KeyValue *)&(it->first);
-      KeyValue *v = it->second;
-      k->destroy();
-      v->destroy();
-      delete v;
+  size_t mask = _numSlots - 1;
+  size_t i = hash & mask;
+
+  while (_slots[i].pair != NULL) {
+    const char *pair = _slots[i].pair;
+    if (_slots[i].hash == hash && pairKeyLen(pair) == keyLen &&
+        memcmp(pairKey(pair), key, keyLen) == 0) {
+      break;
     }
-    kvmap.clear();
+    i = (i + 1) & mask;
   }
-  _maps.clear();
-  _lastUniqueIds.clear();
-  _offsets.clear();
+  return i;
 }
 
 void
-LookupService::addKeyValue(string id,
-                           const void *key,
-                           size_t keyLen,
-                           const void *val,
-                           size_t valLen)
+KeyValueDB::resize(size_t numSlots)
+{
+  Slot *oldSlots = _slots;
+  size_t oldNumSlots = _numSlots;
+
+  _slots = (Slot *)JALLOC_HELPER_MALLOC(numSlots * sizeof(Slot));
+  memset(_slots, 0, numSlots * sizeof(Slot));
+  _numSlots = numSlots;
+  for (size_t i = 0; i < oldNumSlots; i++) {
+    if (oldSlots[i].pair != NULL) {
+      size_t j = oldSlots[i].hash & (numSlots - 1);
+      while (_slots[j].pair != NULL) {
+        j = (j + 1) & (numSlots - 1);
+      }
+      _slots[j] = oldSlots[i];
+    }
+  }
+  if (oldSlots != NULL) {
+    JALLOC_HELPER_FREE(oldSlots);
+  }
+}
+
+char *
+KeyValueDB::allocPair(size_t len)
+{
+  if (_blocks.empty() || _blocks.back().size - _blocks.back().used < len) {
+    Block block;
+    block.size = std::max(len, (size_t)KVDB_BLOCK_SIZE);
+    block.data = (char *)JALLOC_HELPER_MALLOC(block.size);
+    block.used = 0;
+    _blocks.push_back(block);
+  }
+
+  Block &block = _blocks.back();
+  char *pair = block.data + block.used;
+  block.used += len;
+  return pair;
+}
+
+const void *
+KeyValueDB::find(const void *key, size_t keyLen, size_t *valLen) const
 {
-  KeyValueMap &kvmap = _maps[id];
+  const char *pair = _slots[findSlot(hashBytes(key, keyLen), key, keyLen)].pair;
+
+  if (pair == NULL) {
+    return NULL;
+  }
+  *valLen = pairValLen(pair);
+  return pairVal(pair);
+}
 
-  KeyValue k(key, keyLen);
-  KeyValue *v = new KeyValue(val, valLen);
+void
+KeyValueDB::insert(const void *key,
+                   size_t keyLen,
+                   const void *val,
+                   size_t valLen)
+{
+  uint64_t hash = hashBytes(key, keyLen);
+  size_t i = findSlot(hash, key, keyLen);
 
-  if (kvmap.find(k) != kvmap.end()) {
+  if (_slots[i].pair != NULL) {
     JTRACE("Duplicate key");
+    char *old = _slots[i].pair;
+    if (pairValLen(old) == valLen) {
+      memcpy((char *)pairVal(old), val, valLen);
+      return;
+    }
+
+    // The old pair stays in the arena, but is no longer sent.
+    _dataSize -= pairSize(old);
+    _numStale++;
+  } else {
+    if ((_numPairs + 1) * 2 > _numSlots) {
+      resize(_numSlots * 2);
+      i = findSlot(hash, key, keyLen);
+    }
+    _numPairs++;
   }
-  kvmap[k] = v;
+
+  size_t len = 2 * sizeof(size_t) + keyLen + valLen;
+  char *pair = allocPair(len);
+  memcpy(pair, &keyLen, sizeof(keyLen));
+  memcpy(pair + sizeof(size_t), key, keyLen);
+  memcpy(pair + sizeof(size_t) + keyLen, &valLen, sizeof(valLen));
+  memcpy(pair + 2 * sizeof(size_t) + keyLen, val, valLen);
+
+  _slots[i].hash = hash;
+  _slots[i].pair = pair;
+  _dataSize += len;
 }
 
+bool
+KeyValueDB::isLive(const char *pair) const
+{
+  const char *key = pairKey(pair);
+  size_t keyLen = pairKeyLen(pair);
+
+  return _slots[findSlot(hashBytes(key, keyLen), key, keyLen)].pair == pair;
+}
+
+// Appends one iovec per arena block; blocks with replaced pairs are split
+// around them.
 void
-LookupService::query(string id,
-                     const void *key,
-                     size_t keyLen,
-                     void **val,
-                     size_t *valLen)
+KeyValueDB::getIovecs(vector<struct iovec> *iov) const
 {
-  KeyValueMap &kvmap = _maps[id];
-  KeyValue k(key, keyLen);
+  for (size_t b = 0; b < _blocks.size(); b++) {
+    char *start = _blocks[b].data;
+    char *end = start + _blocks[b].used;
+    char *run = start;
+
+    if (_numStale > 0) {
+      for (char *pair = start; pair < end; pair += pairSize(pair)) {
+        if (!isLive(pair)) {
+          if (pair > run) {
+            struct iovec v = { run, (size_t)(pair - run) };
+            iov->push_back(v);
+          }
+          run = pair + pairSize(pair);
+        }
+      }
+    }
+    if (end > run) {
+      struct iovec v = { run, (size_t)(end - run) };
+      iov->push_back(v);
+    }
+  }
+}
+
+// Writes out all of the iovecs; returns false on error.
+static bool
+writevAll(int fd, vector<struct iovec> &iov)
+{
+  size_t i = 0;
+
+  while (i < iov.size()) {
+    int n = std::min(iov.size() - i, (size_t)IOV_MAX);
+    ssize_t ret = writev(fd, &iov[i], n);
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return false;
+    }
+
+    // Skip what was written, possibly part of an iovec.
+    while (i < iov.size() && (size_t)ret >= iov[i].iov_len) {
+      ret -= iov[i].iov_len;
+      i++;
+    }
+    if (ret > 0) {
+      iov[i].iov_base = (char *)iov[i].iov_base + ret;
+      iov[i].iov_len -= ret;
+    }
+  }
+  return true;
+}
 
-  if (kvmap.find(k) == kvmap.end()) {
-    JTRACE("Lookup Failed, Key not found.");
-    *val = NULL;
-    *valLen = 0;
-    return;
+void
+LookupService::reset()
+{
+  for (DBIterator i = _dbs.begin(); i != _dbs.end(); i++) {
+    delete i->second;
   }
+  _dbs.clear();
+  _lastUniqueIds.clear();
+  _offsets.clear();
+}
 
-  KeyValue *v = kvmap[k];
-  *valLen = v->len();
-  *val = new char[v->len()];
-  memcpy(*val, v->data(), *valLen);
+KeyValueDB *
+LookupService::getDB(const string &id, bool create)
+{
+  DBIterator i = _dbs.find(id);
+
+  if (i != _dbs.end()) {
+    return i->second;
+  }
+  if (!create) {
+    return NULL;
+  }
+  KeyValueDB *db = new KeyValueDB();
+  _dbs[id] = db;
+  return db;
 }
 
 void
@@ -96,9 +311,25 @@ LookupService::registerData(const DmtcpMessage &msg, const void *data)
     (msg.keyLen) (msg.valLen) (msg.extraBytes);
   const void *key = data;
   const void *val = (char *)key + msg.keyLen;
-  size_t keyLen = msg.keyLen;
-  size_t valLen = msg.valLen;
-  addKeyValue(msg.nsid, key, keyLen, val, valLen);
+  getDB(msg.nsid, true)->insert(key, msg.keyLen, val, msg.valLen);
+}
+
+// The data is a sequence of pairs, each a key of msg.keyLen bytes followed by
+// a value of msg.valLen bytes.
+void
+LookupService::registerBatch(const DmtcpMessage &msg, const void *data)
+{
+  size_t pairLen = msg.keyLen + msg.valLen;
+
+  JASSERT(msg.keyLen > 0 && msg.valLen > 0 &&
+          msg.extraBytes % pairLen == 0)
+    (msg.keyLen) (msg.valLen) (msg.extraBytes);
+  KeyValueDB *db = getDB(msg.nsid, true);
+  for (const char *p = (const char *)data;
+       p < (const char *)data + msg.extraBytes;
+       p += pairLen) {
+    db->insert(p, msg.keyLen, p + msg.keyLen, msg.valLen);
+  }
 }
 
 void
@@ -108,18 +339,25 @@ LookupService::respondToQuery(jalib::JSocket &remote,
 {
   JASSERT(msg.keyLen > 0 && msg.keyLen == msg.extraBytes)
     (msg.keyLen) (msg.extraBytes);
-  void *val = NULL;
+  const void *val = NULL;
   size_t valLen = 0;
   DmtcpMessage reply;
 
   if (msg.type == DMT_NAME_SERVICE_GET_UNIQUE_ID) {
     reply.type = DMT_NAME_SERVICE_GET_UNIQUE_ID_RESPONSE;
-    getUniqueId(msg.nsid, key, msg.keyLen, &val,
-                msg.uniqueIdOffset, msg.valLen);
+    val = getUniqueId(msg.nsid, key, msg.keyLen,
+                      msg.uniqueIdOffset, msg.valLen);
     valLen = msg.valLen;
   } else {
     reply.type = DMT_NAME_SERVICE_QUERY_RESPONSE;
-    query(msg.nsid, key, msg.keyLen, &val, &valLen);
+    KeyValueDB *db = getDB(msg.nsid, false);
+    if (db != NULL) {
+      val = db->find(key, msg.keyLen, &valLen);
+    }
+    if (val == NULL) {
+      JTRACE("Lookup Failed, Key not found.");
+      valLen = 0;
+    }
   }
 
   reply.keyLen = 0;
@@ -128,79 +366,99 @@ LookupService::respondToQuery(jalib::JSocket &remote,
 
   remote << reply;
   if (valLen > 0) {
-    remote.writeAll((char *)val, valLen);
+    remote.writeAll((const char *)val, valLen);
   }
-  delete[] (char *)val;
 }
 
+// The keys are msg.keyLen bytes each.  The reply has the length of each value
+// (zero if not found), followed by one slot of msg.valLen bytes per key.
 void
+LookupService::respondToBatchQuery(jalib::JSocket &remote,
+                                   const DmtcpMessage &msg,
+                                   const void *keys)
+{
+  JASSERT(msg.keyLen > 0 && msg.extraBytes % msg.keyLen == 0)
+    (msg.keyLen) (msg.extraBytes);
+  size_t numKeys = msg.extraBytes / msg.keyLen;
+  size_t slotLen = msg.valLen;
+  KeyValueDB *db = getDB(msg.nsid, false);
+  DmtcpMessage reply(DMT_NAME_SERVICE_QUERY_BATCH_RESPONSE);
+
+  reply.keyLen = 0;
+  reply.valLen = slotLen;
+  reply.extraBytes = numKeys * (sizeof(uint32_t) + slotLen);
+
+  vector<char> buf(reply.extraBytes, 0);
+  uint32_t *lens = (uint32_t *)buf.data();
+  char *vals = buf.data() + numKeys * sizeof(uint32_t);
+  for (size_t i = 0; db != NULL && i < numKeys; i++) {
+    size_t valLen;
+    const void *val = db->find((const char *)keys + i * msg.keyLen,
+                               msg.keyLen, &valLen);
+    if (val == NULL) {
+      JTRACE("Lookup Failed, Key not found.");
+      continue;
+    }
+
+    // A value too large for its slot is reported, but not sent.
+    lens[i] = valLen;
+    if (valLen <= slotLen) {
+      memcpy(vals + i * slotLen, val, valLen);
+    }
+  }
+
+  remote << reply;
+  if (buf.size() > 0) {
+    remote.writeAll(&buf[0], buf.size());
+  }
+}
+
+const void *
 LookupService::getUniqueId(const char *id,    // DB name
                            const void *key,   // Key: can be hostid, pid, etc.
                            size_t key_len,    // Length of the key
-                           void **val,        // Result
                            uint32_t offset,   // Difference in two unique ids
                            size_t val_len)    // Expected value length
 {
-  KeyValueMap &kvmap = _maps[id];
-  KeyValue k(key, key_len);
+  KeyValueDB *db = getDB(id, true);
+  size_t len;
+  const void *val = db->find(key, key_len, &len);
 
   // if key does not exist in the key-value map, add it
-  if (kvmap.find(k) == kvmap.end()) {
+  if (val == NULL) {
     if (_lastUniqueIds.find(id) == _lastUniqueIds.end()) {
       _lastUniqueIds[id] = 1;
       _offsets[id] = offset;
     }
     JTRACE("Assigning a new unique id to client request")
        (id) (_lastUniqueIds[id]);
-    KeyValue *v = new KeyValue(&_lastUniqueIds[id], val_len);
+    db->insert(key, key_len, &_lastUniqueIds[id], val_len);
     _lastUniqueIds[id] += _offsets[id];
-    kvmap[k] = v;
+    val = db->find(key, key_len, &len);
   }
 
-  KeyValue *v = kvmap[k];
-  JASSERT(v->len() == val_len);
-  *val = new char[v->len()];
-  memcpy(*val, v->data(), val_len);
+  JASSERT(len == val_len);
+  return val;
 }
 
+// The reply and the pairs go out with a single writev() of the arena.
 void
 LookupService::sendAllMappings(jalib::JSocket &remote,
                                const DmtcpMessage &msg)
 {
-  void *val = NULL;
-  size_t valLen = 0;
-  ostringstream o;
-
+  KeyValueDB *db = getDB(msg.nsid, false);
   DmtcpMessage reply(DMT_NAME_SERVICE_QUERY_ALL_RESPONSE);
 
-  map<KeyValue, KeyValue *>::iterator i;
-  KeyValueMap &kvmap = _maps[msg.nsid];
-
-  for (i = kvmap.begin(); i != kvmap.end(); i++) {
-    KeyValue *k = (KeyValue *)&(i->first);
-    KeyValue *v = i->second;
-    size_t len;
-
-    // insert the key length and key
-    len = k->len();
-    o.write((const char*)(&len), sizeof(len));
-    o.write((const char*)k->data(), len);
-    // insert the value length and value
-    len = v->len();
-    o.write((const char*)(&len), sizeof(len));
-    o.write((const char*)v->data(), len);
-  }
-
   reply.keyLen = 0;
-  valLen = o.tellp();
-  reply.valLen = valLen;
+  reply.valLen = db != NULL ? db->dataSize() : 0;
   reply.extraBytes = reply.valLen;
-  val = new char[reply.extraBytes];
-  memcpy(val, o.str().c_str(), reply.extraBytes);
 
-  remote << reply;
-  if (valLen > 0) {
-    remote.writeAll((char *)val, valLen);
+  vector<struct iovec> iov;
+  struct iovec header = { &reply, sizeof(reply) };
+  iov.push_back(header);
+  if (db != NULL) {
+    db->getIovecs(&iov);
   }
-  delete[] (char *)val;
+  JWARNING(writevAll(remote.sockfd(), iov)) (msg.nsid) (JASSERT_ERRNO)
+    .Text("Failed to send the name service database");
 }
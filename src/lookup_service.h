@@ -23,55 +23,71 @@
 #define LOOKUP_SERVICE_H
 
 #include <string.h>
+#include <sys/uio.h>
 #include <map>
 #include "../jalib/jsocket.h"
 #include "dmtcpmessagetypes.h"
 
 namespace dmtcp
 {
-class KeyValue
+/* The key-value pairs of one name service database.  The pairs are copied
+ * into an arena, back to back, in the format of the reply to
+ * DMT_NAME_SERVICE_QUERY_ALL:
+ *    <size_t key_length, key, size_t value_length, value>
+ * so that the whole database is sent without being copied again.  An
+ * open-addressed hash table indexes the pairs by key.
+ */
+class KeyValueDB
 {
   public:
-    KeyValue(const void *data, const size_t len)
-    {
-      _data = JALLOC_HELPER_MALLOC(len);
-      _len = len;
-      memcpy(_data, data, len);
-    }
-
-    ~KeyValue() {}
-
-    void destroy()
-    {
-      JASSERT(_data != NULL);
-      JALLOC_HELPER_FREE(_data);
-    }
-
-    void *data() { return _data; }
-
-    size_t len() { return _len; }
-
-    bool operator<(const KeyValue &that) const
-    {
-      if (_len == that._len) {
-        return memcmp(_data, that._data, _len) < 0;
-      }
-      return _len < that._len;
-    }
-
-    bool operator==(const KeyValue &that) const
-    {
-      return _len == that._len && memcmp(_data, that._data, _len) == 0;
-    }
-
-    bool operator!=(const KeyValue &that) const
-    {
-      return !operator==(that);
-    }
+# ifdef JALIB_ALLOCATOR
+    static void *operator new(size_t nbytes, void *p) { return p; }
+
+    static void *operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+
+    static void operator delete(void *p) { JALLOC_HELPER_DELETE(p); }
+# endif // ifdef JALIB_ALLOCATOR
+
+    KeyValueDB();
+    ~KeyValueDB();
+
+    // Returns the value of key, or NULL if there is none.
+    const void *find(const void *key, size_t keyLen, size_t *valLen) const;
+    void insert(const void *key,
+                size_t keyLen,
+                const void *val,
+                size_t valLen);
+
+    // The serialized size of the pairs, and the iovecs that describe them.
+    size_t dataSize() const { return _dataSize; }
+    void getIovecs(vector<struct iovec> *iov) const;
 
   private:
-    void *_data;
-    size_t _len;
+    struct Slot {
+      uint64_t hash;
+      char *pair;
+    };
+
+    struct Block {
+      char *data;
+      size_t used;
+      size_t size;
+    };
+
+    KeyValueDB(const KeyValueDB &);
+    KeyValueDB &operator=(const KeyValueDB &);
+
+    size_t findSlot(uint64_t hash, const void *key, size_t keyLen) const;
+    void resize(size_t numSlots);
+    char *allocPair(size_t len);
+    bool isLive(const char *pair) const;
+
+    Slot *_slots;
+    size_t _numSlots;
+    size_t _numPairs;
+    vector<Block> _blocks;
+    size_t _dataSize;    // of the live pairs
+    size_t _numStale;    // replaced pairs, still in the arena
 };
 
 class LookupService
@@ -83,35 +99,28 @@ class LookupService
 
     void reset();
     void registerData(const DmtcpMessage &msg, const void *data);
+    void registerBatch(const DmtcpMessage &msg, const void *data);
     void respondToQuery(jalib::JSocket &remote,
                         const DmtcpMessage &msg,
                         const void *data);
-    void getUniqueId(const char *id,    // DB name
-                     const void *key,   // Key: can be hostid, pid, etc.
-                     size_t key_len,  // Length of the key
-                     void **val,        // Result
-                     uint32_t offset,   // Difference in two unique ids
-                     size_t val_len); // Expected value length
+    void respondToBatchQuery(jalib::JSocket &remote,
+                             const DmtcpMessage &msg,
+                             const void *keys);
+    const void *getUniqueId(const char *id,    // DB name
+                            const void *key,   // Key: hostid, pid, etc.
+                            size_t key_len,    // Length of the key
+                            uint32_t offset,   // Difference in two unique ids
+                            size_t val_len);   // Expected value length
 
     void sendAllMappings(jalib::JSocket &remote,
                          const DmtcpMessage &msg);
 
   private:
-    typedef map<KeyValue, KeyValue *>KeyValueMap;
-    typedef map<string, KeyValueMap>::iterator MapIterator;
-    void addKeyValue(string id,
-                     const void *key,
-                     size_t keyLen,
-                     const void *val,
-                     size_t valLen);
-    void query(string id,
-               const void *key,
-               size_t keyLen,
-               void **val,
-               size_t *valLen);
+    typedef map<string, KeyValueDB *>::iterator DBIterator;
+    KeyValueDB *getDB(const string &id, bool create);
 
   private:
-    map<string, KeyValueMap>_maps;
+    map<string, KeyValueDB *>_dbs;
     map<string, uint64_t>_lastUniqueIds;
     map<string, uint64_t>_offsets;
 };
@@ -1,6 +1,7 @@
 #ifndef MTCP_HEADER_H
 #define MTCP_HEADER_H
 
+#include <stdint.h>
 #include "ldt.h"
 
 #ifdef __i386__
@@ -39,6 +40,39 @@ typedef struct _ThreadTLSInfo {
 
 #define MTCP_SIGNATURE     "MTCP_HEADER_v2.2\n"
 #define MTCP_SIGNATURE_LEN 32
+
+// Absolute path of the parent image of an incremental checkpoint.
+#define MTCP_PARENT_IMAGE_LEN 1024
+
+// Longest chain of incremental images that mtcp_restart will replay.
+#define MTCP_MAX_PARENT_IMAGES 64
+
+// Layout of the memory areas after the MTCP header.  Version 0 (DMTCP
+// 3.0.0) has no format_version or index_offset.  In version 1, every Area
+// header starts on a page boundary, and so does the data of every area that
+// is not compressed; the gap after compressed data is filled with zeros.
+// If index_offset is nonzero, an MtcpIndex follows the last area there.
+#define MTCP_FORMAT_VERSION 1
+
+#define MTCP_INDEX_SIGNATURE     "MTCP_INDEX_v1\n"
+#define MTCP_INDEX_SIGNATURE_LEN 16
+
+// One entry per Area header in the image, in image order.  The data of the
+// area, if any, follows the header at offset + sizeof(Area).
+typedef struct _MtcpIndexEntry {
+  uint64_t offset;
+  uint64_t addr;
+  uint64_t size;
+  uint64_t properties;
+} MtcpIndexEntry;
+
+typedef struct _MtcpIndex {
+  char signature[MTCP_INDEX_SIGNATURE_LEN];
+  uint64_t num_entries;
+  uint64_t _reserved;
+
+  // Followed by num_entries MtcpIndexEntry.
+} MtcpIndex;
 typedef union _MtcpHeader {
   struct {
     char signature[MTCP_SIGNATURE_LEN];
@@ -55,6 +89,12 @@ typedef union _MtcpHeader {
     int tls_pid_offset;
     int tls_tid_offset;
     MYINFO_GS_T myinfo_gs;
+
+    // Empty unless this is an incremental image; see writeckpt.cpp.
+    char parent_image[MTCP_PARENT_IMAGE_LEN];
+
+    uint32_t format_version;
+    uint64_t index_offset;
   };
 
   char _padding[4096];
@@ -49,8 +49,11 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <unistd.h>
+#include <linux/futex.h>
 
 #include "../membarrier.h"
 #include "config.h"
@@ -71,9 +74,7 @@
 #endif /* ifdef __clang__ */
 
 void mtcp_check_vdso(char **environ);
-#ifdef FAST_RST_VIA_MMAP
 static void mmapfile(int fd, void *buf, size_t size, int prot, int flags);
-#endif
 
 #define BINARY_NAME     "mtcp_restart"
 #define BINARY_NAME_M32 "mtcp_restart-32"
@@ -122,12 +123,50 @@ typedef struct RestoreInfo {
 #endif
   MYINFO_GS_T myinfo_gs;
   int mtcp_restart_pause;  // Used by env. var. DMTCP_RESTART_PAUSE0
+  int lazy_restore;        // Used by --lazy-restore; see can_map_from_image()
+
+  // Incremental images: fds of the parent images, newest first, and the
+  // offset of the first memory area in this image.
+  int num_parent_fds;
+  int parent_fds[MTCP_MAX_PARENT_IMAGES];
+  off_t areas_offset;
+
+  // Restore reader; see read_image_data().  The image whose data is being
+  // read ahead and how far, and an O_DIRECT fd for the image (--direct-io).
+  int readahead_fd;
+  off_t readahead_end;
+  int direct_fd;
+
+  // The reader process of this image, if any; see start_image_reader().
+  // reader_first is the oldest of its requests that is still in use.
+  struct ImageReader *reader;
+  pid_t reader_pid;
+  int reader_first;
 } RestoreInfo;
 static RestoreInfo rinfo;
 
 /* Internal routines */
-static void readmemoryareas(int fd);
-static int read_one_memory_area(int fd);
+static void readmemoryareas(int fd, RestoreInfo *rinfo_ptr, int replay);
+static int read_one_memory_area(int fd, RestoreInfo *rinfo_ptr, int replay);
+static void read_area_header(int fd, Area *area);
+static void skip_image_bytes(int fd, size_t size);
+static void read_sparse_pages(int fd, RestoreInfo *rinfo_ptr, Area *area,
+                              int skip);
+static void read_area_data(int fd, RestoreInfo *rinfo_ptr, Area *area,
+                           void *buf, size_t size);
+static void read_image_data(int fd, RestoreInfo *rinfo_ptr, void *buf,
+                            size_t size);
+static int open_image_direct(int fd);
+static int open_image_path(int fd, int flags);
+static void start_image_reader(RestoreInfo *rinfo_ptr);
+static void stop_image_reader(RestoreInfo *rinfo_ptr);
+static void read_from_image_reader(RestoreInfo *rinfo_ptr, void *buf,
+                                   size_t size, off_t offset);
+static void skip_area_data(int fd, Area *area, size_t size);
+static int can_map_from_image(int fd, Area *area);
+static int read_mtcp_header(int fd, MtcpHeader *mtcpHdr);
+static void open_parent_images(MtcpHeader *mtcpHdr);
+static void unmap_stale_memory_areas(RestoreInfo *rinfo);
 #if 0
 static void adjust_for_smaller_file_size(Area *area, int fd);
 #endif /* if 0 */
@@ -139,6 +178,8 @@ static int doAreasOverlap(VA addr1, size_t size1, VA addr2, size_t size2);
 static int hasOverlappingMapping(VA addr, size_t size);
 static void getTextAddr(VA *textAddr, size_t *size);
 static void mtcp_simulateread(int fd, MtcpHeader *mtcpHdr);
+static void print_area(Area *area);
+static void list_areas_from_index(int fd, off_t index_offset);
 void restore_libc(ThreadTLSInfo *tlsInfo,
                   int tls_pid_offset,
                   int tls_tid_offset,
@@ -146,10 +187,44 @@ void restore_libc(ThreadTLSInfo *tlsInfo,
 static void unmap_memory_areas_and_restore_vdso(RestoreInfo *rinfo);
 
 
+/* Flags for readmemoryareas() when replaying incremental images. */
+#define REPLAY_PARENT_IMAGE 0x1  /* A parent of the image being restored. */
+#define REPLAY_OVER_PARENT  0x2  /* An older image has already been read. */
+
 #define MB                 1024 * 1024
 #define RESTORE_STACK_SIZE 5 * MB
 #define RESTORE_MEM_SIZE   5 * MB
-#define RESTORE_TOTAL_SIZE (RESTORE_STACK_SIZE + RESTORE_MEM_SIZE)
+
+/* The image data is read in chunks of RESTORE_READ_CHUNK.  The reader
+ * process has RESTORE_READ_SLOTS of them, after a header of one MB, in the
+ * restore area between the copy of this program and its stack.  Without it,
+ * the next RESTORE_READAHEAD bytes of the image are read in the background
+ * by the kernel.  Keep RESTORE_*_SIZE in sync with processinfo.h.
+ */
+#define RESTORE_READ_CHUNK  (16 * MB)
+#define RESTORE_READ_SLOTS  3
+#define RESTORE_READER_SIZE (MB + RESTORE_READ_SLOTS * RESTORE_READ_CHUNK)
+#define RESTORE_READAHEAD   (64 * MB)
+#define RESTORE_TOTAL_SIZE \
+  (RESTORE_STACK_SIZE + RESTORE_MEM_SIZE + RESTORE_READER_SIZE)
+
+/* Shared by mtcp_restart and the reader process; see start_image_reader().
+ * Request i reads the chunk at offset[i % RESTORE_READ_SLOTS] of the image
+ * into slot i % RESTORE_READ_SLOTS.  Each counter has one writer: queued,
+ * wanted and stop are written by mtcp_restart, and done by the reader.
+ */
+typedef struct ImageReader {
+  volatile int queued;    // Requests queued so far.
+  volatile int done;      // Requests read, or skipped, so far.
+  volatile int wanted;    // The requests before this one may be skipped.
+  volatile int stop;
+  int fd;                 // The image, opened once more for the reader.
+  off_t offset[RESTORE_READ_SLOTS];
+  ssize_t len[RESTORE_READ_SLOTS];  // Bytes read (short at the end), or -errno
+} ImageReader;
+
+#define IMAGE_READER_SLOT(reader, slot) \
+  ((char *)(reader) + MB + (size_t)(slot) * RESTORE_READ_CHUNK)
 
 // const char service_interp[] __attribute__((section(".interp"))) =
 // "/lib64/ld-linux-x86-64.so.2";
@@ -206,6 +281,7 @@ main(int argc, char *argv[], char **environ)
   MtcpHeader mtcpHdr;
   int mtcp_sys_errno;
   int simulate = 0;
+  int direct_io = 0;
 
   if (argc == 1) {
     MTCP_PRINTF("***ERROR: This program should not be used directly.\n");
@@ -238,9 +314,19 @@ main(int argc, char *argv[], char **environ)
 #endif /* ifdef ENABLE_VDSO_CHECK */
 
   rinfo.fd = -1;
+  rinfo.num_parent_fds = 0;
   rinfo.mtcp_restart_pause = 0; /* false */
+#ifdef FAST_RST_VIA_MMAP
+  rinfo.lazy_restore = 1; /* true */
+#else
+  rinfo.lazy_restore = 0; /* false */
+#endif
   rinfo.use_gdb = 0;
   rinfo.text_offset = -1;
+  rinfo.readahead_fd = -1;
+  rinfo.readahead_end = 0;
+  rinfo.direct_fd = -1;
+  rinfo.reader = NULL;
   shift;
   while (argc > 0) {
     if (mtcp_strcmp(argv[0], "--use-gdb") == 0) {
@@ -260,6 +346,12 @@ main(int argc, char *argv[], char **environ)
     } else if (mtcp_strcmp(argv[0], "--mtcp-restart-pause") == 0) {
       rinfo.mtcp_restart_pause = 1; /* true */
       shift;
+    } else if (mtcp_strcmp(argv[0], "--lazy-restore") == 0) {
+      rinfo.lazy_restore = 1; /* true */
+      shift;
+    } else if (mtcp_strcmp(argv[0], "--direct-io") == 0) {
+      direct_io = 1;
+      shift;
     } else if (mtcp_strcmp(argv[0], "--simulate") == 0) {
       simulate = 1;
       shift;
@@ -293,14 +385,7 @@ main(int argc, char *argv[], char **environ)
       mtcp_abort();
     }
 
-    // This assumes that the MTCP header signature is unique.
-    // We repeatedly look for mtcpHdr because the first header will be
-    // for DMTCP.  So, we look deeper for the MTCP header.  The MTCP
-    // header is guaranteed to start on an offset that's an integer
-    // multiple of sizeof(mtcpHdr), which is currently 4096 bytes.
-    do {
-      rc = mtcp_readfile(rinfo.fd, &mtcpHdr, sizeof mtcpHdr);
-    } while (rc > 0 && mtcp_strcmp(mtcpHdr.signature, MTCP_SIGNATURE) != 0);
+    rc = read_mtcp_header(rinfo.fd, &mtcpHdr);
     if (rc == 0) { /* if end of file */
       MTCP_PRINTF("***ERROR: ckpt image doesn't match MTCP_SIGNATURE\n");
       return 1;  /* exit with error code 1 */
@@ -320,6 +405,14 @@ main(int argc, char *argv[], char **environ)
     return 0;
   }
 
+  if (direct_io) {
+    rinfo.direct_fd = open_image_direct(rinfo.fd);
+  }
+
+  if (mtcpHdr.parent_image[0] != '\0') {
+    open_parent_images(&mtcpHdr);
+  }
+
   rinfo.saved_brk = mtcpHdr.saved_brk;
   rinfo.restore_addr = mtcpHdr.restore_addr;
   rinfo.restore_end = mtcpHdr.restore_addr + mtcpHdr.restore_size;
@@ -348,6 +441,65 @@ main(int argc, char *argv[], char **environ)
   return 0;  /* Will not reach here, but need to satisfy the compiler */
 }
 
+/* Read the MTCP header of a checkpoint image; returns 0 at end of file. */
+static int
+read_mtcp_header(int fd, MtcpHeader *mtcpHdr)
+{
+  int rc;
+
+  // This assumes that the MTCP header signature is unique.
+  // We repeatedly look for mtcpHdr because the first header will be
+  // for DMTCP.  So, we look deeper for the MTCP header.  The MTCP
+  // header is guaranteed to start on an offset that's an integer
+  // multiple of sizeof(mtcpHdr), which is currently 4096 bytes.
+  do {
+    rc = mtcp_readfile(fd, mtcpHdr, sizeof *mtcpHdr);
+  } while (rc > 0 && mtcp_strcmp(mtcpHdr->signature, MTCP_SIGNATURE) != 0);
+  return rc;
+}
+
+/* An incremental image holds only the pages that changed since its parent
+ * image.  Open the chain of parent images, up to the last full one, and
+ * leave each fd at its first memory area.  restorememoryareas() replays
+ * them oldest first.
+ */
+static void
+open_parent_images(MtcpHeader *mtcpHdr)
+{
+  int mtcp_sys_errno;
+  MtcpHeader parentHdr;
+  char *parent = mtcpHdr->parent_image;
+
+  rinfo.areas_offset = mtcp_sys_lseek(rinfo.fd, 0, SEEK_CUR);
+  if (rinfo.areas_offset == -1) {
+    MTCP_PRINTF("***ERROR: incremental ckpt image must be uncompressed;"
+                " errno: %d\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+
+  while (parent[0] != '\0') {
+    if (rinfo.num_parent_fds == MTCP_MAX_PARENT_IMAGES) {
+      MTCP_PRINTF("***ERROR: more than %d parent ckpt images\n",
+                  MTCP_MAX_PARENT_IMAGES);
+      mtcp_abort();
+    }
+    int fd = mtcp_sys_open2(parent, O_RDONLY);
+    if (fd == -1) {
+      MTCP_PRINTF("***ERROR opening parent ckpt image (%s); errno: %d\n",
+                  parent, mtcp_sys_errno);
+      mtcp_abort();
+    }
+    if (read_mtcp_header(fd, &parentHdr) == 0) {
+      MTCP_PRINTF("***ERROR: parent ckpt image (%s) doesn't match"
+                  " MTCP_SIGNATURE\n", parent);
+      mtcp_abort();
+    }
+    DPRINTF("parent ckpt image: %s\n", parent);
+    rinfo.parent_fds[rinfo.num_parent_fds++] = fd;
+    parent = parentHdr.parent_image;
+  }
+}
+
 NO_OPTIMIZE
 static void
 restore_brk(VA saved_brk, VA restore_begin, VA restore_end)
@@ -569,42 +721,98 @@ mtcp_simulateread(int fd, MtcpHeader *mtcpHdr)
   mtcp_printf("**** brk (sbrk(0)): %p\n", mtcpHdr->saved_brk);
   mtcp_printf("**** vdso: %p..%p\n", mtcpHdr->vdsoStart, mtcpHdr->vdsoEnd);
   mtcp_printf("**** vvar: %p..%p\n", mtcpHdr->vvarStart, mtcpHdr->vvarEnd);
+  if (mtcpHdr->parent_image[0] != '\0') {
+    mtcp_printf("**** parent ckpt image: %s\n", mtcpHdr->parent_image);
+  }
+  mtcp_printf("**** image format version: %d\n", mtcpHdr->format_version);
+
+  if (mtcpHdr->index_offset != 0) {
+    list_areas_from_index(fd, mtcpHdr->index_offset);
+    return;
+  }
 
   Area area;
   mtcp_printf("\n**** Listing ckpt image area:\n");
   while (1) {
-    mtcp_readfile(fd, &area, sizeof area);
+    read_area_header(fd, &area);
     if (area.size == -1) {
       break;
     }
-    if ((area.properties & DMTCP_ZERO_PAGE) == 0 &&
-        (area.properties & DMTCP_SKIP_WRITING_TEXT_SEGMENTS) == 0) {
+    if ((area.properties & DMTCP_SPARSE_PAGES) != 0) {
+      read_sparse_pages(fd, &rinfo, &area, 1);
+    } else if ((area.properties & DMTCP_ZERO_PAGE) == 0 &&
+        (area.properties & DMTCP_SKIP_WRITING_TEXT_SEGMENTS) == 0 &&
+        (area.properties & DMTCP_INCREMENTAL_AREA) == 0) {
       void *addr = mtcp_sys_mmap(0, area.size, PROT_WRITE | PROT_READ,
                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
       if (addr == MAP_FAILED) {
         MTCP_PRINTF("***Error: mmap failed; errno: %d\n", mtcp_sys_errno);
         mtcp_abort();
       }
-      mtcp_readfile(fd, addr, area.size);
+      read_area_data(fd, &rinfo, &area, addr, area.size);
       if (mtcp_sys_munmap(addr, area.size) == -1) {
         MTCP_PRINTF("***Error: munmap failed; errno: %d\n", mtcp_sys_errno);
         mtcp_abort();
       }
     }
+    print_area(&area);
+  }
+}
+
+static void
+print_area(Area *area)
+{
+  mtcp_printf("%p-%p %c%c%c%c "
+
+              // "%x %u:%u %u"
+              "          %s\n",
+              area->addr, area->addr + area->size,
+              (area->prot & PROT_READ  ? 'r' : '-'),
+              (area->prot & PROT_WRITE ? 'w' : '-'),
+              (area->prot & PROT_EXEC  ? 'x' : '-'),
+              (area->flags & MAP_SHARED ? 's'
+               : (area->flags & MAP_ANONYMOUS ? 'p' : '-')),
+
+              // area->offset, area->devmajor, area->devminor, area->inodenum,
+              area->name);
+}
 
-    mtcp_printf("%p-%p %c%c%c%c "
+/* Used by mtcp_simulateread(): list the areas by seeking to each one through
+ * the index at the end of the image (see MtcpIndex in mtcp_header.h).
+ */
+static void
+list_areas_from_index(int fd, off_t index_offset)
+{
+  int mtcp_sys_errno;
+  MtcpIndex index;
+  MtcpIndexEntry entry;
+  Area area;
+  uint64_t i;
 
-                // "%x %u:%u %u"
-                "          %s\n",
-                area.addr, area.addr + area.size,
-                (area.prot & PROT_READ  ? 'r' : '-'),
-                (area.prot & PROT_WRITE ? 'w' : '-'),
-                (area.prot & PROT_EXEC  ? 'x' : '-'),
-                (area.flags & MAP_SHARED ? 's'
-                 : (area.flags & MAP_ANONYMOUS ? 'p' : '-')),
+  if (mtcp_sys_lseek(fd, index_offset, SEEK_SET) != index_offset) {
+    MTCP_PRINTF("***Error: cannot seek to index; errno: %d\n",
+                mtcp_sys_errno);
+    mtcp_abort();
+  }
+  mtcp_readfile(fd, &index, sizeof index);
+  if (mtcp_strcmp(index.signature, MTCP_INDEX_SIGNATURE) != 0) {
+    MTCP_PRINTF("***Error: no index at offset %p\n", (void *)index_offset);
+    mtcp_abort();
+  }
 
-                // area.offset, area.devmajor, area.devminor, area.inodenum,
-                area.name);
+  mtcp_printf("\n**** Listing ckpt image area (from index, %d entries):\n",
+              (int)index.num_entries);
+  for (i = 0; i < index.num_entries; i++) {
+    mtcp_sys_lseek(fd, index_offset + sizeof index + i * sizeof entry,
+                   SEEK_SET);
+    mtcp_readfile(fd, &entry, sizeof entry);
+    if (mtcp_sys_lseek(fd, entry.offset, SEEK_SET) != (off_t)entry.offset) {
+      MTCP_PRINTF("***Error: cannot seek to area; errno: %d\n",
+                  mtcp_sys_errno);
+      mtcp_abort();
+    }
+    mtcp_readfile(fd, &area, sizeof area);
+    print_area(&area);
   }
 }
 
@@ -670,14 +878,34 @@ restorememoryareas(RestoreInfo *rinfo_ptr)
    */
   unmap_memory_areas_and_restore_vdso(&restore_info);
 
-  /* Restore memory areas */
+  /* Read this image ahead from now on, also while its parents are replayed.
+   * Nothing has been mapped yet, so there is little for the fork to copy.
+   */
+  start_image_reader(&restore_info);
+
+  /* Restore memory areas, replaying the parent images first (if any) */
   DPRINTF("restoring memory areas\n");
-  readmemoryareas(restore_info.fd);
+  int is_incremental = restore_info.num_parent_fds > 0;
+  int replay = 0;
+  while (restore_info.num_parent_fds > 0) {
+    int fd = restore_info.parent_fds[--restore_info.num_parent_fds];
+    readmemoryareas(fd, &restore_info, replay | REPLAY_PARENT_IMAGE);
+    mtcp_sys_close(fd);
+    replay = REPLAY_OVER_PARENT;
+  }
+  readmemoryareas(restore_info.fd, &restore_info, replay);
+  stop_image_reader(&restore_info);
+  if (is_incremental) {
+    unmap_stale_memory_areas(&restore_info);
+  }
 
   /* Everything restored, close file and finish up */
 
   DPRINTF("close cpfd %d\n", restore_info.fd);
   mtcp_sys_close(restore_info.fd);
+  if (restore_info.direct_fd != -1) {
+    mtcp_sys_close(restore_info.direct_fd);
+  }
   double readTime = 0.0;
 #ifdef TIMING
   struct timeval endValue;
@@ -909,6 +1137,101 @@ unmap_memory_areas_and_restore_vdso(RestoreInfo *rinfo)
   }
 }
 
+/* Read the next Area header of an (uncompressed) image, skipping its data.
+ * Returns 0 at the end of the memory areas.
+ */
+static int
+next_image_area(int fd, RestoreInfo *rinfo, Area *area)
+{
+  int mtcp_sys_errno;
+
+  read_area_header(fd, area);
+  if (area->size == -1) {
+    return 0;
+  }
+  if ((area->properties & DMTCP_SPARSE_PAGES) != 0) {
+    read_sparse_pages(fd, rinfo, area, 1);
+  } else if ((area->properties & (DMTCP_ZERO_PAGE |
+                                  DMTCP_SKIP_WRITING_TEXT_SEGMENTS |
+                                  DMTCP_INCREMENTAL_AREA)) == 0) {
+    skip_area_data(fd, area, area->size);
+  }
+  return 1;
+}
+
+/* After replaying the parent images, unmap whatever they restored that is
+ * not part of the newest image.  Both /proc/self/maps and the areas of the
+ * image are sorted by address, so one pass over each suffices; after each
+ * munmap, maps is reread from the first address not yet checked.
+ */
+NO_OPTIMIZE
+static void
+unmap_stale_memory_areas(RestoreInfo *rinfo)
+{
+  int mtcp_sys_errno;
+  Area area;
+  Area imageArea;
+  VA checked = NULL;
+  int haveImageArea;
+
+  if (mtcp_sys_lseek(rinfo->fd, rinfo->areas_offset, SEEK_SET) == -1) {
+    MTCP_PRINTF("mtcp_sys_lseek failed with errno %d\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  haveImageArea = next_image_area(rinfo->fd, rinfo, &imageArea);
+
+  int mapsfd = mtcp_sys_open2("/proc/self/maps", O_RDONLY);
+  if (mapsfd < 0) {
+    MTCP_PRINTF("error opening /proc/self/maps; errno: %d\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+
+  while (mtcp_readmapsline(mapsfd, &area)) {
+    VA addr = area.addr > checked ? area.addr : checked;
+    VA staleEnd = NULL;
+
+    if (area.endAddr <= checked ||
+        (area.addr >= rinfo->restore_addr && area.addr < rinfo->restore_end) ||
+        mtcp_strcmp(area.name, "[vdso]") == 0 ||
+        mtcp_strcmp(area.name, "[vvar]") == 0 ||
+        mtcp_strcmp(area.name, "[vsyscall]") == 0 ||
+        mtcp_strcmp(area.name, "[vectors]") == 0) {
+      continue;
+    }
+
+    while (addr < area.endAddr) {
+      while (haveImageArea && imageArea.addr + imageArea.size <= addr) {
+        haveImageArea = next_image_area(rinfo->fd, rinfo, &imageArea);
+      }
+      if (!haveImageArea || imageArea.addr >= area.endAddr) {
+        staleEnd = area.endAddr;
+        break;
+      }
+      if (imageArea.addr > addr) {
+        staleEnd = imageArea.addr;
+        break;
+      }
+      addr = imageArea.addr + imageArea.size;
+    }
+
+    if (staleEnd != NULL) {
+      DPRINTF("***INFO: munmapping stale area (%p..%p)\n", addr, staleEnd);
+      if (mtcp_sys_munmap(addr, staleEnd - addr) == -1) {
+        MTCP_PRINTF("***WARNING: munmap(%p, %d) failed; errno: %d\n",
+                    addr, staleEnd - addr, mtcp_sys_errno);
+        mtcp_abort();
+      }
+      checked = staleEnd;
+
+      // Rewind and reread maps.
+      mtcp_sys_lseek(mapsfd, 0, SEEK_SET);
+    } else {
+      checked = area.endAddr;
+    }
+  }
+  mtcp_sys_close(mapsfd);
+}
+
 /**************************************************************************
  *
  *  Read memory area descriptors from checkpoint file
@@ -936,10 +1259,10 @@ unmap_memory_areas_and_restore_vdso(RestoreInfo *rinfo)
  *
  **************************************************************************/
 static void
-readmemoryareas(int fd)
+readmemoryareas(int fd, RestoreInfo *rinfo_ptr, int replay)
 {
   while (1) {
-    if (read_one_memory_area(fd) == -1) {
+    if (read_one_memory_area(fd, rinfo_ptr, replay) == -1) {
       break; /* error */
     }
   }
@@ -953,9 +1276,23 @@ readmemoryareas(int fd)
 #endif /* if defined(__arm__) || defined(__aarch64__) */
 }
 
+/* Areas in a parent image that overlap mtcp_restart or the vdso/vvar (at
+ * their addresses in the newest image) are gone by the newest image.
+ */
+static int
+is_stale_parent_area(Area *area, RestoreInfo *rinfo_ptr)
+{
+  return doAreasOverlap(area->addr, area->size, rinfo_ptr->restore_addr,
+                        rinfo_ptr->restore_size) ||
+         doAreasOverlap(area->addr, area->size, rinfo_ptr->vdsoStart,
+                        rinfo_ptr->vdsoEnd - rinfo_ptr->vdsoStart) ||
+         doAreasOverlap(area->addr, area->size, rinfo_ptr->vvarStart,
+                        rinfo_ptr->vvarEnd - rinfo_ptr->vvarStart);
+}
+
 NO_OPTIMIZE
 static int
-read_one_memory_area(int fd)
+read_one_memory_area(int fd, RestoreInfo *rinfo_ptr, int replay)
 {
   int mtcp_sys_errno;
   int imagefd;
@@ -965,11 +1302,51 @@ read_one_memory_area(int fd)
   /* Read header of memory area into area; mtcp_readfile() will read header */
   Area area;
 
-  mtcp_readfile(fd, &area, sizeof area);
+  read_area_header(fd, &area);
   if (area.size == -1) {
     return -1;
   }
 
+  /* CASE INCREMENTAL: the area was restored from the parent image(s). */
+  if ((area.properties & DMTCP_INCREMENTAL_AREA) != 0) {
+    return 0;
+  }
+
+  if ((replay & REPLAY_PARENT_IMAGE) != 0 &&
+      is_stale_parent_area(&area, rinfo_ptr)) {
+    DPRINTF("skipping stale area of parent image, %p bytes at %p\n",
+            area.size, area.addr);
+    if ((area.properties & DMTCP_SPARSE_PAGES) != 0) {
+      read_sparse_pages(fd, rinfo_ptr, &area, 1);
+    } else if ((area.properties & (DMTCP_ZERO_PAGE |
+                                   DMTCP_SKIP_WRITING_TEXT_SEGMENTS)) == 0) {
+      skip_area_data(fd, &area, area.size);
+    }
+    return 0;
+  }
+
+  /* CASE INCREMENTAL PAGES: changed pages inside an area that is already
+   * mapped; write them in place.
+   */
+  if ((area.properties & DMTCP_INCREMENTAL_PAGES) != 0) {
+    DPRINTF("restoring incremental pages, %p bytes at %p\n",
+            area.size, area.addr);
+    if (mtcp_sys_mprotect(area.addr, area.size, area.prot | PROT_WRITE) < 0) {
+      MTCP_PRINTF("error %d write-enabling %p bytes at %p\n",
+                  mtcp_sys_errno, area.size, area.addr);
+      mtcp_abort();
+    }
+    read_area_data(fd, rinfo_ptr, &area, area.addr, area.size);
+    if (!(area.prot & PROT_WRITE)) {
+      if (mtcp_sys_mprotect(area.addr, area.size, area.prot) < 0) {
+        MTCP_PRINTF("error %d write-protecting %p bytes at %p\n",
+                    mtcp_sys_errno, area.size, area.addr);
+        mtcp_abort();
+      }
+    }
+    return 0;
+  }
+
   if (area.name[0] && mtcp_strstr(area.name, "[heap]")
       && mtcp_sys_brk(NULL) != area.addr + area.size) {
     DPRINTF("WARNING: break (%p) not equal to end of heap (%p)\n",
@@ -984,6 +1361,11 @@ read_one_memory_area(int fd)
     area.flags = area.flags | MAP_PRIVATE | MAP_ANONYMOUS;
   }
 
+  // An older image of an incremental chain may have mapped this range.
+  if ((replay & REPLAY_OVER_PARENT) != 0) {
+    area.flags |= MAP_FIXED;
+  }
+
   /* Now mmap the data of the area into memory. */
 
   /* CASE MAPPED AS ZERO PAGE: */
@@ -1001,19 +1383,23 @@ read_one_memory_area(int fd)
     }
   }
 
-#ifdef FAST_RST_VIA_MMAP
-    /* CASE MAP_ANONYMOUS with FAST_RST enabled
-     * We only want to do this in the MAP_ANONYMOUS case, since we don't want
-     *   any writes to RAM to be reflected back into the underlying file.
-     * Note that in order to map from a file (ckpt image), we must turn off
-     *   anonymous (~MAP_ANONYMOUS).  It's okay, since the fd
-     *   should have been opened with read permission, only.
-     */
-    else if (area.flags & MAP_ANONYMOUS) {
-      mmapfile (fd, area.addr, area.size, area.prot,
-                area.flags & ~MAP_ANONYMOUS);
-    }
-#endif
+  /* CASE MAP_ANONYMOUS with lazy restore (--lazy-restore, or FAST_RST)
+   * We only want to do this in the MAP_ANONYMOUS case, since we don't want
+   *   any writes to RAM to be reflected back into the underlying file.
+   * Note that in order to map from a file (ckpt image), we must turn off
+   *   anonymous (~MAP_ANONYMOUS).  It's okay, since the fd
+   *   should have been opened with read permission, only.
+   * The pages are read in when first touched.  MADV_WILLNEED starts
+   *   reading them in the background meanwhile.
+   */
+  else if (rinfo_ptr->lazy_restore && (area.flags & MAP_ANONYMOUS) &&
+           can_map_from_image(fd, &area)) {
+    DPRINTF("mapping anonymous area from ckpt image, %p bytes at %p\n",
+            area.size, area.addr);
+    mmapfile(fd, area.addr, area.size, area.prot,
+             (area.flags & ~MAP_ANONYMOUS) | MAP_FIXED);
+    mtcp_sys_madvise(area.addr, area.size, MADV_WILLNEED);
+  }
 
   /* CASE MAP_ANONYMOUS (usually implies MAP_PRIVATE):
    * For anonymous areas, the checkpoint file contains the memory contents
@@ -1102,14 +1488,22 @@ read_one_memory_area(int fd)
 
     if (try_skipping_existing_segment) {
       // This fails on teracluster.  Presumably extra symbols cause overflow.
-      mtcp_skipfile(fd, area.size);
+      if ((area.properties & DMTCP_SPARSE_PAGES) != 0) {
+        read_sparse_pages(fd, rinfo_ptr, &area, 1);
+      } else {
+        skip_area_data(fd, &area, area.size);
+      }
     } else if ((area.properties & DMTCP_SKIP_WRITING_TEXT_SEGMENTS) == 0) {
       /* This mmapfile after prev. mmap is okay; use same args again.
        *  Posix says prev. map will be munmapped.
        */
 
       /* ANALYZE THE CONDITION FOR DOING mmapfile MORE CAREFULLY. */
-      mtcp_readfile(fd, area.addr, area.size);
+      if ((area.properties & DMTCP_SPARSE_PAGES) != 0) {
+        read_sparse_pages(fd, rinfo_ptr, &area, 0);
+      } else {
+        read_area_data(fd, rinfo_ptr, &area, area.addr, area.size);
+      }
       if (!(area.prot & PROT_WRITE)) {
         if (mtcp_sys_mprotect(area.addr, area.size, area.prot) < 0) {
           MTCP_PRINTF("error %d write-protecting %p bytes at %p\n",
@@ -1129,6 +1523,594 @@ read_one_memory_area(int fd)
   return 0;
 }
 
+/* Read the next Area header.  Area headers start on a page boundary
+ * (MTCP_FORMAT_VERSION 1); only compressed data leaves a gap before the next
+ * one.  Compressed images are never read through a pipe, and older images
+ * have no gaps, so the offset is aligned only if the image is seekable.
+ */
+static void
+read_area_header(int fd, Area *area)
+{
+  int mtcp_sys_errno;
+  off_t offset = mtcp_sys_lseek(fd, 0, SEEK_CUR);
+
+  if (offset != -1 && offset % MTCP_PAGE_SIZE != 0) {
+    skip_image_bytes(fd, MTCP_PAGE_SIZE - offset % MTCP_PAGE_SIZE);
+  }
+  mtcp_readfile(fd, area, sizeof *area);
+}
+
+/* Can the data of area be mapped from the ckpt image, rather than read?
+ * Only if it is stored as is (not sparse or compressed), at a page-aligned
+ * offset of a regular file.  An area with the name of a file is read in as
+ * before, to keep that name in /proc/self/maps.  Unreadable areas are read
+ * in, too, since the checkpoint writer scans them for zero pages and would
+ * madvise(MADV_DONTNEED) them, which brings back the image contents.
+ */
+static int
+can_map_from_image(int fd, Area *area)
+{
+  int mtcp_sys_errno;
+  off_t offset;
+
+  if ((area->properties & (DMTCP_SPARSE_PAGES | DMTCP_COMPRESSED_DATA |
+                           DMTCP_SKIP_WRITING_TEXT_SEGMENTS)) != 0 ||
+      area->name[0] == '/' || (area->prot & PROT_READ) == 0) {
+    return 0;
+  }
+  offset = mtcp_sys_lseek(fd, 0, SEEK_CUR);
+  return offset != -1 && offset % MTCP_PAGE_SIZE == 0;
+}
+
+/* Read the data of a DMTCP_SPARSE_PAGES area (see procmapsarea.h) into the
+ * area, which must be mapped with write access and zero-filled.  If skip is
+ * set, the data is skipped instead.
+ */
+NO_OPTIMIZE
+static void
+read_sparse_pages(int fd, RestoreInfo *rinfo_ptr, Area *area, int skip)
+{
+  int mtcp_sys_errno;
+  unsigned char bitmap[DMTCP_SPARSE_BITMAP_SIZE];
+  size_t numPages = area->size / MTCP_PAGE_SIZE;
+  size_t chunk;
+
+  for (chunk = 0; chunk < numPages; chunk += DMTCP_SPARSE_CHUNK_PAGES) {
+    size_t n = numPages - chunk;
+    size_t i = 0;
+
+    if (n > DMTCP_SPARSE_CHUNK_PAGES) {
+      n = DMTCP_SPARSE_CHUNK_PAGES;
+    }
+    read_area_data(fd, rinfo_ptr, area, bitmap, sizeof bitmap);
+    while (i < n) {
+      size_t first;
+
+      if ((bitmap[i / 8] & (1 << (i % 8))) == 0) {
+        i++;
+        continue;
+      }
+      first = i;
+      while (i < n && (bitmap[i / 8] & (1 << (i % 8))) != 0) {
+        i++;
+      }
+
+      VA addr = area->addr + (chunk + first) * MTCP_PAGE_SIZE;
+      size_t size = (i - first) * MTCP_PAGE_SIZE;
+      if (!skip) {
+        read_area_data(fd, rinfo_ptr, area, addr, size);
+      } else {
+        skip_area_data(fd, area, size);
+      }
+    }
+  }
+}
+
+/* Skip size bytes of the image.  The image may be a pipe (gzip). */
+static void
+skip_image_bytes(int fd, size_t size)
+{
+  int mtcp_sys_errno;
+
+  if (mtcp_sys_lseek(fd, size, SEEK_CUR) == -1) {
+    if (mtcp_sys_errno != ESPIPE) {
+      MTCP_PRINTF("mtcp_sys_lseek failed with errno %d\n", mtcp_sys_errno);
+      mtcp_abort();
+    }
+    mtcp_skipfile(fd, size);
+  }
+}
+
+/* Read the next size bytes of the data of an area into buf.  Each such read
+ * of a DMTCP_COMPRESSED_DATA area starts with a new block; see
+ * procmapsarea.h.  The blocks are decompressed directly into buf.
+ */
+NO_OPTIMIZE
+static void
+read_area_data(int fd, RestoreInfo *rinfo_ptr, Area *area, void *buf,
+               size_t size)
+{
+  int mtcp_sys_errno;
+  char block[DMTCP_COMPRESS_BLOCK_SIZE];
+  CompressedBlockHeader hdr;
+  size_t done = 0;
+
+  if ((area->properties & DMTCP_COMPRESSED_DATA) == 0) {
+    read_image_data(fd, rinfo_ptr, buf, size);
+    return;
+  }
+
+  while (done < size) {
+    mtcp_readfile(fd, &hdr, sizeof hdr);
+    if (hdr.rawSize == 0 || hdr.rawSize > size - done ||
+        hdr.compSize > hdr.rawSize) {
+      MTCP_PRINTF("***ERROR: corrupt compressed block at %p"
+                  " (raw size: %u, compressed size: %u)\n",
+                  (char *)buf + done, hdr.rawSize, hdr.compSize);
+      mtcp_abort();
+    }
+    if (hdr.compSize == hdr.rawSize) {
+      read_image_data(fd, rinfo_ptr, (char *)buf + done, hdr.rawSize);
+    } else {
+      read_image_data(fd, rinfo_ptr, block, hdr.compSize);
+      if (mtcp_lz_decompress(block, hdr.compSize, (char *)buf + done,
+                             hdr.rawSize) != hdr.rawSize) {
+        MTCP_PRINTF("***ERROR: failed to decompress block at %p\n",
+                    (char *)buf + done);
+        mtcp_abort();
+      }
+    }
+    done += hdr.rawSize;
+  }
+}
+
+/* Read the next size bytes of the image into buf.  The image being restored
+ * is normally read ahead by the reader process (see start_image_reader()),
+ * and the data is copied from its chunks.  Otherwise (parent images, and
+ * images from before the reader) it is read in chunks of RESTORE_READ_CHUNK:
+ * before each chunk, the kernel is asked to read the image up to
+ * RESTORE_READAHEAD bytes past the chunk in the background
+ * (POSIX_FADV_WILLNEED).  With --direct-io, the page-aligned data of the
+ * image is then read with O_DIRECT instead, bypassing the page cache.  An
+ * image that is read through a pipe (gzip) is read as is.
+ */
+NO_OPTIMIZE
+static void
+read_image_data(int fd, RestoreInfo *rinfo_ptr, void *buf, size_t size)
+{
+  int mtcp_sys_errno;
+  off_t offset = mtcp_sys_lseek(fd, 0, SEEK_CUR);
+  int readfd = fd;
+  size_t done = 0;
+
+  if (offset == -1) {
+    mtcp_readfile(fd, buf, size);
+    return;
+  }
+
+  if (fd == rinfo_ptr->fd && rinfo_ptr->reader != NULL) {
+    read_from_image_reader(rinfo_ptr, buf, size, offset);
+    if (mtcp_sys_lseek(fd, offset + size, SEEK_SET) == -1) {
+      MTCP_PRINTF("mtcp_sys_lseek failed with errno %d\n", mtcp_sys_errno);
+      mtcp_abort();
+    }
+    return;
+  }
+
+  if (fd == rinfo_ptr->fd && rinfo_ptr->direct_fd != -1 &&
+      offset % MTCP_PAGE_SIZE == 0 && size % MTCP_PAGE_SIZE == 0 &&
+      (unsigned long)buf % MTCP_PAGE_SIZE == 0) {
+    readfd = rinfo_ptr->direct_fd;
+    if (mtcp_sys_lseek(readfd, offset, SEEK_SET) == -1) {
+      MTCP_PRINTF("mtcp_sys_lseek failed with errno %d\n", mtcp_sys_errno);
+      mtcp_abort();
+    }
+  } else if (fd != rinfo_ptr->readahead_fd) {
+    rinfo_ptr->readahead_fd = fd;
+    rinfo_ptr->readahead_end = offset;
+  }
+
+  while (done < size) {
+    size_t chunk = size - done;
+    off_t pos = offset + done;
+
+    if (chunk > RESTORE_READ_CHUNK) {
+      chunk = RESTORE_READ_CHUNK;
+    }
+
+    /* Extend the readahead once less than half of it is left, so that each
+     * hint covers at least RESTORE_READAHEAD / 2 bytes.
+     */
+    if (readfd == fd &&
+        rinfo_ptr->readahead_end < pos + chunk + RESTORE_READAHEAD / 2) {
+      off_t start = rinfo_ptr->readahead_end > pos ?
+                    rinfo_ptr->readahead_end : pos;
+      off_t end = pos + chunk + RESTORE_READAHEAD;
+
+      mtcp_sys_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+      rinfo_ptr->readahead_end = end;
+    }
+    mtcp_readfile(readfd, (char *)buf + done, chunk);
+    done += chunk;
+  }
+
+  if (readfd != fd && mtcp_sys_lseek(fd, offset + size, SEEK_SET) == -1) {
+    MTCP_PRINTF("mtcp_sys_lseek failed with errno %d\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+}
+
+/* Open the ckpt image behind fd once more, with O_DIRECT, for
+ * read_image_data().  Returns -1 if the image is not seekable or its file
+ * system does not support O_DIRECT; the image is then read as usual.
+ */
+NO_OPTIMIZE
+static int
+open_image_direct(int fd)
+{
+  int mtcp_sys_errno;
+  int directfd;
+  void *page;
+
+  if (mtcp_sys_lseek(fd, 0, SEEK_CUR) == -1) {
+    return -1;
+  }
+
+  directfd = open_image_path(fd, O_DIRECT);
+  if (directfd == -1) {
+    MTCP_PRINTF("***WARNING: cannot open ckpt image with O_DIRECT;"
+                " errno: %d\n", mtcp_sys_errno);
+    return -1;
+  }
+
+  /* Some file systems accept O_DIRECT at open, but fail the reads. */
+  page = mtcp_sys_mmap(0, MTCP_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    MTCP_PRINTF("mtcp_sys_mmap() failed with error: %d", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  if (mtcp_sys_read(directfd, page, MTCP_PAGE_SIZE) < 0) {
+    MTCP_PRINTF("***WARNING: cannot read ckpt image with O_DIRECT;"
+                " errno: %d\n", mtcp_sys_errno);
+    mtcp_sys_close(directfd);
+    directfd = -1;
+  }
+  mtcp_sys_munmap(page, MTCP_PAGE_SIZE);
+  return directfd;
+}
+
+/* Open the file behind fd once more, read-only and with the extra flags, as
+ * a file description of its own, with its own offset.
+ */
+NO_OPTIMIZE
+static int
+open_image_path(int fd, int flags)
+{
+  int mtcp_sys_errno;
+  char path[32] = "/proc/self/fd/";
+  char digits[12];
+  int len = mtcp_strlen(path);
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + fd % 10;
+    fd /= 10;
+  } while (fd > 0);
+  while (n > 0) {
+    path[len++] = digits[--n];
+  }
+  path[len] = '\0';
+
+  return mtcp_sys_open(path, O_RDONLY | flags, 0);
+}
+
+/* Read the chunk of the image at offset into buf.  Returns the number of
+ * bytes read, which is short only at the end of the image, or -errno.
+ */
+NO_OPTIMIZE
+static ssize_t
+read_image_chunk(int fd, char *buf, off_t offset)
+{
+  int mtcp_sys_errno;
+  ssize_t total = 0;
+
+  if (mtcp_sys_lseek(fd, offset, SEEK_SET) == -1) {
+    return -mtcp_sys_errno;
+  }
+  while (total < RESTORE_READ_CHUNK) {
+    ssize_t rc = mtcp_sys_read(fd, buf + total, RESTORE_READ_CHUNK - total);
+    if (rc == -1 && mtcp_sys_errno == EINTR) {
+      continue;
+    } else if (rc == -1) {
+      return -mtcp_sys_errno;
+    } else if (rc == 0) {
+      break;
+    }
+    total += rc;
+
+    // A regular file is only read short at its end, and an O_DIRECT read
+    // past a short one would be unaligned.
+    if (total < RESTORE_READ_CHUNK && rc % MTCP_PAGE_SIZE != 0) {
+      break;
+    }
+  }
+  return total;
+}
+
+/* The loop of the reader process: read the queued chunks of the image, in
+ * order, skipping the ones that are no longer wanted.  It exits when asked
+ * to, or when mtcp_restart is gone.
+ */
+NO_OPTIMIZE
+static void
+image_reader_loop(ImageReader *reader, pid_t parent)
+{
+  int mtcp_sys_errno;
+  struct timespec timeout = { 1, 0 };
+  int next = 0;
+
+  while (!reader->stop) {
+    int queued = reader->queued;
+    if (next == queued) {
+      mtcp_sys_kernel_futex(&reader->queued, FUTEX_WAIT, queued, &timeout,
+                            NULL, 0);
+      if (mtcp_sys_getppid() != parent) {
+        break;
+      }
+      continue;
+    }
+    RMB;
+
+    int slot = next % RESTORE_READ_SLOTS;
+    if (next >= reader->wanted) {
+      reader->len[slot] = read_image_chunk(reader->fd,
+                                           IMAGE_READER_SLOT(reader, slot),
+                                           reader->offset[slot]);
+    }
+    WMB;
+    reader->done = ++next;
+    mtcp_sys_kernel_futex(&reader->done, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+/* Fork the reader process, which reads the image being restored ahead into
+ * the chunks of a shared mapping in the restore area, while mtcp_restart
+ * copies the data of one area and maps the next ones.  It reads through a
+ * file description of its own, with O_DIRECT under --direct-io, so that
+ * chunks are in flight without relying on the readahead of the kernel or
+ * of the file system.  The restore area of an image from before the reader
+ * has no room for it; such an image, and one read through a pipe, is read
+ * without it.
+ */
+NO_OPTIMIZE
+static void
+start_image_reader(RestoreInfo *rinfo_ptr)
+{
+  int mtcp_sys_errno;
+  void *ring = rinfo_ptr->restore_addr + RESTORE_MEM_SIZE;
+  pid_t parent = mtcp_sys_getpid();
+  off_t offset = mtcp_sys_lseek(rinfo_ptr->fd, 0, SEEK_CUR);
+  ImageReader *reader;
+  int fd;
+  pid_t pid;
+
+  if (rinfo_ptr->restore_size < RESTORE_TOTAL_SIZE || offset == -1) {
+    return;
+  }
+  fd = open_image_path(rinfo_ptr->fd,
+                       rinfo_ptr->direct_fd != -1 ? O_DIRECT : 0);
+  if (fd == -1) {
+    MTCP_PRINTF("***WARNING: cannot open ckpt image for reading ahead;"
+                " errno: %d\n", mtcp_sys_errno);
+    return;
+  }
+
+  reader = mtcp_sys_mmap(ring, RESTORE_READER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (reader == MAP_FAILED) {
+    MTCP_PRINTF("mtcp_sys_mmap() failed with error: %d\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  reader->fd = fd;
+
+  pid = mtcp_sys_fork();
+  if (pid == 0) {
+    image_reader_loop(reader, parent);
+    mtcp_sys_exit(0);
+  }
+  mtcp_sys_close(fd);
+  rinfo_ptr->reader = reader;
+  rinfo_ptr->reader_pid = pid;
+  if (pid == -1) {
+    MTCP_PRINTF("***WARNING: cannot fork the reader of the ckpt image;"
+                " errno: %d\n", mtcp_sys_errno);
+    stop_image_reader(rinfo_ptr);
+    return;
+  }
+
+  rinfo_ptr->reader_first = 0;
+  read_from_image_reader(rinfo_ptr, NULL, 0, offset);
+}
+
+/* Stop the reader process, and give the restore area its private mapping
+ * back.
+ */
+NO_OPTIMIZE
+static void
+stop_image_reader(RestoreInfo *rinfo_ptr)
+{
+  int mtcp_sys_errno;
+  ImageReader *reader = rinfo_ptr->reader;
+
+  if (reader == NULL) {
+    return;
+  }
+  if (rinfo_ptr->reader_pid != -1) {
+    reader->wanted = reader->queued;
+    reader->stop = 1;
+    WMB;
+    mtcp_sys_kernel_futex(&reader->queued, FUTEX_WAKE, 1, NULL, NULL, 0);
+    mtcp_sys_wait4(rinfo_ptr->reader_pid, NULL, 0, NULL);
+  }
+
+  if (mtcp_sys_mmap(reader, RESTORE_READER_SIZE,
+                    PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+      == MAP_FAILED) {
+    MTCP_PRINTF("mtcp_sys_mmap() failed with error: %d\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  rinfo_ptr->reader = NULL;
+}
+
+/* Wait until the reader process is done with the given request. */
+NO_OPTIMIZE
+static void
+wait_for_image_reader(RestoreInfo *rinfo_ptr, int request)
+{
+  int mtcp_sys_errno;
+  ImageReader *reader = rinfo_ptr->reader;
+  struct timespec timeout = { 1, 0 };
+
+  while (1) {
+    int done = reader->done;
+    if (done > request) {
+      break;
+    }
+    mtcp_sys_kernel_futex(&reader->done, FUTEX_WAIT, done, &timeout, NULL, 0);
+    if (reader->done <= request &&
+        mtcp_sys_wait4(rinfo_ptr->reader_pid, NULL, WNOHANG, NULL) ==
+        rinfo_ptr->reader_pid) {
+      MTCP_PRINTF("***ERROR: the reader of the ckpt image exited\n");
+      mtcp_abort();
+    }
+  }
+  RMB;
+}
+
+/* Queue the chunk of the image at offset, if a slot is free for it: the
+ * requests in flight, and the one being copied from, keep theirs.  With
+ * wait, first wait for the reader to free a slot.  Returns whether the
+ * chunk was queued.
+ */
+NO_OPTIMIZE
+static int
+queue_image_chunk(RestoreInfo *rinfo_ptr, off_t offset, int wait)
+{
+  int mtcp_sys_errno;
+  ImageReader *reader = rinfo_ptr->reader;
+  int next = reader->queued;
+
+  if (next - rinfo_ptr->reader_first >= RESTORE_READ_SLOTS) {
+    return 0;
+  }
+  if (next - reader->done >= RESTORE_READ_SLOTS) {
+    if (!wait) {
+      return 0;
+    }
+    wait_for_image_reader(rinfo_ptr, next - RESTORE_READ_SLOTS);
+  }
+
+  reader->offset[next % RESTORE_READ_SLOTS] = offset;
+  WMB;
+  reader->queued = next + 1;
+  mtcp_sys_kernel_futex(&reader->queued, FUTEX_WAKE, 1, NULL, NULL, 0);
+  return 1;
+}
+
+/* Copy size bytes of the image at offset into buf from the chunks of the
+ * reader process.  The chunks before the one being copied from are released,
+ * and the following ones are queued, so that RESTORE_READ_SLOTS - 1 chunks
+ * are in flight while the data is copied and the next areas are mapped.  A
+ * read that skips past the chunks read ahead (an area mapped from the image,
+ * for instance) starts over: the reader skips the requests that are no
+ * longer wanted.
+ */
+NO_OPTIMIZE
+static void
+read_from_image_reader(RestoreInfo *rinfo_ptr, void *buf, size_t size,
+                       off_t offset)
+{
+  int mtcp_sys_errno;
+  ImageReader *reader = rinfo_ptr->reader;
+  size_t done = 0;
+
+  do {
+    off_t pos = offset + done;
+    off_t chunkStart = pos - pos % RESTORE_READ_CHUNK;
+    int request;
+
+    for (request = rinfo_ptr->reader_first; request < reader->queued;
+         request++) {
+      if (reader->offset[request % RESTORE_READ_SLOTS] == chunkStart) {
+        break;
+      }
+    }
+    rinfo_ptr->reader_first = request;
+    reader->wanted = request;
+    if (request == reader->queued) {
+      queue_image_chunk(rinfo_ptr, chunkStart, 1);
+    }
+
+    off_t next = reader->offset[(reader->queued - 1) % RESTORE_READ_SLOTS];
+    do {
+      next += RESTORE_READ_CHUNK;
+    } while (queue_image_chunk(rinfo_ptr, next, 0));
+
+    if (size == 0) {
+      break;
+    }
+
+    int slot = request % RESTORE_READ_SLOTS;
+    wait_for_image_reader(rinfo_ptr, request);
+    if (reader->len[slot] < 0) {
+      MTCP_PRINTF("error %d reading checkpoint\n", (int)-reader->len[slot]);
+      mtcp_abort();
+    }
+    if (pos - chunkStart >= reader->len[slot]) {
+      MTCP_PRINTF("***ERROR: ckpt image ends before offset %p\n",
+                  (void *)pos);
+      mtcp_abort();
+    }
+
+    size_t len = reader->len[slot] - (pos - chunkStart);
+    if (len > size - done) {
+      len = size - done;
+    }
+    mtcp_memcpy((char *)buf + done, IMAGE_READER_SLOT(reader, slot) +
+                (pos - chunkStart), len);
+    done += len;
+  } while (done < size);
+}
+
+/* Skip the next size bytes of the data of an area; see read_area_data(). */
+NO_OPTIMIZE
+static void
+skip_area_data(int fd, Area *area, size_t size)
+{
+  int mtcp_sys_errno;
+  CompressedBlockHeader hdr;
+  size_t done = 0;
+
+  if ((area->properties & DMTCP_COMPRESSED_DATA) == 0) {
+    skip_image_bytes(fd, size);
+    return;
+  }
+
+  while (done < size) {
+    mtcp_readfile(fd, &hdr, sizeof hdr);
+    if (hdr.rawSize == 0 || hdr.rawSize > size - done) {
+      MTCP_PRINTF("***ERROR: corrupt compressed block"
+                  " (raw size: %u, compressed size: %u)\n",
+                  hdr.rawSize, hdr.compSize);
+      mtcp_abort();
+    }
+    skip_image_bytes(fd, hdr.compSize);
+    done += hdr.rawSize;
+  }
+}
+
 #if 0
 
 // See note above.
@@ -1365,7 +2347,6 @@ __intel_security_check_cookie(void)
   mtcp_abort();
 }
 
-#ifdef FAST_RST_VIA_MMAP
 static void mmapfile(int fd, void *buf, size_t size, int prot, int flags)
 {
   int mtcp_sys_errno;
@@ -1390,4 +2371,3 @@ static void mmapfile(int fd, void *buf, size_t size, int prot, int flags)
     mtcp_abort();
   }
 }
-#endif
@@ -327,6 +327,7 @@ struct linux_dirent {
                               args)
 # define mtcp_sys_munmap(args ...)    mtcp_inline_syscall(munmap, 2, args)
 # define mtcp_sys_mprotect(args ...)  mtcp_inline_syscall(mprotect, 3, args)
+# define mtcp_sys_madvise(args ...)   mtcp_inline_syscall(madvise, 3, args)
 # define mtcp_sys_nanosleep(args ...) mtcp_inline_syscall(nanosleep, 2, args)
 # define mtcp_sys_brk(args ...)                                            \
                                       (void *)(mtcp_inline_syscall(brk, 1, \
@@ -379,6 +380,15 @@ struct linux_dirent {
 #  define mtcp_sys_getdents64(args ...) mtcp_inline_syscall(getdents64, 3, args)
 # endif // ifdef __NR_getdents64
 
+/* On 32-bit arch's, fadvise64_64 splits its offset and length into two
+ * registers each, in an arch-specific order.  It is only a hint; skip it.
+ */
+# if defined(__x86_64__) || defined(__aarch64__)
+#  define mtcp_sys_fadvise(args ...) mtcp_inline_syscall(fadvise64, 4, args)
+# else // if defined(__x86_64__) || defined(__aarch64__)
+#  define mtcp_sys_fadvise(fd, offset, len, advice) 0
+# endif // if defined(__x86_64__) || defined(__aarch64__)
+
 # define mtcp_sys_fcntl2(args ...)      mtcp_inline_syscall(fcntl, 2, args)
 # define mtcp_sys_fcntl3(args ...)      mtcp_inline_syscall(fcntl, 3, args)
 # if defined(__aarch64__)
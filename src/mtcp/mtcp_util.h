@@ -162,6 +162,8 @@ void mtcp_printf(char const *format, ...);
 ssize_t mtcp_read_all(int fd, void *buf, size_t count);
 int mtcp_readfile(int fd, void *buf, size_t size);
 void mtcp_skipfile(int fd, size_t size);
+ssize_t mtcp_lz_decompress(const char *src, size_t srcLen,
+                           char *dst, size_t dstLen);
 unsigned long mtcp_strtol(char *str);
 char mtcp_readchar(int fd);
 char mtcp_readdec(int fd, VA *value);
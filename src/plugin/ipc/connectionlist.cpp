@@ -85,7 +85,17 @@ using namespace dmtcp;
 static bool freshProcess = true;
 
 ConnectionList::~ConnectionList()
-{}
+{
+  if (_idSlots != NULL) {
+    JALLOC_HELPER_FREE(_idSlots);
+  }
+  if (_fdTable != NULL) {
+    JALLOC_HELPER_FREE(_fdTable);
+  }
+  for (size_t i = 0; i < _oldFdTables.size(); i++) {
+    JALLOC_HELPER_FREE(_oldFdTables[i]);
+  }
+}
 
 void
 ConnectionList::eventHook(DmtcpEvent_t event, DmtcpEventData_t *data)
@@ -142,6 +152,12 @@ ConnectionList::resetOnFork()
 {
   JASSERT(pthread_mutex_destroy(&_lock) == 0) (JASSERT_ERRNO);
   JASSERT(pthread_mutex_init(&_lock, NULL) == 0) (JASSERT_ERRNO);
+
+  // The child has a single thread, so nobody can be reading the old tables.
+  for (size_t i = 0; i < _oldFdTables.size(); i++) {
+    JALLOC_HELPER_FREE(_oldFdTables[i]);
+  }
+  _oldFdTables.clear();
 }
 
 void
@@ -149,9 +165,10 @@ ConnectionList::deleteStaleConnections()
 {
   // build list of stale connections
   vector<int>staleFds;
-  for (FdToConMapT::iterator i = _fdToCon.begin(); i != _fdToCon.end(); ++i) {
-    if (_isBadFd(i->first)) {
-      staleFds.push_back(i->first);
+  FdTable *table = _fdTable;
+  for (size_t fd = 0; table != NULL && fd < table->size; fd++) {
+    if (table->cons[fd] != NULL && _isBadFd(fd)) {
+      staleFds.push_back(fd);
     }
   }
 
@@ -214,10 +231,10 @@ ConnectionList::serialize(jalib::JBinarySerializer &o)
       con = createDummyConnection(type);
       JASSERT(con != NULL) (key);
       con->serialize(o);
-      _connections[key] = con;
+      addConnection(key, con);
       const vector<int32_t> &fds = con->getFds();
       for (size_t i = 0; i < fds.size(); i++) {
-        _fdToCon[fds[i]] = con;
+        setFdConnection(fds[i], con);
       }
       JSERIALIZE_ASSERT_POINT("[EndConnection]");
     }
@@ -246,22 +263,135 @@ ConnectionList::list()
   JTRACE("ConnectionList") (dmtcp_get_uniquepid_str()) (o.str());
 }
 
+static size_t
+hashConnectionId(const ConnectionIdentifier &id)
+{
+  uint64_t h = id.hostid() ^ ((uint64_t)id.pid() << 32) ^ id.time();
+
+  h ^= (uint64_t)id.conId() * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+// Returns the slot of id, or the free slot where it would be inserted.
+size_t
+ConnectionList::findIdSlot(const ConnectionIdentifier &id) const
+{
+  size_t mask = _numIdSlots - 1;
+  size_t slot = hashConnectionId(id) & mask;
+
+  while (_idSlots[slot] != 0 && _connections[_idSlots[slot] - 1].first != id) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void
+ConnectionList::resizeIdSlots(size_t numSlots)
+{
+  if (_idSlots != NULL) {
+    JALLOC_HELPER_FREE(_idSlots);
+  }
+  _numIdSlots = numSlots;
+  _idSlots = (uint32_t *)JALLOC_HELPER_MALLOC(numSlots * sizeof(uint32_t));
+  memset(_idSlots, 0, numSlots * sizeof(uint32_t));
+  for (size_t i = 0; i < _connections.size(); i++) {
+    _idSlots[findIdSlot(_connections[i].first)] = i + 1;
+  }
+}
+
+void
+ConnectionList::addConnection(const ConnectionIdentifier &id, Connection *c)
+{
+  if ((_connections.size() + 1) * 2 > _numIdSlots) {
+    resizeIdSlots(_numIdSlots == 0 ? 64 : _numIdSlots * 2);
+  }
+  _connections.push_back(std::make_pair(id, c));
+  _idSlots[findIdSlot(id)] = _connections.size();
+}
+
+void
+ConnectionList::removeConnection(const ConnectionIdentifier &id)
+{
+  size_t mask = _numIdSlots - 1;
+  size_t hole = findIdSlot(id);
+  size_t idx = _idSlots[hole] - 1;
+
+  JASSERT(_idSlots[hole] != 0) (id);
+
+  // Backward-shift deletion: move up every entry of the cluster that can no
+  // longer be reached from its home slot once the hole is there.
+  for (size_t next = (hole + 1) & mask; _idSlots[next] != 0;
+       next = (next + 1) & mask) {
+    size_t home =
+      hashConnectionId(_connections[_idSlots[next] - 1].first) & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      _idSlots[hole] = _idSlots[next];
+      hole = next;
+    }
+  }
+  _idSlots[hole] = 0;
+
+  // Fill the gap in _connections with the last entry.
+  size_t last = _connections.size() - 1;
+  if (idx != last) {
+    _idSlots[findIdSlot(_connections[last].first)] = idx + 1;
+    _connections[idx] = _connections[last];
+  }
+  _connections.pop_back();
+}
+
+void
+ConnectionList::setFdConnection(int fd, Connection *c)
+{
+  FdTable *table = _fdTable;
+
+  JASSERT(fd >= 0) (fd);
+  if (table == NULL || (size_t)fd >= table->size) {
+    size_t oldSize = table != NULL ? table->size : 0;
+    size_t size = oldSize > 0 ? oldSize : 1024;
+    while (size <= (size_t)fd) {
+      size *= 2;
+    }
+
+    size_t bytes = sizeof(FdTable) + (size - 1) * sizeof(Connection *);
+    FdTable *newTable = (FdTable *)JALLOC_HELPER_MALLOC(bytes);
+    newTable->size = size;
+    memset(newTable->cons, 0, size * sizeof(Connection *));
+    if (table != NULL) {
+      memcpy(newTable->cons, table->cons, oldSize * sizeof(Connection *));
+      _oldFdTables.push_back(table);
+    }
+
+    // The contents must be visible before the new table is.
+    __sync_synchronize();
+    _fdTable = newTable;
+    table = newTable;
+  }
+  table->cons[fd] = c;
+}
+
 Connection *
 ConnectionList::getConnection(const ConnectionIdentifier &id)
 {
-  if (_connections.find(id) == _connections.end()) {
+  if (_numIdSlots == 0) {
     return NULL;
   }
-  return _connections[id];
+  uint32_t idx = _idSlots[findIdSlot(id)];
+  return idx == 0 ? NULL : _connections[idx - 1].second;
 }
 
 Connection *
 ConnectionList::getConnection(int fd)
 {
-  if (_fdToCon.find(fd) == _fdToCon.end()) {
+  FdTable *table = _fdTable;
+
+  if (fd < 0 || table == NULL || (size_t)fd >= table->size) {
     return NULL;
   }
-  return _fdToCon[fd];
+  return table->cons[fd];
 }
 
 void
@@ -269,7 +399,7 @@ ConnectionList::add(int fd, Connection *c)
 {
   _lock_tbl();
 
-  if (_fdToCon.find(fd) != _fdToCon.end()) {
+  if (getConnection(fd) != NULL) {
     /* In ordinary situations, we never exercise this path since we already
      * capture close() and remove the connection. However, there is one
      * particular case where this assumption fails -- when gblic opens a socket
@@ -280,23 +410,23 @@ ConnectionList::add(int fd, Connection *c)
     processCloseWork(fd);
   }
 
-  if (_connections.find(c->id()) == _connections.end()) {
-    _connections[c->id()] = c;
+  if (getConnection(c->id()) == NULL) {
+    addConnection(c->id(), c);
   }
   c->addFd(fd);
-  _fdToCon[fd] = c;
+  setFdConnection(fd, c);
   _unlock_tbl();
 }
 
 void
 ConnectionList::processCloseWork(int fd)
 {
-  Connection *con = _fdToCon[fd];
+  Connection *con = getConnection(fd);
 
-  _fdToCon.erase(fd);
+  setFdConnection(fd, NULL);
   con->removeFd(fd);
   if (con->numFds() == 0) {
-    _connections.erase(con->id());
+    removeConnection(con->id());
     delete con;
   }
 }
@@ -305,7 +435,7 @@ void
 ConnectionList::processClose(int fd)
 {
   _lock_tbl();
-  if (_fdToCon.find(fd) != _fdToCon.end()) {
+  if (getConnection(fd) != NULL) {
     processCloseWork(fd);
   }
   _unlock_tbl();
@@ -319,14 +449,14 @@ ConnectionList::processDup(int oldfd, int newfd)
   }
 
   _lock_tbl();
-  if (_fdToCon.find(newfd) != _fdToCon.end()) {
+  if (getConnection(newfd) != NULL) {
     processCloseWork(newfd);
   }
 
-  // Add only if the oldfd was already in the _fdToCon table.
-  if (_fdToCon.find(oldfd) != _fdToCon.end()) {
-    Connection *con = _fdToCon[oldfd];
-    _fdToCon[newfd] = con;
+  // Add only if the oldfd was already in the fd table.
+  Connection *con = getConnection(oldfd);
+  if (con != NULL) {
+    setFdConnection(newfd, con);
     con->addFd(newfd);
   }
   _unlock_tbl();
@@ -42,11 +42,15 @@ class ConnectionList
 
     static void operator delete(void *p) { JALLOC_HELPER_DELETE(p); }
 # endif // ifdef JALIB_ALLOCATOR
-    typedef map<ConnectionIdentifier, Connection *>::iterator iterator;
+    typedef vector<std::pair<ConnectionIdentifier, Connection *> >::iterator
+      iterator;
 
     ConnectionList()
     {
       numIncomingCons = 0;
+      _numIdSlots = 0;
+      _idSlots = NULL;
+      _fdTable = NULL;
       JASSERT(pthread_mutex_init(&_lock, NULL) == 0);
     }
 
@@ -101,6 +105,11 @@ class ConnectionList
 
   private:
     void processCloseWork(int fd);
+    void addConnection(const ConnectionIdentifier &id, Connection *c);
+    void removeConnection(const ConnectionIdentifier &id);
+    size_t findIdSlot(const ConnectionIdentifier &id) const;
+    void resizeIdSlots(size_t numSlots);
+    void setFdConnection(int fd, Connection *c);
     void _lock_tbl()
     {
       JASSERT(_real_pthread_mutex_lock(&_lock) == 0) (JASSERT_ERRNO);
@@ -112,11 +121,26 @@ class ConnectionList
     }
 
     pthread_mutex_t _lock;
-    typedef map<ConnectionIdentifier, Connection *>ConnectionMapT;
-    ConnectionMapT _connections;
 
-    typedef map<int, Connection *>FdToConMapT;
-    FdToConMapT _fdToCon;
+    // The connections, in no particular order.  _idSlots is an open-addressed
+    // (linear probing) hash index into it; each slot holds an index plus one,
+    // or zero if free.
+    typedef vector<std::pair<ConnectionIdentifier, Connection *> >
+      ConnectionVectorT;
+    ConnectionVectorT _connections;
+    size_t _numIdSlots;
+    uint32_t *_idSlots;
+
+    // The connection of each fd.  getConnection(fd) is called by the
+    // wrappers without the lock: a full table is replaced by a larger copy,
+    // and the old one is only freed on fork, when no other thread can still
+    // be reading it.
+    struct FdTable {
+      size_t size;
+      Connection *cons[1];
+    };
+    FdTable *volatile _fdTable;
+    vector<FdTable *>_oldFdTables;
 
     size_t numIncomingCons;
 };
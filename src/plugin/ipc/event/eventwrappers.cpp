@@ -28,6 +28,7 @@
 /* Next three according to earlier standards */
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "jassert.h"
 #include "dmtcpalloc.h"
@@ -236,40 +237,45 @@ epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
   return ret;
 }
 
+/* The wrapper does not hold off the checkpoint while blocked: the checkpoint
+ * signal interrupts the wait, which returns EINTR (epoll_wait is never
+ * restarted, see above), and the wait is then resumed like poll() above, for
+ * the rest of the timeout.  The time until the interruption is not known; the
+ * time that the wait took, checkpoint included, is counted instead.  After a
+ * restart, where the clock is not comparable, a negative time counts as the
+ * whole timeout.
+ */
 extern "C" int
 epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-  int readyFds = 0;
-  int timeLeft = timeout;
-  int mytime;
-
-  // JTRACE("Starting to do wait on epoll fd");
-
-  if (timeout >= 0 && timeout < 1000) {
-    // Short time intervals
-    DMTCP_PLUGIN_DISABLE_CKPT();
-    readyFds = _real_epoll_wait(epfd, events, maxevents, timeout);
-    DMTCP_PLUGIN_ENABLE_CKPT();
-    return readyFds;
-  } else if (timeout >= 1000) {
-    mytime = 1000; // wait time quanta: 1000 ms
-  } else {
-    // In case of indefinite timeout, start with 0 and increment by 1ms.
-    mytime = 0;
-  }
+  int rc;
 
-  do {
-    DMTCP_PLUGIN_DISABLE_CKPT();
-    readyFds = _real_epoll_wait(epfd, events, maxevents, mytime);
-    DMTCP_PLUGIN_ENABLE_CKPT();
-    if (timeout < 0 && mytime <= 100) {
-      // Increase timeout if we are going to wait forever.
-      mytime += 1;
+  while (1) {
+    uint32_t orig_generation = dmtcp_get_generation();
+    struct timespec start;
+    if (timeout > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    rc = _real_epoll_wait(epfd, events, maxevents, timeout);
+    if (rc == -1 && errno == EINTR &&
+        dmtcp_get_generation() > orig_generation) {
+      // This was a restart or resume after checkpoint.
+      if (timeout > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+          (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed < 0 || elapsed >= timeout) {
+          return 0;
+        }
+        timeout -= elapsed;
+      }
+      continue;
     } else {
-      timeLeft -= mytime;
+      break;  // The signal interrupting us was not our checkpoint signal.
     }
-  } while ((timeLeft > 0 || timeout < 0) && readyFds == 0);
-  return readyFds;
+  }
+  return rc;
 }
 #endif // ifdef HAVE_SYS_EPOLL_H
 
@@ -21,11 +21,16 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <linux/limits.h>
+#include <linux/magic.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
+#include <sys/vfs.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -46,8 +51,27 @@
 
 using namespace dmtcp;
 
-static void writeFileFromFd(int fd, int destFd);
+static void writeFileFromFd(int fd, int destFd, unsigned char *hash = NULL);
 static bool areFilesEqual(int fd, int destFd, size_t size);
+static bool hashFile(int fd, off_t size, unsigned char *hash);
+
+static int64_t
+timespecToNs(const struct timespec &ts)
+{
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Files whose contents may change without a change of their mtime: those
+ * written through a shared mapping on tmpfs, which does not update it.
+ */
+static bool
+mayChangeWithoutMtime(int fd, int type)
+{
+  struct statfs fsbuf;
+
+  return type == FileConnection::FILE_SHM ||
+         fstatfs(fd, &fsbuf) == -1 || fsbuf.f_type == TMPFS_MAGIC;
+}
 
 static bool
 _isVimApp()
@@ -220,23 +244,16 @@ FileConnection::preCkpt()
       JASSERT(Util::createDirectoryTree(_savedFilePath)) (_savedFilePath)
       .Text("Unable to create directory in File Path");
 
-      int destFd = _real_open(
-          _savedFilePath.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
-          S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-      JASSERT(destFd != -1) (JASSERT_ERRNO) (_path) (_savedFilePath);
-
-      JTRACE("Saving checkpointed copy of the file") (_path) (_savedFilePath);
       if (_fcntlFlags & O_WRONLY) {
         // If the file is opened() in write-only mode. Open it in readonly mode
         // to create the ckpt copy.
         int tmpfd = _real_open(_path.c_str(), O_RDONLY, 0);
         JASSERT(tmpfd != -1);
-        writeFileFromFd(tmpfd, destFd);
+        saveFile(tmpfd);
         _real_close(tmpfd);
       } else {
-        writeFileFromFd(_fds[0], destFd);
+        saveFile(_fds[0]);
       }
-      _real_close(destFd);
     } else {
       JTRACE("Not checkpointing this file") (_path);
       _ckpted_file = false;
@@ -255,6 +272,99 @@ FileConnection::preCkpt()
   }
 }
 
+/* Whether the copy saved at the last checkpoint still has the contents of fd.
+ * Neither the file nor the copy may have changed in size or mtime since.  The
+ * mtime of the file can be trusted only if it is older than the copy (a write
+ * in the same clock tick as the copy would not change it) and if the file
+ * cannot change without it; otherwise, the file is hashed and compared with
+ * the hash of the copy, if the copy was hashed.
+ */
+bool
+FileConnection::isSavedFileCurrent(int fd)
+{
+  struct stat statbuf;
+  struct stat copyStat;
+
+  if (_copySrcSize == -1 ||
+      fstat(fd, &statbuf) == -1 ||
+      stat(_savedFilePath.c_str(), &copyStat) == -1) {
+    return false;
+  }
+
+  if (statbuf.st_size != _copySrcSize ||
+      timespecToNs(statbuf.st_mtim) != _copySrcMtime ||
+      timespecToNs(statbuf.st_ctim) != _copySrcCtime ||
+      copyStat.st_dev != _copyDev ||
+      copyStat.st_ino != _copyIno ||
+      copyStat.st_size != _copySrcSize ||
+      timespecToNs(copyStat.st_mtim) != _copyMtime) {
+    return false;
+  }
+
+  if (_copySrcMtime < _copyMtime && !mayChangeWithoutMtime(fd, _type)) {
+    return true;
+  }
+
+  unsigned char hash[FILE_HASH_SIZE];
+  return _copyHashValid &&
+         hashFile(fd, statbuf.st_size, hash) &&
+         memcmp(hash, _copyHash, FILE_HASH_SIZE) == 0;
+}
+
+/* Saves the contents of fd to _savedFilePath, unless the copy of the last
+ * checkpoint still has them.  Files that may change without a change of
+ * mtime are hashed as they are copied, for the next checkpoint to compare.
+ */
+void
+FileConnection::saveFile(int fd)
+{
+  struct stat statbuf;
+  struct stat copyStat;
+
+  if (isSavedFileCurrent(fd)) {
+    JTRACE("Checkpointed copy of the file is unchanged")
+      (_path) (_savedFilePath);
+    return;
+  }
+
+  _copySrcSize = -1;
+  int destFd = _real_open(
+      _savedFilePath.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+      S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  JASSERT(destFd != -1) (JASSERT_ERRNO) (_path) (_savedFilePath);
+
+  JTRACE("Saving checkpointed copy of the file") (_path) (_savedFilePath);
+  _copyHashValid = mayChangeWithoutMtime(fd, _type);
+  writeFileFromFd(fd, destFd, _copyHashValid ? _copyHash : NULL);
+
+  if (fstat(fd, &statbuf) == 0 && fstat(destFd, &copyStat) == 0 &&
+      copyStat.st_size == statbuf.st_size) {
+    _copySrcSize = statbuf.st_size;
+    _copySrcMtime = timespecToNs(statbuf.st_mtim);
+    _copySrcCtime = timespecToNs(statbuf.st_ctim);
+    _copyDev = copyStat.st_dev;
+    _copyIno = copyStat.st_ino;
+    _copyMtime = timespecToNs(copyStat.st_mtim);
+  }
+  _real_close(destFd);
+}
+
+/* Whether the file that already exists at _path on restart has the contents
+ * of the saved copy.  The file is overwritten if not, so both are compared
+ * byte for byte rather than trusting a hash.
+ */
+bool
+FileConnection::isSameAsSavedFile(int savedFd)
+{
+  struct stat statbuf;
+
+  JASSERT(fstat(_fds[0], &statbuf) != -1) (_path) (JASSERT_ERRNO);
+  if (statbuf.st_size < _st_size) {
+    return false;
+  }
+  return areFilesEqual(_fds[0], savedFd, _st_size);
+}
+
 /* Given an open file-descriptor for a saved file, saves a copy
  * of its existing copy, and replaces the existing copy with the
  * saved file.
@@ -313,7 +423,7 @@ FileConnection::refill(bool isRestart)
         (_savedFilePath) (_path);
       this->overwriteFileWithBackup(savedFd);
     } else {
-      if (!areFilesEqual(_fds[0], savedFd, _st_size)) {
+      if (!isSameAsSavedFile(savedFd)) {
         if (_type == FILE_SHM) {
           JWARNING(false) (_path) (_savedFilePath)
           .Text("\n"
@@ -574,21 +684,264 @@ areFilesEqual(int fd, int savedFd, size_t size)
   return size == 0;
 }
 
+/* BLAKE2b (RFC 7693), unkeyed, with a FILE_HASH_SIZE-byte digest.  A saved
+ * copy is reused when the file hashes the same, so the hash must resist
+ * collisions, not just be fast.
+ */
+#define BLAKE2B_BLOCK_SIZE 128
+
+typedef struct FileHash {
+  uint64_t h[8];
+  uint64_t t[2];
+  unsigned char buf[BLAKE2B_BLOCK_SIZE];
+  size_t bufLen;
+} FileHash;
+
+static const uint64_t blake2bIV[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned char blake2bSigma[12][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+  { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+  { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+  { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+  { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+  { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+  { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+  { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+static inline uint64_t
+rotr64(uint64_t x, int n)
+{
+  return (x >> n) | (x << (64 - n));
+}
+
+#define BLAKE2B_G(a, b, c, d, x, y) \
+  do {                              \
+    a = a + b + (x);                \
+    d = rotr64(d ^ a, 32);          \
+    c = c + d;                      \
+    b = rotr64(b ^ c, 24);          \
+    a = a + b + (y);                \
+    d = rotr64(d ^ a, 16);          \
+    c = c + d;                      \
+    b = rotr64(b ^ c, 63);          \
+  } while (0)
+
+static void
+blake2bCompress(FileHash *s, const unsigned char *block, bool last)
+{
+  uint64_t m[16];
+  uint64_t v[16];
+
+  for (int i = 0; i < 16; i++) {
+    m[i] = 0;
+    for (int j = 7; j >= 0; j--) {
+      m[i] = (m[i] << 8) | block[8 * i + j];
+    }
+  }
+  for (int i = 0; i < 8; i++) {
+    v[i] = s->h[i];
+    v[i + 8] = blake2bIV[i];
+  }
+  v[12] ^= s->t[0];
+  v[13] ^= s->t[1];
+  if (last) {
+    v[14] = ~v[14];
+  }
+
+  for (int r = 0; r < 12; r++) {
+    const unsigned char *sigma = blake2bSigma[r];
+    BLAKE2B_G(v[0], v[4], v[8], v[12], m[sigma[0]], m[sigma[1]]);
+    BLAKE2B_G(v[1], v[5], v[9], v[13], m[sigma[2]], m[sigma[3]]);
+    BLAKE2B_G(v[2], v[6], v[10], v[14], m[sigma[4]], m[sigma[5]]);
+    BLAKE2B_G(v[3], v[7], v[11], v[15], m[sigma[6]], m[sigma[7]]);
+    BLAKE2B_G(v[0], v[5], v[10], v[15], m[sigma[8]], m[sigma[9]]);
+    BLAKE2B_G(v[1], v[6], v[11], v[12], m[sigma[10]], m[sigma[11]]);
+    BLAKE2B_G(v[2], v[7], v[8], v[13], m[sigma[12]], m[sigma[13]]);
+    BLAKE2B_G(v[3], v[4], v[9], v[14], m[sigma[14]], m[sigma[15]]);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    s->h[i] ^= v[i] ^ v[i + 8];
+  }
+}
+
+static void
+blake2bAddCount(FileHash *s, size_t n)
+{
+  s->t[0] += n;
+  if (s->t[0] < n) {
+    s->t[1]++;
+  }
+}
+
 static void
-writeFileFromFd(int fd, int destFd)
+hashInit(FileHash *s)
+{
+  for (int i = 0; i < 8; i++) {
+    s->h[i] = blake2bIV[i];
+  }
+  s->h[0] ^= 0x01010000 ^ FILE_HASH_SIZE;
+  s->t[0] = s->t[1] = 0;
+  s->bufLen = 0;
+}
+
+// The last block must be compressed by hashFinal(), so a full block is only
+// compressed once more data follows it.
+static void
+hashUpdate(FileHash *s, const char *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  while (len > 0) {
+    if (s->bufLen == BLAKE2B_BLOCK_SIZE) {
+      blake2bAddCount(s, BLAKE2B_BLOCK_SIZE);
+      blake2bCompress(s, s->buf, false);
+      s->bufLen = 0;
+    }
+    if (s->bufLen == 0 && len > BLAKE2B_BLOCK_SIZE) {
+      blake2bAddCount(s, BLAKE2B_BLOCK_SIZE);
+      blake2bCompress(s, p, false);
+      p += BLAKE2B_BLOCK_SIZE;
+      len -= BLAKE2B_BLOCK_SIZE;
+      continue;
+    }
+    size_t n = MIN(len, BLAKE2B_BLOCK_SIZE - s->bufLen);
+    memcpy(s->buf + s->bufLen, p, n);
+    s->bufLen += n;
+    p += n;
+    len -= n;
+  }
+}
+
+static void
+hashFinal(FileHash *s, unsigned char *digest)
+{
+  blake2bAddCount(s, s->bufLen);
+  memset(s->buf + s->bufLen, 0, BLAKE2B_BLOCK_SIZE - s->bufLen);
+  blake2bCompress(s, s->buf, true);
+  for (int i = 0; i < FILE_HASH_SIZE; i++) {
+    digest[i] = (unsigned char)(s->h[i / 8] >> (8 * (i % 8)));
+  }
+}
+
+/* Hashes the first size bytes of fd, in one pass.  Returns false if the file
+ * is shorter than that.  The file offset is left unchanged.
+ */
+static bool
+hashFile(int fd, off_t size, unsigned char *hash)
 {
   long page_size = sysconf(_SC_PAGESIZE);
   const size_t bufSize = 1024 * page_size;
   char *buf = (char *)JALLOC_HELPER_MALLOC(bufSize);
 
+  off_t offset = _real_lseek(fd, 0, SEEK_CUR);
+  JASSERT(_real_lseek(fd, 0, SEEK_SET) == 0) (fd) (JASSERT_ERRNO);
+
+  FileHash state;
+  hashInit(&state);
+  while (size > 0) {
+    int readBytes = Util::readAll(fd, buf, MIN(bufSize, (size_t)size));
+    JASSERT(readBytes != -1) (JASSERT_ERRNO).Text("Read Failed");
+    if (readBytes == 0) {
+      break;
+    }
+    hashUpdate(&state, buf, readBytes);
+    size -= readBytes;
+  }
+  hashFinal(&state, hash);
+  JALLOC_HELPER_FREE(buf);
+  JASSERT(_real_lseek(fd, offset, SEEK_SET) != -1);
+  return size == 0;
+}
+
+/* Copies the first size bytes of fd to destFd without passing them through
+ * user space: by sharing the blocks of the file (FICLONE) on file systems
+ * with reflinks, or else with copy_file_range() or sendfile().  Returns the
+ * number of bytes copied; the caller copies the rest, if any.
+ */
+static off_t
+copyFileInKernel(int fd, int destFd, off_t size)
+{
+  off_t copied = 0;
+
+#ifdef FICLONE
+  if (ioctl(destFd, FICLONE, fd) == 0) {
+    return size;
+  }
+#endif // ifdef FICLONE
+
+#ifdef __NR_copy_file_range
+  while (copied < size) {
+    loff_t inOffset = copied;
+    loff_t outOffset = copied;
+    ssize_t ret = _real_syscall(__NR_copy_file_range, fd, &inOffset,
+                                destFd, &outOffset, size - copied, 0);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    copied += ret;
+  }
+#endif // ifdef __NR_copy_file_range
+
+  if (copied < size) {
+    JASSERT(_real_lseek(destFd, copied, SEEK_SET) == copied)
+      (destFd) (JASSERT_ERRNO);
+  }
+  while (copied < size) {
+    off_t inOffset = copied;
+    ssize_t ret = sendfile(destFd, fd, &inOffset, size - copied);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    copied += ret;
+  }
+  return copied;
+}
+
+/* Copies all of fd to destFd, in the kernel where possible.  If hash is not
+ * NULL, the data is instead copied through user space and hashed on the way.
+ */
+static void
+writeFileFromFd(int fd, int destFd, unsigned char *hash)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  const size_t bufSize = 1024 * page_size;
+  struct stat statbuf;
+  off_t copied = 0;
+
   // Synchronize memory buffer with data in filesystem
   // On some Linux kernels, the shared-memory test will fail without this.
   fsync(fd);
 
   off_t offset = _real_lseek(fd, 0, SEEK_CUR);
-  JASSERT(_real_lseek(fd, 0, SEEK_SET) == 0) (fd) (JASSERT_ERRNO);
-  JASSERT(_real_lseek(destFd, 0, SEEK_SET) == 0) (destFd) (JASSERT_ERRNO);
+  if (hash == NULL && fstat(fd, &statbuf) == 0 && statbuf.st_size > 0) {
+    copied = copyFileInKernel(fd, destFd, statbuf.st_size);
+  }
+  JASSERT(_real_lseek(fd, copied, SEEK_SET) == copied) (fd) (JASSERT_ERRNO);
+  JASSERT(_real_lseek(destFd, copied, SEEK_SET) == copied)
+    (destFd) (JASSERT_ERRNO);
 
+  FileHash state;
+  hashInit(&state);
+
+  char *buf = (char *)JALLOC_HELPER_MALLOC(bufSize);
   int readBytes, writtenBytes;
   while (1) {
     readBytes = Util::readAll(fd, buf, bufSize);
@@ -596,10 +949,16 @@ writeFileFromFd(int fd, int destFd)
     if (readBytes == 0) {
       break;
     }
+    if (hash != NULL) {
+      hashUpdate(&state, buf, readBytes);
+    }
     writtenBytes = Util::writeAll(destFd, buf, readBytes);
     JASSERT(writtenBytes != -1) (JASSERT_ERRNO).Text("Write failed.");
   }
   JALLOC_HELPER_FREE(buf);
+  if (hash != NULL) {
+    hashFinal(&state, hash);
+  }
   JASSERT(_real_lseek(fd, offset, SEEK_SET) != -1);
 }
 
@@ -620,6 +979,8 @@ FileConnection::serializeSubClass(jalib::JBinarySerializer &o)
   JSERIALIZE_ASSERT_POINT("FileConnection");
   o&_path &_rel_path;
   o&_offset&_st_dev&_st_ino&_st_size&_ckpted_file &_rmtype;
+  o&_copyHash&_copyHashValid;
+  o&_copySrcSize&_copySrcMtime&_copySrcCtime&_copyDev&_copyIno&_copyMtime;
   JTRACE("Serializing FileConn.") (_path) (_rel_path)
     (dmtcp_get_ckpt_files_subdir()) (_ckpted_file) (_allow_overwrite) (
     _fcntlFlags);
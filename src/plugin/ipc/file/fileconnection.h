@@ -40,6 +40,9 @@
 
 # include "connection.h"
 
+// Size of the hash of a saved copy; see FileConnection::saveFile().
+# define FILE_HASH_SIZE 32
+
 namespace dmtcp
 {
 class StdioConnection : public Connection
@@ -83,7 +86,16 @@ class FileConnection : public Connection
       FILE_BATCH_QUEUE
     };
 
-    FileConnection() {}
+    FileConnection()
+      : _copyHash()
+      , _copyHashValid(false)
+      , _copySrcSize(-1)
+      , _copySrcMtime(0)
+      , _copySrcCtime(0)
+      , _copyDev(0)
+      , _copyIno(0)
+      , _copyMtime(0)
+    { }
 
     FileConnection(const string &path,
                    int flags,
@@ -92,6 +104,14 @@ class FileConnection : public Connection
       : Connection(type)
       , _path(path)
       , _fileAlreadyExists(false)
+      , _copyHash()
+      , _copyHashValid(false)
+      , _copySrcSize(-1)
+      , _copySrcMtime(0)
+      , _copySrcCtime(0)
+      , _copyDev(0)
+      , _copyIno(0)
+      , _copyMtime(0)
     { }
 
     virtual void doLocking();
@@ -125,6 +145,9 @@ class FileConnection : public Connection
     void calculateRelativePath();
     string getSavedFilePath(const string &path);
     void overwriteFileWithBackup(int savedFd);
+    bool isSavedFileCurrent(int fd);
+    void saveFile(int fd);
+    bool isSameAsSavedFile(int savedFd);
 
     string _path;
     string _savedFilePath;
@@ -143,6 +166,20 @@ class FileConnection : public Connection
     uint64_t _st_dev;
     uint64_t _st_ino;
     int64_t _st_size;
+
+    // Hash of the contents of the saved copy, if they were hashed as they
+    // were copied.
+    unsigned char _copyHash[FILE_HASH_SIZE];
+    int32_t _copyHashValid;
+
+    // The file and its saved copy as of the last copy, to skip the copy at
+    // the next checkpoint if neither one changed since.  Times are in ns.
+    int64_t _copySrcSize;
+    int64_t _copySrcMtime;
+    int64_t _copySrcCtime;
+    uint64_t _copyDev;
+    uint64_t _copyIno;
+    int64_t _copyMtime;
 };
 
 class FifoConnection : public Connection
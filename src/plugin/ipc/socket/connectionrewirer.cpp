@@ -22,7 +22,7 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
-#include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -40,26 +40,19 @@ using namespace dmtcp;
 // FIXME: IP6 Support disabled for now. However, we do go through the exercise
 // of creating the restore socket and all.
 // #define ENABLE_IP6_SUPPORT
-static void
-markSocketNonBlocking(int sockfd)
-{
-  // Remove O_NONBLOCK flag from listener socket
-  int flags = _real_fcntl(sockfd, F_GETFL, NULL);
 
-  JASSERT(flags != -1);
-  JASSERT(_real_fcntl(sockfd, F_SETFL,
-                      (void *)(long)(flags | O_NONBLOCK)) != -1);
-}
+// All of the peers may connect to a restore socket at the same time.
+#define RESTORE_LISTEN_BACKLOG SOMAXCONN
 
 static void
-markSocketBlocking(int sockfd)
+markSocketNonBlocking(int sockfd)
 {
   // Remove O_NONBLOCK flag from listener socket
   int flags = _real_fcntl(sockfd, F_GETFL, NULL);
 
   JASSERT(flags != -1);
   JASSERT(_real_fcntl(sockfd, F_SETFL,
-                      (void *)(long)(flags & ~O_NONBLOCK)) != -1);
+                      (void *)(long)(flags | O_NONBLOCK)) != -1);
 }
 
 static ConnectionRewirer *theRewirer = NULL;
@@ -85,78 +78,185 @@ ConnectionRewirer::destroy()
 }
 
 void
-ConnectionRewirer::checkForPendingIncoming(int restoreSockFd,
-                                           ConnectionListT *conList)
+ConnectionRewirer::watchFd(int fd, uint32_t events)
 {
-  while (conList->size() > 0) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  JASSERT(_real_epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    (fd) (JASSERT_ERRNO);
+}
+
+void
+ConnectionRewirer::acceptIncoming(int restoreSockFd, ConnectionListT *conList)
+{
+  struct epoll_event ev;
+
+  if (conList->size() == 0) {
+    _real_epoll_ctl(_epollFd, EPOLL_CTL_DEL, restoreSockFd, &ev);
+    return;
+  }
+
+  while (true) {
     int fd = _real_accept(restoreSockFd, NULL, NULL);
     if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
       return;
     }
     JASSERT(fd != -1) (JASSERT_ERRNO).Text("Accept failed.");
-    ConnectionIdentifier id;
-    JASSERT(Util::readAll(fd, &id, sizeof id) == sizeof id);
 
-    iterator i = conList->find(id);
-    JASSERT(i != conList->end()) (id)
-    .Text("got unexpected incoming restore request");
+    // The peer sends its id once connected; read it when it is there, so
+    // that a peer busy with its own connects does not hold us up.
+    _accepted[fd] = conList;
+    watchFd(fd, EPOLLIN);
+  }
+}
 
-    Util::dupFds(fd, (i->second)->getFds());
+void
+ConnectionRewirer::readIncomingId(int fd)
+{
+  ConnectionIdentifier id;
+  struct epoll_event ev;
+  ssize_t ret = recv(fd, &id, sizeof id, MSG_PEEK | MSG_DONTWAIT);
 
-    JTRACE("restoring incoming connection") (id);
-    conList->erase(i);
+  if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  JASSERT(ret > 0) (fd) (ret) (JASSERT_ERRNO)
+    .Text("restore connection closed before the peer sent its id");
+  if ((size_t)ret < sizeof id) {
+    return;
   }
+  JASSERT(Util::readAll(fd, &id, sizeof id) == sizeof id);
+
+  ConnectionListT *conList = _accepted[fd];
+  _accepted.erase(fd);
+  _real_epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, &ev);
+
+  iterator i = conList->find(id);
+  JASSERT(i != conList->end()) (id)
+  .Text("got unexpected incoming restore request");
+
+  Util::dupFds(fd, (i->second)->getFds());
+
+  JTRACE("restoring incoming connection") (id);
+  conList->erase(i);
 }
 
 void
-ConnectionRewirer::doReconnect()
+ConnectionRewirer::startConnect(const PendingConnect &pending)
 {
-  iterator i;
+  struct RemoteAddr &remoteAddr = _remoteInfo[pending.id];
 
-  for (i = _pendingOutgoing.begin(); i != _pendingOutgoing.end(); i++) {
-    const ConnectionIdentifier &id = i->first;
-    Connection *con = i->second;
-    struct RemoteAddr &remoteAddr = _remoteInfo[id];
-    int fd = con->getFds()[0];
-    errno = 0;
-    JASSERT(_real_connect(fd, (sockaddr *)&remoteAddr.addr, remoteAddr.len)
-            == 0)
-      (id) (JASSERT_ERRNO).Text("failed to restore connection");
-
-    Util::writeAll(fd, &id, sizeof id);
-
-    checkForPendingIncoming(PROTECTED_RESTORE_IP4_SOCK_FD,
-                            &_pendingIP4Incoming);
-    checkForPendingIncoming(PROTECTED_RESTORE_IP6_SOCK_FD,
-                            &_pendingIP6Incoming);
-    checkForPendingIncoming(PROTECTED_RESTORE_UDS_SOCK_FD,
-                            &_pendingUDSIncoming);
+  errno = 0;
+  if (_real_connect(pending.fd, (sockaddr *)&remoteAddr.addr,
+                    remoteAddr.len) == 0) {
+    finishConnect(pending);
+    return;
   }
-  _pendingOutgoing.clear();
-  _remoteInfo.clear();
+
+  // The listen queue of a UNIX domain socket is full; try again later.
+  if (errno == EAGAIN) {
+    _connectRetries.push_back(pending);
+    return;
+  }
+
+  JASSERT(errno == EINPROGRESS || errno == EINTR)
+    (pending.id) (JASSERT_ERRNO).Text("failed to restore connection");
+  _connecting[pending.fd] = pending;
+  watchFd(pending.fd, EPOLLOUT);
+}
+
+void
+ConnectionRewirer::finishConnect(const PendingConnect &pending)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  JASSERT(_real_getsockopt(pending.fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0)
+    (JASSERT_ERRNO);
+  errno = err;
+  JASSERT(err == 0)
+    (pending.id) (JASSERT_ERRNO).Text("failed to restore connection");
+
+  Util::writeAll(pending.fd, &pending.id, sizeof pending.id);
+  JASSERT(_real_fcntl(pending.fd, F_SETFL,
+                      (void *)(long)pending.flags) != -1);
+  JTRACE("restored outgoing connection") (pending.id);
+}
+
+// All of the connects are started at once and complete in any order, while
+// the incoming connections are accepted as they come; the peers do the same.
+void
+ConnectionRewirer::doReconnect()
+{
+  _epollFd = _real_epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(_epollFd != -1) (JASSERT_ERRNO);
 
   if (_pendingIP4Incoming.size() > 0) {
-    // Add O_NONBLOCK flag to the listener sockets.
-    markSocketBlocking(PROTECTED_RESTORE_IP4_SOCK_FD);
-    checkForPendingIncoming(PROTECTED_RESTORE_IP4_SOCK_FD,
-                            &_pendingIP4Incoming);
-    _real_close(PROTECTED_RESTORE_IP4_SOCK_FD);
+    watchFd(PROTECTED_RESTORE_IP4_SOCK_FD, EPOLLIN);
   }
   if (_pendingIP6Incoming.size() > 0) {
-    // Add O_NONBLOCK flag to the listener sockets.
-    markSocketBlocking(PROTECTED_RESTORE_IP6_SOCK_FD);
-    checkForPendingIncoming(PROTECTED_RESTORE_IP6_SOCK_FD,
-                            &_pendingIP6Incoming);
-    _real_close(PROTECTED_RESTORE_IP6_SOCK_FD);
+    watchFd(PROTECTED_RESTORE_IP6_SOCK_FD, EPOLLIN);
   }
   if (_pendingUDSIncoming.size() > 0) {
-    // Add O_NONBLOCK flag to the listener sockets.
-    markSocketBlocking(PROTECTED_RESTORE_UDS_SOCK_FD);
-    checkForPendingIncoming(PROTECTED_RESTORE_UDS_SOCK_FD,
-                            &_pendingUDSIncoming);
-    _real_close(PROTECTED_RESTORE_UDS_SOCK_FD);
+    watchFd(PROTECTED_RESTORE_UDS_SOCK_FD, EPOLLIN);
   }
-  JTRACE("Closed restore sockets");
+
+  iterator i;
+  for (i = _pendingOutgoing.begin(); i != _pendingOutgoing.end(); i++) {
+    PendingConnect pending;
+    pending.id = i->first;
+    pending.fd = i->second->getFds()[0];
+    pending.flags = _real_fcntl(pending.fd, F_GETFL, NULL);
+    JASSERT(pending.flags != -1) (pending.fd) (JASSERT_ERRNO);
+    JASSERT(_real_fcntl(pending.fd, F_SETFL,
+                        (void *)(long)(pending.flags | O_NONBLOCK)) != -1);
+    startConnect(pending);
+  }
+
+  const int maxEvents = 256;
+  struct epoll_event events[maxEvents];
+  while (_connecting.size() > 0 || _connectRetries.size() > 0 ||
+         _accepted.size() > 0 || _pendingIP4Incoming.size() > 0 ||
+         _pendingIP6Incoming.size() > 0 || _pendingUDSIncoming.size() > 0) {
+    int timeout = _connectRetries.size() > 0 ? 10 : -1;
+    int nfds = _real_epoll_wait(_epollFd, events, maxEvents, timeout);
+    if (nfds == -1 && errno == EINTR) {
+      continue;
+    }
+    JASSERT(nfds != -1) (JASSERT_ERRNO);
+
+    for (int n = 0; n < nfds; n++) {
+      int fd = events[n].data.fd;
+      if (fd == PROTECTED_RESTORE_IP4_SOCK_FD) {
+        acceptIncoming(fd, &_pendingIP4Incoming);
+      } else if (fd == PROTECTED_RESTORE_IP6_SOCK_FD) {
+        acceptIncoming(fd, &_pendingIP6Incoming);
+      } else if (fd == PROTECTED_RESTORE_UDS_SOCK_FD) {
+        acceptIncoming(fd, &_pendingUDSIncoming);
+      } else if (_connecting.find(fd) != _connecting.end()) {
+        PendingConnect pending = _connecting[fd];
+        _connecting.erase(fd);
+        _real_epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, &events[n]);
+        finishConnect(pending);
+      } else if (_accepted.find(fd) != _accepted.end()) {
+        readIncomingId(fd);
+      }
+    }
+
+    vector<PendingConnect> retries;
+    retries.swap(_connectRetries);
+    for (size_t n = 0; n < retries.size(); n++) {
+      startConnect(retries[n]);
+    }
+  }
+
+  _real_close(_epollFd);
+  _epollFd = -1;
+  _pendingOutgoing.clear();
+  _remoteInfo.clear();
 }
 
 void
@@ -170,7 +270,8 @@ ConnectionRewirer::openRestoreSocket(bool hasIPv4Sock,
 
   // Open IP4 Restore Socket
   if (hasIPv4Sock) {
-    jalib::JServerSocket restoreSocket(jalib::JSockAddr::ANY, 0);
+    jalib::JServerSocket restoreSocket(jalib::JSockAddr::ANY, 0,
+                                       RESTORE_LISTEN_BACKLOG);
     JASSERT(restoreSocket.isValid());
     restoreSocket.changeFd(PROTECTED_RESTORE_IP4_SOCK_FD);
 
@@ -200,7 +301,8 @@ ConnectionRewirer::openRestoreSocket(bool hasIPv4Sock,
     JASSERT(getsockname(ip6fd, (struct sockaddr *)&_ip6RestoreAddr,
                         &_ip6RestoreAddrlen) == 0)
       (JASSERT_ERRNO);
-    JASSERT(_real_listen(ip6fd, 32) == 0) (JASSERT_ERRNO);
+    JASSERT(_real_listen(ip6fd, RESTORE_LISTEN_BACKLOG) == 0)
+      (JASSERT_ERRNO);
     Util::changeFd(ip6fd, PROTECTED_RESTORE_IP6_SOCK_FD);
 
     JTRACE("opened ip6 listen socket") (PROTECTED_RESTORE_IP6_SOCK_FD);
@@ -221,7 +323,8 @@ ConnectionRewirer::openRestoreSocket(bool hasIPv4Sock,
     JASSERT(_real_bind(udsfd, (struct sockaddr *)&_udsRestoreAddr,
                        _udsRestoreAddrlen) == 0)
       (JASSERT_ERRNO);
-    JASSERT(_real_listen(udsfd, 32) == 0) (JASSERT_ERRNO);
+    JASSERT(_real_listen(udsfd, RESTORE_LISTEN_BACKLOG) == 0)
+      (JASSERT_ERRNO);
     Util::changeFd(udsfd, PROTECTED_RESTORE_UDS_SOCK_FD);
 
     JTRACE("opened UDS listen socket")
@@ -274,56 +377,70 @@ ConnectionRewirer::registerNSData()
                  &_pendingUDSIncoming);
 }
 
+// All of the connections of a restore socket are registered with a single
+// message; they share its address.
 void
 ConnectionRewirer::registerNSData(void *addr,
                                   socklen_t addrLen,
                                   ConnectionListT *conList)
 {
-  iterator i;
+  size_t numPairs = conList->size();
 
   JASSERT(theRewirer != NULL);
-  for (i = conList->begin(); i != conList->end(); ++i) {
-    const ConnectionIdentifier &id = i->first;
-    dmtcp_send_key_val_pair_to_coordinator("Socket",
-                                           (const void *)&id,
-                                           (uint32_t)sizeof(id),
-                                           addr,
-                                           (uint32_t)addrLen);
-
-    /*
-    sockaddr_in *sn = (sockaddr_in*) &_restoreAddr;
-    unsigned short port = htons(sn->sin_port);
-    char *ip = inet_ntoa(sn->sin_addr);
-    JTRACE("Send NS information:")(id)(sn->sin_family)(port)(ip);
-    */
+  if (numPairs == 0) {
+    return;
   }
 
-  // debugPrint();
+  vector<ConnectionIdentifier> ids;
+  vector<char> addrs(numPairs * addrLen);
+  ids.reserve(numPairs);
+  for (iterator i = conList->begin(); i != conList->end(); ++i) {
+    memcpy(&addrs[ids.size() * addrLen], addr, addrLen);
+    ids.push_back(i->first);
+  }
+
+  dmtcp_send_key_val_pairs_to_coordinator("Socket",
+                                          numPairs,
+                                          (const void *)&ids[0],
+                                          (uint32_t)sizeof(ids[0]),
+                                          (const void *)&addrs[0],
+                                          (uint32_t)addrLen);
 }
 
+// The addresses of all of the peers are fetched with a single round trip to
+// the coordinator.
 void
 ConnectionRewirer::sendQueries()
 {
-  iterator i;
+  size_t numKeys = _pendingOutgoing.size();
+
+  if (numKeys == 0) {
+    return;
+  }
 
+  vector<ConnectionIdentifier> ids;
+  ids.reserve(numKeys);
+  iterator i;
   for (i = _pendingOutgoing.begin(); i != _pendingOutgoing.end(); ++i) {
-    const ConnectionIdentifier &id = i->first;
+    ids.push_back(i->first);
+  }
+
+  vector<struct sockaddr_storage> addrs(numKeys);
+  vector<uint32_t> lens(numKeys);
+  dmtcp_send_queries_to_coordinator("Socket",
+                                    numKeys,
+                                    (const void *)&ids[0],
+                                    (uint32_t)sizeof(ConnectionIdentifier),
+                                    &addrs[0],
+                                    (uint32_t)sizeof(addrs[0]),
+                                    &lens[0]);
+
+  for (size_t n = 0; n < numKeys; n++) {
+    JASSERT(lens[n] != 0) (ids[n]).Text("peer address not found");
     struct RemoteAddr remote;
-    uint32_t len = sizeof(remote.addr);
-    JASSERT(dmtcp_send_query_to_coordinator("Socket",
-                                            (const void *)&id,
-                                            (uint32_t)sizeof(id),
-                                            &remote.addr,
-                                            &len) != 0);
-    remote.len = len;
-
-    /*
-    sockaddr_in *sn = (sockaddr_in*) &remote.addr;
-    unsigned short port = htons(sn->sin_port);
-    char *ip = inet_ntoa(sn->sin_addr);
-    JTRACE("Send Queries. Get remote from coordinator:")(id)(sn->sin_family)(port)(ip);
-    */
-    _remoteInfo[id] = remote;
+    memcpy(&remote.addr, &addrs[n], lens[n]);
+    remote.len = lens[n];
+    _remoteInfo[ids[n]] = remote;
   }
 }
 
@@ -43,6 +43,8 @@ class ConnectionRewirer
       Connection *con;
     };
 
+    ConnectionRewirer() : _epollFd(-1) {}
+
     static ConnectionRewirer &instance();
     static void destroy();
 
@@ -54,12 +56,22 @@ class ConnectionRewirer
     void registerNSData();
     void sendQueries();
     void doReconnect();
-    void checkForPendingIncoming(int restoreSockFd, ConnectionListT *conList);
 
     void debugPrint() const;
 
   private:
+    struct PendingConnect {
+      ConnectionIdentifier id;
+      int fd;
+      int flags;
+    };
+
     void registerNSData(void *addr, socklen_t len, ConnectionListT *conList);
+    void startConnect(const PendingConnect &pending);
+    void finishConnect(const PendingConnect &pending);
+    void acceptIncoming(int restoreSockFd, ConnectionListT *conList);
+    void readIncomingId(int fd);
+    void watchFd(int fd, uint32_t events);
 
     struct sockaddr_in _ip4RestoreAddr;
     socklen_t _ip4RestoreAddrlen;
@@ -79,6 +91,14 @@ class ConnectionRewirer
 
     ConnectionListT _pendingOutgoing;
     RemoteInfoT _remoteInfo;
+
+    // State of doReconnect(), keyed by fd: the connects in progress, the
+    // accepted connections whose id is yet to be read, and the connects that
+    // found the listen queue of a UNIX domain socket full.
+    int _epollFd;
+    map<int, PendingConnect>_connecting;
+    map<int, ConnectionListT *>_accepted;
+    vector<PendingConnect>_connectRetries;
 };
 }
 #endif // ifndef CONNECTIONREWIRER_H
@@ -20,15 +20,28 @@
  ****************************************************************************/
 
 #include "kernelbufferdrainer.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "../jalib/jalloc.h"
 #include "../jalib/jassert.h"
-#include "../jalib/jbuffer.h"
+#include "../jalib/jconvert.h"
 #include "connectionlist.h"
 #include "connectionmessage.h"
 #include "socketwrappers.h"
 #include "util.h"
+#include "../../../tracing.h"
 
 #define SOCKET_DRAIN_MAGIC_COOKIE_STR "[dmtcp{v0<DRAIN!"
 
+#define DRAIN_CHUNK_SIZE              (64 * 1024)
+#define DRAIN_IOV_COUNT               64
+
+// The number of sockets, the slowest to drain, in the trace of a checkpoint.
+#define DRAIN_TRACE_SOCKETS           32
+
 using namespace dmtcp;
 
 const char theMagicDrainCookie[] = SOCKET_DRAIN_MAGIC_COOKIE_STR;
@@ -52,6 +65,143 @@ scaleSendBuffers(int fd, double factor)
                            len) == 0);
 }
 
+DrainBuffer::DrainBuffer(const DrainBuffer &that)
+  : _size(0)
+{
+  *this = that;
+}
+
+DrainBuffer&
+DrainBuffer::operator=(const DrainBuffer &that)
+{
+  if (this == &that) {
+    return *this;
+  }
+  clear();
+  for (size_t pos = 0; pos < that._size; pos += DRAIN_CHUNK_SIZE) {
+    size_t len = std::min((size_t)DRAIN_CHUNK_SIZE, that._size - pos);
+    size_t avail;
+    char *buf = reserve(&avail);
+    memcpy(buf, that._chunks[pos / DRAIN_CHUNK_SIZE], len);
+    commit(len);
+  }
+  return *this;
+}
+
+void
+DrainBuffer::clear()
+{
+  for (size_t i = 0; i < _chunks.size(); i++) {
+    JALLOC_HELPER_FREE(_chunks[i]);
+  }
+  _chunks.clear();
+  _size = 0;
+}
+
+void
+DrainBuffer::swap(DrainBuffer &that)
+{
+  _chunks.swap(that._chunks);
+  std::swap(_size, that._size);
+}
+
+char *
+DrainBuffer::reserve(size_t *len)
+{
+  size_t idx = _size / DRAIN_CHUNK_SIZE;
+  size_t offset = _size % DRAIN_CHUNK_SIZE;
+
+  if (idx == _chunks.size()) {
+    _chunks.push_back((char *)JALLOC_HELPER_MALLOC(DRAIN_CHUNK_SIZE));
+  }
+  *len = DRAIN_CHUNK_SIZE - offset;
+  return _chunks[idx] + offset;
+}
+
+// The data may end in the middle of a chunk, and the tail being compared may
+// span two chunks.
+bool
+DrainBuffer::endsWith(const char *data, size_t len) const
+{
+  if (len > _size) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    size_t pos = _size - len + i;
+    if (_chunks[pos / DRAIN_CHUNK_SIZE][pos % DRAIN_CHUNK_SIZE] != data[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+DrainBuffer::truncate(size_t len)
+{
+  JASSERT(len <= _size) (len) (_size);
+  _size = len;
+  while (_chunks.size() > (len + DRAIN_CHUNK_SIZE - 1) / DRAIN_CHUNK_SIZE) {
+    JALLOC_HELPER_FREE(_chunks.back());
+    _chunks.pop_back();
+  }
+}
+
+bool
+DrainBuffer::readAll(int fd, size_t len)
+{
+  while (len > 0) {
+    size_t avail;
+    char *buf = reserve(&avail);
+    ssize_t ret = recv(fd, buf, std::min(avail, len), 0);
+    if (ret > 0) {
+      commit(ret);
+      len -= ret;
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // The fd has the O_NONBLOCK flag of the application back; wait for the
+      // peer to send the rest.
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (_real_poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+ssize_t
+DrainBuffer::writeAll(int fd) const
+{
+  size_t written = 0;
+
+  while (written < _size) {
+    struct iovec iov[DRAIN_IOV_COUNT];
+    int n = 0;
+    for (size_t pos = written; pos < _size && n < DRAIN_IOV_COUNT; n++) {
+      size_t offset = pos % DRAIN_CHUNK_SIZE;
+      size_t len = std::min(DRAIN_CHUNK_SIZE - offset, _size - pos);
+      iov[n].iov_base = _chunks[pos / DRAIN_CHUNK_SIZE] + offset;
+      iov[n].iov_len = len;
+      pos += len;
+    }
+
+    ssize_t ret = writev(fd, iov, n);
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    } else if (ret == 0) {
+      break;
+    }
+    written += ret;
+  }
+  return written;
+}
+
 static KernelBufferDrainer *theDrainer = NULL;
 KernelBufferDrainer&
 KernelBufferDrainer::instance()
@@ -63,125 +213,289 @@ KernelBufferDrainer::instance()
 }
 
 void
-KernelBufferDrainer::onConnect(const jalib::JSocket &sock,
-                               const struct sockaddr *remoteAddr,
-                               socklen_t remoteLen)
+KernelBufferDrainer::beginDrainOf(int fd, const ConnectionIdentifier &id)
 {
-  JWARNING(false) (sock.sockfd())
-  .Text("we don't yet support checkpointing non-accepted connections..."
-        " restore will likely fail.. closing connection");
-  jalib::JSocket(sock).close();
+  // JTRACE("will drain socket") (fd);
+  _drainedData[fd]; // create buffer
+
+  // insert it in reverse lookup
+  _reverseLookup[fd] = id;
+
+  DrainState &state = _drainStates[fd];
+  state.fd = fd;
+  state.isListenSocket = false;
+  state.drained = false;
+  state.cookieBytesWritten = 0;
+  _numPending++;
+
+  // The peer can start draining as soon as it sees our cookie.  If the
+  // kernel buffer is full, the rest is written from drainAllSockets().
+  writeCookie(&state);
 }
 
 void
-KernelBufferDrainer::onData(jalib::JReaderInterface *sock)
+KernelBufferDrainer::addListenSocket(int fd)
 {
-  vector<char> &buffer = _drainedData[sock->socket().sockfd()];
-  buffer.resize(buffer.size() + sock->bytesRead());
-  int startIdx = buffer.size() - sock->bytesRead();
-  memcpy(&buffer[startIdx], sock->buffer(), sock->bytesRead());
+  DrainState &state = _drainStates[fd];
 
-  // JTRACE("got buffer chunk") (sock->bytesRead());
-  sock->reset();
+  state.fd = fd;
+  state.isListenSocket = true;
+  state.drained = true;
+  state.cookieBytesWritten = sizeof(theMagicDrainCookie);
 }
 
-void
-KernelBufferDrainer::onDisconnect(jalib::JReaderInterface *sock)
+static double
+elapsedSince(const struct timespec &start)
 {
-  int fd;
+  struct timespec now;
 
-  errno = 0;
-  fd = sock->socket().sockfd();
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
 
-  // check if this was on purpose
-  if (fd < 0) {
-    return;
+void
+KernelBufferDrainer::writeCookie(DrainState *state)
+{
+  while (state->cookieBytesWritten < sizeof(theMagicDrainCookie)) {
+    ssize_t ret = send(state->fd,
+                       theMagicDrainCookie + state->cookieBytesWritten,
+                       sizeof(theMagicDrainCookie) - state->cookieBytesWritten,
+                       MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret > 0) {
+      state->cookieBytesWritten += ret;
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else {
+      if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        // The peer is gone; the read side will find out.
+        JTRACE("failed to write drain cookie") (state->fd) (JASSERT_ERRNO);
+        state->cookieBytesWritten = sizeof(theMagicDrainCookie);
+      }
+      break;
+    }
+  }
+}
+
+// Reads whatever is available, and checks the end of the buffer for the
+// cookie of the peer.  Nothing follows the cookie, since the peer is
+// suspended.
+void
+KernelBufferDrainer::readData(DrainState *state)
+{
+  const size_t cookieLen = sizeof(theMagicDrainCookie);
+  DrainBuffer &buffer = _drainedData[state->fd];
+
+  while (true) {
+    size_t avail;
+    char *buf = buffer.reserve(&avail);
+    ssize_t ret = recv(state->fd, buf, avail, MSG_DONTWAIT);
+
+    if (ret > 0) {
+      buffer.commit(ret);
+      if (buffer.endsWith(theMagicDrainCookie, cookieLen)) {
+        buffer.truncate(buffer.size() - cookieLen);
+        JTRACE("buffer drain complete") (state->fd) (buffer.size());
+        finishDrainOf(state);
+        return;
+      }
+    } else if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      int fd = state->fd;
+      JTRACE("found disconnected socket... marking it dead")
+        (fd) (_reverseLookup[fd]) (JASSERT_ERRNO);
+      _disconnectedSockets[_reverseLookup[fd]].swap(buffer);
+
+      // _drainedData is used to refill socket buffers. Remove the
+      // disconnected socket from this list. Disconnected sockets are
+      // refilled when they are recreated by _makeDeadSocket().
+      _drainedData.erase(fd);
+      state->cookieBytesWritten = cookieLen;
+      finishDrainOf(state);
+
+      // reading from the socket, and taking the error, results in an
+      // implicit close().
+      _real_close(fd);
+      return;
+    }
   }
-  JTRACE("found disconnected socket... marking it dead")
-    (fd) (_reverseLookup[fd]) (JASSERT_ERRNO);
-  _disconnectedSockets[_reverseLookup[fd]] = _drainedData[fd];
+}
 
-  // _drainedData is used to refill socket buffers. Remove the disconnected
-  // socket from this list. Disconnected sockets are refilled when they are
-  // recreated by _makeDeadSocket().
-  _drainedData.erase(fd);
+void
+KernelBufferDrainer::finishDrainOf(DrainState *state)
+{
+  state->drained = true;
+  _drainTimes[_reverseLookup[state->fd]] = elapsedSince(_startTime);
 }
 
 void
-KernelBufferDrainer::onTimeoutInterval()
+KernelBufferDrainer::acceptConnection(DrainState *state)
 {
-  int count = 0;
+  int fd = _real_accept(state->fd, NULL, NULL);
 
-  for (size_t i = 0; i < _dataSockets.size(); ++i) {
-    if (_dataSockets[i]->bytesRead() > 0) {
-      onData(_dataSockets[i]);
-    }
-    vector<char> &buffer = _drainedData[_dataSockets[i]->socket().sockfd()];
-    if (buffer.size() >= sizeof(theMagicDrainCookie)
-        && memcmp(&buffer[buffer.size() - sizeof(theMagicDrainCookie)],
-                  theMagicDrainCookie,
-                  sizeof(theMagicDrainCookie)) == 0) {
-      buffer.resize(buffer.size() - sizeof(theMagicDrainCookie));
-      JTRACE("buffer drain complete") (_dataSockets[i]->socket().sockfd())
-        (buffer.size()) ((_dataSockets.size()));
-      _dataSockets[i]->socket() = -1; // poison socket
-    } else {
-      ++count;
+  if (fd != -1) {
+    JWARNING(false) (fd)
+    .Text("we don't yet support checkpointing non-accepted connections..."
+          " restore will likely fail.. closing connection");
+    _real_close(fd);
+  }
+}
+
+void
+KernelBufferDrainer::updateEpoll(DrainState *state, int op)
+{
+  struct epoll_event ev;
+
+  ev.events = 0;
+  if (!state->drained || state->isListenSocket) {
+    ev.events |= EPOLLIN;
+  }
+  if (state->cookieBytesWritten < sizeof(theMagicDrainCookie)) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.ptr = state;
+
+  if (ev.events == 0) {
+    if (op == EPOLL_CTL_MOD) {
+      _real_epoll_ctl(_epollFd, EPOLL_CTL_DEL, state->fd, &ev);
     }
+    return;
   }
+  JASSERT(_real_epoll_ctl(_epollFd, op, state->fd, &ev) == 0)
+    (state->fd) (JASSERT_ERRNO);
+}
+
+void
+KernelBufferDrainer::warnStillDraining(double elapsed)
+{
+  map<int, DrainState>::iterator it;
 
-  if (count == 0) {
-    _listenSockets.clear();
-  } else {
-    const static int WARN_INTERVAL_TICKS =
-      (int)(DRAINER_WARNING_FREQ / DRAINER_CHECK_FREQ + 0.5);
-    const static float WARN_INTERVAL_SEC =
-      WARN_INTERVAL_TICKS * DRAINER_CHECK_FREQ;
-    if (_timeoutCount++ > WARN_INTERVAL_TICKS) {
-      _timeoutCount = 0;
-      for (size_t i = 0; i < _dataSockets.size(); ++i) {
-        vector<char> &buffer = _drainedData[_dataSockets[i]->socket().sockfd()];
-        JWARNING(false) (_dataSockets[i]->socket().sockfd())
-          (buffer.size()) (WARN_INTERVAL_SEC)
-        .Text("Still draining socket... "
-              "perhaps remote host is not running under DMTCP?");
+  for (it = _drainStates.begin(); it != _drainStates.end(); it++) {
+    DrainState &state = it->second;
+    if (state.isListenSocket || state.drained) {
+      continue;
+    }
+    DrainBuffer &buffer = _drainedData[state.fd];
+    JWARNING(false) (state.fd) (buffer.size()) (elapsed)
+    .Text("Still draining socket... "
+          "perhaps remote host is not running under DMTCP?");
 #ifdef CERN_CMS
-        JNOTE("\n*** Closing this socket (to database?).  Please use dmtcp \n"
-              "***  plugins to gracefully handle such sockets, and re-run.\n"
-              "***  Trying a workaround for now, and hoping it doesn't fail.\n"
-             );
-        _real_close(_dataSockets[i]->socket().sockfd());
-
-        // it does it by creating a socket pair and closing one side
-        int sp[2] = { -1, -1 };
-        JASSERT(_real_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0)
-          (JASSERT_ERRNO).Text("socketpair() failed");
-        JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
-        .Text("socketpair() failed");
-        _real_close(sp[1]);
-        JTRACE("created dead socket") (sp[0]);
-        _real_dup2(sp[0], _dataSockets[i]->socket().sockfd());
+    JNOTE("\n*** Closing this socket (to database?).  Please use dmtcp \n"
+          "***  plugins to gracefully handle such sockets, and re-run.\n"
+          "***  Trying a workaround for now, and hoping it doesn't fail.\n"
+         );
+    _real_close(state.fd);
+
+    // it does it by creating a socket pair and closing one side
+    int sp[2] = { -1, -1 };
+    JASSERT(_real_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0)
+      (JASSERT_ERRNO).Text("socketpair() failed");
+    JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
+    .Text("socketpair() failed");
+    _real_close(sp[1]);
+    JTRACE("created dead socket") (sp[0]);
+    _real_dup2(sp[0], state.fd);
 #endif // ifdef CERN_CMS
+  }
+}
+
+void
+KernelBufferDrainer::drainAllSockets()
+{
+  const int maxEvents = 1024;
+  struct epoll_event events[maxEvents];
+
+  clock_gettime(CLOCK_MONOTONIC, &_startTime);
+  _traceStart = Tracing::now();
+  if (_numPending == 0) {
+    return;
+  }
+
+  _epollFd = _real_epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(_epollFd != -1) (JASSERT_ERRNO);
+
+  map<int, DrainState>::iterator it;
+  for (it = _drainStates.begin(); it != _drainStates.end(); it++) {
+    updateEpoll(&it->second, EPOLL_CTL_ADD);
+  }
+
+  double nextWarning = DRAINER_WARNING_FREQ;
+  while (_numPending > 0) {
+    double elapsed = elapsedSince(_startTime);
+    if (elapsed >= nextWarning) {
+      warnStillDraining(elapsed);
+      nextWarning = elapsed + DRAINER_WARNING_FREQ;
+    }
+
+    int timeout = (int)((nextWarning - elapsed) * 1000) + 1;
+    int nfds = _real_epoll_wait(_epollFd, events, maxEvents, timeout);
+    if (nfds == -1 && errno == EINTR) {
+      continue;
+    }
+    JASSERT(nfds != -1) (JASSERT_ERRNO);
+
+    for (int n = 0; n < nfds; n++) {
+      DrainState *state = (DrainState *)events[n].data.ptr;
+      if (state->isListenSocket) {
+        acceptConnection(state);
+        continue;
+      }
+
+      bool wasComplete = state->drained &&
+        state->cookieBytesWritten == sizeof(theMagicDrainCookie);
+      if (wasComplete) {
+        continue;
+      }
+      if (events[n].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        writeCookie(state);
+      }
+      if (!state->drained &&
+          (events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        readData(state);
+      }
+
+      if (state->drained &&
+          state->cookieBytesWritten == sizeof(theMagicDrainCookie)) {
+        _numPending--;
+      }
+
+      // A socket closed after a disconnect is gone from the epoll set.
+      if (_drainedData.find(state->fd) != _drainedData.end()) {
+        updateEpoll(state, EPOLL_CTL_MOD);
       }
     }
   }
+
+  _real_close(_epollFd);
+  _epollFd = -1;
+
+  traceDrainTimes();
 }
 
+// Only the slowest sockets are recorded, so that a process with many of them
+// does not fill the trace before the image is even written.
 void
-KernelBufferDrainer::beginDrainOf(int fd, const ConnectionIdentifier &id)
+KernelBufferDrainer::traceDrainTimes()
 {
-  // JTRACE("will drain socket") (fd);
-  _drainedData[fd]; // create buffer
-  // this is the simple way:  jalib::JSocket(fd) << theMagicDrainCookie;
-  // instead used delayed write in case kernel buffer is full:
-  addWrite(new jalib::JChunkWriter(fd, theMagicDrainCookie,
-                                   sizeof theMagicDrainCookie));
+  vector<std::pair<double, ConnectionIdentifier> > times;
+  map<ConnectionIdentifier, double>::iterator t;
 
-  // now setup a reader:
-  addDataSocket(new jalib::JChunkReader(fd, 512));
-
-  // insert it in reverse lookup
-  _reverseLookup[fd] = id;
+  for (t = _drainTimes.begin(); t != _drainTimes.end(); t++) {
+    times.push_back(std::make_pair(t->second, t->first));
+  }
+  std::sort(times.begin(), times.end());
+
+  size_t numTraced = std::min(times.size(), (size_t)DRAIN_TRACE_SOCKETS);
+  for (size_t i = times.size() - numTraced; i < times.size(); i++) {
+    Tracing::recordDuration("drain",
+                            "socket " + jalib::XToString(times[i].second),
+                            _traceStart,
+                            (uint64_t)(times[i].first * 1e6));
+  }
+  JTRACE("all sockets drained") (times.size())
+    (times.empty() ? 0 : times.back().first);
 }
 
 void
@@ -190,13 +504,9 @@ KernelBufferDrainer::refillAllSockets()
   JTRACE("refilling socket buffers") (_drainedData.size());
 
   // write all buffers out
-  map<int, vector<char> >::iterator i;
+  map<int, DrainBuffer>::iterator i;
   for (i = _drainedData.begin(); i != _drainedData.end(); ++i) {
-    int size = i->second.size();
-    JWARNING(size >= 0) (size).Text("a failed drain is in our table???");
-    if (size < 0) {
-      size = 0;
-    }
+    size_t size = i->second.size();
 
     // Double the send buffer
     scaleSendBuffers(i->first, 2);
@@ -208,7 +518,8 @@ KernelBufferDrainer::refillAllSockets()
     }
     sock << msg;
     if (size > 0) {
-      sock.writeAll(&i->second[0], size);
+      JASSERT(i->second.writeAll(i->first) == (ssize_t)size)
+        (i->first) (size) (JASSERT_ERRNO);
     }
     i->second.clear();
   }
@@ -226,10 +537,12 @@ KernelBufferDrainer::refillAllSockets()
     int size = msg.extraBytes;
     JTRACE("repeating buffer back to peer") (size);
     if (size > 0) {
-      // echo it back...
-      jalib::JBuffer tmp(size);
-      sock.readAll(tmp, size);
-      sock.writeAll(tmp, size);
+      // echo it back... The whole buffer is read first, since the peer may
+      // still be writing it.
+      DrainBuffer &tmp = i->second;
+      JASSERT(tmp.readAll(i->first, size)) (i->first) (size) (JASSERT_ERRNO);
+      JASSERT(tmp.writeAll(i->first) == size) (i->first) (size) (JASSERT_ERRNO);
+      tmp.clear();
     }
 
     // Reset the send buffer
@@ -243,7 +556,7 @@ KernelBufferDrainer::refillAllSockets()
   theDrainer = NULL;
 }
 
-const vector<char>&
+const DrainBuffer&
 KernelBufferDrainer::getDrainedData(ConnectionIdentifier id)
 {
   JASSERT(_disconnectedSockets.find(id) != _disconnectedSockets.end()) (id);
@@ -23,6 +23,7 @@
 #ifndef KERNELBUFFERDRAINER_H
 # define KERNELBUFFERDRAINER_H
 
+# include <time.h>
 # include <map>
 # include <vector>
 
@@ -32,36 +33,99 @@
 
 namespace dmtcp
 {
-class KernelBufferDrainer : public jalib::JMultiSocketProgram
+/* The data drained from one socket.  It is kept in a list of fixed-size
+ * chunks that recv() writes into directly: the buffer grows without copying
+ * what was already read, and it is written back with writev().  The chunks
+ * are ordinary memory, so that the data is part of the checkpoint image.
+ */
+class DrainBuffer
 {
   public:
-    KernelBufferDrainer() : _timeoutCount(0) {}
+    DrainBuffer() : _size(0) {}
+    DrainBuffer(const DrainBuffer &that);
+    ~DrainBuffer() { clear(); }
+    DrainBuffer &operator=(const DrainBuffer &that);
+
+    size_t size() const { return _size; }
+    void clear();
+    void swap(DrainBuffer &that);
+
+    // Free space at the end of the buffer, at least one byte; commit()
+    // appends the first len bytes of it to the data.
+    char *reserve(size_t *len);
+    void commit(size_t len) { _size += len; }
+
+    bool endsWith(const char *data, size_t len) const;
+    void truncate(size_t len);
+
+    // Reads len bytes from fd, waiting for them even if it is nonblocking;
+    // returns false at EOF.
+    bool readAll(int fd, size_t len);
+
+    // Writes all of the data to fd; returns the number of bytes written.
+    ssize_t writeAll(int fd) const;
+
+  private:
+    vector<char *>_chunks;
+    size_t _size;
+};
+
+/* Drains the kernel buffers of the TCP sockets before a checkpoint.  A cookie
+ * is written to every socket; once the cookie of the peer has been read from
+ * a socket, everything the peer sent before the checkpoint is in our buffer.
+ * The sockets are watched with epoll and the cookie is looked for as the data
+ * arrives, so that the drain is over as soon as the last socket completes.
+ */
+class KernelBufferDrainer
+{
+  public:
+    KernelBufferDrainer() : _epollFd(-1), _numPending(0) {}
 
     static KernelBufferDrainer &instance();
 
-    // void drainAllSockets();
     void beginDrainOf(int fd, const ConnectionIdentifier &id);
+    void addListenSocket(int fd);
+
+    // Blocks until all of the sockets are drained.
+    void drainAllSockets();
     void refillAllSockets();
-    virtual void onData(jalib::JReaderInterface *sock);
-    virtual void onConnect(const jalib::JSocket &sock,
-                           const struct sockaddr *remoteAddr,
-                           socklen_t remoteLen);
-    virtual void onTimeoutInterval();
-    virtual void onDisconnect(jalib::JReaderInterface *sock);
 
     const map<ConnectionIdentifier,
-              vector<char> > &getDisconnectedSockets() const
+              DrainBuffer> &getDisconnectedSockets() const
     {
       return _disconnectedSockets;
     }
 
-    const vector<char> &getDrainedData(ConnectionIdentifier id);
+    const DrainBuffer &getDrainedData(ConnectionIdentifier id);
 
   private:
-    map<int, vector<char> >_drainedData;
+    struct DrainState {
+      int fd;
+      bool isListenSocket;
+      bool drained;
+      size_t cookieBytesWritten;
+    };
+
+    void writeCookie(DrainState *state);
+    void readData(DrainState *state);
+    void acceptConnection(DrainState *state);
+    void updateEpoll(DrainState *state, int op);
+    void finishDrainOf(DrainState *state);
+    void warnStillDraining(double elapsed);
+    void traceDrainTimes();
+
+    map<int, DrainBuffer>_drainedData;
     map<int, ConnectionIdentifier>_reverseLookup;
-    map<ConnectionIdentifier, vector<char> >_disconnectedSockets;
-    int _timeoutCount;
+    map<ConnectionIdentifier, DrainBuffer>_disconnectedSockets;
+
+    // Seconds from the start of drainAllSockets() until the socket was
+    // drained (or found disconnected).
+    map<ConnectionIdentifier, double>_drainTimes;
+    map<int, DrainState>_drainStates;
+    int _epollFd;
+    size_t _numPending;
+    struct timespec _startTime;
+    uint64_t _traceStart;
 };
 }
 #endif // ifndef KERNELBUFFERDRAINER_H
@@ -54,7 +54,7 @@ using namespace dmtcp;
 
 // this function creates a socket that is in an error state
 static int
-_makeDeadSocket(const char *refillData = NULL, ssize_t len = -1)
+_makeDeadSocket(const DrainBuffer *refillData = NULL)
 {
   // it does it by creating a socket pair and closing one side
   int sp[2] = { -1, -1 };
@@ -64,7 +64,8 @@ _makeDeadSocket(const char *refillData = NULL, ssize_t len = -1)
   JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
   .Text("socketpair() failed");
   if (refillData != NULL) {
-    JASSERT(Util::writeAll(sp[1], refillData, len) == len);
+    JASSERT(refillData->writeAll(sp[1]) == (ssize_t)refillData->size())
+      (JASSERT_ERRNO);
   }
   _real_close(sp[1]);
   if (really_verbose) {
@@ -499,9 +500,9 @@ TcpConnection::onError()
   JTRACE("Error.") (id());
   _type = TCP_ERROR;
   JTRACE("Creating dead socket.") (_fds[0]) (_fds.size());
-  const vector<char> &buffer =
+  const DrainBuffer &buffer =
     KernelBufferDrainer::instance().getDrainedData(_id);
-  Util::dupFds(_makeDeadSocket(&buffer[0], buffer.size()), _fds);
+  Util::dupFds(_makeDeadSocket(&buffer), _fds);
 }
 
 void
@@ -635,9 +636,9 @@ TcpConnection::postRestart()
 
     // Disconnected socket. Need to refill the drained data
   {
-    const vector<char> &buffer =
+    const DrainBuffer &buffer =
       KernelBufferDrainer::instance().getDrainedData(_id);
-    Util::dupFds(_makeDeadSocket(&buffer[0], buffer.size()), _fds);
+    Util::dupFds(_makeDeadSocket(&buffer), _fds);
     break;
   }
 
@@ -76,13 +76,13 @@ SocketConnList::drain()
   ConnectionList::drain();
 
   // this will block until draining is complete
-  KernelBufferDrainer::instance().monitorSockets(DRAINER_CHECK_FREQ);
+  KernelBufferDrainer::instance().drainAllSockets();
 
   // handle disconnected sockets
-  const map<ConnectionIdentifier, vector<char> > &discn =
+  const map<ConnectionIdentifier, DrainBuffer> &discn =
     KernelBufferDrainer::instance().getDisconnectedSockets();
 
-  map<ConnectionIdentifier, vector<char> >::const_iterator it;
+  map<ConnectionIdentifier, DrainBuffer>::const_iterator it;
   for (it = discn.begin(); it != discn.end(); it++) {
     const ConnectionIdentifier &id = it->first;
     TcpConnection *con =
@@ -19,11 +19,13 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <pthread.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/sem.h>
 #include <unistd.h>
+#include <algorithm>
 #include <fstream>
 #include <ios>
 #include <iostream>
@@ -35,6 +37,7 @@
 #include "jserialize.h"
 #include "config.h"
 #include "dmtcp.h"
+#include "dmtcp_dlsym.h"
 #include "shareddata.h"
 #include "util.h"
 
@@ -227,30 +230,115 @@ _do_unlock_tbl()
   JASSERT(_real_pthread_mutex_unlock(&tblLock) == 0) (JASSERT_ERRNO);
 }
 
+/* On restart, the contents of a segment come back as a private mapping at
+ * its old address, and are copied into the newly created segment.  The copy
+ * is split into chunks that a few threads work on in parallel.  Pages that
+ * are zero are skipped, since the new segment is zero-filled, and every
+ * chunk of the private copy is released as soon as it has been copied, so
+ * that the process never holds two full copies of a large segment.
+ */
+#define SHM_COPY_CHUNK_SIZE  (64 * 1024 * 1024)
+#define SHM_COPY_MAX_THREADS 8
+
+typedef int (*pthread_create_fnptr_t)(pthread_t *, const pthread_attr_t *,
+                                      void *(*)(void *), void *);
+typedef int (*pthread_join_fnptr_t)(pthread_t, void **);
+
+struct ShmCopy {
+  char *dest;
+  char *src;
+  size_t size;
+  size_t numChunks;
+  size_t volatile nextChunk;
+};
+
 static void
-huge_memcpy(char *dest, char *src, size_t size)
+copy_nonzero_pages(char *dest, char *src, size_t size)
 {
-  if (size < 100 * 1024 * 1024) {
-    memcpy(dest, src, size);
-    return;
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t numPages = size / page_size;
+  size_t i = 0;
+
+  while (i < numPages) {
+    if (Util::areZeroPages(src + i * page_size, 1)) {
+      i++;
+      continue;
+    }
+    size_t start = i++;
+    while (i < numPages && !Util::areZeroPages(src + i * page_size, 1)) {
+      i++;
+    }
+    memcpy(dest + start * page_size, src + start * page_size,
+           (i - start) * page_size);
   }
-  const size_t hundredMB = (100 * 1024 * 1024);
-
-  // const size_t oneGB = (1024 * 1024 * 1024);
-  size_t chunkSize = hundredMB;
-  static long page_size = sysconf(_SC_PAGESIZE);
-  static long pagesPerChunk = chunkSize / page_size;
-  size_t n = size / chunkSize;
-  for (size_t i = 0; i < n; i++) {
-    if (!Util::areZeroPages(src, pagesPerChunk)) {
-      memcpy(dest, src, chunkSize);
+  memcpy(dest + numPages * page_size, src + numPages * page_size,
+         size - numPages * page_size);
+}
+
+static void *
+shm_copy_thread(void *arg)
+{
+  ShmCopy *copy = (ShmCopy *)arg;
+
+  while (true) {
+    size_t idx = __sync_fetch_and_add(&copy->nextChunk, 1);
+    if (idx >= copy->numChunks) {
+      break;
+    }
+    size_t offset = idx * SHM_COPY_CHUNK_SIZE;
+    size_t len = std::min((size_t)SHM_COPY_CHUNK_SIZE, copy->size - offset);
+    copy_nonzero_pages(copy->dest + offset, copy->src + offset, len);
+    madvise(copy->src + offset, len, MADV_DONTNEED);
+  }
+  return NULL;
+}
+
+// The helper threads must not be seen by DMTCP, so they are created with the
+// pthread_create of libc rather than through our own wrapper.
+static void
+shm_copy(char *dest, char *src, size_t size)
+{
+  static pthread_create_fnptr_t create_fnptr = NULL;
+  static pthread_join_fnptr_t join_fnptr = NULL;
+  ShmCopy copy;
+
+  copy.dest = dest;
+  copy.src = src;
+  copy.size = size;
+  copy.numChunks = (size + SHM_COPY_CHUNK_SIZE - 1) / SHM_COPY_CHUNK_SIZE;
+  copy.nextChunk = 0;
+
+  long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t numThreads = std::min((size_t)std::max(numCpus, 1L),
+                               (size_t)SHM_COPY_MAX_THREADS);
+  numThreads = std::min(numThreads, copy.numChunks);
+
+  if (numThreads > 1 && create_fnptr == NULL) {
+    const char *libs[] = { "libpthread.so", "libc.so" };
+    for (size_t i = 0; i < 2 && create_fnptr == NULL; i++) {
+      create_fnptr =
+        (pthread_create_fnptr_t)dmtcp_dlsym_lib(libs[i], "pthread_create");
+      join_fnptr =
+        (pthread_join_fnptr_t)dmtcp_dlsym_lib(libs[i], "pthread_join");
     }
-    madvise(src, chunkSize, MADV_DONTNEED);
-    dest += chunkSize;
-    src += chunkSize;
-    size -= chunkSize;
   }
-  memcpy(dest, src, size);
+
+  pthread_t threads[SHM_COPY_MAX_THREADS];
+  size_t numStarted = 0;
+  if (create_fnptr != NULL && join_fnptr != NULL) {
+    for (; numStarted + 1 < numThreads; numStarted++) {
+      if (create_fnptr(&threads[numStarted], NULL,
+                       shm_copy_thread, &copy) != 0) {
+        break;
+      }
+    }
+  }
+
+  shm_copy_thread(&copy);
+  for (size_t i = 0; i < numStarted; i++) {
+    join_fnptr(threads[i], NULL);
+  }
+  JTRACE("Copied shared memory segment") (size) (numStarted + 1);
 }
 
 static SysVShm *sysvShmInst = NULL;
@@ -758,7 +846,7 @@ ShmSegment::postRestart()
   ShmaddrToFlagIter i = _shmaddrToFlag.begin();
   void *tmpaddr = _real_shmat(_realId, NULL, 0);
   JASSERT(tmpaddr != (void *)-1) (_realId)(JASSERT_ERRNO);
-  huge_memcpy((char *)tmpaddr, (char *)i->first, _size);
+  shm_copy((char *)tmpaddr, (char *)i->first, _size);
   JASSERT(_real_shmdt(tmpaddr) == 0);
   munmap((void *)i->first, _size);
 
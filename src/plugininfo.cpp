@@ -27,6 +27,7 @@
 #include "coordinatorapi.h"
 #include "dmtcp.h"
 #include "shareddata.h"
+#include "tracing.h"
 
 namespace dmtcp
 {
@@ -116,6 +117,7 @@ PluginInfo::processBarrier(BarrierInfo *barrier)
 {
   JTIMER_NOPRINT(barrier);
 
+  uint64_t start = Tracing::now();
   JTIMER_START(barrier);
   if (dmtcp_no_coordinator()) {
     // Do nothing.
@@ -131,12 +133,16 @@ PluginInfo::processBarrier(BarrierInfo *barrier)
 
   JTIMER_STOP(barrier);
   JTIMER_GETDELTA(barrier->execTime, barrier);
+  Tracing::record(barrier->isGlobal() ? "barrier" : "local-barrier",
+                  barrier->toString(), start);
 
+  start = Tracing::now();
   JTIMER_START(barrier);
 
   barrier->callback();
 
   JTIMER_STOP(barrier);
   JTIMER_GETDELTA(barrier->cbExecTime, barrier);
+  Tracing::record("callback", barrier->toString(), start);
 }
 }
@@ -29,7 +29,11 @@
 #define MB                 1024 * 1024
 #define RESTORE_STACK_SIZE 5 * MB
 #define RESTORE_MEM_SIZE   5 * MB
-#define RESTORE_TOTAL_SIZE (RESTORE_STACK_SIZE + RESTORE_MEM_SIZE)
+
+// The read-ahead buffers of mtcp_restart; see start_image_reader() there.
+#define RESTORE_READER_SIZE 49 * MB
+#define RESTORE_TOTAL_SIZE \
+  (RESTORE_STACK_SIZE + RESTORE_MEM_SIZE + RESTORE_READER_SIZE)
 
 namespace dmtcp
 {
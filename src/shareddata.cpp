@@ -468,132 +468,300 @@ SharedData::getDlsymOffset_m32(void)
   return sharedDataHeader->dlsymOffset_m32;
 }
 
+/*
+ * The pid, IPC-id and pty-name maps are read without taking the file lock.
+ * Writers still serialize on the lock, and bump the map's sequence count
+ * before and after each update (a seqlock); readers retry the lookup if the
+ * count was odd or has changed meanwhile.  Each map is a dense array of
+ * entries plus an open-addressed (linear probing) hash index over it.
+ */
+#define SEQ_SPIN_LIMIT 1000000
+
+static uint32_t
+seqReadBegin(volatile uint32_t *seq)
+{
+  uint32_t s;
+  size_t spins = 0;
+
+  while (((s = *seq) & 1) != 0) {
+    if (++spins < SEQ_SPIN_LIMIT) {
+      continue;
+    }
+
+    // Writers hold the file lock.  An odd count once we hold it means that
+    // a writer died in the middle of an update.
+    Util::lockFile(PROTECTED_SHM_FD);
+    if ((*seq & 1) != 0) {
+      JWARNING(false).Text("Recovering shared map from an aborted update.");
+      *seq = *seq + 1;
+    }
+    Util::unlockFile(PROTECTED_SHM_FD);
+    spins = 0;
+  }
+  __sync_synchronize();
+  return s;
+}
+
+static bool
+seqReadRetry(volatile uint32_t *seq, uint32_t s)
+{
+  __sync_synchronize();
+  return *seq != s;
+}
+
+static void
+seqWriteBegin(volatile uint32_t *seq)
+{
+  *seq = *seq + 1;
+  __sync_synchronize();
+}
+
+static void
+seqWriteEnd(volatile uint32_t *seq)
+{
+  __sync_synchronize();
+  *seq = *seq + 1;
+}
+
+static uint32_t
+hashId(int32_t id, uint32_t size)
+{
+  // Multiplicative hashing; 'size' is a power of two.
+  return ((uint32_t)id * 2654435761u) & (size - 1);
+}
+
+static uint32_t
+hashName(const char *name, uint32_t size)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return h & (size - 1);
+}
+
+// Returns the index slot holding the entry for 'virt', or else the empty slot
+// where it belongs.  Returns 'size' only if the index is full.
+template<typename T>
+static uint32_t
+findIdSlot(const volatile uint32_t *index,
+           uint32_t size,
+           const T *map,
+           int32_t virt)
+{
+  uint32_t i = hashId(virt, size);
+
+  for (uint32_t n = 0; n < size; n++, i = (i + 1) & (size - 1)) {
+    uint32_t idx = index[i];
+    if (idx == 0 || map[idx - 1].virt == virt) {
+      return i;
+    }
+  }
+  return size;
+}
+
+static uint32_t
+findPtraceSlot(pid_t tracerId)
+{
+  const uint32_t size = PTRACE_ID_MAP_HASH_SIZE;
+  const uint32_t *index = sharedDataHeader->ptraceIdMapIndex;
+  uint32_t i = hashId(tracerId, size);
+
+  for (uint32_t n = 0; n < size; n++, i = (i + 1) & (size - 1)) {
+    uint32_t idx = index[i];
+    if (idx == 0 ||
+        sharedDataHeader->ptraceIdMap[idx - 1].tracerId == tracerId) {
+      return i;
+    }
+  }
+  return size;
+}
+
+static uint32_t
+findPtyNameSlot(const volatile uint32_t *index, const char *name, bool virt)
+{
+  const uint32_t size = PTY_NAME_MAP_HASH_SIZE;
+  uint32_t i = hashName(name, size);
+
+  for (uint32_t n = 0; n < size; n++, i = (i + 1) & (size - 1)) {
+    uint32_t idx = index[i];
+    if (idx == 0) {
+      return i;
+    }
+    const SharedData::PtyNameMap &map = sharedDataHeader->ptyNameMap[idx - 1];
+    if (strcmp(virt ? map.virt : map.real, name) == 0) {
+      return i;
+    }
+  }
+  return size;
+}
+
 pid_t
 SharedData::getRealPid(pid_t virt)
 {
-  pid_t res = -1;
+  pid_t res;
+  uint32_t seq;
 
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  Util::lockFile(PROTECTED_SHM_FD);
-  for (size_t i = 0; i < sharedDataHeader->numPidMaps; i++) {
-    if (sharedDataHeader->pidMap[i].virt == virt) {
-      res = sharedDataHeader->pidMap[i].real;
+  const volatile uint32_t *index = sharedDataHeader->pidMapIndex;
+  do {
+    seq = seqReadBegin(&sharedDataHeader->pidMapSeq);
+    res = -1;
+    uint32_t i = findIdSlot(index, PID_MAP_HASH_SIZE,
+                            sharedDataHeader->pidMap, virt);
+    uint32_t idx = i < PID_MAP_HASH_SIZE ? index[i] : 0;
+    if (idx != 0) {
+      res = sharedDataHeader->pidMap[idx - 1].real;
     }
-  }
-  Util::unlockFile(PROTECTED_SHM_FD);
+  } while (seqReadRetry(&sharedDataHeader->pidMapSeq, seq));
   return res;
 }
 
 void
 SharedData::setPidMap(pid_t virt, pid_t real)
 {
-  size_t i;
-
   if (sharedDataHeader == NULL) {
     initialize();
   }
   Util::lockFile(PROTECTED_SHM_FD);
-  for (i = 0; i < sharedDataHeader->numPidMaps; i++) {
-    if (sharedDataHeader->pidMap[i].virt == virt) {
-      sharedDataHeader->pidMap[i].real = real;
-      break;
-    }
-  }
-  if (i == sharedDataHeader->numPidMaps) {
+  uint32_t *index = sharedDataHeader->pidMapIndex;
+  uint32_t i = findIdSlot(index, PID_MAP_HASH_SIZE,
+                          sharedDataHeader->pidMap, virt);
+  JASSERT(i < PID_MAP_HASH_SIZE);
+
+  seqWriteBegin(&sharedDataHeader->pidMapSeq);
+  if (index[i] != 0) {
+    sharedDataHeader->pidMap[index[i] - 1].real = real;
+  } else {
     JASSERT(sharedDataHeader->numPidMaps < MAX_PID_MAPS);
-    sharedDataHeader->pidMap[i].virt = virt;
-    sharedDataHeader->pidMap[i].real = real;
-    sharedDataHeader->numPidMaps++;
+    size_t n = sharedDataHeader->numPidMaps++;
+    sharedDataHeader->pidMap[n].virt = virt;
+    sharedDataHeader->pidMap[n].real = real;
+    __sync_synchronize();
+    index[i] = n + 1;
   }
+  seqWriteEnd(&sharedDataHeader->pidMapSeq);
   Util::unlockFile(PROTECTED_SHM_FD);
 }
 
-int32_t
-SharedData::getRealIPCId(int type, int32_t virt)
+static void
+getIPCIdMap(int type,
+            uint32_t **nmaps,
+            SharedData::IPCIdMap **map,
+            uint32_t **index)
 {
-  int32_t res = -1;
-  uint32_t nmaps = 0;
-  IPCIdMap *map = NULL;
-
-  if (sharedDataHeader == NULL) {
-    initialize();
-  }
-  Util::lockFile(PROTECTED_SHM_FD);
   switch (type) {
   case SYSV_SHM_ID:
-    nmaps = sharedDataHeader->numSysVShmIdMaps;
-    map = sharedDataHeader->sysvShmIdMap;
+    *nmaps = &sharedDataHeader->numSysVShmIdMaps;
+    *map = sharedDataHeader->sysvShmIdMap;
+    *index = sharedDataHeader->sysvShmIdMapIndex;
     break;
 
   case SYSV_SEM_ID:
-    nmaps = sharedDataHeader->numSysVSemIdMaps;
-    map = sharedDataHeader->sysvSemIdMap;
+    *nmaps = &sharedDataHeader->numSysVSemIdMaps;
+    *map = sharedDataHeader->sysvSemIdMap;
+    *index = sharedDataHeader->sysvSemIdMapIndex;
     break;
 
   case SYSV_MSQ_ID:
-    nmaps = sharedDataHeader->numSysVMsqIdMaps;
-    map = sharedDataHeader->sysvMsqIdMap;
+    *nmaps = &sharedDataHeader->numSysVMsqIdMaps;
+    *map = sharedDataHeader->sysvMsqIdMap;
+    *index = sharedDataHeader->sysvMsqIdMapIndex;
     break;
 
   default:
     JASSERT(false) (type).Text("Unknown IPC-Id type.");
     break;
   }
-  for (size_t i = 0; i < nmaps; i++) {
-    if (map[i].virt == virt) {
-      res = map[i].real;
-    }
+}
+
+int32_t
+SharedData::getRealIPCId(int type, int32_t virt)
+{
+  int32_t res;
+  uint32_t seq;
+  uint32_t *nmaps = NULL;
+  IPCIdMap *map = NULL;
+  uint32_t *index = NULL;
+
+  if (sharedDataHeader == NULL) {
+    initialize();
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
+  getIPCIdMap(type, &nmaps, &map, &index);
+  do {
+    seq = seqReadBegin(&sharedDataHeader->ipcIdMapSeq);
+    res = -1;
+    uint32_t i = findIdSlot(index, IPC_ID_MAP_HASH_SIZE, map, virt);
+    uint32_t idx = i < IPC_ID_MAP_HASH_SIZE ?
+      ((volatile uint32_t *)index)[i] : 0;
+    if (idx != 0) {
+      res = map[idx - 1].real;
+    }
+  } while (seqReadRetry(&sharedDataHeader->ipcIdMapSeq, seq));
   return res;
 }
 
 void
 SharedData::setIPCIdMap(int type, int32_t virt, int32_t real)
 {
-  size_t i;
   uint32_t *nmaps = NULL;
   IPCIdMap *map = NULL;
+  uint32_t *index = NULL;
 
   if (sharedDataHeader == NULL) {
     initialize();
   }
+  getIPCIdMap(type, &nmaps, &map, &index);
   Util::lockFile(PROTECTED_SHM_FD);
-  switch (type) {
-  case SYSV_SHM_ID:
-    nmaps = &sharedDataHeader->numSysVShmIdMaps;
-    map = sharedDataHeader->sysvShmIdMap;
-    break;
+  uint32_t i = findIdSlot(index, IPC_ID_MAP_HASH_SIZE, map, virt);
+  JASSERT(i < IPC_ID_MAP_HASH_SIZE);
 
-  case SYSV_SEM_ID:
-    nmaps = &sharedDataHeader->numSysVSemIdMaps;
-    map = sharedDataHeader->sysvSemIdMap;
-    break;
+  seqWriteBegin(&sharedDataHeader->ipcIdMapSeq);
+  if (index[i] != 0) {
+    map[index[i] - 1].real = real;
+  } else {
+    JASSERT(*nmaps < MAX_IPC_ID_MAPS);
+    size_t n = (*nmaps)++;
+    map[n].virt = virt;
+    map[n].real = real;
+    __sync_synchronize();
+    index[i] = n + 1;
+  }
+  seqWriteEnd(&sharedDataHeader->ipcIdMapSeq);
+  Util::unlockFile(PROTECTED_SHM_FD);
+}
 
-  case SYSV_MSQ_ID:
-    nmaps = &sharedDataHeader->numSysVMsqIdMaps;
-    map = sharedDataHeader->sysvMsqIdMap;
-    break;
+// Removes the entry at index slot 'slot'.  Called with the file lock held.
+static void
+removePtraceIdMap(uint32_t slot)
+{
+  const uint32_t mask = PTRACE_ID_MAP_HASH_SIZE - 1;
+  uint32_t *index = sharedDataHeader->ptraceIdMapIndex;
+  SharedData::PtraceIdMaps *map = sharedDataHeader->ptraceIdMap;
+  uint32_t idx = index[slot] - 1;
 
-  default:
-    JASSERT(false) (type).Text("Unknown IPC-Id type.");
-    break;
-  }
-  for (i = 0; i < *nmaps; i++) {
-    if (map[i].virt == virt) {
-      map[i].real = real;
-      break;
+  // Backward-shift deletion: move later entries of the probe sequence into
+  // the hole, unless that would put them before their home slot.
+  uint32_t i = slot;
+  for (uint32_t j = (i + 1) & mask; index[j] != 0; j = (j + 1) & mask) {
+    uint32_t k = hashId(map[index[j] - 1].tracerId, PTRACE_ID_MAP_HASH_SIZE);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      index[i] = index[j];
+      i = j;
     }
   }
-  if (i == *nmaps) {
-    JASSERT(*nmaps < MAX_IPC_ID_MAPS);
-    map[i].virt = virt;
-    map[i].real = real;
-    *nmaps += 1;
+  index[i] = 0;
+
+  // Keep the entries dense: move the last one into the freed entry.
+  uint32_t last = --sharedDataHeader->numPtraceIdMaps;
+  if (idx != last) {
+    map[idx] = map[last];
+    index[findPtraceSlot(map[idx].tracerId)] = idx + 1;
   }
-  Util::unlockFile(PROTECTED_SHM_FD);
 }
 
 pid_t
@@ -605,13 +773,12 @@ SharedData::getPtraceVirtualId(pid_t tracerId)
     initialize();
   }
   Util::lockFile(PROTECTED_SHM_FD);
-  for (size_t i = 0; i < sharedDataHeader->numPtraceIdMaps; i++) {
-    if (sharedDataHeader->ptraceIdMap[i].tracerId == tracerId) {
-      childId = sharedDataHeader->ptraceIdMap[i].childId;
-      sharedDataHeader->ptraceIdMap[i] =
-        sharedDataHeader->ptraceIdMap[sharedDataHeader->numPtraceIdMaps];
-      sharedDataHeader->numPtraceIdMaps--;
-    }
+  uint32_t i = findPtraceSlot(tracerId);
+  if (i < PTRACE_ID_MAP_HASH_SIZE &&
+      sharedDataHeader->ptraceIdMapIndex[i] != 0) {
+    uint32_t idx = sharedDataHeader->ptraceIdMapIndex[i] - 1;
+    childId = sharedDataHeader->ptraceIdMap[idx].childId;
+    removePtraceIdMap(i);
   }
   Util::unlockFile(PROTECTED_SHM_FD);
   return childId;
@@ -620,27 +787,53 @@ SharedData::getPtraceVirtualId(pid_t tracerId)
 void
 SharedData::setPtraceVirtualId(pid_t tracerId, pid_t childId)
 {
-  size_t i;
-
   if (sharedDataHeader == NULL) {
     initialize();
   }
   Util::lockFile(PROTECTED_SHM_FD);
-  for (i = 0; i < sharedDataHeader->numPtraceIdMaps; i++) {
-    if (sharedDataHeader->ptraceIdMap[i].tracerId == tracerId) {
-      break;
-    }
-  }
+  uint32_t i = findPtraceSlot(tracerId);
+  JASSERT(i < PTRACE_ID_MAP_HASH_SIZE);
 
-  if (i == sharedDataHeader->numPtraceIdMaps) {
+  uint32_t idx = sharedDataHeader->ptraceIdMapIndex[i];
+  if (idx == 0) {
     JASSERT(sharedDataHeader->numPtraceIdMaps < MAX_PTRACE_ID_MAPS);
-    sharedDataHeader->numPtraceIdMaps++;
+    idx = ++sharedDataHeader->numPtraceIdMaps;
+    sharedDataHeader->ptraceIdMapIndex[i] = idx;
   }
-  sharedDataHeader->ptraceIdMap[i].tracerId = tracerId;
-  sharedDataHeader->ptraceIdMap[i].childId = childId;
+  sharedDataHeader->ptraceIdMap[idx - 1].tracerId = tracerId;
+  sharedDataHeader->ptraceIdMap[idx - 1].childId = childId;
   Util::unlockFile(PROTECTED_SHM_FD);
 }
 
+// Called with the file lock held.  As before, a lookup finds the first
+// entry inserted for a name.
+static void
+insertPtyNameMapLocked(const char *virt, const char *real)
+{
+  JASSERT(sharedDataHeader->numPtyNameMaps < MAX_PTY_NAME_MAPS);
+  JASSERT(strlen(virt) < PTS_PATH_MAX);
+  JASSERT(strlen(real) < PTS_PATH_MAX);
+
+  uint32_t *virtIndex = sharedDataHeader->ptyVirtNameIndex;
+  uint32_t *realIndex = sharedDataHeader->ptyRealNameIndex;
+  uint32_t vi = findPtyNameSlot(virtIndex, virt, true);
+  uint32_t ri = findPtyNameSlot(realIndex, real, false);
+  JASSERT(vi < PTY_NAME_MAP_HASH_SIZE && ri < PTY_NAME_MAP_HASH_SIZE);
+
+  seqWriteBegin(&sharedDataHeader->ptyNameMapSeq);
+  size_t n = sharedDataHeader->numPtyNameMaps++;
+  strcpy(sharedDataHeader->ptyNameMap[n].real, real);
+  strcpy(sharedDataHeader->ptyNameMap[n].virt, virt);
+  __sync_synchronize();
+  if (virtIndex[vi] == 0) {
+    virtIndex[vi] = n + 1;
+  }
+  if (realIndex[ri] == 0) {
+    realIndex[ri] = n + 1;
+  }
+  seqWriteEnd(&sharedDataHeader->ptyNameMapSeq);
+}
+
 void
 SharedData::createVirtualPtyName(const char *real, char *out, uint32_t len)
 {
@@ -654,33 +847,42 @@ SharedData::createVirtualPtyName(const char *real, char *out, uint32_t len)
     jalib::XToString(sharedDataHeader->nextVirtualPtyId++);
 
   // FIXME: We should be removing ptys once they are gone.
-  JASSERT(sharedDataHeader->numPtyNameMaps < MAX_PTY_NAME_MAPS);
-  size_t n = sharedDataHeader->numPtyNameMaps++;
-  JASSERT(strlen(real) < PTS_PATH_MAX);
-  JASSERT(virt.length() < PTS_PATH_MAX);
-  strcpy(sharedDataHeader->ptyNameMap[n].real, real);
-  strcpy(sharedDataHeader->ptyNameMap[n].virt, virt.c_str());
+  insertPtyNameMapLocked(virt.c_str(), real);
   JASSERT(len > virt.length());
   strcpy(out, virt.c_str());
   Util::unlockFile(PROTECTED_SHM_FD);
 }
 
+// Entries are never modified once inserted, so 'out' is always a complete
+// name; a retry only catches an index slot that was being filled in.
+static void
+lookupPtyName(const char *name, bool virt, char *out, uint32_t len)
+{
+  uint32_t seq;
+  const volatile uint32_t *index = virt ? sharedDataHeader->ptyVirtNameIndex
+                                        : sharedDataHeader->ptyRealNameIndex;
+
+  do {
+    seq = seqReadBegin(&sharedDataHeader->ptyNameMapSeq);
+    *out = '\0';
+    uint32_t i = findPtyNameSlot(index, name, virt);
+    uint32_t idx = i < PTY_NAME_MAP_HASH_SIZE ? index[i] : 0;
+    if (idx != 0) {
+      const SharedData::PtyNameMap &map = sharedDataHeader->ptyNameMap[idx - 1];
+      const char *res = virt ? map.real : map.virt;
+      JASSERT(strlen(res) < len);
+      strcpy(out, res);
+    }
+  } while (seqReadRetry(&sharedDataHeader->ptyNameMapSeq, seq));
+}
+
 void
 SharedData::getRealPtyName(const char *virt, char *out, uint32_t len)
 {
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  *out = '\0';
-  Util::lockFile(PROTECTED_SHM_FD);
-  for (size_t i = 0; i < sharedDataHeader->numPtyNameMaps; i++) {
-    if (strcmp(virt, sharedDataHeader->ptyNameMap[i].virt) == 0) {
-      JASSERT(strlen(sharedDataHeader->ptyNameMap[i].real) < len);
-      strcpy(out, sharedDataHeader->ptyNameMap[i].real);
-      break;
-    }
-  }
-  Util::unlockFile(PROTECTED_SHM_FD);
+  lookupPtyName(virt, true, out, len);
 }
 
 void
@@ -689,16 +891,7 @@ SharedData::getVirtPtyName(const char *real, char *out, uint32_t len)
   if (sharedDataHeader == NULL) {
     initialize();
   }
-  *out = '\0';
-  Util::lockFile(PROTECTED_SHM_FD);
-  for (size_t i = 0; i < sharedDataHeader->numPtyNameMaps; i++) {
-    if (strcmp(real, sharedDataHeader->ptyNameMap[i].real) == 0) {
-      JASSERT(strlen(sharedDataHeader->ptyNameMap[i].virt) < len);
-      strcpy(out, sharedDataHeader->ptyNameMap[i].virt);
-      break;
-    }
-  }
-  Util::unlockFile(PROTECTED_SHM_FD);
+  lookupPtyName(real, false, out, len);
 }
 
 void
@@ -708,11 +901,7 @@ SharedData::insertPtyNameMap(const char *virt, const char *real)
     initialize();
   }
   Util::lockFile(PROTECTED_SHM_FD);
-  size_t n = sharedDataHeader->numPtyNameMaps++;
-  JASSERT(strlen(virt) < PTS_PATH_MAX);
-  JASSERT(strlen(real) < PTS_PATH_MAX);
-  strcpy(sharedDataHeader->ptyNameMap[n].real, real);
-  strcpy(sharedDataHeader->ptyNameMap[n].virt, virt);
+  insertPtyNameMapLocked(virt, real);
   Util::unlockFile(PROTECTED_SHM_FD);
 }
 
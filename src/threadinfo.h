@@ -3,6 +3,7 @@
 
 #include <linux/version.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
@@ -94,6 +95,17 @@ struct Thread {
    */
   double ckptReadTime;
 
+  /* When the ckpt thread signalled this thread to suspend at the last
+   * checkpoint, and how long the thread took to suspend, in microseconds.
+   */
+  uint64_t suspendSignalTime;
+  uint64_t suspendLatency;
+
+  /* Whether the ckpt thread is still counting this thread in the threads
+   * that have yet to suspend at the current checkpoint.
+   */
+  int suspendPending;
+
   Thread *next;
   Thread *prev;
 };
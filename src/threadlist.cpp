@@ -1,7 +1,10 @@
+#include <limits.h>
+#include <linux/futex.h>
 #include <linux/version.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
@@ -24,6 +27,7 @@
 #include "syscallwrappers.h"
 #include "threadlist.h"
 #include "threadsync.h"
+#include "tracing.h"
 #include "uniquepid.h"
 #include "util.h"
 
@@ -59,7 +63,14 @@ static Thread *threads_freelist = NULL;
 static pthread_mutex_t threadlistLock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t threadStateLock = PTHREAD_MUTEX_INITIALIZER;
 
-static pthread_rwlock_t threadResumeLock = PTHREAD_RWLOCK_INITIALIZER;
+/* Futex words for suspending and resuming the user threads at checkpoint.
+ * numPendingThreads is the number of signalled threads that have yet to
+ * suspend, less the ones that suspended before the ckpt thread counted
+ * them; the thread that brings it to zero wakes the ckpt thread.  The
+ * suspended threads wait for resumeRound to change.
+ */
+static volatile int numPendingThreads = 0;
+static volatile int resumeRound = 0;
 
 static __thread Thread *curThread = NULL;
 static Thread *ckptThread = NULL;
@@ -175,6 +186,8 @@ ThreadList::init()
   motherofall_tlsInfo = &motherofall->tlsInfo;
   updateTid(motherofall);
 
+  numPendingThreads = 0;
+
   sem_init(&sem_launch, 0, 0);
   sem_init(&semNotifyCkptThread, 0, 0);
   sem_init(&semWaitForCkptThreadSignal, 0, 0);
@@ -241,7 +254,11 @@ ThreadList::initThread(Thread *th, int (*fn)(
 void
 ThreadList::threadExit()
 {
+  // Under the state lock, so that suspendThreads() cannot signal this thread
+  // after reading ST_RUNNING but store ST_SIGNALED after this.
+  JASSERT(_real_pthread_mutex_lock(&threadStateLock) == 0);
   curThread->state = ST_ZOMBIE;
+  JASSERT(_real_pthread_mutex_unlock(&threadStateLock) == 0);
 }
 
 /*****************************************************************************
@@ -304,6 +321,8 @@ prepareMtcpHeader(MtcpHeader *mtcpHdr)
   mtcpHdr->tls_pid_offset = TLSInfo_GetPidOffset();
   mtcpHdr->tls_tid_offset = TLSInfo_GetTidOffset();
   mtcpHdr->myinfo_gs = myinfo_gs;
+  mtcpHdr->format_version = MTCP_FORMAT_VERSION;
+  mtcpHdr->index_offset = 0;  // Filled in by mtcp_writememoryareas()
 }
 
 /*************************************************************************
@@ -325,7 +344,10 @@ ThreadList::writeCkpt()
 
   MtcpHeader mtcpHdr;
   prepareMtcpHeader(&mtcpHdr);
+
+  uint64_t start = Tracing::now();
   CkptSerializer::writeCkptImage(&mtcpHdr, sizeof(mtcpHdr));
+  Tracing::record("ckpt", "write image", start);
 }
 
 /*************************************************************************
@@ -413,7 +435,9 @@ checkpointhread(void *dummy)
 
     restoreInProgress = false;
 
+    uint64_t start = Tracing::now();
     suspendThreads();
+    Tracing::record("ckpt", "suspend threads", start);
 
     JTRACE("Prepare plugin, etc. for checkpoint");
     DmtcpWorker::preCheckpoint();
@@ -426,97 +450,143 @@ checkpointhread(void *dummy)
     DmtcpWorker::postCheckpoint();
 
     resumeThreads();
+
+    DmtcpWorker::postCheckpointResume();
   }
 
   return NULL;
 }
 
+static long
+futex(volatile int *addr, int op, int val, const struct timespec *timeout)
+{
+  return _real_syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/* Halt all other threads - force them to call stopthisthread.  All of them
+ * are signalled in one pass over the list; then the ckpt thread sleeps until
+ * the last one to suspend wakes it.  A signalled thread that exits before
+ * handling the signal never suspends: it is left in ST_ZOMBIE, or is gone
+ * while still in ST_SIGNALED.  So every SUSPEND_RECHECK_NS, the threads that
+ * are still counted are checked for that, and are counted out once.
+ */
+#define SUSPEND_RECHECK_NS (10 * 1000 * 1000)
+
 static void
 suspendThreads()
 {
-  int needrescan;
+  const struct timespec recheck = { 0, SUSPEND_RECHECK_NS };
   Thread *thread;
   Thread *next;
+  int numSignaled = 0;
+  uint64_t start = Tracing::now();
 
-  JASSERT(pthread_rwlock_destroy(&threadResumeLock) == 0) (JASSERT_ERRNO);
-  JASSERT(pthread_rwlock_init(&threadResumeLock, NULL) == 0)
-    (JASSERT_ERRNO);
-  JASSERT(_real_pthread_rwlock_wrlock(&threadResumeLock) == 0) (JASSERT_ERRNO);
-
-  /* Halt all other threads - force them to call stopthisthread
-   * If any have blocked checkpointing, wait for them to unblock before
-   * signalling
-   */
   lock_threads();
-  do {
-    needrescan = 0;
-    numUserThreads = 0;
-    for (thread = activeThreads; thread != NULL; thread = next) {
-      next = thread->next;
-      int ret;
-
-      /* Do various things based on thread's state */
-      switch (thread->state) {
-      case ST_RUNNING:
-
-        /* Thread is running. Send it a signal so it will call stopthisthread.
-         * We will need to rescan (hopefully it will be suspended by then)
-         */
-        if (Thread_UpdateState(thread, ST_SIGNALED, ST_RUNNING)) {
-          if (THREAD_TGKILL(motherpid, thread->tid,
-                            SigInfo::ckptSignal()) < 0) {
-            JASSERT(errno == ESRCH) (JASSERT_ERRNO) (thread->tid)
-            .Text("error signalling thread");
-            ThreadList::threadIsDead(thread);
-          } else {
-            needrescan = 1;
-          }
-        }
-        break;
-
-      case ST_ZOMBIE:
-        ret = THREAD_TGKILL(motherpid, thread->tid, 0);
-        JASSERT(ret == 0 || errno == ESRCH);
-        if (ret == -1 && errno == ESRCH) {
-          ThreadList::threadIsDead(thread);
-        }
-        break;
+  numUserThreads = 0;
+  for (thread = activeThreads; thread != NULL; thread = next) {
+    next = thread->next;
+    int ret;
 
-      case ST_SIGNALED:
-        if (THREAD_TGKILL(motherpid, thread->tid, 0) == -1 && errno == ESRCH) {
-          ThreadList::threadIsDead(thread);
-        } else {
-          needrescan = 1;
-        }
-        break;
+    thread->suspendPending = 0;
 
-      case ST_SUSPINPROG:
-        numUserThreads++;
-        break;
+    /* Do various things based on thread's state */
+    switch (thread->state) {
+    case ST_RUNNING:
 
-      case ST_SUSPENDED:
-        numUserThreads++;
+      /* Thread is running. Send it a signal so it will call stopthisthread.
+       */
+      // If the state changed, the thread is exiting; it is not counted.
+      thread->suspendSignalTime = start;
+      if (!Thread_UpdateState(thread, ST_SIGNALED, ST_RUNNING)) {
         break;
-
-      case ST_CKPNTHREAD:
+      }
+      if (THREAD_TGKILL(motherpid, thread->tid, SigInfo::ckptSignal()) < 0) {
+        JASSERT(errno == ESRCH) (JASSERT_ERRNO) (thread->tid)
+        .Text("error signalling thread");
+        ThreadList::threadIsDead(thread);
         break;
-
-      default:
-        JASSERT(false);
       }
+      thread->suspendPending = 1;
+      numUserThreads++;
+      numSignaled++;
+      break;
+
+    case ST_ZOMBIE:
+      ret = THREAD_TGKILL(motherpid, thread->tid, 0);
+      JASSERT(ret == 0 || errno == ESRCH);
+      if (ret == -1 && errno == ESRCH) {
+        ThreadList::threadIsDead(thread);
+      }
+      break;
+
+    case ST_SIGNALED:
+    case ST_SUSPINPROG:
+    case ST_SUSPENDED:
+      // Signalled by a superior thread; it suspends all the same.
+      thread->suspendSignalTime = start;
+      thread->suspendPending = 1;
+      numUserThreads++;
+      numSignaled++;
+      break;
+
+    case ST_CKPNTHREAD:
+      break;
+
+    default:
+      JASSERT(false);
     }
-    if (needrescan) {
-      usleep(10);
-    }
-  } while (needrescan);
+  }
   unlk_threads();
 
-  for (int i = 0; i < numUserThreads; i++) {
-    sem_wait(&semNotifyCkptThread);
+  int pending = __sync_add_and_fetch(&numPendingThreads, numSignaled);
+  while (pending != 0) {
+    long ret = futex(&numPendingThreads, FUTEX_WAIT_PRIVATE, pending, &recheck);
+    if (ret == -1 && errno == ETIMEDOUT) {
+      lock_threads();
+      for (thread = activeThreads; thread != NULL; thread = next) {
+        next = thread->next;
+        if (!thread->suspendPending) {
+          continue;
+        }
+        int state = thread->state;
+        bool isDead = (state == ST_SIGNALED || state == ST_ZOMBIE) &&
+                      THREAD_TGKILL(motherpid, thread->tid, 0) == -1 &&
+                      errno == ESRCH;
+        if (isDead || (state != ST_SIGNALED && state != ST_SUSPINPROG &&
+                       state != ST_SUSPENDED)) {
+          thread->suspendPending = 0;
+          numUserThreads--;
+          __sync_sub_and_fetch(&numPendingThreads, 1);
+        }
+        if (isDead) {
+          ThreadList::threadIsDead(thread);
+        }
+      }
+      unlk_threads();
+    } else {
+      JASSERT(ret == 0 || errno == EAGAIN || errno == EINTR) (JASSERT_ERRNO);
+    }
+    pending = __atomic_load_n(&numPendingThreads, __ATOMIC_ACQUIRE);
+  }
+
+  uint64_t maxLatency = 0;
+  uint64_t totalLatency = 0;
+  for (thread = activeThreads; thread != NULL; thread = thread->next) {
+    if (thread->state == ST_SUSPENDED) {
+      if (thread->suspendLatency > maxLatency) {
+        maxLatency = thread->suspendLatency;
+      }
+      totalLatency += thread->suspendLatency;
+    }
+  }
+  if (numUserThreads > 0) {
+    Tracing::recordDuration("ckpt", "slowest thread suspend", start,
+                            maxLatency);
   }
 
   JASSERT(activeThreads != NULL);
-  JTRACE("everything suspended") (numUserThreads);
+  JTRACE("everything suspended") (numUserThreads) (maxLatency)
+    (numUserThreads > 0 ? totalLatency / numUserThreads : 0);
 }
 
 /* Resume all threads. */
@@ -524,7 +594,8 @@ static void
 resumeThreads()
 {
   JTRACE("resuming everything");
-  JASSERT(_real_pthread_rwlock_unlock(&threadResumeLock) == 0) (JASSERT_ERRNO);
+  __sync_add_and_fetch(&resumeRound, 1);
+  futex(&resumeRound, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
   JTRACE("everything resumed");
 }
 
@@ -587,9 +658,17 @@ stopthisthread(int signum)
        * Wait for ckpt thread to write ckpt, and resume.
        */
 
-      /* Tell the checkpoint thread that we're all saved away */
+      /* Tell the checkpoint thread that we're all saved away.  The resume
+       * round is read first, so that a resume cannot be missed.
+       */
+      int round = resumeRound;
+      uint64_t now = Tracing::now();
+      curThread->suspendLatency = now > curThread->suspendSignalTime ?
+                                  now - curThread->suspendSignalTime : 0;
       JASSERT(Thread_UpdateState(curThread, ST_SUSPENDED, ST_SUSPINPROG));
-      sem_post(&semNotifyCkptThread);
+      if (__sync_sub_and_fetch(&numPendingThreads, 1) == 0) {
+        futex(&numPendingThreads, FUTEX_WAKE_PRIVATE, 1, NULL);
+      }
 
       /* Then wait for the ckpt thread to write the ckpt file then wake us up */
       JTRACE("User thread suspended") (curThread->tid);
@@ -603,13 +682,12 @@ stopthisthread(int signum)
       // However, the sem_wait cleanup handler is now invalid and thus we get a
       // segfault.
       // The change in sem_wait behavior was first introduce in glibc 2.21.
-      JASSERT(_real_pthread_rwlock_rdlock(&threadResumeLock) == 0)
-        (JASSERT_ERRNO);
+      // A raw futex wait has no such handler.
+      while (resumeRound == round) {
+        futex(&resumeRound, FUTEX_WAIT_PRIVATE, round, NULL);
+      }
 
       JASSERT(Thread_UpdateState(curThread, ST_RUNNING, ST_SUSPENDED));
-
-      JASSERT(_real_pthread_rwlock_unlock(&threadResumeLock) == 0)
-        (JASSERT_ERRNO);
     } else {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 11)
       if (!Util::strStartsWith(curThread->procname, DMTCP_PRGNAME_PREFIX)) {
@@ -1075,3 +1153,70 @@ ThreadList::emptyFreeList()
 
   unlk_threads();
 }
+
+/*****************************************************************************
+ *
+ * Helper threads of the ckpt thread, e.g., to write the image in parallel.
+ *
+ * A helper thread is created by a bare clone(): libc has no struct pthread
+ * for it, no entry in its thread list and no cached stack, and ThreadList
+ * does not know it either.  Its stack is mapped here, after the ckpt thread
+ * has read /proc/self/maps, and unmapped by joinHelperThread().  So nothing
+ * of the thread is in the checkpoint image, and nothing is missing on
+ * restart.
+ *
+ * The thread shares the TLS of the ckpt thread.  So it must not call
+ * anything that uses TLS: malloc, JASSERT output other than a fatal error,
+ * stdio, the cancellable libc wrappers (use _real_syscall() instead).
+ * errno is shared too and cannot be relied upon.  All signals are blocked
+ * in the thread.
+ *
+ *****************************************************************************/
+bool
+ThreadList::startHelperThread(HelperThread *th, int (*fn)(void *), void *arg,
+                              size_t stackSize)
+{
+  const int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+                    CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID |
+                    CLONE_CHILD_CLEARTID;
+  sigset_t allSignals;
+  sigset_t oldMask;
+
+  th->stackSize = stackSize;
+  th->stack = _real_mmap(NULL, stackSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (th->stack == MAP_FAILED) {
+    th->stack = NULL;
+    return false;
+  }
+
+  // The new thread inherits the signal mask.
+  sigfillset(&allSignals);
+  _real_pthread_sigmask(SIG_SETMASK, &allSignals, &oldMask);
+  th->tid = 0;
+  pid_t tid = _real_clone(fn, (char *)th->stack + stackSize, flags, arg,
+                          (int *)&th->tid, NULL, (int *)&th->tid);
+  _real_pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+  if (tid == -1) {
+    _real_munmap(th->stack, stackSize);
+    th->stack = NULL;
+    return false;
+  }
+  return true;
+}
+
+/* The kernel clears th->tid and wakes it once the thread has exited
+ * (CLONE_CHILD_CLEARTID), i.e., when it no longer uses its stack.
+ */
+void
+ThreadList::joinHelperThread(HelperThread *th)
+{
+  pid_t tid;
+
+  while ((tid = __atomic_load_n(&th->tid, __ATOMIC_ACQUIRE)) != 0) {
+    futex(&th->tid, FUTEX_WAIT, tid, NULL);
+  }
+  _real_munmap(th->stack, th->stackSize);
+  th->stack = NULL;
+}
@@ -54,6 +54,18 @@ void waitForAllRestored(Thread *thisthread);
 void writeCkpt();
 void postRestart(double readTime = 0.0);
 void postRestartDebug(double readTime = 0.0);
+
+// A thread of the ckpt thread that libc and DMTCP know nothing about; see
+// startHelperThread() in threadlist.cpp.
+struct HelperThread {
+  void *stack;
+  size_t stackSize;
+  volatile pid_t tid;
+};
+
+bool startHelperThread(HelperThread *th, int (*fn)(void *), void *arg,
+                       size_t stackSize);
+void joinHelperThread(HelperThread *th);
 }
 }
 #endif // ifndef THREADLIST_H
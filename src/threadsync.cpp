@@ -19,8 +19,13 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -43,6 +48,8 @@ using namespace dmtcp;
  *     threads, it must acquire the write lock. It is blocked until all the
  *     existing read-locks by user threads have been released. NOTE that this
  *     is a WRITER-PREFERRED lock.
+ *   The fork() and exec() wrappers take the write lock too; see
+ *     wrapperExecutionLockLockExcl().
  *
  * There is a corner case too -- the newly created thread that has not been
  *   initialized yet; we need to take some extra efforts for that.
@@ -61,9 +68,34 @@ using namespace dmtcp;
  * should be extended to other calls as well.           -- KAPIL
  */
 
+/*
+ * Every wrapper takes the read lock of _wrapperExecutionLock, so it is not a
+ *   pthread rwlock, whose readers all update the same word, but a lock of its
+ *   own:
+ *   A reader increments the counter of the CPU that it runs on (each counter
+ *     is in a cache line of its own), and then checks that 'writer' is zero.
+ *     If not, it backs out, and sleeps on 'writer' until the writer is done.
+ *     It decrements the same counter on unlock.
+ *   A writer sets 'writer', after which no reader gets in, and then sleeps on
+ *     'drainSeq' until the counters sum to zero.  A reader that leaves while
+ *     'writer' is set bumps 'drainSeq' and wakes the writer.
+ *   'writer' is 0 if free, 1 if held, and 2 if held with threads sleeping on
+ *   it, as in Drepper's "Futexes Are Tricky".
+ */
+#define WRAPPER_LOCK_SLOTS 16
+#define WRAPPER_LOCK_ALIGN 64
+
+struct WrapperExecutionLock {
+  struct {
+    volatile int count;
+  } __attribute__((aligned(WRAPPER_LOCK_ALIGN))) readers[WRAPPER_LOCK_SLOTS];
+  volatile int writer __attribute__((aligned(WRAPPER_LOCK_ALIGN)));
+  volatile int drainSeq;
+};
+
+static WrapperExecutionLock _wrapperExecutionLock;
+
 // NOTE: PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP is not POSIX.
-static pthread_rwlock_t
-  _wrapperExecutionLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
 static pthread_rwlock_t
   _threadCreationLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
 static bool _wrapperExecutionLockAcquiredByCkptThread = false;
@@ -83,6 +115,8 @@ static bool _checkpointThreadInitialized = false;
 static pthread_mutex_t preResumeThreadCountLock = PTHREAD_MUTEX_INITIALIZER;
 
 static __thread int _wrapperExecutionLockLockCount = 0;
+static __thread int _wrapperExecutionLockSlot = -1;
+static __thread bool _wrapperExecutionLockHeldExcl = false;
 static __thread int _threadCreationLockLockCount = 0;
 #if TRACK_DLOPEN_DLSYM_FOR_LOCKS
 static __thread bool _threadPerformingDlopenDlsym = false;
@@ -106,6 +140,124 @@ dmtcp_libdlLockUnlock()
   ThreadSync::libdlLockUnlock();
 }
 
+static long
+futex(volatile int *addr, int op, int val)
+{
+  return _real_syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void
+wrapperLockLeave(int slot)
+{
+  __sync_sub_and_fetch(&_wrapperExecutionLock.readers[slot].count, 1);
+  if (_wrapperExecutionLock.writer != 0) {
+    __sync_add_and_fetch(&_wrapperExecutionLock.drainSeq, 1);
+    futex(&_wrapperExecutionLock.drainSeq, FUTEX_WAKE_PRIVATE, 1);
+  }
+}
+
+// Returns 0, EBUSY if a writer holds or waits for the lock, or EDEADLK if
+// this thread is the writer.
+static int
+wrapperLockTryRdLock()
+{
+  if (_wrapperExecutionLockHeldExcl) {
+    return EDEADLK;
+  }
+
+  int cpu = sched_getcpu();
+  int slot = cpu < 0 ? 0 : cpu % WRAPPER_LOCK_SLOTS;
+  __sync_add_and_fetch(&_wrapperExecutionLock.readers[slot].count, 1);
+  if (_wrapperExecutionLock.writer == 0) {
+    _wrapperExecutionLockSlot = slot;
+    return 0;
+  }
+
+  // The writer may have counted us already.
+  wrapperLockLeave(slot);
+  return EBUSY;
+}
+
+// Sleeps until the writer, if any, releases the lock.  A signal (e.g., the
+// checkpoint signal) also ends the wait.
+static void
+wrapperLockWaitForWriter()
+{
+  int c = _wrapperExecutionLock.writer;
+
+  if (c == 1) {
+    c = __sync_val_compare_and_swap(&_wrapperExecutionLock.writer, 1, 2);
+  }
+  if (c != 0) {
+    futex(&_wrapperExecutionLock.writer, FUTEX_WAIT_PRIVATE, 2);
+  }
+}
+
+static int
+wrapperLockRdUnlock()
+{
+  int slot = _wrapperExecutionLockSlot;
+
+  if (slot < 0) {
+    return EPERM;
+  }
+  _wrapperExecutionLockSlot = -1;
+  wrapperLockLeave(slot);
+  return 0;
+}
+
+static int
+wrapperLockWrLock()
+{
+  if (_wrapperExecutionLockHeldExcl) {
+    return EDEADLK;
+  }
+
+  int c = __sync_val_compare_and_swap(&_wrapperExecutionLock.writer, 0, 1);
+  if (c != 0) {
+    if (c != 2) {
+      c = __sync_lock_test_and_set(&_wrapperExecutionLock.writer, 2);
+    }
+    while (c != 0) {
+      futex(&_wrapperExecutionLock.writer, FUTEX_WAIT_PRIVATE, 2);
+      c = __sync_lock_test_and_set(&_wrapperExecutionLock.writer, 2);
+    }
+  }
+  _wrapperExecutionLockHeldExcl = true;
+
+  // No new reader gets in now; wait for the current ones to leave.
+  while (1) {
+    int seq = _wrapperExecutionLock.drainSeq;
+    int numReaders = 0;
+
+    __sync_synchronize();
+    for (int i = 0; i < WRAPPER_LOCK_SLOTS; i++) {
+      numReaders += _wrapperExecutionLock.readers[i].count;
+    }
+    if (numReaders == 0) {
+      break;
+    }
+    futex(&_wrapperExecutionLock.drainSeq, FUTEX_WAIT_PRIVATE, seq);
+  }
+  return 0;
+}
+
+static int
+wrapperLockWrUnlock()
+{
+  if (!_wrapperExecutionLockHeldExcl) {
+    return EPERM;
+  }
+  _wrapperExecutionLockHeldExcl = false;
+
+  // Wake all of the sleepers, readers and writers alike.
+  if (__sync_fetch_and_sub(&_wrapperExecutionLock.writer, 1) != 1) {
+    _wrapperExecutionLock.writer = 0;
+    futex(&_wrapperExecutionLock.writer, FUTEX_WAKE_PRIVATE, INT_MAX);
+  }
+  return 0;
+}
+
 void
 ThreadSync::initThread()
 {
@@ -116,6 +268,8 @@ ThreadSync::initThread()
   // pthread_start -> threadFinishedInitialization -> stopthisthread ->
   // callbackHoldsAnyLocks -> JASSERT().
   _wrapperExecutionLockLockCount = 0;
+  _wrapperExecutionLockSlot = -1;
+  _wrapperExecutionLockHeldExcl = false;
   _threadCreationLockLockCount = 0;
 #if TRACK_DLOPEN_DLSYM_FOR_LOCKS
   _threadPerformingDlopenDlsym = false;
@@ -156,8 +310,7 @@ ThreadSync::acquireLocks()
   _threadCreationLockAcquiredByCkptThread = true;
 
   JTRACE("Waiting for other threads to exit DMTCP-Wrappers");
-  JASSERT(_real_pthread_rwlock_wrlock(&_wrapperExecutionLock) == 0)
-    (JASSERT_ERRNO);
+  JASSERT(wrapperLockWrLock() == 0);
   _wrapperExecutionLockAcquiredByCkptThread = true;
 
   JTRACE("Waiting for newly created threads to finish initialization")
@@ -174,8 +327,7 @@ ThreadSync::releaseLocks()
   JASSERT(WorkerState::currentState() == WorkerState::SUSPENDED);
 
   JTRACE("Releasing ThreadSync locks");
-  JASSERT(_real_pthread_rwlock_unlock(&_wrapperExecutionLock) == 0)
-    (JASSERT_ERRNO);
+  JASSERT(wrapperLockWrUnlock() == 0);
   _wrapperExecutionLockAcquiredByCkptThread = false;
   JASSERT(_real_pthread_rwlock_unlock(&_threadCreationLock) == 0)
     (JASSERT_ERRNO);
@@ -192,10 +344,12 @@ ThreadSync::resetLocks()
 {
   pthread_rwlock_t newLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
 
-  _wrapperExecutionLock = newLock;
+  memset(&_wrapperExecutionLock, 0, sizeof(_wrapperExecutionLock));
   _threadCreationLock = newLock;
 
   _wrapperExecutionLockLockCount = 0;
+  _wrapperExecutionLockSlot = -1;
+  _wrapperExecutionLockHeldExcl = false;
   _threadCreationLockLockCount = 0;
 #if TRACK_DLOPEN_DLSYM_FOR_LOCKS
   _threadPerformingDlopenDlsym = false;
@@ -386,11 +540,10 @@ ThreadSync::wrapperExecutionLockLock()
         isOkToGrabLock() == true &&
         _wrapperExecutionLockLockCount == 0) {
       incrementWrapperExecutionLockLockCount();
-      int retVal = _real_pthread_rwlock_tryrdlock(&_wrapperExecutionLock);
+      int retVal = wrapperLockTryRdLock();
       if (retVal != 0 && retVal == EBUSY) {
         decrementWrapperExecutionLockLockCount();
-        struct timespec sleepTime = { 0, 100 * 1000 * 1000 };
-        nanosleep(&sleepTime, NULL);
+        wrapperLockWaitForWriter();
         continue;
       }
       if (retVal != 0 && retVal != EDEADLK) {
@@ -440,11 +593,9 @@ ThreadSync::wrapperExecutionLockLock()
  *    rdlock for 100 ms. Thread B executes and trywrlock and fails. Thread B
  *    sleeps goes to sleep for some time. While thread B is sleeping, thread A
  *    releases the rdlock and reacquires it or some other thread acquires the
- *    rdlock. This would cause the thread B to starve. This scenario can be
- *    easily observed if thread A calls
- *      epoll_wait(fd, events, max_events, -1).
- *    It is wrapped by the epoll_wait wrapper in IPC plugin, which then makes
- *    repeated calls to _real_epoll_wait with smaller timeout.
+ *    rdlock. This would cause the thread B to starve. Hence the blocking
+ *    wrapperLockWrLock(): once it has set the writer flag, no thread gets
+ *    the rdlock until thread B is done, and a thread that leaves wakes B.
  */
 bool
 ThreadSync::wrapperExecutionLockLockExcl()
@@ -458,7 +609,7 @@ ThreadSync::wrapperExecutionLockLockExcl()
   }
   if (WorkerState::currentState() == WorkerState::RUNNING) {
     incrementWrapperExecutionLockLockCount();
-    int retVal = _real_pthread_rwlock_wrlock(&_wrapperExecutionLock);
+    int retVal = wrapperLockWrLock();
     if (retVal != 0 && retVal != EDEADLK) {
       fprintf(stderr, "ERROR %s:%d %s: Failed to acquire lock\n",
               __FILE__, __LINE__, __PRETTY_FUNCTION__);
@@ -503,7 +654,9 @@ ThreadSync::wrapperExecutionLockUnlock()
   if (DmtcpWorker::exitInProgress()) {
     return;
   }
-  if (_real_pthread_rwlock_unlock(&_wrapperExecutionLock) != 0) {
+  int retVal = _wrapperExecutionLockHeldExcl ? wrapperLockWrUnlock()
+                                             : wrapperLockRdUnlock();
+  if (retVal != 0) {
     fprintf(stderr, "ERROR %s:%d %s: Failed to release lock\n",
             __FILE__, __LINE__, __PRETTY_FUNCTION__);
     _exit(DMTCP_FAIL_RC);
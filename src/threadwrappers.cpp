@@ -65,6 +65,10 @@ clone_start(void *arg)
   JTRACE("Calling user function") (dmtcp_gettid());
   int ret = thread->fn(thread->arg);
 
+  // Flush while the thread still takes part in checkpoints.  After
+  // threadExit(), it is no longer suspended, and could be changing the
+  // shared stacks while the image is written.
+  jalib::JAllocDispatcher::flushThreadCache();
   ThreadList::threadExit();
   return ret;
 }
@@ -176,6 +180,7 @@ pthread_start(void *arg)
   PluginManager::eventHook(DMTCP_EVENT_PTHREAD_RETURN, NULL);
   WRAPPER_EXECUTION_ENABLE_CKPT();
   ThreadSync::unsetOkToGrabLock();
+  jalib::JAllocDispatcher::flushThreadCache();
   return result;
 }
 
@@ -244,6 +249,7 @@ pthread_exit(void *retval)
   PluginManager::eventHook(DMTCP_EVENT_PTHREAD_EXIT, NULL);
   WRAPPER_EXECUTION_ENABLE_CKPT();
   ThreadSync::unsetOkToGrabLock();
+  jalib::JAllocDispatcher::flushThreadCache();
   _real_pthread_exit(retval);
   for (;;) { // To hide compiler warning about "noreturn" function
   }
@@ -0,0 +1,105 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2012 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#include "tracing.h"
+#include <string.h>
+#include <time.h>
+#include "jassert.h"
+#include "coordinatorapi.h"
+#include "dmtcpmessagetypes.h"
+
+// Enough for the barriers of all of the plugins, several times over.
+#define MAX_TRACE_EVENTS 1024
+
+namespace dmtcp
+{
+static TraceEvent traceEvents[MAX_TRACE_EVENTS];
+static size_t numTraceEvents = 0;
+static size_t numDroppedEvents = 0;
+static bool traceEnabled = false;
+
+uint64_t
+Tracing::now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+Tracing::reset()
+{
+  numTraceEvents = 0;
+  numDroppedEvents = 0;
+}
+
+void
+Tracing::enable(bool enabled)
+{
+  traceEnabled = enabled;
+}
+
+void
+Tracing::record(const char *category, const string &name, uint64_t start)
+{
+  uint64_t end = now();
+
+  recordDuration(category, name, start, end > start ? end - start : 0);
+}
+
+void
+Tracing::recordDuration(const char *category,
+                        const string &name,
+                        uint64_t start,
+                        uint64_t duration)
+{
+  if (numTraceEvents == MAX_TRACE_EVENTS) {
+    numDroppedEvents++;
+    return;
+  }
+
+  TraceEvent *event = &traceEvents[numTraceEvents++];
+  event->start = start;
+  event->duration = duration;
+  strncpy(event->category, category, sizeof(event->category) - 1);
+  event->category[sizeof(event->category) - 1] = '\0';
+  strncpy(event->name, name.c_str(), sizeof(event->name) - 1);
+  event->name[sizeof(event->name) - 1] = '\0';
+}
+
+void
+Tracing::sendToCoordinator()
+{
+  if (!traceEnabled || numTraceEvents == 0 ||
+      CoordinatorAPI::noCoordinator()) {
+    return;
+  }
+
+  JWARNING(numDroppedEvents == 0) (numDroppedEvents)
+    .Text("Trace buffer full; some of the events were not recorded");
+
+  DmtcpMessage msg(DMT_TRACE_EVENTS);
+  CoordinatorAPI::sendMsgToCoordinator(msg,
+                                       traceEvents,
+                                       numTraceEvents * sizeof(TraceEvent));
+}
+}
@@ -0,0 +1,56 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2012 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <stdint.h>
+#include "dmtcpalloc.h"
+
+namespace dmtcp
+{
+/* The timeline of the checkpoint (or restart) of this process: the barrier
+ * waits, the barrier callbacks, where the plugins drain and refill, and the
+ * writing of the image.  The spans are always recorded, which costs a clock
+ * read per barrier, and are sent to the coordinator at the end if it asked for
+ * them (dmtcp_coordinator --trace-dir).
+ */
+namespace Tracing
+{
+// Microseconds since the epoch; the coordinator merges the timelines of all
+// the hosts.
+uint64_t now();
+
+// Called at the start of a checkpoint and of a restart.
+void reset();
+void enable(bool enabled);
+
+// Records the span from start until now.
+void record(const char *category, const string &name, uint64_t start);
+void recordDuration(const char *category,
+                    const string &name,
+                    uint64_t start,
+                    uint64_t duration);
+
+void sendToCoordinator();
+}
+}
+#endif // ifndef TRACING_H
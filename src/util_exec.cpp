@@ -683,6 +683,10 @@ Util::getDmtcpArgs(vector<string> &dmtcp_args)
   const char *ckptDir = getenv(ENV_VAR_CHECKPOINT_DIR);
   const char *tmpDir = getenv(ENV_VAR_TMPDIR);
   const char *plugins = getenv(ENV_VAR_PLUGIN);
+  const char *writerThreads = getenv(ENV_VAR_CKPT_WRITER_THREADS);
+  const char *incremental = getenv(ENV_VAR_CKPT_INCREMENTAL);
+  const char *compress = getenv(ENV_VAR_CKPT_COMPRESS);
+  const char *forkedCkpt = getenv(ENV_VAR_FORKED_CKPT);
 
   // modify the command
   dmtcp_args.clear();
@@ -716,6 +720,25 @@ Util::getDmtcpArgs(vector<string> &dmtcp_args)
     dmtcp_args.push_back("--checkpoint-open-files");
   }
 
+  if (writerThreads != NULL) {
+    dmtcp_args.push_back("--ckpt-writer-threads");
+    dmtcp_args.push_back(writerThreads);
+  }
+
+  if (incremental != NULL) {
+    dmtcp_args.push_back("--ckpt-incremental");
+    dmtcp_args.push_back(incremental);
+  }
+
+  if (compress != NULL) {
+    dmtcp_args.push_back("--ckpt-compress");
+    dmtcp_args.push_back(compress);
+  }
+
+  if (forkedCkpt != NULL) {
+    dmtcp_args.push_back("--forked-checkpointing");
+  }
+
   if (plugins != NULL) {
     dmtcp_args.push_back("--with-plugin");
     dmtcp_args.push_back(plugins);
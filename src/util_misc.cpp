@@ -656,31 +656,6 @@ Util::pageMask()
   return page_mask;
 }
 
-/* This function detects if the given pages are zero pages or not. There is
- * scope of improving this function using some optimizations.
- *
- * TODO: One can use /proc/self/pagemap to detect if the page is backed by a
- * shared zero page.
- */
-bool
-Util::areZeroPages(void *addr, size_t numPages)
-{
-  static size_t page_size = pageSize();
-  long long *buf = (long long *)addr;
-  size_t i;
-  size_t end = numPages * page_size / sizeof(*buf);
-  long long res = 0;
-
-  for (i = 0; i + 7 < end; i += 8) {
-    res = buf[i + 0] | buf[i + 1] | buf[i + 2] | buf[i + 3] |
-      buf[i + 4] | buf[i + 5] | buf[i + 6] | buf[i + 7];
-    if (res != 0) {
-      break;
-    }
-  }
-  return res == 0;
-}
-
 /* Caller must allocate exec_path of size at least MTCP_MAX_PATH */
 char *
 Util::findExecutable(char *executable, const char *path_env, char *exec_path)
@@ -0,0 +1,177 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2013 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *  This file is part of DMTCP.                                             *
+ *                                                                          *
+ *  DMTCP is free software: you can redistribute it and/or                  *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP is distributed in the hope that it will be useful,                *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+/* Zero-page detection for the checkpoint writer.  The memory of the
+ * application is scanned while it is frozen, so this is on the critical
+ * path of every checkpoint.  The scan kernel is chosen once, at run time,
+ * from AVX2, SSE2 and plain C.
+ *
+ * This file depends on nothing else in DMTCP, so that
+ * test/benchmark/zeroscan can link with it directly.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif // if defined(__x86_64__) || defined(__i386__)
+#include "util.h"
+
+using namespace dmtcp;
+
+typedef bool (*ZeroScanFn)(const void *addr, size_t len);
+
+/* All kernels take a length that is a multiple of 128 bytes (a page).
+ * They check 128 bytes at a time, so that a non-zero page is usually
+ * rejected after its first cache lines.
+ */
+static bool
+isZeroScalar(const void *addr, size_t len)
+{
+  const uint64_t *buf = (const uint64_t *)addr;
+  size_t end = len / sizeof(*buf);
+
+  for (size_t i = 0; i < end; i += 16) {
+    uint64_t res = buf[i + 0] | buf[i + 1] | buf[i + 2] | buf[i + 3] |
+      buf[i + 4] | buf[i + 5] | buf[i + 6] | buf[i + 7] |
+      buf[i + 8] | buf[i + 9] | buf[i + 10] | buf[i + 11] |
+      buf[i + 12] | buf[i + 13] | buf[i + 14] | buf[i + 15];
+    if (res != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static bool
+isZeroSSE2(const void *addr, size_t len)
+{
+  const __m128i *buf = (const __m128i *)addr;
+  const __m128i zero = _mm_setzero_si128();
+  size_t end = len / sizeof(*buf);
+
+  for (size_t i = 0; i < end; i += 8) {
+    __m128i res = _mm_or_si128(
+      _mm_or_si128(_mm_or_si128(_mm_loadu_si128(buf + i + 0),
+                                _mm_loadu_si128(buf + i + 1)),
+                   _mm_or_si128(_mm_loadu_si128(buf + i + 2),
+                                _mm_loadu_si128(buf + i + 3))),
+      _mm_or_si128(_mm_or_si128(_mm_loadu_si128(buf + i + 4),
+                                _mm_loadu_si128(buf + i + 5)),
+                   _mm_or_si128(_mm_loadu_si128(buf + i + 6),
+                                _mm_loadu_si128(buf + i + 7))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(res, zero)) != 0xFFFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+__attribute__((target("avx2")))
+static bool
+isZeroAVX2(const void *addr, size_t len)
+{
+  const __m256i *buf = (const __m256i *)addr;
+  size_t end = len / sizeof(*buf);
+
+  for (size_t i = 0; i < end; i += 4) {
+    __m256i res = _mm256_or_si256(
+      _mm256_or_si256(_mm256_loadu_si256(buf + i + 0),
+                      _mm256_loadu_si256(buf + i + 1)),
+      _mm256_or_si256(_mm256_loadu_si256(buf + i + 2),
+                      _mm256_loadu_si256(buf + i + 3)));
+    if (!_mm256_testz_si256(res, res)) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif // if defined(__x86_64__) || defined(__i386__)
+
+static const char *zeroScanName = NULL;
+static ZeroScanFn zeroScanFn = NULL;
+
+static ZeroScanFn
+getZeroScanFn()
+{
+  if (zeroScanFn != NULL) {
+    return zeroScanFn;
+  }
+
+  zeroScanName = "scalar";
+  zeroScanFn = isZeroScalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    zeroScanName = "avx2";
+    zeroScanFn = isZeroAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    zeroScanName = "sse2";
+    zeroScanFn = isZeroSSE2;
+  }
+#endif // if defined(__x86_64__) || defined(__i386__)
+  return zeroScanFn;
+}
+
+static size_t
+zeroScanPageSize()
+{
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+
+  return page_size;
+}
+
+const char *
+Util::zeroPageScanner()
+{
+  getZeroScanFn();
+  return zeroScanName;
+}
+
+/* This function detects if the given pages are zero pages or not.
+ *
+ * TODO: One can use /proc/self/pagemap to detect if the page is backed by a
+ * shared zero page.
+ */
+bool
+Util::areZeroPages(void *addr, size_t numPages)
+{
+  return getZeroScanFn()(addr, numPages * zeroScanPageSize());
+}
+
+/* Sets isZero[i] for each of the numPages MTCP_PAGE_SIZE pages at addr, and
+ * returns the number of zero pages.  The checkpoint image is laid out in
+ * MTCP_PAGE_SIZE units, whatever the page size of the kernel.
+ */
+size_t
+Util::scanZeroPages(void *addr, size_t numPages, char *isZero)
+{
+  ZeroScanFn isZeroFn = getZeroScanFn();
+  size_t numZero = 0;
+
+  for (size_t i = 0; i < numPages; i++) {
+    isZero[i] = isZeroFn((char *)addr + i * MTCP_PAGE_SIZE, MTCP_PAGE_SIZE);
+    numZero += isZero[i];
+  }
+  return numZero;
+}
@@ -29,13 +29,20 @@
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include "jalloc.h"
 #include "jassert.h"
+#include "jfilesystem.h"
+#include "ckptcompress.h"
 #include "constants.h"
 #include "dmtcp.h"
+#include "mtcp/mtcp_header.h"
 #include "processinfo.h"
 #include "procmapsarea.h"
 #include "procselfmaps.h"
 #include "shareddata.h"
+#include "syscallwrappers.h"
+#include "threadlist.h"
 #include "util.h"
 
 #define DEV_ZERO_DELETED_STR "/dev/zero (deleted)"
@@ -56,6 +63,12 @@ EXTERNC int dmtcp_infiniband_enabled(void) __attribute__((weak));
 
 static bool skipWritingTextSegments = false;
 
+/* See write_image_index(). */
+static vector<MtcpIndexEntry> *imageIndex = NULL;
+static bool imageIndexFull = false;  /* The image gets no index */
+static off_t imageOffset = -1;       /* Offset of the next byte written */
+static off_t mtcpHeaderOffset = -1;  /* -1 if the image gets no index */
+
 // FIXME:  Why do we create two global variable here?  They should at least
 // be static (file-private), and preferably local to a function.
 ProcSelfMaps *procSelfMaps = NULL;
@@ -71,12 +84,51 @@ vector<ProcMapsArea> *nscdAreas = NULL;
 // class can then be careful about allocating memory.
 
 
+/* The kinds of output that prepare_memory_area() can ask for. */
+typedef enum AreaWriteKind {
+  AREA_WRITE_SKIP,         /* Nothing goes to the image. */
+  AREA_WRITE_HEADER_ONLY,  /* Only the Area header is written. */
+  AREA_WRITE_DATA,         /* Area header followed by the whole area. */
+  AREA_WRITE_ZERO_SCAN,    /* Split into zero and non-zero page ranges. */
+  AREA_WRITE_INCREMENTAL   /* Only the pages changed since the parent image. */
+} AreaWriteKind;
+
+/* Per-page state of an incremental area; see update_page_states(). */
+typedef enum PageState {
+  PAGE_CLEAN,  /* Unchanged since the parent image. */
+  PAGE_DIRTY,  /* Written to since the parent image. */
+  PAGE_ZERO    /* Not populated, or all zeros. */
+} PageState;
+
 /* Internal routines */
 
 // static void sync_shared_mem(void);
-static void writememoryarea(int fd, Area *area, int stack_was_seen);
+static int prepare_memory_area(Area *area);
+static void writememoryarea(int fd, Area *area, int kind, char *pageState);
+static int get_num_writer_threads(int fd);
+static void reset_write_queue(size_t numAreas);
+static void queue_memory_area(Area *area, int kind, char *pageState);
+static void write_queued_memory_areas(int fd, int numThreads);
 
 static void remap_nscd_areas(const vector<ProcMapsArea> &areas);
+static void write_area_header(int fd, Area *area);
+static void write_area_data(int fd, const void *buf, size_t len);
+static void flush_area_data();
+static void begin_image_index(int fd, size_t numAreas);
+static void add_index_entry(VA addr, size_t size, uint64_t properties,
+                            off_t offset);
+static void write_image_index(int fd, bool compressed);
+
+static bool is_incremental_candidate(const Area *area);
+static void reserve_incremental_areas(size_t numAreas);
+static void snapshot_dirty_pages(const Area *area);
+static size_t count_dirty_runs();
+static void begin_incremental_ckpt();
+static char *get_incremental_pages(const Area *area, int kind);
+static void end_incremental_ckpt();
+static void update_page_states(VA addr, size_t numPages, char *pageState);
+static size_t next_page_run(const char *pageState, size_t numPages,
+                            size_t first, int *state);
 
 /*****************************************************************************
  *
@@ -93,14 +145,14 @@ mtcp_writememoryareas(int fd)
 {
   Area area;
 
-  // DeviceInfo dev_info;
-  int stack_was_seen = 0;
-
   if (getenv(ENV_VAR_SKIP_WRITING_TEXT_SEGMENTS) != NULL) {
     skipWritingTextSegments = true;
   }
 
-  JTRACE("Performing checkpoint.");
+  int numCompressThreads = CkptCompress::numThreads();
+  int numWriterThreads = get_num_writer_threads(fd);
+
+  JTRACE("Performing checkpoint.") (numWriterThreads) (numCompressThreads);
 
   // Here we want to sync the shared memory pages with the backup files
   // FIXME: Why do we need this?
@@ -123,6 +175,7 @@ mtcp_writememoryareas(int fd)
     // This block is to ensure that the object is deleted as soon as we leave
     // this block.
     ProcSelfMaps procSelfMaps;
+    reserve_incremental_areas(procSelfMaps.getNumAreas());
 
     // Preprocess memory regions as needed.
     while (procSelfMaps.getNextArea(&area)) {
@@ -135,10 +188,15 @@ mtcp_writememoryareas(int fd)
           (area.name);
 
         nscdAreas->push_back(area);
+      } else if (is_incremental_candidate(&area)) {
+        snapshot_dirty_pages(&area);
       }
     }
   }
 
+  // Start tracking the pages dirtied from here on, for the next checkpoint.
+  begin_incremental_ckpt();
+
   if (procSelfMaps != NULL) {
     // We need to explicitly delete this object here because on restart, we
     // never get back to this function and the object is never released.
@@ -147,7 +205,18 @@ mtcp_writememoryareas(int fd)
 
   /* Finally comes the memory contents */
   procSelfMaps = new ProcSelfMaps();
+  reserve_incremental_areas(procSelfMaps->getNumAreas());
+  begin_image_index(fd, procSelfMaps->getNumAreas());
+  if (numCompressThreads > 0) {
+    // One raw write per Area header; see write_area_header().
+    CkptCompress::begin(fd, numCompressThreads, imageIndex->capacity() + 1);
+  }
+  if (numWriterThreads > 1) {
+    reset_write_queue(procSelfMaps->getNumAreas());
+  }
   while (procSelfMaps->getNextArea(&area)) {
+    bool incrementalCandidate = is_incremental_candidate(&area);
+
     // TODO(kapil): Verify that we are not doing any operation that might
     // result in a change of memory layout. For example, a call to JALLOC_NEW
     // will invoke mmap if the JAlloc arena is full. Similarly, for STL objects
@@ -252,7 +321,11 @@ mtcp_writememoryareas(int fd)
       area.prot = PROT_READ | PROT_WRITE;
       area.properties |= DMTCP_ZERO_PAGE;
       area.flags = MAP_PRIVATE | MAP_ANONYMOUS;
-      Util::writeAll(fd, &area, sizeof(area));
+      if (numWriterThreads > 1) {
+        queue_memory_area(&area, AREA_WRITE_HEADER_ONLY, NULL);
+      } else {
+        write_area_header(fd, &area);
+      }
       continue;
     } else if (Util::isIBShmArea(area)) {
       // TODO: Don't checkpoint infiniband shared area for now.
@@ -282,29 +355,202 @@ mtcp_writememoryareas(int fd)
      * at the beginning.
      */
 
-    if (strstr(area.name, "[stack]")) {
-      stack_was_seen = 1;
+    // the whole thing comes after the restore image
+    int kind = prepare_memory_area(&area);
+    char *pageState = NULL;
+    if (incrementalCandidate) {
+      pageState = get_incremental_pages(&area, kind);
+      if (pageState != NULL) {
+        kind = AREA_WRITE_INCREMENTAL;
+      }
     }
 
-    // the whole thing comes after the restore image
-    writememoryarea(fd, &area, stack_was_seen);
+    if (numWriterThreads > 1) {
+      queue_memory_area(&area, kind, pageState);
+    } else {
+      writememoryarea(fd, &area, kind, pageState);
+    }
   }
 
+  // Nothing may read the areas after this, e.g., after remap_nscd_areas().
+  flush_area_data();
+
   // Release the memory.
   delete procSelfMaps;
   procSelfMaps = NULL;
 
+  if (numWriterThreads > 1) {
+    write_queued_memory_areas(fd, numWriterThreads);
+    imageOffset = lseek(fd, 0, SEEK_CUR);
+  }
+
+  end_incremental_ckpt();
+
   /* It's now safe to do this, since we're done using writememoryarea() */
   remap_nscd_areas(*nscdAreas);
 
   area.addr = NULL; // End of data
   area.size = -1; // End of data
-  Util::writeAll(fd, &area, sizeof(area));
+  write_area_header(fd, &area);
+  if (CkptCompress::isActive()) {
+    CkptCompress::end();
+  }
+  write_image_index(fd, numCompressThreads > 0);
 
   /* That's all folks */
   JASSERT(_real_close(fd) == 0);
 }
 
+/* Everything after the MTCP header goes through these two, so that the
+ * data can be compressed in-process (DMTCP_CKPT_COMPRESS).  The Area headers
+ * are never compressed, and start on a page boundary (MTCP_FORMAT_VERSION).
+ */
+static void
+write_area_header(int fd, Area *area)
+{
+  if (CkptCompress::isActive()) {
+    Area a = *area;
+    a.properties |= DMTCP_COMPRESSED_DATA;
+    CkptCompress::alignOutput(MTCP_PAGE_SIZE);
+    size_t n = CkptCompress::writeRaw(&a, sizeof(a));
+    // The offset is known only once written; see write_image_index().
+    add_index_entry(a.addr, a.size, a.properties, n);
+  } else {
+    add_index_entry(area->addr, area->size, area->properties, imageOffset);
+    Util::writeAll(fd, area, sizeof(*area));
+    if (imageOffset != -1) {
+      imageOffset += sizeof(*area);
+    }
+  }
+}
+
+static void
+write_area_data(int fd, const void *buf, size_t len)
+{
+  if (CkptCompress::isActive()) {
+    CkptCompress::writeCompressed(buf, len);
+  } else {
+    Util::writeAll(fd, buf, len);
+    if (imageOffset != -1) {
+      imageOffset += len;
+    }
+  }
+}
+
+/* The compressor threads read the data of write_area_data() in place until
+ * it is flushed; see ckptcompress.cpp.
+ */
+static void
+flush_area_data()
+{
+  if (CkptCompress::isActive()) {
+    CkptCompress::flush();
+  }
+}
+
+/*****************************************************************************
+ *
+ *  Image index (MtcpIndex in mtcp_header.h).
+ *
+ *  Every Area header written is recorded with its file offset.  After the
+ *  last area, the table is appended at a page boundary and its offset is
+ *  patched into the MTCP header, so that tools can find any area without
+ *  reading through the image.  An image written to a pipe (gzip/hbict) has
+ *  no index.
+ *
+ *****************************************************************************/
+
+/* The index must not grow while the areas are walked, so room is made for
+ * it beforehand.  An incremental area has one entry per run of dirty or
+ * zero pages, which is only known when the area is written; the runs of
+ * dirty pages in the snapshot are taken as an estimate, doubled.  If the
+ * index does fill up, the image gets none; it is optional.
+ */
+static void
+begin_image_index(int fd, size_t numAreas)
+{
+  // Left over from the previous checkpoint, or from before a restart.
+  delete imageIndex;
+  imageIndex = new vector<MtcpIndexEntry>();
+  imageIndex->reserve(2 * numAreas + 2 * count_dirty_runs());
+  imageIndexFull = false;
+  imageOffset = lseek(fd, 0, SEEK_CUR);
+  mtcpHeaderOffset = imageOffset == -1 ? -1
+                                       : imageOffset - sizeof(MtcpHeader);
+}
+
+static void
+add_index_entry(VA addr, size_t size, uint64_t properties, off_t offset)
+{
+  if (size == (size_t)-1 || mtcpHeaderOffset == -1) {
+    return; /* End of data, or no index */
+  }
+  if (imageIndex->size() == imageIndex->capacity()) {
+    imageIndexFull = true;
+    return;
+  }
+
+  MtcpIndexEntry entry;
+  entry.offset = offset;
+  entry.addr = (uint64_t)(uintptr_t)addr;
+  entry.size = size;
+  entry.properties = properties;
+  imageIndex->push_back(entry);
+}
+
+static void
+write_image_index(int fd, bool compressed)
+{
+  if (mtcpHeaderOffset == -1) {
+    return;
+  }
+  if (imageIndexFull) {
+    JNOTE("Too many areas for the image index; writing the image without")
+      (imageIndex->size());
+    delete imageIndex;
+    imageIndex = NULL;
+    return;
+  }
+
+  if (compressed) {
+    for (size_t i = 0; i < imageIndex->size(); i++) {
+      MtcpIndexEntry &entry = (*imageIndex)[i];
+      entry.offset = CkptCompress::rawOffset(entry.offset);
+    }
+  }
+
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  JASSERT(offset != -1) (JASSERT_ERRNO);
+  size_t pad = (MTCP_PAGE_SIZE - offset % MTCP_PAGE_SIZE) % MTCP_PAGE_SIZE;
+  if (pad > 0) {
+    char zeros[MTCP_PAGE_SIZE];
+    memset(zeros, 0, pad);
+    Util::writeAll(fd, zeros, pad);
+    offset += pad;
+  }
+
+  MtcpIndex index;
+  memset(&index, 0, sizeof(index));
+  strncpy(index.signature, MTCP_INDEX_SIGNATURE, sizeof(index.signature));
+  index.num_entries = imageIndex->size();
+  Util::writeAll(fd, &index, sizeof(index));
+  if (!imageIndex->empty()) {
+    Util::writeAll(fd, &(*imageIndex)[0],
+                   imageIndex->size() * sizeof(MtcpIndexEntry));
+  }
+
+  uint64_t indexOffset = offset;
+  off_t fieldOffset = mtcpHeaderOffset + offsetof(MtcpHeader, index_offset);
+  JASSERT(pwrite(fd, &indexOffset, sizeof(indexOffset), fieldOffset) ==
+          sizeof(indexOffset)) (fieldOffset) (JASSERT_ERRNO)
+  .Text("error writing index offset into MTCP header");
+  JTRACE("Wrote image index") (index.num_entries) (offset);
+
+  // As with procSelfMaps, we never return here on restart, so free now.
+  delete imageIndex;
+  imageIndex = NULL;
+}
+
 static void
 remap_nscd_areas(const vector<ProcMapsArea> &areas)
 {
@@ -317,43 +563,74 @@ remap_nscd_areas(const vector<ProcMapsArea> &areas)
   }
 }
 
-/* This function returns a range of zero or non-zero pages. If the first page
- * is non-zero, it searches for all contiguous non-zero pages and returns them.
- * If the first page is all-zero, it searches for contiguous zero pages and
- * returns them.
+/* Returns the end of the run of pages, starting at page first, that are all
+ * zero or all non-zero.
  */
-static void
-mtcp_get_next_page_range(Area *area, size_t *size, int *is_zero)
+static size_t
+next_zero_run(const char *isZero, size_t numPages, size_t first)
 {
-  char *pg;
-  char *prevAddr;
-  size_t count = 0;
-  const size_t one_MB = (1024 * 1024);
+  size_t i = first + 1;
 
-  if (area->size < one_MB) {
-    *size = area->size;
-    *is_zero = 0;
-    return;
+  while (i < numPages && isZero[i] == isZero[first]) {
+    i++;
   }
-  *size = one_MB;
-  *is_zero = Util::areZeroPages(area->addr, one_MB / MTCP_PAGE_SIZE);
-  prevAddr = area->addr;
-  for (pg = area->addr + one_MB;
-       pg < area->addr + area->size;
-       pg += one_MB) {
-    size_t minsize = MIN(one_MB, (size_t)(area->addr + area->size - pg));
-    if (*is_zero != Util::areZeroPages(pg, minsize / MTCP_PAGE_SIZE)) {
-      break;
+  return i;
+}
+
+/* Choose the encoding of an area with numZero zero pages out of numPages:
+ * a single DMTCP_ZERO_PAGE header, a DMTCP_SPARSE_PAGES area if leaving out
+ * the zero pages saves more than the bitmaps cost, or else plain data (0).
+ */
+static uint64_t
+zero_scan_properties(size_t numPages, size_t numZero)
+{
+  size_t numChunks = (numPages + DMTCP_SPARSE_CHUNK_PAGES - 1) /
+    DMTCP_SPARSE_CHUNK_PAGES;
+
+  if (numZero == numPages) {
+    return DMTCP_ZERO_PAGE;
+  }
+  if (numZero * MTCP_PAGE_SIZE > numChunks * DMTCP_SPARSE_BITMAP_SIZE) {
+    return DMTCP_SPARSE_PAGES;
+  }
+  return 0;
+}
+
+/* Fill in the bitmap of a chunk of a DMTCP_SPARSE_PAGES area; see
+ * procmapsarea.h.
+ */
+static void
+fill_sparse_bitmap(const char *isZero, size_t numPages, char *bitmap)
+{
+  memset(bitmap, 0, DMTCP_SPARSE_BITMAP_SIZE);
+  for (size_t i = 0; i < numPages; i++) {
+    if (!isZero[i]) {
+      bitmap[i / 8] |= 1 << (i % 8);
     }
-    *size += minsize;
-    if (*is_zero && ++count % 10 == 0) { // madvise every 10MB
-      if (madvise(prevAddr, area->addr + *size - prevAddr,
-                  MADV_DONTNEED) == -1) {
+  }
+}
+
+/* Release the zero pages to the kernel, so that they do not need to be
+ * swapped in again.  Short runs are not worth a system call.  A failure is
+ * harmless; it is reported unless called from a writer thread (see the
+ * parallel writer below).
+ */
+static void
+madvise_zero_runs(VA addr, const char *isZero, size_t numPages, bool report)
+{
+  const size_t minPages = (1024 * 1024) / MTCP_PAGE_SIZE;
+
+  for (size_t i = 0; i < numPages;) {
+    size_t next = next_zero_run(isZero, numPages, i);
+    if (isZero[i] && next - i >= minPages) {
+      VA a = addr + i * MTCP_PAGE_SIZE;
+      size_t size = (next - i) * MTCP_PAGE_SIZE;
+      if (madvise(a, size, MADV_DONTNEED) == -1 && report) {
         JNOTE("error doing madvise(..., MADV_DONTNEED)")
-          (JASSERT_ERRNO) ((void *)area->addr) ((int)*size);
-        prevAddr = pg;
+          (JASSERT_ERRNO) ((void *)a) (size);
       }
     }
+    i = next;
   }
 }
 
@@ -386,47 +663,126 @@ mtcp_write_non_rwx_and_anonymous_pages(int fd, Area *orig_area)
     .Text("error adding PROT_READ to mem region");
   }
 
-  while (area.size > 0) {
-    size_t size;
-    int is_zero;
-    Area a = area;
-    if (dmtcp_infiniband_enabled && dmtcp_infiniband_enabled()) {
-      size = area.size;
-      is_zero = 0;
-    } else {
-      mtcp_get_next_page_range(&a, &size, &is_zero);
-    }
-
-    a.properties = is_zero ? DMTCP_ZERO_PAGE : 0;
-    a.size = size;
+  if (dmtcp_infiniband_enabled && dmtcp_infiniband_enabled()) {
+    area.properties = 0;
+    write_area_header(fd, &area);
+    write_area_data(fd, area.addr, area.size);
+  } else {
+    /* Nothing may be allocated while the areas are walked, and an area can
+     * be huge.  So scan it a chunk at a time into zeroScanFlags, and scan
+     * each chunk again to write it out if the area turns out to be sparse.
+     */
+    static char zeroScanFlags[DMTCP_SPARSE_CHUNK_PAGES];
+    size_t numPages = area.size / MTCP_PAGE_SIZE;
+    size_t numZero = 0;
 
-    Util::writeAll(fd, &a, sizeof(a));
-    if (!is_zero) {
-      Util::writeAll(fd, a.addr, a.size);
-    } else {
-      if (madvise(a.addr, a.size, MADV_DONTNEED) == -1) {
-        JNOTE("error doing madvise(..., MADV_DONTNEED)")
-          (JASSERT_ERRNO) (a.addr) ((int)a.size);
+    for (size_t c = 0; c < numPages; c += DMTCP_SPARSE_CHUNK_PAGES) {
+      size_t n = MIN(numPages - c, (size_t)DMTCP_SPARSE_CHUNK_PAGES);
+      VA addr = area.addr + c * MTCP_PAGE_SIZE;
+      numZero += Util::scanZeroPages(addr, n, zeroScanFlags);
+      madvise_zero_runs(addr, zeroScanFlags, n, true);
+    }
+    area.properties = zero_scan_properties(numPages, numZero);
+    write_area_header(fd, &area);
+    if (area.properties == 0) {
+      write_area_data(fd, area.addr, area.size);
+    } else if (area.properties == DMTCP_SPARSE_PAGES) {
+      char bitmap[DMTCP_SPARSE_BITMAP_SIZE];
+      for (size_t c = 0; c < numPages; c += DMTCP_SPARSE_CHUNK_PAGES) {
+        size_t n = MIN(numPages - c, (size_t)DMTCP_SPARSE_CHUNK_PAGES);
+        VA addr = area.addr + c * MTCP_PAGE_SIZE;
+        Util::scanZeroPages(addr, n, zeroScanFlags);
+        fill_sparse_bitmap(zeroScanFlags, n, bitmap);
+        write_area_data(fd, bitmap, sizeof(bitmap));
+        for (size_t i = 0; i < n;) {
+          size_t next = next_zero_run(zeroScanFlags, n, i);
+          if (!zeroScanFlags[i]) {
+            write_area_data(fd, addr + i * MTCP_PAGE_SIZE,
+                            (next - i) * MTCP_PAGE_SIZE);
+          }
+          i = next;
+        }
       }
     }
-    area.addr += size;
-    area.size -= size;
   }
 
   /* Now remove the PROT_READ from the area if it didn't have it originally
   */
   if ((orig_area->prot & PROT_READ) == 0) {
+    flush_area_data();
     JASSERT(mprotect(orig_area->addr, orig_area->size, orig_area->prot) == 0)
       (JASSERT_ERRNO) (orig_area->addr) (orig_area->size)
     .Text("error removing PROT_READ from mem region.");
   }
 }
 
+/* Write an area that is unchanged since the parent image, except for the
+ * pages flagged in pageState.  The area header (DMTCP_INCREMENTAL_AREA) has
+ * no data; it is followed by one header per run of dirty pages
+ * (DMTCP_INCREMENTAL_PAGES, with data) or zero pages (DMTCP_ZERO_PAGE).
+ * Clean pages are restored from the parent image.
+ */
 static void
-writememoryarea(int fd, Area *area, int stack_was_seen)
+mtcp_write_incremental_pages(int fd, Area *orig_area, char *pageState)
+{
+  Area area = *orig_area;
+  size_t numPages = area.size / MTCP_PAGE_SIZE;
+
+  if ((orig_area->prot & PROT_READ) == 0) {
+    JASSERT(mprotect(orig_area->addr, orig_area->size,
+                     orig_area->prot | PROT_READ) == 0)
+      (JASSERT_ERRNO) (orig_area->size) (orig_area->addr)
+    .Text("error adding PROT_READ to mem region");
+  }
+
+  update_page_states(area.addr, numPages, pageState);
+
+  area.properties |= DMTCP_INCREMENTAL_AREA;
+  write_area_header(fd, &area);
+
+  for (size_t i = 0; i < numPages;) {
+    int state;
+    size_t next = next_page_run(pageState, numPages, i, &state);
+
+    if (state != PAGE_CLEAN) {
+      Area a = *orig_area;
+      a.addr = orig_area->addr + i * MTCP_PAGE_SIZE;
+      a.size = (next - i) * MTCP_PAGE_SIZE;
+      a.properties = state == PAGE_ZERO ? DMTCP_ZERO_PAGE
+                                        : DMTCP_INCREMENTAL_PAGES;
+      write_area_header(fd, &a);
+      if (state == PAGE_DIRTY) {
+        write_area_data(fd, a.addr, a.size);
+      }
+    }
+    i = next;
+  }
+
+  if ((orig_area->prot & PROT_READ) == 0) {
+    flush_area_data();
+    JASSERT(mprotect(orig_area->addr, orig_area->size, orig_area->prot) == 0)
+      (JASSERT_ERRNO) (orig_area->addr) (orig_area->size)
+    .Text("error removing PROT_READ from mem region.");
+  }
+}
+
+/* Decide how an area goes into the checkpoint image.  This may fill in
+ * area->name and area->properties, but writes nothing.
+ */
+static int
+prepare_memory_area(Area *area)
 {
   void *addr = area->addr;
 
+  /* An area that dmtcp_restart --lazy-restore mapped from a ckpt image is
+   * a private file mapping.  Its pages that were never touched are not
+   * present, but are not zero either; and madvise(MADV_DONTNEED) would bring
+   * back the image contents.  So write it in full, without its name.
+   */
+  bool mappedFromImage =
+    Util::strEndsWith(area->name, CKPT_FILE_SUFFIX) ||
+    Util::strEndsWith(area->name, CKPT_FILE_SUFFIX DELETED_FILE_SUFFIX);
+
   if (!(area->flags & MAP_ANONYMOUS)) {
     JTRACE("save region") (addr) (area->size) (area->name) (area->offset);
   } else if (area->name[0] == '\0') {
@@ -446,13 +802,15 @@ writememoryarea(int fd, Area *area, int stack_was_seen)
     /* Kernel won't let us munmap this.  But we don't need to restore it. */
     JTRACE("skipping over [stack] segment (not the orig stack)")
       (addr) (area->size);
+    return AREA_WRITE_SKIP;
   } else if (0 == strcmp(area->name, "[vsyscall]") ||
              0 == strcmp(area->name, "[vectors]") ||
              0 == strcmp(area->name, "[vvar]") ||
              0 == strcmp(area->name, "[vdso]")) {
     JTRACE("skipping over memory special section")
       (area->name) (addr) (area->size);
-  } else if (area->prot == 0 ||
+    return AREA_WRITE_SKIP;
+  } else if ((area->prot == 0 && !mappedFromImage) ||
              (area->name[0] == '\0' &&
               ((area->flags & MAP_ANONYMOUS) != 0) &&
               ((area->flags & MAP_PRIVATE) != 0))) {
@@ -460,22 +818,951 @@ writememoryarea(int fd, Area *area, int stack_was_seen)
      * Currently, we detect zero pages in non-rwx mapping and anonymous
      * mappings only
      */
+    return AREA_WRITE_ZERO_SCAN;
+  }
+
+  /* Anonymous sections need to have their data copied to the file,
+   *   as there is no file that contains their data
+   * We also save shared files to checkpoint file to handle shared memory
+   *   implemented with backing files
+   */
+  JASSERT((area->flags & MAP_ANONYMOUS) || (area->flags & MAP_SHARED));
+
+  if (skipWritingTextSegments && (area->prot & PROT_EXEC)) {
+    area->properties |= DMTCP_SKIP_WRITING_TEXT_SEGMENTS;
+    JTRACE("Skipping over text segments") (area->name) ((void *)area->addr);
+    return AREA_WRITE_HEADER_ONLY;
+  }
+  if (mappedFromImage) {
+    area->name[0] = '\0';
+  }
+  return AREA_WRITE_DATA;
+}
+
+static void
+writememoryarea(int fd, Area *area, int kind, char *pageState)
+{
+  switch (kind) {
+  case AREA_WRITE_ZERO_SCAN:
     mtcp_write_non_rwx_and_anonymous_pages(fd, area);
-  } else {
-    /* Anonymous sections need to have their data copied to the file,
-     *   as there is no file that contains their data
-     * We also save shared files to checkpoint file to handle shared memory
-     *   implemented with backing files
-     */
-    JASSERT((area->flags & MAP_ANONYMOUS) || (area->flags & MAP_SHARED));
+    break;
+
+  case AREA_WRITE_INCREMENTAL:
+    mtcp_write_incremental_pages(fd, area, pageState);
+    break;
+
+  case AREA_WRITE_HEADER_ONLY:
+    write_area_header(fd, area);
+    break;
+
+  case AREA_WRITE_DATA:
+    write_area_header(fd, area);
+    write_area_data(fd, area->addr, area->size);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/*****************************************************************************
+ *
+ *  Parallel writer (DMTCP_CKPT_WRITER_THREADS > 1).
+ *
+ *  The areas are first queued by mtcp_writememoryareas().  A pool of writer
+ *  threads then (1) scans the anonymous areas for zero pages, (2) the
+ *  checkpoint thread lays out every header and data range at a fixed file
+ *  offset, and (3) the writer threads pwrite() the ranges in parallel.
+ *  The resulting image is byte-for-byte what the serial writer would have
+ *  produced, so mtcp_restart reads it unchanged.
+ *
+ *  The writer threads are helper threads (ThreadList::startHelperThread()):
+ *  libc does not know them, and their stacks are mapped after
+ *  /proc/self/maps was read and unmapped before the checkpoint completes.
+ *  So they leave no trace in the image.  They share the TLS of this thread
+ *  and so must not use malloc, JNOTE and the like.  This mode requires a
+ *  seekable image fd, i.e., no gzip/hbict pipe.
+ *
+ *****************************************************************************/
+
+#define WRITER_SCAN_PAGES (64 * 1024 * 1024 / MTCP_PAGE_SIZE)
+#define WRITER_WRITE_SIZE (64 * 1024 * 1024)
+#define WRITER_MAX_THREADS 64
+#define WRITER_STACK_SIZE (1024 * 1024)
+
+typedef struct AreaWriteJob {
+  ProcMapsArea area;
+  int kind;
+  char *zeroPages;    /* AREA_WRITE_ZERO_SCAN: one flag per page */
+  char *bitmaps;      /* DMTCP_SPARSE_PAGES: one bitmap per chunk */
+  char *pageState;    /* AREA_WRITE_INCREMENTAL: one PageState per page */
+  size_t numPages;
+} AreaWriteJob;
+
+typedef struct AreaWriteUnit {
+  size_t job;
+  VA addr;
+  size_t size;
+  off_t offset;
+  uint64_t properties;
+  int isHeader;
+} AreaWriteUnit;
+
+typedef struct AreaScanUnit {
+  size_t job;
+  size_t firstPage;
+} AreaScanUnit;
+
+typedef enum WriterPhase {
+  WRITER_PHASE_SCAN,
+  WRITER_PHASE_WRITE
+} WriterPhase;
+
+static vector<AreaWriteJob> *writeJobs = NULL;
+static vector<AreaWriteUnit> *writeUnits = NULL;
+static vector<AreaScanUnit> *scanUnits = NULL;
+static volatile size_t nextWorkItem = 0;
+static int writerFd = -1;
+static WriterPhase writerPhase;
+
+static int
+get_num_writer_threads(int fd)
+{
+  const char *str = getenv(ENV_VAR_CKPT_WRITER_THREADS);
+
+  if (str == NULL) {
+    return 1;
+  }
+
+  int numThreads = atoi(str);
+  if (numThreads <= 1) {
+    return 1;
+  }
+  numThreads = MIN(numThreads, WRITER_MAX_THREADS);
+
+  if (CkptCompress::numThreads() > 0) {
+    JTRACE("Compressed ckpt image; using a single writer thread.");
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      lseek(fd, 0, SEEK_CUR) == -1) {
+    JTRACE("Ckpt image is not a regular file (compression?); "
+           "using a single writer thread.") (numThreads);
+    return 1;
+  }
+  return numThreads;
+}
+
+static void
+free_write_job(AreaWriteJob *job)
+{
+  if (job->zeroPages != NULL) {
+    JALLOC_HELPER_FREE(job->zeroPages);
+    job->zeroPages = NULL;
+  }
+  if (job->bitmaps != NULL) {
+    JALLOC_HELPER_FREE(job->bitmaps);
+    job->bitmaps = NULL;
+  }
+}
+
+static void
+free_write_queue()
+{
+  if (writeJobs != NULL) {
+    for (size_t j = 0; j < writeJobs->size(); j++) {
+      free_write_job(&(*writeJobs)[j]);
+    }
+  }
+  delete writeJobs;
+  delete writeUnits;
+  delete scanUnits;
+  writeJobs = NULL;
+  writeUnits = NULL;
+  scanUnits = NULL;
+}
+
+static void
+reset_write_queue(size_t numAreas)
+{
+  // The queue is still allocated if the previous checkpoint was interrupted
+  // by a restart (the image holds the queue as it was during the write).
+  free_write_queue();
+
+  writeJobs = new vector<AreaWriteJob>();
+  writeUnits = new vector<AreaWriteUnit>();
+  scanUnits = new vector<AreaScanUnit>();
+  writeJobs->reserve(numAreas);
+}
+
+static void
+queue_memory_area(Area *area, int kind, char *pageState)
+{
+  if (kind == AREA_WRITE_SKIP) {
+    return;
+  }
+
+  writeJobs->push_back(AreaWriteJob());
+  AreaWriteJob &job = writeJobs->back();
+  job.area = *area;
+  job.kind = kind;
+  job.zeroPages = NULL;
+  job.bitmaps = NULL;
+  job.pageState = pageState;
+  job.numPages = area->size / MTCP_PAGE_SIZE;
+
+  if (kind != AREA_WRITE_ZERO_SCAN && kind != AREA_WRITE_INCREMENTAL) {
+    return;
+  }
+
+  /* See mtcp_write_non_rwx_and_anonymous_pages().  PROT_READ is removed
+   * again after the area has been written.
+   */
+  JASSERT(area->name[0] == '\0' || (strcmp(area->name, "[heap]") == 0) ||
+          (strcmp(area->name, "[stack]") == 0) ||
+          (Util::strStartsWith(area->name, "[stack:XXX]")));
+  if ((area->prot & PROT_READ) == 0) {
+    JASSERT(mprotect(area->addr, area->size, area->prot | PROT_READ) == 0)
+      (JASSERT_ERRNO) (area->size) (area->addr)
+    .Text("error adding PROT_READ to mem region");
+  }
+
+}
+
+/* Allocate the zero-page flags and split the scans into units.  This is
+ * done only once all the areas have been walked; see mtcp_writememoryareas().
+ */
+static void
+queue_scan_units()
+{
+  bool infiniband = dmtcp_infiniband_enabled && dmtcp_infiniband_enabled();
+
+  for (size_t j = 0; j < writeJobs->size(); j++) {
+    AreaWriteJob &job = (*writeJobs)[j];
+
+    if (job.kind == AREA_WRITE_ZERO_SCAN && !infiniband) {
+      job.zeroPages = (char *)JALLOC_HELPER_MALLOC(job.numPages);
+    } else if (job.kind != AREA_WRITE_INCREMENTAL) {
+      continue;
+    }
+    for (size_t i = 0; i < job.numPages; i += WRITER_SCAN_PAGES) {
+      AreaScanUnit unit = { j, i };
+      scanUnits->push_back(unit);
+    }
+  }
+}
+
+static void
+writer_scan_unit(size_t n)
+{
+  AreaWriteJob &job = (*writeJobs)[(*scanUnits)[n].job];
+  size_t first = (*scanUnits)[n].firstPage;
+  size_t numPages = MIN((size_t)WRITER_SCAN_PAGES, job.numPages - first);
+  VA addr = job.area.addr + first * MTCP_PAGE_SIZE;
+
+  if (job.kind == AREA_WRITE_INCREMENTAL) {
+    update_page_states(addr, numPages, job.pageState + first);
+    return;
+  }
 
-    if (skipWritingTextSegments && (area->prot & PROT_EXEC)) {
-      area->properties |= DMTCP_SKIP_WRITING_TEXT_SEGMENTS;
-      Util::writeAll(fd, area, sizeof(*area));
-      JTRACE("Skipping over text segments") (area->name) ((void *)area->addr);
+  Util::scanZeroPages(addr, numPages, job.zeroPages + first);
+  madvise_zero_runs(addr, job.zeroPages + first, numPages, false);
+}
+
+static void
+writer_write_unit(size_t n)
+{
+  const AreaWriteUnit &unit = (*writeUnits)[n];
+  const AreaWriteJob &job = (*writeJobs)[unit.job];
+  const char *buf = unit.addr;
+  Area a;
+
+  if (unit.isHeader) {
+    a = job.area;
+    a.addr = unit.addr;
+    a.size = unit.size;
+    a.properties = unit.properties;
+    buf = (const char *)&a;
+  }
+
+  // Signals are blocked and the image is a regular file: no EINTR/EAGAIN.
+  size_t len = unit.isHeader ? sizeof(a) : unit.size;
+  size_t num_written = 0;
+  while (num_written < len) {
+    long rc = _real_syscall(SYS_pwrite64, writerFd, buf + num_written,
+                            len - num_written, unit.offset + num_written);
+    JASSERT(rc > 0) (rc) (len) (unit.offset)
+    .Text("error writing checkpoint image");
+    num_written += rc;
+  }
+}
+
+static void
+writer_loop()
+{
+  size_t total = writerPhase == WRITER_PHASE_SCAN ? scanUnits->size()
+                                                  : writeUnits->size();
+
+  while (1) {
+    size_t n = __sync_fetch_and_add(&nextWorkItem, 1);
+    if (n >= total) {
+      break;
+    }
+    if (writerPhase == WRITER_PHASE_SCAN) {
+      writer_scan_unit(n);
+    } else {
+      writer_write_unit(n);
+    }
+  }
+}
+
+static int
+writer_thread(void *arg)
+{
+  writer_loop();
+  return 0;
+}
+
+/* Run the current phase on numThreads threads, including this one. */
+static void
+run_writer_phase(WriterPhase phase, int numThreads)
+{
+  ThreadList::HelperThread threads[WRITER_MAX_THREADS];
+  int numStarted = 0;
+
+  writerPhase = phase;
+  nextWorkItem = 0;
+
+  for (int i = 1; i < numThreads; i++) {
+    if (!ThreadList::startHelperThread(&threads[numStarted], writer_thread,
+                                       NULL, WRITER_STACK_SIZE)) {
+      JTRACE("Failed to create writer thread; continuing with fewer threads")
+        (i) (JASSERT_ERRNO);
+      break;
+    }
+    numStarted++;
+  }
+
+  writer_loop();
+  for (int i = 0; i < numStarted; i++) {
+    ThreadList::joinHelperThread(&threads[i]);
+  }
+}
+
+/* Queue the data at addr..addr+size at offset.  Returns the offset past the
+ * data.
+ */
+static off_t
+layout_data_range(size_t j, VA addr, size_t size, off_t offset)
+{
+  for (size_t done = 0; done < size; done += WRITER_WRITE_SIZE) {
+    AreaWriteUnit data;
+    data.job = j;
+    data.addr = addr + done;
+    data.size = MIN((size_t)WRITER_WRITE_SIZE, size - done);
+    data.offset = offset + done;
+    data.properties = 0;
+    data.isHeader = 0;
+    writeUnits->push_back(data);
+  }
+  return offset + size;
+}
+
+/* Queue an Area header for addr..addr+size at offset, followed by the data
+ * if hasData.  Returns the offset past the range.
+ */
+static off_t
+layout_area_range(size_t j, VA addr, size_t size, uint64_t properties,
+                  bool hasData, off_t offset)
+{
+  AreaWriteUnit unit;
+
+  unit.job = j;
+  unit.addr = addr;
+  unit.size = size;
+  unit.properties = properties;
+  unit.isHeader = 1;
+  unit.offset = offset;
+  writeUnits->push_back(unit);
+  add_index_entry(addr, size, properties, offset);
+  offset += sizeof(Area);
+
+  if (hasData) {
+    offset = layout_data_range(j, addr, size, offset);
+  }
+  return offset;
+}
+
+/* Same records as mtcp_write_non_rwx_and_anonymous_pages().  The bitmaps of
+ * a DMTCP_SPARSE_PAGES area are built here and written from job->bitmaps.
+ */
+static off_t
+layout_zero_scan_area(size_t j, off_t offset)
+{
+  AreaWriteJob &job = (*writeJobs)[j];
+  VA addr = job.area.addr;
+
+  if (job.zeroPages == NULL) {
+    return layout_area_range(j, addr, job.area.size, 0, true, offset);
+  }
+
+  size_t numZero = 0;
+  for (size_t i = 0; i < job.numPages; i++) {
+    numZero += job.zeroPages[i];
+  }
+  uint64_t properties = zero_scan_properties(job.numPages, numZero);
+  if (properties != DMTCP_SPARSE_PAGES) {
+    return layout_area_range(j, addr, job.area.size, properties,
+                             properties == 0, offset);
+  }
+
+  size_t numChunks = (job.numPages + DMTCP_SPARSE_CHUNK_PAGES - 1) /
+    DMTCP_SPARSE_CHUNK_PAGES;
+  job.bitmaps = (char *)JALLOC_HELPER_MALLOC(numChunks *
+                                             DMTCP_SPARSE_BITMAP_SIZE);
+  offset = layout_area_range(j, addr, job.area.size, properties, false,
+                             offset);
+  for (size_t c = 0; c < job.numPages; c += DMTCP_SPARSE_CHUNK_PAGES) {
+    size_t n = MIN(job.numPages - c, (size_t)DMTCP_SPARSE_CHUNK_PAGES);
+    char *bitmap = job.bitmaps +
+      (c / DMTCP_SPARSE_CHUNK_PAGES) * DMTCP_SPARSE_BITMAP_SIZE;
+    fill_sparse_bitmap(job.zeroPages + c, n, bitmap);
+    offset = layout_data_range(j, bitmap, DMTCP_SPARSE_BITMAP_SIZE, offset);
+    for (size_t i = c; i < c + n;) {
+      size_t next = next_zero_run(job.zeroPages, c + n, i);
+      if (!job.zeroPages[i]) {
+        offset = layout_data_range(j, addr + i * MTCP_PAGE_SIZE,
+                                   (next - i) * MTCP_PAGE_SIZE, offset);
+      }
+      i = next;
+    }
+  }
+  return offset;
+}
+
+/* Lay out the header and data ranges of each job, exactly as the serial
+ * writer would have produced them.  Returns the end of the image data.
+ */
+static off_t
+layout_queued_memory_areas(off_t offset)
+{
+  for (size_t j = 0; j < writeJobs->size(); j++) {
+    AreaWriteJob &job = (*writeJobs)[j];
+    VA addr = job.area.addr;
+
+    switch (job.kind) {
+    case AREA_WRITE_HEADER_ONLY:
+    case AREA_WRITE_DATA:
+      offset = layout_area_range(j, addr, job.area.size, job.area.properties,
+                                 job.kind == AREA_WRITE_DATA, offset);
+      break;
+
+    case AREA_WRITE_ZERO_SCAN:
+      offset = layout_zero_scan_area(j, offset);
+      break;
+
+    case AREA_WRITE_INCREMENTAL:
+    {
+      /* Same records as mtcp_write_incremental_pages(). */
+      size_t numPages = job.area.size / MTCP_PAGE_SIZE;
+      offset = layout_area_range(j, addr, job.area.size,
+                                 job.area.properties | DMTCP_INCREMENTAL_AREA,
+                                 false, offset);
+      for (size_t i = 0; i < numPages;) {
+        int state;
+        size_t next = next_page_run(job.pageState, numPages, i, &state);
+        if (state != PAGE_CLEAN) {
+          offset = layout_area_range(j, addr + i * MTCP_PAGE_SIZE,
+                                     (next - i) * MTCP_PAGE_SIZE,
+                                     state == PAGE_ZERO
+                                       ? DMTCP_ZERO_PAGE
+                                       : DMTCP_INCREMENTAL_PAGES,
+                                     state == PAGE_DIRTY, offset);
+        }
+        i = next;
+      }
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+  return offset;
+}
+
+static void
+write_queued_memory_areas(int fd, int numThreads)
+{
+  writerFd = fd;
+  queue_scan_units();
+  run_writer_phase(WRITER_PHASE_SCAN, numThreads);
+
+  off_t start = lseek(fd, 0, SEEK_CUR);
+  JASSERT(start != -1) (JASSERT_ERRNO);
+  off_t end = layout_queued_memory_areas(start);
+
+  JTRACE("Writing memory areas in parallel")
+    (numThreads) (writeJobs->size()) (writeUnits->size()) (end - start);
+  run_writer_phase(WRITER_PHASE_WRITE, numThreads);
+
+  JASSERT(lseek(fd, end, SEEK_SET) == end) (JASSERT_ERRNO);
+
+  /* Now remove the PROT_READ again; see queue_memory_area(). */
+  for (size_t j = 0; j < writeJobs->size(); j++) {
+    AreaWriteJob &job = (*writeJobs)[j];
+    if ((job.kind == AREA_WRITE_ZERO_SCAN ||
+         job.kind == AREA_WRITE_INCREMENTAL) &&
+        (job.area.prot & PROT_READ) == 0) {
+      JASSERT(mprotect(job.area.addr, job.area.size, job.area.prot) == 0)
+        (JASSERT_ERRNO) (job.area.addr) (job.area.size)
+      .Text("error removing PROT_READ from mem region.");
+    }
+    free_write_job(&job);
+  }
+
+  // As with procSelfMaps, we never return here on restart, so free now.
+  delete writeJobs;
+  delete writeUnits;
+  delete scanUnits;
+  writeJobs = NULL;
+  writeUnits = NULL;
+  scanUnits = NULL;
+}
+
+/*****************************************************************************
+ *
+ *  Incremental checkpoints (DMTCP_CKPT_INCREMENTAL=N).
+ *
+ *  After each checkpoint, the soft-dirty bits of the process are cleared
+ *  (/proc/self/clear_refs).  At the next checkpoint, a private anonymous
+ *  area ("", [heap], [stack]) that has the same address, size, protection
+ *  and name as in the previous image is written incrementally: only the
+ *  pages whose soft-dirty bit is set in /proc/self/pagemap go to the image,
+ *  and the MTCP header names the previous image as the parent.  All other
+ *  areas are written in full.  mtcp_restart replays the chain of parent
+ *  images, oldest first, and then the newest image.
+ *
+ *  The bits are snapshotted and cleared before any area is written, and
+ *  each area is checked once more right before it is written.  So the
+ *  image is as consistent as a full one, even though the checkpoint thread
+ *  keeps writing to memory (e.g., the JAlloc arenas) during the checkpoint.
+ *
+ *  After N incremental images, or after a restart, the next image is a full
+ *  one.  Incremental images need a seekable, uncompressed image, and a new
+ *  image name for each generation (e.g., the unique-ckpt plugin), since the
+ *  parent images must still exist on restart.
+ *
+ *****************************************************************************/
+
+#define PAGEMAP_BATCH     512
+#define PM_SOFT_DIRTY     (1ULL << 55)
+#define PM_SWAPPED        (1ULL << 62)
+#define PM_PRESENT        (1ULL << 63)
+#define CLEAR_SOFT_DIRTY  "4"
+
+typedef struct IncrementalArea {
+  VA addr;
+  size_t size;
+  int prot;
+  int flags;
+  char name[32];
+} IncrementalArea;
+
+typedef struct DirtyPageSnapshot {
+  VA addr;
+  size_t size;
+  char *pageState;
+} DirtyPageSnapshot;
+
+// These are updated only after the image has been written.  So, a restarted
+// process sees the state of the previous generation, and numRestarts tells
+// it that the parent is stale.
+static bool trackDirtyPages = false;
+static bool writeIncremental = false;
+static int pagemapFd = -1;
+static int parentChainLength = 0;
+static uint32_t parentNumRestarts = 0;
+static string *parentImage = NULL;
+static string *currentImage = NULL;
+static vector<IncrementalArea> *parentAreas = NULL;
+static vector<IncrementalArea> *currentAreas = NULL;
+static vector<DirtyPageSnapshot> *dirtySnapshots = NULL;
+
+static bool
+clear_soft_dirty_bits()
+{
+  int fd = _real_open("/proc/self/clear_refs", O_WRONLY);
+
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = Util::writeAll(fd, CLEAR_SOFT_DIRTY, strlen(CLEAR_SOFT_DIRTY)) ==
+            (ssize_t)strlen(CLEAR_SOFT_DIRTY);
+  _real_close(fd);
+  return ok;
+}
+
+static void
+read_pagemap(VA addr, size_t numPages, uint64_t *entries)
+{
+  size_t len = numPages * sizeof(uint64_t);
+  off_t offset = ((uintptr_t)addr / MTCP_PAGE_SIZE) * sizeof(uint64_t);
+
+  // Not pread(): this runs in the writer threads; see update_page_states().
+  JASSERT(_real_syscall(SYS_pread64, pagemapFd, entries, len, offset) ==
+          (long)len) ((void *)addr) (numPages)
+  .Text("error reading /proc/self/pagemap");
+}
+
+/* Without CONFIG_MEM_SOFT_DIRTY, clear_refs accepts "4" but pagemap never
+ * reports a soft-dirty page.  So, dirty a page and look.
+ */
+static bool
+soft_dirty_supported()
+{
+  bool supported = false;
+  char *page = (char *)mmap(NULL, MTCP_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  JASSERT(page != MAP_FAILED) (JASSERT_ERRNO);
+  if (clear_soft_dirty_bits()) {
+    uint64_t entry;
+    page[0] = 1;
+    read_pagemap(page, 1, &entry);
+    supported = (entry & PM_SOFT_DIRTY) != 0;
+  }
+  JASSERT(munmap(page, MTCP_PAGE_SIZE) == 0) (JASSERT_ERRNO);
+  return supported;
+}
+
+static void
+free_dirty_page_snapshots()
+{
+  if (dirtySnapshots != NULL) {
+    for (size_t i = 0; i < dirtySnapshots->size(); i++) {
+      JALLOC_HELPER_FREE((*dirtySnapshots)[i].pageState);
+    }
+  }
+  delete dirtySnapshots;
+  delete currentAreas;
+  dirtySnapshots = NULL;
+  currentAreas = NULL;
+}
+
+static void
+reset_incremental_parent()
+{
+  delete parentImage;
+  delete parentAreas;
+  parentImage = NULL;
+  parentAreas = NULL;
+  parentChainLength = 0;
+}
+
+/* Called by CkptSerializer::writeCkptImage() before the MTCP header is
+ * written.  Decides whether this image will be incremental, and if so,
+ * records the parent image in the header.
+ */
+void
+mtcp_prepare_incremental_ckpt(int fd, void *mtcpHdr)
+{
+  MtcpHeader *hdr = (MtcpHeader *)mtcpHdr;
+  const char *str = getenv(ENV_VAR_CKPT_INCREMENTAL);
+  int maxChainLength = str == NULL ? 0 : atoi(str);
+  struct stat st;
+
+  // Left over if the previous checkpoint was interrupted by a restart.  The
+  // pagemap fd was not restored; its number may now belong to another file.
+  free_dirty_page_snapshots();
+  pagemapFd = -1;
+  trackDirtyPages = false;
+  writeIncremental = false;
+
+  if (maxChainLength <= 0) {
+    reset_incremental_parent();
+    return;
+  }
+  maxChainLength = MIN(maxChainLength, MTCP_MAX_PARENT_IMAGES - 1);
+
+  if (getenv(ENV_VAR_FORKED_CKPT) != NULL) {
+    // The child process would clear its own soft-dirty bits, not ours.
+    JTRACE("Incremental checkpoints are not used with forked checkpointing");
+    reset_incremental_parent();
+    return;
+  }
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    JTRACE("Ckpt image is not a regular file (compression?); "
+           "writing a full image.");
+    reset_incremental_parent();
+    return;
+  }
+
+  string ckptFilename = ProcessInfo::instance().getCkptFilename();
+  if (ckptFilename[0] != '/') {
+    ckptFilename = jalib::Filesystem::GetCWD() + "/" + ckptFilename;
+  }
+
+  if (parentImage != NULL &&
+      (parentNumRestarts != ProcessInfo::instance().numRestarts() ||
+       parentChainLength >= maxChainLength ||
+       *parentImage == ckptFilename ||
+       parentImage->length() >= MTCP_PARENT_IMAGE_LEN ||
+       access(parentImage->c_str(), R_OK) != 0)) {
+    JTRACE("Writing a full image") (*parentImage) (ckptFilename)
+      (parentChainLength) (parentNumRestarts);
+    reset_incremental_parent();
+  }
+
+  pagemapFd = _real_open("/proc/self/pagemap", O_RDONLY);
+  JASSERT(pagemapFd != -1) (JASSERT_ERRNO);
+
+  if (parentImage == NULL && !soft_dirty_supported()) {
+    static bool warned = false;
+    JWARNING(warned) .Text("Soft-dirty page tracking is not available;\n"
+                           "    incremental checkpoints are disabled.");
+    warned = true;
+    _real_close(pagemapFd);
+    pagemapFd = -1;
+    return;
+  }
+
+  trackDirtyPages = true;
+  writeIncremental = parentImage != NULL;
+  if (writeIncremental) {
+    strcpy(hdr->parent_image, parentImage->c_str());
+  }
+
+  delete currentImage;
+  currentImage = new string(ckptFilename);
+  dirtySnapshots = new vector<DirtyPageSnapshot>();
+  currentAreas = new vector<IncrementalArea>();
+  JTRACE("Incremental checkpoint") (writeIncremental) (ckptFilename)
+    (hdr->parent_image);
+}
+
+/* Only private anonymous memory has a well-defined value for pages that
+ * are not present (zero).  This is checked before mtcp_writememoryareas()
+ * rewrites the flags and names.
+ */
+static bool
+is_incremental_candidate(const Area *area)
+{
+  return trackDirtyPages &&
+         (area->flags & MAP_PRIVATE) &&
+         (area->name[0] == '\0' ||
+          strcmp(area->name, "[heap]") == 0 ||
+          Util::strStartsWith(area->name, "[stack"));
+}
+
+static const IncrementalArea *
+find_incremental_area(const vector<IncrementalArea> *areas, VA addr)
+{
+  if (areas == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < areas->size(); i++) {
+    if ((*areas)[i].addr == addr) {
+      return &(*areas)[i];
+    }
+  }
+  return NULL;
+}
+
+/* Nothing may be allocated while walking the memory areas; see
+ * mtcp_writememoryareas().  So make room for one entry per area beforehand.
+ */
+static void
+reserve_incremental_areas(size_t numAreas)
+{
+  if (!trackDirtyPages) {
+    return;
+  }
+  dirtySnapshots->reserve(numAreas);
+  currentAreas->reserve(numAreas);
+}
+
+/* The number of runs of dirty pages in the snapshots; see
+ * begin_image_index().
+ */
+static size_t
+count_dirty_runs()
+{
+  size_t numRuns = 0;
+
+  if (dirtySnapshots == NULL) {
+    return 0;
+  }
+  for (size_t i = 0; i < dirtySnapshots->size(); i++) {
+    const DirtyPageSnapshot &snapshot = (*dirtySnapshots)[i];
+    size_t numPages = snapshot.size / MTCP_PAGE_SIZE;
+    for (size_t j = 0; j < numPages; j++) {
+      if (snapshot.pageState[j] == PAGE_DIRTY &&
+          (j == 0 || snapshot.pageState[j - 1] != PAGE_DIRTY)) {
+        numRuns++;
+      }
+    }
+  }
+  return numRuns;
+}
+
+/* Remember which pages of area were dirtied since the parent image. */
+static void
+snapshot_dirty_pages(const Area *area)
+{
+  const IncrementalArea *parent;
+
+  if (!writeIncremental) {
+    return;
+  }
+  parent = find_incremental_area(parentAreas, area->addr);
+  if (parent == NULL || parent->size != area->size) {
+    return;
+  }
+
+  DirtyPageSnapshot snapshot;
+  size_t numPages = area->size / MTCP_PAGE_SIZE;
+  uint64_t entries[PAGEMAP_BATCH];
+
+  snapshot.addr = area->addr;
+  snapshot.size = area->size;
+  snapshot.pageState = (char *)JALLOC_HELPER_MALLOC(numPages);
+  for (size_t i = 0; i < numPages; i += PAGEMAP_BATCH) {
+    size_t n = MIN((size_t)PAGEMAP_BATCH, numPages - i);
+    read_pagemap(area->addr + i * MTCP_PAGE_SIZE, n, entries);
+    for (size_t j = 0; j < n; j++) {
+      snapshot.pageState[i + j] =
+        (entries[j] & PM_SOFT_DIRTY) ? PAGE_DIRTY : PAGE_CLEAN;
+    }
+  }
+  dirtySnapshots->push_back(snapshot);
+}
+
+static void
+begin_incremental_ckpt()
+{
+  if (trackDirtyPages) {
+    JASSERT(clear_soft_dirty_bits()) (JASSERT_ERRNO)
+    .Text("error clearing soft-dirty bits");
+  }
+}
+
+/* Returns the page states of area if it can be written incrementally, or
+ * NULL if it must be written in full.  Either way, the area is recorded as
+ * a possible parent for the next image.
+ */
+static char *
+get_incremental_pages(const Area *area, int kind)
+{
+  if (kind != AREA_WRITE_DATA && kind != AREA_WRITE_ZERO_SCAN) {
+    return NULL;
+  }
+
+  IncrementalArea current;
+  current.addr = area->addr;
+  current.size = area->size;
+  current.prot = area->prot;
+  current.flags = area->flags;
+  strncpy(current.name, area->name, sizeof(current.name));
+  current.name[sizeof(current.name) - 1] = '\0';
+  currentAreas->push_back(current);
+
+  const IncrementalArea *parent = find_incremental_area(parentAreas,
+                                                        area->addr);
+  if (!writeIncremental || parent == NULL ||
+      parent->size != current.size || parent->prot != current.prot ||
+      parent->flags != current.flags ||
+      strcmp(parent->name, current.name) != 0) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < dirtySnapshots->size(); i++) {
+    if ((*dirtySnapshots)[i].addr == area->addr &&
+        (*dirtySnapshots)[i].size == area->size) {
+      return (*dirtySnapshots)[i].pageState;
+    }
+  }
+  return NULL;
+}
+
+/* Combine the snapshot taken before the soft-dirty bits were cleared with
+ * the bits set since then.  A page that is not present (nor swapped out) is
+ * zero.  So is a clean page that reads as zero: after
+ * madvise(MADV_DONTNEED), a read fault maps the zero page without setting
+ * the soft-dirty bit.  The area must be readable.  This runs in the writer
+ * threads of the parallel writer too, so it must not allocate or log.
+ */
+static void
+update_page_states(VA addr, size_t numPages, char *pageState)
+{
+  uint64_t entries[PAGEMAP_BATCH];
+
+  for (size_t i = 0; i < numPages; i += PAGEMAP_BATCH) {
+    size_t n = MIN((size_t)PAGEMAP_BATCH, numPages - i);
+    read_pagemap(addr + i * MTCP_PAGE_SIZE, n, entries);
+    for (size_t j = 0; j < n; j++) {
+      char *state = &pageState[i + j];
+      VA page = addr + (i + j) * MTCP_PAGE_SIZE;
+      if ((entries[j] & (PM_PRESENT | PM_SWAPPED)) == 0) {
+        *state = PAGE_ZERO;
+      } else if (*state == PAGE_DIRTY || (entries[j] & PM_SOFT_DIRTY)) {
+        *state = PAGE_DIRTY;
+      } else if ((entries[j] & PM_PRESENT) && Util::areZeroPages(page, 1)) {
+        *state = PAGE_ZERO;
+      } else {
+        *state = PAGE_CLEAN;
+      }
+    }
+  }
+}
+
+/* Returns the end of the run of pages starting at first, all in the same
+ * state.  A single clean or zero page between dirty pages is absorbed in
+ * the dirty run, since its Area header would take as much space.
+ */
+static size_t
+next_page_run(const char *pageState, size_t numPages, size_t first,
+              int *state)
+{
+  size_t next = first + 1;
+
+  *state = pageState[first];
+  while (next < numPages) {
+    if (pageState[next] == *state) {
+      next++;
+    } else if (*state == PAGE_DIRTY && next + 1 < numPages &&
+               pageState[next + 1] == PAGE_DIRTY) {
+      next += 2;
     } else {
-      Util::writeAll(fd, area, sizeof(*area));
-      Util::writeAll(fd, area->addr, area->size);
+      break;
     }
   }
+  return next;
+}
+
+static void
+end_incremental_ckpt()
+{
+  if (!trackDirtyPages) {
+    return;
+  }
+
+  // This image is the parent of the next one.
+  delete parentImage;
+  delete parentAreas;
+  parentImage = currentImage;
+  parentAreas = currentAreas;
+  currentImage = NULL;
+  currentAreas = NULL;
+  parentNumRestarts = ProcessInfo::instance().numRestarts();
+  parentChainLength = writeIncremental ? parentChainLength + 1 : 0;
+
+  free_dirty_page_snapshots();
+  _real_close(pagemapFd);
+  pagemapFd = -1;
+  trackDirtyPages = false;
+  writeIncremental = false;
 }
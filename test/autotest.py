@@ -910,6 +910,33 @@ os.environ['DMTCP_GZIP'] = "1"
 runTest("gzip",          1, ["./test/dmtcp1"])
 os.environ['DMTCP_GZIP'] = GZIP
 
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_CKPT_WRITER_THREADS'] = "4"
+runTest("writer-threads", 1, ["./test/dmtcp1"])
+del os.environ['DMTCP_CKPT_WRITER_THREADS']
+os.environ['DMTCP_GZIP'] = GZIP
+
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_CKPT_INCREMENTAL'] = "4"
+runTest("incremental",   1, ["./test/dmtcp1"])
+del os.environ['DMTCP_CKPT_INCREMENTAL']
+os.environ['DMTCP_GZIP'] = GZIP
+
+os.environ['DMTCP_CKPT_COMPRESS'] = "4"
+runTest("compress",      1, ["./test/dmtcp1"])
+del os.environ['DMTCP_CKPT_COMPRESS']
+
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_LAZY_RESTORE'] = "1"
+runTest("lazy-restore",  1, ["./test/dmtcp1"])
+del os.environ['DMTCP_LAZY_RESTORE']
+os.environ['DMTCP_GZIP'] = GZIP
+
+os.environ['DMTCP_FORKED_CHECKPOINT'] = "1"
+runTest("forked-ckpt",   1, ["./test/dmtcp1"])
+runTest("forked-ckpt-threads", 1, ["./test/dmtcp2"])
+del os.environ['DMTCP_FORKED_CHECKPOINT']
+
 if HAS_READLINE == "yes":
   runTest("readline",    1,  ["./test/readline"])
 
@@ -0,0 +1,223 @@
+#!/usr/bin/env python
+#
+# Checkpoint/restart benchmark.  Runs ckptworkload under dmtcp_launch with a
+# private coordinator, checkpoints it, kills it and restarts it, a number of
+# times.  Each cycle is reported as one line of JSON:
+#
+#   {"workload": {...}, "generation": N,
+#    "checkpoint": {"pause_ms", "command_ms", "image_bytes",
+#                   "write_mb_per_s", "phases": {...}},
+#    "restart": {"time_ms", "phases": {...}}}
+#
+# The phases come from the timeline that the coordinator writes with
+# --trace-dir: for each "category/name" (barrier/PLUGIN::BARRIER,
+# callback/PLUGIN::BARRIER, ckpt/write image, ...), the longest duration in
+# ms among the processes; "coordinator/..." is the time from the release of a
+# barrier until all of the processes reached it.
+#
+# Usage:  ckptbench.py [--mem MB] [--zero FRACTION] [--threads N] ...
+#         (see --help)
+
+from __future__ import print_function
+
+import argparse
+import glob
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+parser = argparse.ArgumentParser(
+  description='Measure the checkpoint and restart of a synthetic workload.')
+parser.add_argument('--bin', default=os.path.join(os.path.dirname(
+                      os.path.abspath(__file__)), '..', '..', 'bin'),
+                    help='Directory of dmtcp_launch, etc. (default: ../../bin)')
+parser.add_argument('--mem', type=int, default=64,
+                    help='Anonymous memory per process, in MB (default: 64)')
+parser.add_argument('--zero', type=float, default=0.5,
+                    help='Fraction of the memory left zero (default: 0.5)')
+parser.add_argument('--threads', type=int, default=1,
+                    help='Threads per process (default: 1)')
+parser.add_argument('--fds', type=int, default=0,
+                    help='Open files per process (default: 0)')
+parser.add_argument('--sockets', type=int, default=0,
+                    help='TCP socket pairs per process (default: 0)')
+parser.add_argument('--shm', type=int, default=0,
+                    help='SysV shared memory, in MB (default: 0)')
+parser.add_argument('--procs', type=int, default=1,
+                    help='Number of processes (default: 1)')
+parser.add_argument('--cycles', type=int, default=3,
+                    help='Checkpoint/restart cycles (default: 3)')
+parser.add_argument('--gzip', action='store_true',
+                    help='Compress the images (default: off)')
+parser.add_argument('--launch-args', default='',
+                    help='More options for dmtcp_launch, e.g. '
+                         '"--ckpt-writer-threads 4"')
+parser.add_argument('--timeout', type=float, default=300,
+                    help='Seconds to wait for each step (default: 300)')
+parser.add_argument('--output', default='-',
+                    help='File to append the results to (default: stdout)')
+parser.add_argument('--keep', action='store_true',
+                    help='Keep the images and traces in the work directory')
+
+args = parser.parse_args()
+
+INTERVAL = 0.01
+
+def binary(name):
+  return os.path.join(args.bin, name)
+
+def waitFor(test, what):
+  deadline = time.time() + args.timeout
+  while not test():
+    if time.time() > deadline:
+      raise RuntimeError('timed out waiting for ' + what)
+    time.sleep(INTERVAL)
+
+def coordinatorCmd(port, *cmd):
+  return subprocess.check_output([binary('dmtcp_command'), '-p', str(port)] +
+                                 list(cmd)).decode()
+
+def getStatus(port):
+  status = {}
+  for line in coordinatorCmd(port, '-s').splitlines():
+    if '=' in line:
+      key, val = line.strip().split('=', 1)
+      status[key] = val
+  return int(status.get('NUM_PEERS', 0)), status.get('RUNNING') == 'yes'
+
+def isRunning(port, numPeers):
+  return getStatus(port) == (numPeers, True)
+
+def readTrace(traceDir, generation, kind):
+  pattern = '%s/dmtcp_trace_*_%05d_%s.json' % (traceDir, generation, kind)
+  files = glob.glob(pattern)
+  if not files:
+    return None
+  with open(files[0]) as f:
+    return json.load(f)['traceEvents']
+
+def phases(events):
+  result = {}
+  for e in events:
+    if e['ph'] != 'X':
+      continue
+    if e['pid'] == 0:
+      key = 'coordinator/' + e['name']
+    else:
+      key = e['cat'] + '/' + e['name']
+    result[key] = max(result.get(key, 0), e['dur'] / 1000.0)
+  return result
+
+def span(events, name=None):
+  spans = [e for e in events
+           if e['ph'] == 'X' and (name is None or e['name'] == name)]
+  if not spans:
+    return 0
+  start = min(e['ts'] for e in spans)
+  end = max(e['ts'] + e['dur'] for e in spans)
+  return (end - start) / 1e6
+
+def imageBytes(ckptDir):
+  return sum(os.path.getsize(f)
+             for f in glob.glob(os.path.join(ckptDir, 'ckpt_*.dmtcp')))
+
+def main():
+  workDir = tempfile.mkdtemp(prefix='ckptbench-')
+  ckptDir = os.path.join(workDir, 'ckpt')
+  traceDir = os.path.join(workDir, 'trace')
+  portFile = os.path.join(workDir, 'port')
+  readyFile = os.path.join(workDir, 'ready')
+  os.mkdir(ckptDir)
+  os.mkdir(traceDir)
+
+  env = dict(os.environ)
+  env['DMTCP_GZIP'] = '1' if args.gzip else '0'
+  env['DMTCP_CHECKPOINT_DIR'] = ckptDir
+
+  coordinator = subprocess.Popen([binary('dmtcp_coordinator'), '-q', '-q',
+                                  '-p', '0', '--port-file', portFile,
+                                  '--ckptdir', ckptDir,
+                                  '--trace-dir', traceDir],
+                                 stdin=open(os.devnull), env=env)
+  out = sys.stdout if args.output == '-' else open(args.output, 'a')
+  port = None
+  try:
+    waitFor(lambda: os.path.exists(portFile) and
+                    os.path.getsize(portFile) > 0, 'the coordinator')
+    port = int(open(portFile).read())
+
+    workload = {'mem_mb': args.mem, 'zero_fraction': args.zero,
+                'threads': args.threads, 'fds': args.fds,
+                'sockets': args.sockets, 'shm_mb': args.shm,
+                'procs': args.procs, 'gzip': args.gzip,
+                'launch_args': args.launch_args}
+    cmd = [binary('dmtcp_launch'), '-j', '-p', str(port)]
+    cmd += args.launch_args.split()
+    cmd += [os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         'ckptworkload'),
+            '-m', str(args.mem), '-z', str(args.zero),
+            '-t', str(args.threads), '-f', str(args.fds),
+            '-s', str(args.sockets), '-S', str(args.shm),
+            '-p', str(args.procs), '-r', readyFile]
+    subprocess.Popen(cmd, stdin=open(os.devnull), env=env)
+    waitFor(lambda: os.path.exists(readyFile), 'the workload')
+    waitFor(lambda: isRunning(port, args.procs), 'the workload')
+
+    for cycle in range(args.cycles):
+      generation = cycle + 1
+
+      start = time.time()
+      coordinatorCmd(port, '-bc')
+      commandTime = time.time() - start
+      waitFor(lambda: readTrace(traceDir, generation, 'ckpt') is not None,
+              'the checkpoint trace')
+      ckptEvents = readTrace(traceDir, generation, 'ckpt')
+      size = imageBytes(ckptDir)
+      writeTime = span(ckptEvents, 'write image')
+
+      coordinatorCmd(port, '-k')
+      waitFor(lambda: getStatus(port)[0] == 0, 'the workload to exit')
+
+      start = time.time()
+      subprocess.Popen([binary('dmtcp_restart'), '-j', '-p', str(port)] +
+                       glob.glob(os.path.join(ckptDir, 'ckpt_*.dmtcp')),
+                       stdin=open(os.devnull), env=env)
+      waitFor(lambda: isRunning(port, args.procs), 'the restart')
+      restartTime = time.time() - start
+      waitFor(lambda: readTrace(traceDir, generation, 'restart') is not None,
+              'the restart trace')
+      rstEvents = readTrace(traceDir, generation, 'restart')
+
+      result = {
+        'workload': workload,
+        'generation': generation,
+        'checkpoint': {
+          'pause_ms': span(ckptEvents) * 1000,
+          'command_ms': commandTime * 1000,
+          'image_bytes': size,
+          'write_mb_per_s': size / writeTime / 1e6 if writeTime > 0 else None,
+          'phases': phases(ckptEvents),
+        },
+        'restart': {
+          'time_ms': restartTime * 1000,
+          'phases': phases(rstEvents),
+        },
+      }
+      out.write(json.dumps(result, sort_keys=True) + '\n')
+      out.flush()
+  finally:
+    if port is None or subprocess.call([binary('dmtcp_command'), '-p',
+                                        str(port), '-q']) != 0:
+      coordinator.kill()
+    coordinator.wait()
+    if args.keep:
+      print('Images and traces kept in', workDir, file=sys.stderr)
+    else:
+      shutil.rmtree(workDir, ignore_errors=True)
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,279 @@
+/* Synthetic workload for ckptbench.py.  Each of the processes allocates and
+ * fills its memory, starts its threads, opens its files and sockets, and
+ * then runs until killed.  Once all of the processes are ready, the file
+ * given with -r is created.
+ *
+ * Usage:  ckptworkload [-m MB] [-z FRACTION] [-t THREADS] [-f FDS]
+ *                      [-s SOCKETS] [-S SHM_MB] [-p PROCS] [-r READY_FILE]
+ *   -m  anonymous memory per process, in MB
+ *   -z  fraction of those pages (and of the shm pages) left zero
+ *   -t  threads per process, besides the main thread
+ *   -f  open files per process
+ *   -s  connected TCP socket pairs per process, with unread data in them
+ *   -S  size of a SysV shared memory segment, shared by all the processes
+ *   -p  number of processes
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PAGE_SIZE 4096
+
+static size_t memMB = 64;
+static double zeroFraction = 0.5;
+static int numThreads = 1;
+static int numFds = 0;
+static int numSockets = 0;
+static size_t shmMB = 0;
+static int numProcs = 1;
+static const char *readyFile = NULL;
+
+static char *shmAddr = NULL;
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-m MB] [-z FRACTION] [-t THREADS] [-f FDS]\n"
+                  "       [-s SOCKETS] [-S SHM_MB] [-p PROCS] [-r FILE]\n",
+          prog);
+  exit(1);
+}
+
+static void
+die(const char *what)
+{
+  perror(what);
+  exit(1);
+}
+
+/* Fills the pages that are not to be zero with data that does not compress
+ * to nothing.  The zero pages are spread out, as in a sparse heap.
+ */
+static void
+fillPages(char *buf, size_t len, unsigned seed)
+{
+  size_t numPages = len / PAGE_SIZE;
+  size_t numZero = (size_t)(numPages * zeroFraction);
+  size_t i;
+
+  for (i = 0; i < numPages; i++) {
+    uint64_t *page = (uint64_t *)(buf + i * PAGE_SIZE);
+    size_t j;
+
+    if ((i + 1) * numZero / numPages != i * numZero / numPages) {
+      continue;
+    }
+    for (j = 0; j < PAGE_SIZE / sizeof(uint64_t); j++) {
+      seed = seed * 1103515245 + 12345;
+      page[j] = ((uint64_t)seed << 32) | (seed >> 8);
+    }
+  }
+}
+
+static void *
+threadMain(void *arg)
+{
+  volatile uint64_t counter = 0;
+
+  (void)arg;
+  while (1) {
+    counter++;
+    if ((counter & 0xfffff) == 0) {
+      usleep(1000);
+    }
+  }
+  return NULL;
+}
+
+static void
+openFiles(void)
+{
+  char path[] = "/tmp/ckptworkload-XXXXXX";
+  int fd = mkstemp(path);
+  int i;
+
+  if (fd == -1) {
+    die("mkstemp");
+  }
+  if (write(fd, path, sizeof(path)) != sizeof(path)) {
+    die("write");
+  }
+  for (i = 0; i < numFds; i++) {
+    if (open(path, O_RDWR) == -1) {
+      die("open");
+    }
+  }
+  // The files stay open; the name is not needed at restart.
+  close(fd);
+  unlink(path);
+}
+
+static void
+openSockets(void)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char data[1024];
+  int listener;
+  int i;
+
+  memset(data, 'x', sizeof(data));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener == -1 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener, SOMAXCONN) == -1 ||
+      getsockname(listener, (struct sockaddr *)&addr, &len) == -1) {
+    die("listen");
+  }
+
+  for (i = 0; i < numSockets; i++) {
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    int server;
+
+    if (client == -1 ||
+        connect(client, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      die("connect");
+    }
+    server = accept(listener, NULL, NULL);
+    if (server == -1) {
+      die("accept");
+    }
+
+    // Left unread, to be drained and refilled at checkpoint.
+    if (write(client, data, sizeof(data)) != sizeof(data) ||
+        write(server, data, sizeof(data)) != sizeof(data)) {
+      die("write");
+    }
+  }
+  close(listener);
+}
+
+static void
+setupProcess(int rank)
+{
+  size_t len = memMB << 20;
+  int i;
+
+  if (len > 0) {
+    char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      die("mmap");
+    }
+    fillPages(buf, len, rank + 1);
+  }
+
+  openFiles();
+  openSockets();
+
+  for (i = 0; i < numThreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, threadMain, NULL) != 0) {
+      die("pthread_create");
+    }
+  }
+}
+
+static void
+runProcess(int rank)
+{
+  while (1) {
+    sleep(1);
+    if (shmAddr != NULL) {
+      shmAddr[rank * PAGE_SIZE % (shmMB << 20)]++;
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pipefd[2];
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "m:z:t:f:s:S:p:r:")) != -1) {
+    switch (opt) {
+    case 'm': memMB = strtoul(optarg, NULL, 10); break;
+    case 'z': zeroFraction = atof(optarg); break;
+    case 't': numThreads = atoi(optarg); break;
+    case 'f': numFds = atoi(optarg); break;
+    case 's': numSockets = atoi(optarg); break;
+    case 'S': shmMB = strtoul(optarg, NULL, 10); break;
+    case 'p': numProcs = atoi(optarg); break;
+    case 'r': readyFile = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || numProcs < 1 || zeroFraction < 0 || zeroFraction > 1) {
+    usage(argv[0]);
+  }
+
+  if (shmMB > 0) {
+    int id = shmget(IPC_PRIVATE, shmMB << 20, IPC_CREAT | 0600);
+    if (id == -1) {
+      die("shmget");
+    }
+    shmAddr = shmat(id, NULL, 0);
+    if (shmAddr == (char *)-1) {
+      die("shmat");
+    }
+    // Removed once the last process detaches.
+    shmctl(id, IPC_RMID, NULL);
+    fillPages(shmAddr, shmMB << 20, 0);
+  }
+
+  if (pipe(pipefd) == -1) {
+    die("pipe");
+  }
+
+  for (i = 1; i < numProcs; i++) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      die("fork");
+    } else if (pid == 0) {
+      close(pipefd[0]);
+      setupProcess(i);
+      if (write(pipefd[1], "r", 1) != 1) {
+        die("write");
+      }
+      close(pipefd[1]);
+      runProcess(i);
+    }
+  }
+  close(pipefd[1]);
+
+  setupProcess(0);
+  for (i = 1; i < numProcs; i++) {
+    char c;
+    if (read(pipefd[0], &c, 1) != 1) {
+      die("read");
+    }
+  }
+  close(pipefd[0]);
+
+  if (readyFile != NULL) {
+    FILE *fp = fopen(readyFile, "w");
+    if (fp == NULL) {
+      die(readyFile);
+    }
+    fclose(fp);
+  }
+  runProcess(0);
+  return 0;
+}
@@ -0,0 +1,192 @@
+/* Connection-table overhead of the open/close/dup wrappers.
+ *
+ * "old" is the table as it was before the flat fd array and the id hash:
+ * two maps, keyed by fd and by ConnectionIdentifier.  "new" is
+ * ConnectionList from src/plugin/ipc/connectionlist.cpp.  The process is
+ * given N open descriptors; then each iteration does what the wrappers of
+ * socket(), fcntl(), dup2() and close() do with the table.  A lookup-only
+ * pass follows, as done by the wrappers of read(), write(), fcntl(), etc.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "connection.h"
+#include "connectionlist.h"
+
+#define NUM_ITERS 1000000
+
+using namespace dmtcp;
+
+/* Provided by libdmtcp.so, which is not loaded here. */
+EXTERNC void *
+dmtcp_get_libc_dlsym_addr(void)
+{
+  return (void *)&dlsym;
+}
+
+EXTERNC void
+dmtcp_close_protected_fd(int fd)
+{
+  close(fd);
+}
+
+class BenchConnection : public Connection
+{
+  public:
+    BenchConnection() : Connection(Connection::FILE) {}
+
+    virtual void drain() {}
+
+    virtual void refill(bool isRestart) {}
+
+    virtual void postRestart() {}
+
+    virtual string str() { return "bench"; }
+
+    virtual void serializeSubClass(jalib::JBinarySerializer &o) {}
+};
+
+class NewList : public ConnectionList
+{
+  public:
+    virtual int protectedFd() { return -1; }
+
+  protected:
+    virtual Connection *createDummyConnection(int type) { return NULL; }
+};
+
+class OldList
+{
+  public:
+    OldList() { pthread_mutex_init(&_lock, NULL); }
+
+    Connection *getConnection(int fd)
+    {
+      if (_fdToCon.find(fd) == _fdToCon.end()) {
+        return NULL;
+      }
+      return _fdToCon[fd];
+    }
+
+    void add(int fd, Connection *c)
+    {
+      pthread_mutex_lock(&_lock);
+      if (_fdToCon.find(fd) != _fdToCon.end()) {
+        processCloseWork(fd);
+      }
+      if (_connections.find(c->id()) == _connections.end()) {
+        _connections[c->id()] = c;
+      }
+      c->addFd(fd);
+      _fdToCon[fd] = c;
+      pthread_mutex_unlock(&_lock);
+    }
+
+    void processClose(int fd)
+    {
+      pthread_mutex_lock(&_lock);
+      if (_fdToCon.find(fd) != _fdToCon.end()) {
+        processCloseWork(fd);
+      }
+      pthread_mutex_unlock(&_lock);
+    }
+
+    void processDup(int oldfd, int newfd)
+    {
+      pthread_mutex_lock(&_lock);
+      if (_fdToCon.find(newfd) != _fdToCon.end()) {
+        processCloseWork(newfd);
+      }
+      if (_fdToCon.find(oldfd) != _fdToCon.end()) {
+        Connection *con = _fdToCon[oldfd];
+        _fdToCon[newfd] = con;
+        con->addFd(newfd);
+      }
+      pthread_mutex_unlock(&_lock);
+    }
+
+  private:
+    void processCloseWork(int fd)
+    {
+      Connection *con = _fdToCon[fd];
+
+      _fdToCon.erase(fd);
+      con->removeFd(fd);
+      if (con->numFds() == 0) {
+        _connections.erase(con->id());
+        delete con;
+      }
+    }
+
+    pthread_mutex_t _lock;
+    map<ConnectionIdentifier, Connection *>_connections;
+    map<int, Connection *>_fdToCon;
+};
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<typename ListT>
+static void
+run(const char *name, int numFds)
+{
+  ListT list;
+
+  for (int fd = 0; fd < numFds; fd++) {
+    list.add(fd, new BenchConnection());
+  }
+
+  /* socket(); fcntl(); dup2(); close(); close(); */
+  double start = now();
+  for (int i = 0; i < NUM_ITERS; i++) {
+    int fd = numFds + (i & 15);
+    list.add(fd, new BenchConnection());
+    if (list.getConnection(fd) == NULL) {
+      abort();
+    }
+    list.processDup(fd, fd + 16);
+    list.processClose(fd);
+    list.processClose(fd + 16);
+  }
+  double cycle = now() - start;
+
+  /* Lookups of random fds: the wrappers of read(), write(), fcntl(), ... */
+  unsigned seed = 1;
+  size_t found = 0;
+  start = now();
+  for (int i = 0; i < NUM_ITERS; i++) {
+    seed = seed * 1103515245 + 12345;
+    found += list.getConnection((seed >> 8) % numFds) != NULL;
+  }
+  double lookup = now() - start;
+  if (found != NUM_ITERS) {
+    abort();
+  }
+
+  for (int fd = 0; fd < numFds; fd++) {
+    list.processClose(fd);
+  }
+  printf("%8d fds %-4s %8.1f ns/open-close %8.1f ns/lookup\n", numFds, name,
+         cycle / NUM_ITERS * 1e9, lookup / NUM_ITERS * 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxFds = argc > 1 ? atoi(argv[1]) : 100000;
+
+  for (int numFds = 100; numFds <= maxFds; numFds *= 10) {
+    run<OldList>("old", numFds);
+    run<NewList>("new", numFds);
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* Latency of an epoll echo server, and the CPU that it uses while idle.  A
+ * thread waits in epoll_wait() with no timeout and echoes each byte that the
+ * main thread sends over a socket pair.  The main thread sends one byte
+ * every GAP microseconds, so that the server is idle in between, and times
+ * the round trips.  Then both threads are idle for a second, and the CPU
+ * time of the process over that second is reported.
+ *
+ * Run it natively and under dmtcp_launch, and compare: the epoll_wait()
+ * wrapper of the ipc plugin should add neither latency nor idle CPU.
+ *
+ * Usage:  epollecho [NUM_PINGS [GAP_US]]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sockets[2];
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpuTime()
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void *
+server(void *arg)
+{
+  struct epoll_event event;
+  int epfd = epoll_create1(0);
+  char c;
+
+  (void)arg;
+  event.events = EPOLLIN;
+  event.data.fd = sockets[1];
+  if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, sockets[1], &event) == -1) {
+    perror("epoll");
+    exit(1);
+  }
+
+  while (1) {
+    int n = epoll_wait(epfd, &event, 1, -1);
+    if (n == -1) {
+      perror("epoll_wait");
+      exit(1);
+    }
+    if (n == 1) {
+      if (read(sockets[1], &c, 1) != 1 || write(sockets[1], &c, 1) != 1) {
+        exit(0);
+      }
+    }
+  }
+  return NULL;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int numPings = argc > 1 ? atoi(argv[1]) : 2000;
+  int gap = argc > 2 ? atoi(argv[2]) : 2000;
+  double *latency = malloc(numPings * sizeof(double));
+  pthread_t thread;
+  char c = 'x';
+  int i;
+
+  if (numPings < 1 || socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1 ||
+      pthread_create(&thread, NULL, server, NULL) != 0) {
+    fprintf(stderr, "Usage: %s [NUM_PINGS [GAP_US]]\n", argv[0]);
+    return 1;
+  }
+
+  for (i = 0; i < numPings; i++) {
+    usleep(gap);
+    double start = now();
+    if (write(sockets[0], &c, 1) != 1 || read(sockets[0], &c, 1) != 1) {
+      perror("echo");
+      return 1;
+    }
+    latency[i] = now() - start;
+  }
+  qsort(latency, numPings, sizeof(double), compare);
+
+  double cpu = cpuTime();
+  sleep(1);
+  cpu = cpuTime() - cpu;
+
+  printf("epoll echo: %d pings, p50 %.1f us, p99 %.1f us, max %.1f us; "
+         "idle CPU %.2f ms/s\n", numPings,
+         latency[numPings / 2] * 1e6, latency[numPings * 99 / 100] * 1e6,
+         latency[numPings - 1] * 1e6, cpu * 1e3);
+  return 0;
+}
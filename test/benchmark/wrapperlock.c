@@ -0,0 +1,164 @@
+/* Latency of the open() and close() wrappers while other threads fork.
+ * NUM_THREADS threads open and close /dev/null in a loop, and time each
+ * open/close pair; another thread forks a child that exits at once, every
+ * GAP microseconds, and times each fork.  The threads run for SECONDS.
+ *
+ * Run it natively and under dmtcp_launch, and compare: the fork() wrapper
+ * takes the wrapper-execution lock of DMTCP (src/threadsync.cpp) in
+ * exclusive mode, and the open() and close() wrappers should not stall
+ * behind it for longer than the fork itself.  Checkpoints taken during the
+ * run (dmtcp_command -c) stall them too, for the length of the checkpoint.
+ *
+ * Usage:  wrapperlock [NUM_THREADS [SECONDS [GAP_US]]]
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SAMPLES (1 << 20)
+
+struct samples {
+  double *latency;
+  int num;
+  double max;
+};
+
+static volatile int stop = 0;
+static int gap = 1000;
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The percentiles are of the first MAX_SAMPLES calls of each thread only.
+static void
+addSample(struct samples *s, double latency)
+{
+  if (s->num < MAX_SAMPLES) {
+    s->latency[s->num++] = latency;
+  }
+  if (latency > s->max) {
+    s->max = latency;
+  }
+}
+
+static void *
+openClose(void *arg)
+{
+  struct samples *s = arg;
+
+  while (!stop) {
+    double start = now();
+    int fd = open("/dev/null", O_RDONLY);
+    if (fd == -1 || close(fd) == -1) {
+      perror("open/close");
+      exit(1);
+    }
+    addSample(s, now() - start);
+  }
+  return NULL;
+}
+
+static void *
+forker(void *arg)
+{
+  struct samples *s = arg;
+
+  while (!stop) {
+    usleep(gap);
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      exit(1);
+    } else if (pid == 0) {
+      _exit(0);
+    }
+    addSample(s, now() - start);
+    waitpid(pid, NULL, 0);
+  }
+  return NULL;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *what, struct samples *s, int num)
+{
+  struct samples all = { malloc(MAX_SAMPLES * num * sizeof(double)), 0, 0 };
+  int i;
+
+  for (i = 0; i < num; i++) {
+    int j;
+    for (j = 0; j < s[i].num; j++) {
+      all.latency[all.num++] = s[i].latency[j];
+    }
+    if (s[i].max > all.max) {
+      all.max = s[i].max;
+    }
+  }
+  if (all.num == 0) {
+    printf("%s: no samples\n", what);
+    return;
+  }
+  qsort(all.latency, all.num, sizeof(double), compare);
+  printf("%s: %d calls, p50 %.1f us, p99 %.1f us, max %.1f us\n", what,
+         all.num, all.latency[all.num / 2] * 1e6,
+         all.latency[all.num * 99 / 100] * 1e6,
+         all.max * 1e6);
+  free(all.latency);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int numThreads = argc > 1 ? atoi(argv[1]) : 4;
+  int seconds = argc > 2 ? atoi(argv[2]) : 5;
+  struct samples *s;
+  pthread_t *threads;
+  int i;
+
+  gap = argc > 3 ? atoi(argv[3]) : 1000;
+  if (numThreads < 1 || seconds < 1 || gap < 0) {
+    fprintf(stderr, "Usage: %s [NUM_THREADS [SECONDS [GAP_US]]]\n", argv[0]);
+    return 1;
+  }
+
+  s = calloc(numThreads + 1, sizeof(struct samples));
+  threads = calloc(numThreads + 1, sizeof(pthread_t));
+  for (i = 0; i <= numThreads; i++) {
+    s[i].latency = malloc(MAX_SAMPLES * sizeof(double));
+    if (pthread_create(&threads[i], NULL, i == 0 ? forker : openClose,
+                       &s[i]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  sleep(seconds);
+  stop = 1;
+  for (i = 0; i <= numThreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  report("fork", &s[0], 1);
+  report("open+close", &s[1], numThreads);
+  return 0;
+}
@@ -0,0 +1,126 @@
+/* Zero-page scan throughput of the checkpoint writer.
+ *
+ * "old" is the scan as it was before src/util_zeropages.cpp: a scalar loop,
+ * applied to 1 MB blocks (mtcp_get_next_page_range()).  "new" is
+ * Util::scanZeroPages(): the kernel chosen at run time, one flag per page.
+ * The "zero" column is the amount of memory that each scan finds to be zero,
+ * and so can leave out of the checkpoint image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "util.h"
+
+#define ONE_MB (1024 * 1024)
+#define NUM_RUNS 5
+
+using namespace dmtcp;
+
+static bool
+oldAreZeroPages(void *addr, size_t numPages)
+{
+  long long *buf = (long long *)addr;
+  size_t i;
+  size_t end = numPages * MTCP_PAGE_SIZE / sizeof(*buf);
+  long long res = 0;
+
+  for (i = 0; i + 7 < end; i += 8) {
+    res = buf[i + 0] | buf[i + 1] | buf[i + 2] | buf[i + 3] |
+      buf[i + 4] | buf[i + 5] | buf[i + 6] | buf[i + 7];
+    if (res != 0) {
+      break;
+    }
+  }
+  return res == 0;
+}
+
+static size_t
+oldScan(char *buf, size_t size, char *unused)
+{
+  size_t zero = 0;
+
+  for (size_t i = 0; i < size; i += ONE_MB) {
+    if (oldAreZeroPages(buf + i, ONE_MB / MTCP_PAGE_SIZE)) {
+      zero += ONE_MB;
+    }
+  }
+  return zero;
+}
+
+static size_t
+newScan(char *buf, size_t size, char *isZero)
+{
+  return Util::scanZeroPages(buf, size / MTCP_PAGE_SIZE, isZero) *
+         MTCP_PAGE_SIZE;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run(const char *name, const char *pattern, char *buf, size_t size,
+    size_t (*scan)(char *, size_t, char *), char *isZero)
+{
+  double best = 0;
+  size_t zero = 0;
+
+  for (int i = 0; i < NUM_RUNS; i++) {
+    double start = now();
+    zero = scan(buf, size, isZero);
+    double t = now() - start;
+    if (i == 0 || t < best) {
+      best = t;
+    }
+  }
+  printf("%-8s %-4s %10.2f GB/s %8zu MB zero\n", pattern, name,
+         size / best / 1e9, zero / ONE_MB);
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t size = (argc > 1 ? atoi(argv[1]) : 256) * (size_t)ONE_MB;
+  char *buf = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *isZero = (char *)malloc(size / MTCP_PAGE_SIZE);
+
+  if (buf == MAP_FAILED || isZero == NULL) {
+    perror("zeroscan: allocating buffers");
+    return 1;
+  }
+
+  printf("buffer: %zu MB, kernel: %s\n", size / ONE_MB,
+         Util::zeroPageScanner());
+
+  /* zero: all pages zero (populated, so that no page fault is timed). */
+  memset(buf, 0, size);
+  run("old", "zero", buf, size, oldScan, isZero);
+  run("new", "zero", buf, size, newScan, isZero);
+
+  /* sparse: one page in 16 has a non-zero byte at its end. */
+  for (size_t i = 0; i < size; i += 16 * MTCP_PAGE_SIZE) {
+    buf[i + MTCP_PAGE_SIZE - 1] = 1;
+  }
+  run("old", "sparse", buf, size, oldScan, isZero);
+  run("new", "sparse", buf, size, newScan, isZero);
+
+  /* dense: every page has non-zero data. */
+  for (size_t i = 0; i < size; i++) {
+    buf[i] = (char)(i * 7 + 1);
+  }
+  run("old", "dense", buf, size, oldScan, isZero);
+  run("new", "dense", buf, size, newScan, isZero);
+
+  munmap(buf, size);
+  free(isZero);
+  return 0;
+}